@@ -2,15 +2,37 @@
 #include "config.h"
 #include <QDebug>
 #include <QUrl>
+#include <QMap>
+#include <QSslConfiguration>
+#include <QSslCertificate>
+#include <QRandomGenerator>
+#include <algorithm>
 
 ApiClient::ApiClient() : QObject(nullptr)
-    , m_socket(new QTcpSocket(this))
+    , m_socket(new QSslSocket(this))
+    , m_heartbeatTimer(new QTimer(this))
+    , m_reconnectTimer(new QTimer(this))
+    , m_port(0)
+    , m_reconnectEnabled(false)
+    , m_reconnectAttempts(0)
+    , m_drainReconnectDelay(-1)
+    , m_encoding(WireProtocol::Encoding::Json)
+    , m_nextRequestId(1)
     , m_authenticated(false){
 
-    connect(m_socket, &QTcpSocket::connected, this, &ApiClient::onConnected);
+    if (USE_TLS) {
+        connect(m_socket, &QSslSocket::encrypted, this, &ApiClient::onConnected);
+        connect(m_socket, &QSslSocket::sslErrors, this, &ApiClient::onSslErrors);
+    } else {
+        connect(m_socket, &QTcpSocket::connected, this, &ApiClient::onConnected);
+    }
     connect(m_socket, &QTcpSocket::disconnected, this, &ApiClient:: onDisconnected);
     connect(m_socket, &QTcpSocket::readyRead, this, &ApiClient::onReadyRead);
     connect(m_socket, QOverload<QAbstractSocket::SocketError>:: of(&QTcpSocket::errorOccurred), this, &ApiClient:: onSocketError);
+    connect(m_heartbeatTimer, &QTimer::timeout, this, &ApiClient::onHeartbeat);
+
+    m_reconnectTimer->setSingleShot(true);
+    connect(m_reconnectTimer, &QTimer::timeout, this, &ApiClient::onReconnectTimer);
 }
 
 void ApiClient::connectToServer(const QString& host, quint16 port)
@@ -21,11 +43,36 @@ void ApiClient::connectToServer(const QString& host, quint16 port)
     }
 
     qDebug() << "Connecting to" << host << ":" << port;
-    m_socket->connectToHost(host, port);
+    m_host = host;
+    m_port = port;
+    m_reconnectEnabled = true;
+
+    if (!USE_TLS) {
+        m_socket->connectToHost(host, port);
+        return;
+    }
+
+    QSslConfiguration configuration = QSslConfiguration::defaultConfiguration();
+    configuration.setProtocol(QSsl::TlsV1_2OrLater);
+    if (!TLS_CA_CERTIFICATE.isEmpty()) {
+        configuration.addCaCertificates(TLS_CA_CERTIFICATE);
+    }
+    m_socket->setSslConfiguration(configuration);
+    m_socket->connectToHostEncrypted(host, port);
+}
+
+void ApiClient::onSslErrors(const QList<QSslError>& errors)
+{
+    for (const QSslError& sslError: errors) {
+        qWarning() << "TLS error:" << sslError.errorString();
+    }
 }
 
 void ApiClient::disconnectFromServer()
 {
+    m_reconnectEnabled = false;
+    m_reconnectTimer->stop();
+    m_resumeToken.clear();
     if (m_socket->state() == QAbstractSocket::ConnectedState) {
         m_socket->disconnectFromHost();
     }
@@ -38,31 +85,104 @@ bool ApiClient::isConnected() const
 
 void ApiClient::onConnected()
 {
-    qDebug() << "Connected to server";
+    qDebug() << "Connected to server" << (USE_TLS ? "over TLS" : "");
+    m_encoding = WireProtocol::Encoding::Json;
+
+    if (PREFER_BINARY_PROTOCOL) {
+        QJsonObject data;
+        data["encodings"] = QJsonArray::fromStringList(WireProtocol::supportedEncodings());
+        sendCommand("HELLO", data);
+    }
+
+    m_reconnectAttempts = 0;
+    if (!m_resumeToken.isEmpty()) {
+        QJsonObject data;
+        data["sessionToken"] = m_resumeToken;
+        sendCommand("RESUME_SESSION", data);
+    }
+
+    m_heartbeatTimer->start(HEARTBEAT_INTERVAL);
     emit connected();
 }
 
 void ApiClient::onDisconnected()
 {
     qDebug() << "Disconnected from server";
+    m_heartbeatTimer->stop();
+    if (m_authenticated) {
+        m_resumeToken = m_sessionToken;
+    }
     m_authenticated = false;
     m_sessionToken.clear();
+    m_buffer.clear();
+    failPendingRequests("Соединение с сервером потеряно");
     emit disconnected();
+
+    if (m_reconnectEnabled) {
+        scheduleReconnect();
+    }
+}
+
+// A draining server names the delay itself, spread across its clients;
+// otherwise the delay doubles per failed attempt. Either way random jitter
+// keeps clients that lost the connection together from returning together.
+void ApiClient::scheduleReconnect()
+{
+    if (m_reconnectTimer->isActive()) {
+        return;
+    }
+
+    int delay;
+    if (m_drainReconnectDelay >= 0) {
+        delay = m_drainReconnectDelay;
+        m_drainReconnectDelay = -1;
+    } else {
+        int shift = qMin(m_reconnectAttempts, 5);
+        delay = qMin(RECONNECT_MAX_DELAY, RECONNECT_BASE_DELAY << shift);
+        delay += QRandomGenerator::global()->bounded(delay / 2 + 1);
+    }
+    m_reconnectAttempts++;
+
+    qDebug() << "Reconnecting in" << delay << "ms";
+    m_reconnectTimer->start(delay);
+    emit reconnecting(delay);
+}
+
+void ApiClient::onReconnectTimer()
+{
+    if (!m_reconnectEnabled || m_socket->state() != QAbstractSocket::UnconnectedState) {
+        return;
+    }
+    connectToServer(m_host, m_port);
+}
+
+// Keeps the connection from being closed by the server's idle reaper while
+// the user is sitting on a screen without sending requests.
+void ApiClient::onHeartbeat()
+{
+    if (m_socket->state() == QAbstractSocket::ConnectedState) {
+        sendCommand("PING");
+    }
 }
 
 void ApiClient::onReadyRead()
 {
     m_buffer.append(m_socket->readAll());
 
-    int newlineIndex;
-    while ((newlineIndex = m_buffer.indexOf('\n')) != -1) {
-        QByteArray message = m_buffer.left(newlineIndex);
-        m_buffer.remove(0, newlineIndex + 1);
-
+    QByteArray message;
+    WireProtocol::Encoding encoding;
+    WireProtocol::DecodeStatus status;
+    while ((status = WireProtocol::takeMessage(m_buffer, &message, &encoding)) == WireProtocol::DecodeStatus::Message) {
         if (!message.isEmpty()) {
-            processResponse(message);
+            processResponse(message, encoding);
         }
     }
+
+    if (status == WireProtocol::DecodeStatus::Error) {
+        qWarning() << "Oversized frame from server, dropping connection";
+        m_buffer.clear();
+        m_socket->abort();
+    }
 }
 
 void ApiClient::onSocketError(QAbstractSocket::SocketError socketError)
@@ -70,59 +190,138 @@ void ApiClient::onSocketError(QAbstractSocket::SocketError socketError)
     Q_UNUSED(socketError);
     QString errorMsg = QString("Ошибка сети: %1").arg(m_socket->errorString());
     qWarning() << errorMsg;
+
+    if (m_drainReconnectDelay >= 0) {
+        return;
+    }
+
+    // A failed connection attempt never reaches onDisconnected.
+    if (m_reconnectAttempts > 0 && m_socket->state() == QAbstractSocket::UnconnectedState) {
+        if (m_reconnectEnabled) {
+            scheduleReconnect();
+        }
+        return;
+    }
     emit error(errorMsg);
 }
 
 
-void ApiClient::sendCommand(const QString &command, const QJsonObject &data){
+quint64 ApiClient::sendCommand(const QString &command, const QJsonObject &data){
     if (!isConnected()) {
         emit error("Нет подключения к серверу");
-        return;
+        return 0;
     }
 
+    quint64 requestId = m_nextRequestId++;
+
     QJsonObject request;
     request["command"] = command;
+    request["requestId"] = QJsonValue(qint64(requestId));
 
     if (!data.isEmpty()) {
         request["data"] = data;
     }
 
-    QJsonDocument doc(request);
-    QByteArray postData = doc.toJson(QJsonDocument::Compact);
-    postData.append("\n");
+    QByteArray postData = WireProtocol::encode(request, m_encoding);
 
-    qDebug() << "Sending command:" << command;
-    qDebug() << "Request:" << postData;
+    qDebug() << "Sending command:" << command << "id:" << requestId;
 
+    m_pendingCommands.insert(requestId, command);
     m_socket->write(postData);
-    m_socket->flush();
+    return requestId;
+}
+
+QFuture<QJsonObject> ApiClient::request(const QString& command, const QJsonObject& data){
+    auto promise = std::make_shared<QPromise<QJsonObject>>();
+    QFuture<QJsonObject> future = promise->future();
+    promise->start();
+
+    quint64 requestId = sendCommand(command, data);
+    if (requestId == 0) {
+        QJsonObject failure;
+        failure["command"] = command;
+        failure["success"] = false;
+        failure["message"] = "Нет подключения к серверу";
+        promise->addResult(failure);
+        promise->finish();
+        return future;
+    }
+
+    m_pendingPromises.insert(requestId, promise);
+    return future;
 }
 
-void ApiClient::processResponse(const QByteArray &data){
-    qDebug() << "=== CLIENT: RAW RESPONSE ===" << data;//
+QFuture<QJsonObject> ApiClient::batch(const QJsonArray& items){
+    QJsonObject data;
+    data["items"] = items;
+
+    return request("BATCH", data);
+}
 
-    QJsonParseError parseError;
-    QJsonDocument doc = QJsonDocument::fromJson(data, &parseError);
+void ApiClient::failPendingRequests(const QString& reason){
+    for (auto it = m_pendingPromises.begin(); it != m_pendingPromises.end(); it++) {
+        QJsonObject failure;
+        failure["command"] = m_pendingCommands.value(it.key());
+        failure["requestId"] = QJsonValue(qint64(it.key()));
+        failure["success"] = false;
+        failure["message"] = reason;
+        it.value()->addResult(failure);
+        it.value()->finish();
+    }
+    m_pendingPromises.clear();
+    m_pendingCommands.clear();
+}
 
-    if (parseError.error != QJsonParseError::NoError) {
-        qWarning() << "JSON parse error:" << parseError.errorString();
+void ApiClient::processResponse(const QByteArray &data, WireProtocol::Encoding encoding){
+    QJsonObject response;
+    QString parseError;
+    if (!WireProtocol::decode(data, encoding, &response, &parseError)) {
+        qWarning() << "Response parse error:" << parseError;
         return;
     }
 
-    QJsonObject response = doc.object();
+    quint64 requestId = quint64(response["requestId"].toInteger());
     QString command = response["command"].toString();
+    if (requestId != 0) {
+        QString pendingCommand = m_pendingCommands.take(requestId);
+        if (command.isEmpty()) {
+            command = pendingCommand;
+        }
+    }
+
+    if (requestId != 0 && m_pendingPromises.contains(requestId)) {
+        auto promise = m_pendingPromises.take(requestId);
+        promise->addResult(response);
+        promise->finish();
+        return;
+    }
+
     bool success = response["success"].toBool();
     QString message = response["message"].toString();
 
-    if (command != "GET_AVAILABLE_SEATS") {
-        qDebug() << "Response:" << command << "Success:" << success;
+    if (command == "PING") {
+        return;
+    }
+
+    if (command == "SERVER_DRAINING") {
+        handleServerDraining(response);
+        return;
+    }
+
+    if (command != "GET_AVAILABLE_SEATS" && command != "SEAT_UPDATE") {
+        qDebug() << "Response:" << command << "id:" << requestId << "Success:" << success;
     }
 
     if (!success) {
-        if (command == "REGISTER") {
+        if (command == "HELLO") {
+            qDebug() << "Server does not support encoding negotiation, staying on JSON";
+        } else if (command == "REGISTER") {
             emit registerFailed(message);
         } else if (command == "LOGIN") {
             emit loginFailed(message);
+        } else if (command == "RESUME_SESSION") {
+            m_resumeToken.clear();
+            emit sessionExpired(message);
         } else if (command == "VERIFY_EMAIL") {
             emit verificationFailed(message);
         } else if (command == "CHANGE_PASSWORD") {
@@ -133,10 +332,14 @@ void ApiClient::processResponse(const QByteArray &data){
         return;
     }
 
-    if (command == "REGISTER") {
+    if (command == "HELLO") {
+        handleHelloResponse(response);
+    } else if (command == "REGISTER") {
         handleRegisterResponse(response);
     } else if (command == "LOGIN") {
         handleLoginResponse(response);
+    } else if (command == "RESUME_SESSION") {
+        handleResumeSessionResponse(response);
     } else if (command == "LOGOUT") {
         handleLogoutResponse(response);
     } else if (command == "VERIFY_EMAIL") {
@@ -146,7 +349,11 @@ void ApiClient::processResponse(const QByteArray &data){
     } else if (command == "SEARCH_TRAINS") {
         handleTrainsResponse(response);
     } else if (command == "GET_AVAILABLE_SEATS") {
-        handleSeatsResponse(response);
+        handleSeatsResponse(response, requestId);
+    } else if (command == "SEAT_UPDATE") {
+        handleSeatUpdate(response);
+    } else if (command == "SEAT_RESYNC") {
+        emit seatMapResyncRequired(response["data"].toObject()["scheduleId"].toInt());
     } else if (command == "BOOK_TICKET") {
         handleBookTicketResponse(response);
     } else if (command == "PAY_TICKET") {
@@ -239,14 +446,33 @@ void ApiClient::searchTrains(int departureStationId, int arrivalStationId, const
     sendCommand("SEARCH_TRAINS", data);
 }
 
-void ApiClient::getAvailableSeats(int scheduleId, int departureStationId, int arrivalStationId)
+quint64 ApiClient::getAvailableSeats(int scheduleId, int departureStationId, int arrivalStationId)
+{
+    QJsonObject data;
+    data["scheduleId"] = scheduleId;
+    data["departureStationId"] = departureStationId;
+    data["arrivalStationId"] = arrivalStationId;
+    data["compact"] = true;
+
+    return sendCommand("GET_AVAILABLE_SEATS", data);
+}
+
+void ApiClient::subscribeSchedule(int scheduleId, int departureStationId, int arrivalStationId)
 {
     QJsonObject data;
     data["scheduleId"] = scheduleId;
     data["departureStationId"] = departureStationId;
     data["arrivalStationId"] = arrivalStationId;
 
-    sendCommand("GET_AVAILABLE_SEATS", data);
+    sendCommand("SUBSCRIBE_SCHEDULE", data);
+}
+
+void ApiClient::unsubscribeSchedule(int scheduleId)
+{
+    QJsonObject data;
+    data["scheduleId"] = scheduleId;
+
+    sendCommand("UNSUBSCRIBE_SCHEDULE", data);
 }
 
 void ApiClient::bookTicket(int scheduleId, int seatId, int departureStationId, int arrivalStationId, const QString &passengerName, const QString &passengerDocument, double price){
@@ -281,9 +507,22 @@ void ApiClient::cancelTicket(const QString& ticketNumber, const QString& reason)
     sendCommand("CANCEL_TICKET", data);
 }
 
-void ApiClient::getMyTickets()
+void ApiClient::getMyTickets(const QString& cursor)
 {
-    sendCommand("GET_MY_TICKETS");
+    QJsonObject data;
+    if (!cursor.isEmpty()) {
+        data["cursor"] = cursor;
+    }
+
+    sendCommand("GET_MY_TICKETS", data);
+}
+
+void ApiClient::syncMyTickets(const QString& syncToken)
+{
+    QJsonObject data;
+    data["since"] = syncToken;
+
+    sendCommand("GET_MY_TICKETS", data);
 }
 
 void ApiClient::getTicketDetails(const QString& ticketNumber)
@@ -294,6 +533,17 @@ void ApiClient::getTicketDetails(const QString& ticketNumber)
     sendCommand("GET_TICKET_DETAILS", data);
 }
 
+void ApiClient::handleHelloResponse(const QJsonObject& response)
+{
+    QJsonObject data = response["data"].toObject();
+
+    WireProtocol::Encoding encoding;
+    if (WireProtocol::encodingFromName(data["encoding"].toString(), &encoding)) {
+        m_encoding = encoding;
+        qDebug() << "Negotiated encoding:" << WireProtocol::encodingName(encoding);
+    }
+}
+
 void ApiClient::handleRegisterResponse(const QJsonObject &response){
     QJsonObject data = response["data"].toObject();
     int userId = data["userId"].toInt();
@@ -309,7 +559,34 @@ void ApiClient::handleLoginResponse(const QJsonObject& response)
     m_sessionToken = data["sessionToken"].toString();
     m_authenticated = true;
 
-    QJsonObject userObj = data["user"].toObject();
+    parseUserProfile(data["user"].toObject());
+    emit loginSuccess(m_userProfile);
+}
+
+void ApiClient::handleResumeSessionResponse(const QJsonObject& response)
+{
+    QJsonObject data = response["data"].toObject();
+    m_sessionToken = data["sessionToken"].toString();
+    m_resumeToken.clear();
+    m_authenticated = true;
+
+    parseUserProfile(data["user"].toObject());
+    qDebug() << "Session resumed after reconnect";
+    emit sessionResumed();
+}
+
+// The server closes the connection right after this notice; the delay it
+// names is used for the reconnect that onDisconnected schedules.
+void ApiClient::handleServerDraining(const QJsonObject& response)
+{
+    QJsonObject data = response["data"].toObject();
+    m_drainReconnectDelay = data["reconnectAfterMs"].toInt();
+    m_reconnectAttempts = 0;
+    qDebug() << "Server is restarting, reconnecting in" << m_drainReconnectDelay << "ms";
+}
+
+void ApiClient::parseUserProfile(const QJsonObject& userObj)
+{
     m_userProfile.id = userObj["id"].toInt();
     m_userProfile.name = userObj["name"].toString();
     m_userProfile.surname = userObj["surname"].toString();
@@ -320,14 +597,13 @@ void ApiClient::handleLoginResponse(const QJsonObject& response)
     if (userObj.contains("lastLogin") && !userObj["lastLogin"].isNull()) {
         m_userProfile.lastLogin = QDateTime::fromString(userObj["lastLogin"].toString(), Qt::ISODate);
     }
-
-    emit loginSuccess(m_userProfile);
 }
 
 void ApiClient::handleLogoutResponse(const QJsonObject&)
 {
     m_authenticated = false;
     m_sessionToken.clear();
+    m_resumeToken.clear();
     m_userProfile = UserProfile();
 
     emit logoutSuccess();
@@ -391,12 +667,100 @@ void ApiClient::handleTrainsResponse(const QJsonObject& response)
     emit trainsReceived(trains);
 }
 
-void ApiClient::handleSeatsResponse(const QJsonObject& response)
+void ApiClient::handleSeatsResponse(const QJsonObject& response, quint64 requestId)
+{
+    QJsonObject data = response["data"].toObject();
+
+    QList<Carriage> carriages;
+    if (data.contains("carriages")) {
+        carriages = decodeSeatMap(data);
+    } else {
+        carriages = groupSeatsByCarriage(data["seats"].toArray());
+    }
+
+    emit seatsReceived(carriages, requestId);
+}
+
+void ApiClient::handleSeatUpdate(const QJsonObject& response)
 {
     QJsonObject data = response["data"].toObject();
-    QJsonArray seatsArray = data["seats"].toArray();
 
-    QList<Seat> seats;
+    auto seatIds = [](const QJsonArray& segments) {
+        QList<int> ids;
+        for (int i = 0; i + 2 < segments.size(); i += 3) {
+            ids.append(segments[i].toInt());
+        }
+        return ids;
+    };
+
+    emit seatAvailabilityChanged(data["scheduleId"].toInt(),
+                                 seatIds(data["taken"].toArray()),
+                                 seatIds(data["released"].toArray()));
+}
+
+QList<Carriage> ApiClient::decodeSeatMap(const QJsonObject& data)
+{
+    QJsonArray seatTypes = data["seatTypes"].toArray();
+    QJsonArray carriagesArray = data["carriages"].toArray();
+
+    auto expandRuns = [](const QJsonArray& runs, bool consecutive) {
+        QList<int> values;
+        for (int i = 0; i + 1 < runs.size(); i += 2) {
+            int start = runs[i].toInt();
+            int length = runs[i + 1].toInt();
+            for (int j = 0; j < length; j++) {
+                values.append(consecutive ? start + j : start);
+            }
+        }
+        return values;
+    };
+
+    QList<Carriage> carriages;
+    carriages.reserve(carriagesArray.size());
+
+    for (const QJsonValue& value: carriagesArray) {
+        QJsonObject obj = value.toObject();
+
+        Carriage carriage;
+        carriage.id = obj["id"].toInt();
+        carriage.number = obj["number"].toInt();
+        carriage.type = obj["type"].toString();
+
+        int seatCount = obj["seatCount"].toInt();
+        QList<int> ids = expandRuns(obj["seatIds"].toArray(), true);
+        QList<int> numbers = expandRuns(obj["seatNumbers"].toArray(), true);
+        QList<int> types = expandRuns(obj["seatTypes"].toArray(), false);
+        QByteArray available = QByteArray::fromBase64(obj["available"].toString().toLatin1());
+
+        if (ids.size() != seatCount || numbers.size() != seatCount || types.size() != seatCount
+            || available.size() < (seatCount + 7) / 8) {
+            qWarning() << "Malformed seat map for carriage" << carriage.number;
+            continue;
+        }
+
+        carriage.seats.reserve(seatCount);
+        for (int i = 0; i < seatCount; i++) {
+            Seat seat;
+            seat.id = ids[i];
+            seat.carriageId = carriage.id;
+            seat.carriageNumber = carriage.number;
+            seat.carriageType = carriage.type;
+            seat.seatNumber = numbers[i];
+            seat.seatType = seatTypes.at(types[i]).toString();
+            seat.isAvailable = (quint8(available[i / 8]) >> (i % 8)) & 1;
+            carriage.seats.append(seat);
+        }
+
+        carriages.append(carriage);
+    }
+
+    return carriages;
+}
+
+QList<Carriage> ApiClient::groupSeatsByCarriage(const QJsonArray& seatsArray)
+{
+    QMap<int, Carriage> carriagesByNumber;
+
     for (const QJsonValue& value: seatsArray) {
         QJsonObject obj = value.toObject();
 
@@ -409,10 +773,24 @@ void ApiClient::handleSeatsResponse(const QJsonObject& response)
         seat.seatType = obj["seatType"].toString();
         seat.isAvailable = obj["isAvailable"].toBool();
 
-        seats.append(seat);
+        int number = seat.carriageNumber != 0 ? seat.carriageNumber : seat.carriageId;
+        if (!carriagesByNumber.contains(number)) {
+            Carriage carriage;
+            carriage.id = seat.carriageId;
+            carriage.number = number;
+            carriage.type = seat.carriageType;
+            carriagesByNumber.insert(number, carriage);
+        }
+        carriagesByNumber[number].seats.append(seat);
     }
 
-    emit seatsReceived(seats);
+    QList<Carriage> carriages = carriagesByNumber.values();
+    for (Carriage& carriage: carriages) {
+        std::sort(carriage.seats.begin(), carriage.seats.end(), [](const Seat& a, const Seat& b) {
+            return a.seatNumber < b.seatNumber;
+        });
+    }
+    return carriages;
 }
 
 void ApiClient::handleBookTicketResponse(const QJsonObject& response)
@@ -445,7 +823,13 @@ void ApiClient::handleMyTicketsResponse(const QJsonObject& response)
     QJsonObject data = response["data"].toObject();
     QJsonArray ticketsArray = data["tickets"].toArray();
 
-    QList<Ticket> tickets;
+    TicketsPage page;
+    page.incremental = data["incremental"].toBool();
+    page.resync = data["resync"].toBool();
+    page.hasMore = data["hasMore"].toBool();
+    page.nextCursor = data["nextCursor"].toString();
+    page.syncToken = data["syncToken"].toString();
+
     for (const QJsonValue& value : ticketsArray) {
         QJsonObject obj = value.toObject();
 
@@ -469,10 +853,10 @@ void ApiClient::handleMyTicketsResponse(const QJsonObject& response)
             ticket.cancelledAt = QDateTime::fromString(obj["cancelledAt"].toString(), Qt::ISODate);
         }
 
-        tickets.append(ticket);
+        page.tickets.append(ticket);
     }
 
-    emit ticketsReceived(tickets);
+    emit ticketsPageReceived(page);
 }
 
 void ApiClient::handleTicketDetailsResponse(const QJsonObject& response)
@@ -3,9 +3,17 @@
 
 #include <QObject>
 #include <QTcpSocket>
+#include <QSslSocket>
+#include <QSslError>
+#include <QTimer>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QJsonArray>
+#include <QHash>
+#include <QFuture>
+#include <QPromise>
+#include <memory>
+#include "wireprotocol.h"
 
 struct Station{
     int id;
@@ -42,6 +50,13 @@ struct Seat{
     bool isAvailable;
 };
 
+struct Carriage {
+    int id;
+    int number;
+    QString type;
+    QList<Seat> seats;
+};
+
 struct Ticket {
     int id;
     QString ticketNumber;
@@ -58,6 +73,19 @@ struct Ticket {
     QDateTime cancelledAt;
 };
 
+// One GET_MY_TICKETS response. A full load arrives page by page, newest
+// first, each with the cursor of the next one; an incremental one holds the
+// tickets changed since the sync token it was asked with, or sets resync
+// when the client should load everything again.
+struct TicketsPage {
+    QList<Ticket> tickets;
+    bool incremental;
+    bool resync;
+    bool hasMore;
+    QString nextCursor;
+    QString syncToken;
+};
+
 struct UserProfile {
     int id;
     QString name;
@@ -96,7 +124,12 @@ public:
     void getStations(const QString& search = "");
     void searchTrains(int departureStationId, int arrivalStationId, const QDate& date);
 
-    void getAvailableSeats(int scheduleId, int departureStationId, int arrivalStationId);
+    QFuture<QJsonObject> request(const QString& command, const QJsonObject& data = QJsonObject());
+    QFuture<QJsonObject> batch(const QJsonArray& items);
+
+    quint64 getAvailableSeats(int scheduleId, int departureStationId, int arrivalStationId);
+    void subscribeSchedule(int scheduleId, int departureStationId, int arrivalStationId);
+    void unsubscribeSchedule(int scheduleId);
     void bookTicket(int scheduleId
                     , int seatId
                     , int departureStationId
@@ -107,7 +140,8 @@ public:
     void payTicket(const QString& ticketNumber);
     void cancelTicket(const QString& ticketNumber, const QString& reason = "");
 
-    void getMyTickets();
+    void getMyTickets(const QString& cursor = "");
+    void syncMyTickets(const QString& syncToken);
     void getTicketDetails(const QString& ticketNumber);
 
     QString getSessionToken() const {return m_sessionToken;}
@@ -118,6 +152,9 @@ signals:
     void connected();
     void disconnected();
     void error(QString errorMessage);
+    void reconnecting(int delayMs);
+    void sessionResumed();
+    void sessionExpired(QString errorMessage);
 
     void registerSuccess(int userId, QString email, bool requiresVerification);
     void registerFailed(QString errorMessage);
@@ -129,11 +166,13 @@ signals:
 
     void stationsReceived(QList<Station> stations);
     void trainsReceived(QList<TrainSearchResult> trains);
-    void seatsReceived(QList<Seat> seats);
+    void seatsReceived(QList<Carriage> carriages, quint64 requestId);
+    void seatAvailabilityChanged(int scheduleId, QList<int> takenSeatIds, QList<int> releasedSeatIds);
+    void seatMapResyncRequired(int scheduleId);
     void ticketBooked(QString ticketNumber, QString status);
     void ticketPaid(QString ticketNumber);
     void ticketCancelled(QString ticketNumber);
-    void ticketsReceived(QList<Ticket> tickets);
+    void ticketsPageReceived(TicketsPage page);
     void ticketDetailsReceived(Ticket ticket);
     void profileReceived(UserProfile profile);
     void resendVerificationSuccess();
@@ -145,6 +184,9 @@ private slots:
     void onDisconnected();
     void onReadyRead();
     void onSocketError(QAbstractSocket::SocketError socketError);
+    void onSslErrors(const QList<QSslError>& errors);
+    void onHeartbeat();
+    void onReconnectTimer();
 
 private:
     ApiClient();
@@ -152,23 +194,45 @@ private:
     ApiClient(const ApiClient&) = delete;
     ApiClient& operator=(const ApiClient&) = delete;
 
-    QTcpSocket* m_socket;
+    QSslSocket* m_socket;
+    QTimer* m_heartbeatTimer;
+    QTimer* m_reconnectTimer;
+    QString m_host;
+    quint16 m_port;
+    bool m_reconnectEnabled;
+    int m_reconnectAttempts;
+    int m_drainReconnectDelay;
+    QString m_resumeToken;
     QByteArray m_buffer;
+    WireProtocol::Encoding m_encoding;
+
+    quint64 m_nextRequestId;
+    QHash<quint64, QString> m_pendingCommands;
+    QHash<quint64, std::shared_ptr<QPromise<QJsonObject>>> m_pendingPromises;
 
     bool m_authenticated;
     QString m_sessionToken;
     UserProfile m_userProfile;
 
-    void sendCommand(const QString& command, const QJsonObject& data = QJsonObject());
-    void processResponse(const QByteArray& data);
+    quint64 sendCommand(const QString& command, const QJsonObject& data = QJsonObject());
+    void processResponse(const QByteArray& data, WireProtocol::Encoding encoding);
+    void failPendingRequests(const QString& reason);
+    void scheduleReconnect();
+    void parseUserProfile(const QJsonObject& userObj);
 
+    void handleHelloResponse(const QJsonObject& response);
     void handleRegisterResponse(const QJsonObject& response);
     void handleLoginResponse(const QJsonObject& response);
+    void handleResumeSessionResponse(const QJsonObject& response);
+    void handleServerDraining(const QJsonObject& response);
     void handleLogoutResponse(const QJsonObject&);
     void handleVerifyEmailResponse(const QJsonObject&);
     void handleStationsResponse(const QJsonObject& response);
     void handleTrainsResponse(const QJsonObject& response);
-    void handleSeatsResponse(const QJsonObject& response);
+    void handleSeatsResponse(const QJsonObject& response, quint64 requestId);
+    void handleSeatUpdate(const QJsonObject& response);
+    QList<Carriage> decodeSeatMap(const QJsonObject& data);
+    QList<Carriage> groupSeatsByCarriage(const QJsonArray& seatsArray);
     void handleBookTicketResponse(const QJsonObject& response);
     void handlePayTicketResponse(const QJsonObject& response);
     void handleCancelTicketResponse(const QJsonObject& response);
@@ -149,6 +149,16 @@ void CarriageWidget::markSeatsAsBooked(const QList<int>& seatNumbers)
     }
 }
 
+SeatWidget* CarriageWidget::findSeat(int seatId) const
+{
+    for (SeatWidget* seat: m_seatWidgets) {
+        if (seat->getSeat().id == seatId) {
+            return seat;
+        }
+    }
+    return nullptr;
+}
+
 void CarriageWidget::paintEvent(QPaintEvent* event)
 {
     Q_UNUSED(event);
@@ -37,6 +37,7 @@ public:
                             , QWidget *parent = nullptr);
     void clearSelection();
     void markSeatsAsBooked(const QList<int>& seatNumbers);
+    SeatWidget* findSeat(int seatId) const;
     void paintEvent(QPaintEvent* event) override;
 
 signals:
@@ -8,6 +8,12 @@ const QString API_HOST = "localhost";
 const quint16 API_PORT = 8080;
 
 const int NETWORK_TIMEOUT = 30000;
+const int HEARTBEAT_INTERVAL = 60000;
+const int RECONNECT_BASE_DELAY = 1000;
+const int RECONNECT_MAX_DELAY = 30000;
+const bool PREFER_BINARY_PROTOCOL = true;
+const bool USE_TLS = false;
+const QString TLS_CA_CERTIFICATE = "";
 const int BOOKING_TIMEOUT = 15 * 60 * 1000;
 
 const QString APP_NAME = "Railway Ticket Booking System";
@@ -10,6 +10,7 @@
 #include "profilewidget.h"
 #include <QVBoxLayout>
 #include <QMessageBox>
+#include <QDebug>
 
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent)
@@ -72,6 +73,9 @@ void MainWindow::connectSignals()
 {
     connect(&ApiClient::instance(), &ApiClient::loginSuccess, this, &MainWindow::onLoginSuccess);
     connect(&ApiClient::instance(), &ApiClient::logoutSuccess, this, &MainWindow::onLogoutSuccess);
+    connect(&ApiClient::instance(), &ApiClient::reconnecting, this, &MainWindow::onReconnecting);
+    connect(&ApiClient::instance(), &ApiClient::sessionResumed, this, &MainWindow::onSessionResumed);
+    connect(&ApiClient::instance(), &ApiClient::sessionExpired, this, &MainWindow::onSessionExpired);
 
     connect(m_loginWidget, &LoginWidget::loginSuccess, this, &MainWindow::showMainMenu);
     connect(m_loginWidget, &LoginWidget::registerRequested, this, &MainWindow:: showRegistration);
@@ -151,6 +155,24 @@ void MainWindow::onLogoutSuccess()
     showLogin();
 }
 
+void MainWindow::onReconnecting(int delayMs)
+{
+    statusBar()->showMessage(QString("Соединение потеряно, переподключение через %1 с...")
+                             .arg((delayMs + 999) / 1000));
+}
+
+void MainWindow::onSessionResumed()
+{
+    statusBar()->showMessage("Соединение восстановлено", 3000);
+}
+
+void MainWindow::onSessionExpired(QString errorMessage)
+{
+    statusBar()->showMessage("Сессия истекла, войдите снова", 5000);
+    qDebug() << "Session could not be resumed:" << errorMessage;
+    showLogin();
+}
+
 void MainWindow::onBookingCompleted()
 {
     showMainMenu();
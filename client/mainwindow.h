@@ -36,6 +36,9 @@ private slots:
     void showProfile();
 
     void onLoginSuccess(UserProfile user);
+    void onReconnecting(int delayMs);
+    void onSessionResumed();
+    void onSessionExpired(QString errorMessage);
     void onLogoutSuccess();
     void onBookingCompleted();
 
@@ -3,13 +3,17 @@
 #include <QHBoxLayout>
 #include <QMessageBox>
 #include <QFrame>
+#include <algorithm>
 
 MyTicketsWidget::MyTicketsWidget(QWidget *parent)
     : QWidget(parent)
+    , m_fullLoadInProgress(false)
 {
     setupUi();
 
-    connect(&ApiClient::instance(), &ApiClient::ticketsReceived, this, &MyTicketsWidget::onTicketsReceived);
+    connect(&ApiClient::instance(), &ApiClient::ticketsPageReceived, this, &MyTicketsWidget::onTicketsPageReceived);
+    connect(&ApiClient::instance(), &ApiClient::loginSuccess, this, &MyTicketsWidget::resetTickets);
+    connect(&ApiClient::instance(), &ApiClient::logoutSuccess, this, &MyTicketsWidget::resetTickets);
 }
 
 void MyTicketsWidget::setupUi(){
@@ -114,7 +118,29 @@ void MyTicketsWidget::setupUi(){
     connect(m_historyTicketsList, &QListWidget::itemClicked, this, &MyTicketsWidget::onTicketItemClicked);
 }
 
+// The first load pages through every ticket; after that only the tickets
+// changed since the last sync token are fetched and merged in.
 void MyTicketsWidget::loadTickets(){
+    if (m_syncToken.isEmpty()) {
+        startFullLoad();
+    } else if (!m_fullLoadInProgress) {
+        ApiClient::instance().syncMyTickets(m_syncToken);
+    }
+}
+
+void MyTicketsWidget::resetTickets(){
+    m_tickets.clear();
+    m_syncToken.clear();
+    m_loadSyncToken.clear();
+    m_fullLoadInProgress = false;
+}
+
+void MyTicketsWidget::startFullLoad(){
+    m_tickets.clear();
+    m_syncToken.clear();
+    m_loadSyncToken.clear();
+    m_fullLoadInProgress = true;
+
     m_activeTicketsList->clear();
     m_historyTicketsList->clear();
 
@@ -131,9 +157,52 @@ void MyTicketsWidget::loadTickets(){
     ApiClient::instance().getMyTickets();
 }
 
-void MyTicketsWidget::onTicketsReceived(QList<Ticket> tickets){
-    m_tickets = tickets;
+void MyTicketsWidget::onTicketsPageReceived(TicketsPage page){
+    if (page.incremental) {
+        if (page.resync) {
+            startFullLoad();
+            return;
+        }
+        mergeTickets(page.tickets);
+        m_syncToken = page.syncToken;
+        displayTickets();
+        return;
+    }
+
+    if (!m_fullLoadInProgress) return;
+
+    // Changes made while later pages load are caught by the next sync
+    // because it starts from the token of the first page.
+    if (m_loadSyncToken.isEmpty()) {
+        m_loadSyncToken = page.syncToken;
+    }
+    m_tickets.append(page.tickets);
     displayTickets();
+
+    if (page.hasMore) {
+        ApiClient::instance().getMyTickets(page.nextCursor);
+    } else {
+        m_fullLoadInProgress = false;
+        m_syncToken = m_loadSyncToken;
+    }
+}
+
+void MyTicketsWidget::mergeTickets(const QList<Ticket>& changed){
+    for (const Ticket& ticket: changed) {
+        auto existing = std::find_if(m_tickets.begin(), m_tickets.end(), [&ticket](const Ticket& known) {
+            return known.ticketNumber == ticket.ticketNumber;
+        });
+        if (existing != m_tickets.end()) {
+            *existing = ticket;
+        } else {
+            m_tickets.append(ticket);
+        }
+    }
+
+    std::sort(m_tickets.begin(), m_tickets.end(), [](const Ticket& a, const Ticket& b) {
+        if (a.bookedAt != b.bookedAt) return a.bookedAt > b.bookedAt;
+        return a.id > b.id;
+    });
 }
 
 void MyTicketsWidget::displayTickets(){
@@ -21,7 +21,8 @@ signals:
     void backRequested();
 
 private slots:
-    void onTicketsReceived(QList<Ticket> tickets);
+    void onTicketsPageReceived(TicketsPage page);
+    void resetTickets();
     void onTicketItemClicked(QListWidgetItem* item);
     void onBackClicked();
     void onRefreshClicked();
@@ -29,6 +30,8 @@ private slots:
 
 private:
     void setupUi();
+    void startFullLoad();
+    void mergeTickets(const QList<Ticket>& changed);
     void displayTickets();
     QString getStatusText(const QString& status) const;
     QString getStatusColor(const QString& status) const;
@@ -41,6 +44,9 @@ private:
     QPushButton* m_refreshButton;
 
     QList<Ticket> m_tickets;
+    QString m_syncToken;
+    QString m_loadSyncToken;
+    bool m_fullLoadInProgress;
     Ticket m_selectedTicket;
 };
 
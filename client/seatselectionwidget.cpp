@@ -7,10 +7,15 @@
 
 SeatSelectionWidget::SeatSelectionWidget(QWidget *parent)
     : QWidget{parent}
+    , m_seatsRequestId(0)
+    , m_subscribedScheduleId(0)
     , m_selectedButton(nullptr)
 {
     setupUi();
     connect(&ApiClient::instance(), &ApiClient::seatsReceived, this, &SeatSelectionWidget::onSeatsReceived);
+    connect(&ApiClient::instance(), &ApiClient::seatAvailabilityChanged, this, &SeatSelectionWidget::onSeatAvailabilityChanged);
+    connect(&ApiClient::instance(), &ApiClient::seatMapResyncRequired, this, &SeatSelectionWidget::onSeatMapResyncRequired);
+    connect(&ApiClient::instance(), &ApiClient::sessionResumed, this, &SeatSelectionWidget::onSessionResumed);
 }
 
 void SeatSelectionWidget::setupUi()
@@ -230,14 +235,86 @@ void SeatSelectionWidget::loadSeats(const TrainSearchResult& train, int depId, i
     }
     m_carriageWidgets.clear();
 
-    ApiClient::instance().getAvailableSeats(train.scheduleId, depId, arrId);
+    if (m_subscribedScheduleId != train.scheduleId) {
+        unsubscribeFromSchedule();
+    }
+    ApiClient::instance().subscribeSchedule(train.scheduleId, depId, arrId);
+    m_subscribedScheduleId = train.scheduleId;
+
+    m_seatsRequestId = ApiClient::instance().getAvailableSeats(train.scheduleId, depId, arrId);
+}
+
+void SeatSelectionWidget::unsubscribeFromSchedule()
+{
+    if (m_subscribedScheduleId > 0) {
+        ApiClient::instance().unsubscribeSchedule(m_subscribedScheduleId);
+        m_subscribedScheduleId = 0;
+    }
 }
 
-void SeatSelectionWidget::onSeatsReceived(QList<Seat> seats){
-    m_seats = seats;
+void SeatSelectionWidget::onSeatsReceived(QList<Carriage> carriages, quint64 requestId){
+    if (requestId != m_seatsRequestId) {
+        return;
+    }
+
+    m_carriages = carriages;
     createCarriageWidgets();
 }
 
+void SeatSelectionWidget::onSeatAvailabilityChanged(int scheduleId, QList<int> takenSeatIds, QList<int> releasedSeatIds)
+{
+    if (scheduleId != m_subscribedScheduleId) {
+        return;
+    }
+
+    auto applyChange = [this](int seatId, bool occupied) {
+        for (CarriageWidget* cw: qAsConst(m_carriageWidgets)) {
+            SeatWidget* sw = cw->findSeat(seatId);
+            if (!sw) {
+                continue;
+            }
+
+            sw->setOccupied(occupied);
+            if (occupied && sw == m_selectedButton) {
+                resetSelection();
+                m_selectedSeatLabel->setText("Выбранное место только что заняли, выберите другое");
+            }
+            return;
+        }
+    };
+
+    for (int seatId: releasedSeatIds) {
+        applyChange(seatId, false);
+    }
+    for (int seatId: takenSeatIds) {
+        applyChange(seatId, true);
+    }
+}
+
+void SeatSelectionWidget::onSeatMapResyncRequired(int scheduleId)
+{
+    if (scheduleId != m_subscribedScheduleId) {
+        return;
+    }
+
+    resetSelection();
+    m_seatsRequestId = ApiClient::instance().getAvailableSeats(m_currentTrain.scheduleId,
+                                                               m_departureStationId,
+                                                               m_arrivalStationId);
+}
+
+// Subscriptions do not survive a reconnect, and seats may have changed while
+// the connection was down.
+void SeatSelectionWidget::onSessionResumed()
+{
+    if (m_subscribedScheduleId <= 0) {
+        return;
+    }
+
+    ApiClient::instance().subscribeSchedule(m_subscribedScheduleId, m_departureStationId, m_arrivalStationId);
+    onSeatMapResyncRequired(m_subscribedScheduleId);
+}
+
 void SeatSelectionWidget::setBookedSeats(const QList<int>& bookedSeatIds)
 {
     m_bookedSeatIds = bookedSeatIds;
@@ -258,7 +335,7 @@ void SeatSelectionWidget::createCarriageWidgets()
     m_carriageWidgets.clear();
     m_carriageSelector->clear();
 
-    if (m_seats.isEmpty()) {
+    if (m_carriages.isEmpty()) {
         QLabel* noSeatsLabel = new QLabel("Свободные места отсутствуют", m_scrollContent);
         noSeatsLabel->setAlignment(Qt::AlignCenter);
         noSeatsLabel->setStyleSheet("font-size: 16px; color: #999; padding: 50px;");
@@ -266,30 +343,9 @@ void SeatSelectionWidget::createCarriageWidgets()
         return;
     }
 
-    QMap<int, QList<Seat>> carriageSeats;
-    QMap<int, QString> carriageTypes;
-
-    for (const Seat& seat : m_seats) {
-        int cnum = seat.carriageNumber;
-        if (cnum == 0) {
-            qWarning() << "Seat has no carriageNumber, fallback to carriageId:" << seat.id << seat.carriageId;
-            cnum = seat.carriageId;
-        }
-        carriageSeats[cnum].append(seat);
-        carriageTypes[cnum] = seat.carriageType;
-    }
-
-    QList<int> carriageNumbers = carriageSeats.keys();
-    std::sort(carriageNumbers.begin(), carriageNumbers.end());
-
-    for (int carriageNumber: carriageNumbers) {
-        QList<Seat> seats = carriageSeats[carriageNumber];
-        std::sort(seats.begin(), seats.end(), [](const Seat& a, const Seat& b) {
-            return a.seatNumber < b.seatNumber;
-        });
-
-        QString carriageType = carriageTypes.value(carriageNumber, QString("Вагон"));
-        CarriageWidget* cw = new CarriageWidget(carriageNumber, carriageType, seats, m_scrollContent);
+    for (const Carriage& carriage: m_carriages) {
+        QString carriageType = carriage.type.isEmpty() ? QString("Вагон") : carriage.type;
+        CarriageWidget* cw = new CarriageWidget(carriage.number, carriageType, carriage.seats, m_scrollContent);
         connect(cw, &CarriageWidget::seatClicked, this, &SeatSelectionWidget::onSeatClicked);
 
         if (!m_bookedSeatIds.isEmpty()) {
@@ -300,8 +356,8 @@ void SeatSelectionWidget::createCarriageWidgets()
         m_carriagesLayout->addWidget(cw);
 
         m_carriageSelector->addItem(
-            QString("Вагон %1 (%2) - %3 мест").arg(carriageNumber).arg(carriageType).arg(seats.size()),
-            carriageNumber
+            QString("Вагон %1 (%2) - %3 мест").arg(carriage.number).arg(carriageType).arg(carriage.seats.size()),
+            carriage.number
             );
     }
 
@@ -311,22 +367,7 @@ void SeatSelectionWidget::createCarriageWidgets()
 void SeatSelectionWidget::onSeatClicked(const Seat& seat, SeatWidget* button)
 {
     if (m_selectedButton == button && button->isChecked()) {
-        button->setSelected(false);
-        m_selectedButton = nullptr;
-        m_selectedSeat = Seat();
-
-        m_selectedSeatLabel->setText("Выберите место");
-        m_selectedSeatLabel->setStyleSheet(R"(
-            QLabel {
-                background-color: #f5f5f5;
-                border: 1px solid #e0e0e0;
-                border-radius: 5px;
-                padding: 12px;
-                font-size: 14px;
-                color: #666;
-            }
-        )");
-        m_continueButton->setEnabled(false);
+        resetSelection();
         return;
     }
 
@@ -357,6 +398,28 @@ void SeatSelectionWidget::onSeatClicked(const Seat& seat, SeatWidget* button)
     m_continueButton->setEnabled(true);
 }
 
+void SeatSelectionWidget::resetSelection()
+{
+    if (m_selectedButton) {
+        m_selectedButton->setSelected(false);
+    }
+    m_selectedButton = nullptr;
+    m_selectedSeat = Seat();
+
+    m_selectedSeatLabel->setText("Выберите место");
+    m_selectedSeatLabel->setStyleSheet(R"(
+        QLabel {
+            background-color: #f5f5f5;
+            border: 1px solid #e0e0e0;
+            border-radius: 5px;
+            padding: 12px;
+            font-size: 14px;
+            color: #666;
+        }
+    )");
+    m_continueButton->setEnabled(false);
+}
+
 void SeatSelectionWidget::displaySeats()
 {
     createCarriageWidgets();
@@ -371,6 +434,7 @@ void SeatSelectionWidget::onCarriageChanged(int index){
 
 void SeatSelectionWidget::onBackClicked()
 {
+    unsubscribeFromSchedule();
     emit backRequested();
 }
 
@@ -381,6 +445,7 @@ void SeatSelectionWidget::onContinueClicked()
         return;
     }
 
+    unsubscribeFromSchedule();
     emit seatSelected(m_currentTrain, m_selectedSeat,
                       m_departureStationId, m_arrivalStationId,
                       m_currentTrain.minPrice);
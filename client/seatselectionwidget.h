@@ -26,7 +26,10 @@ signals:
     void seatSelected(TrainSearchResult train, Seat seat, int depId, int arrId, double price);
 
 private slots:
-    void onSeatsReceived(QList<Seat> seats);
+    void onSeatsReceived(QList<Carriage> carriages, quint64 requestId);
+    void onSeatAvailabilityChanged(int scheduleId, QList<int> takenSeatIds, QList<int> releasedSeatIds);
+    void onSeatMapResyncRequired(int scheduleId);
+    void onSessionResumed();
     void onSeatClicked(const Seat& seat, SeatWidget* button);
     void onCarriageChanged(int index);
     void onBackClicked();
@@ -36,6 +39,8 @@ private:
     void setupUi();
     void displaySeats();
     void createCarriageWidgets();
+    void unsubscribeFromSchedule();
+    void resetSelection();
 
     QLabel* m_trainInfoLabel;
     QLabel* m_selectedSeatLabel;
@@ -49,7 +54,9 @@ private:
     TrainSearchResult m_currentTrain;
     int m_departureStationId;
     int m_arrivalStationId;
-    QList<Seat> m_seats;
+    quint64 m_seatsRequestId;
+    int m_subscribedScheduleId;
+    QList<Carriage> m_carriages;
     Seat m_selectedSeat;
     SeatWidget* m_selectedButton;
     QList<CarriageWidget*> m_carriageWidgets;
@@ -0,0 +1,137 @@
+#include "copystream.h"
+
+CopyStream::CopyStream(PGconn* connection)
+    : m_connection(connection)
+    , m_active(false)
+    , m_rowStarted(false)
+    , m_rows(0)
+{
+    m_buffer.reserve(FLUSH_THRESHOLD + 64 * 1024);
+}
+
+CopyStream::~CopyStream(){
+    if (m_active){
+        PQputCopyEnd(m_connection, "aborted");
+        PQclear(PQgetResult(m_connection));
+    }
+}
+
+// FREEZE is only accepted when the table was created or truncated in the
+// same transaction; it spares the later vacuum from rewriting every page.
+bool CopyStream::begin(const QString& table, const QStringList& columns, bool freeze){
+    m_table = table;
+    m_rows = 0;
+    m_buffer.resize(0);
+
+    QString sql = QString("COPY %1 (%2) FROM STDIN%3").arg(table, columns.join(", "), freeze ? " WITH (FREEZE)" : "");
+    PGresult* result = PQexec(m_connection, sql.toUtf8().constData());
+    bool ok = PQresultStatus(result) == PGRES_COPY_IN;
+    if (!ok){
+        m_lastError = QString("COPY %1: %2").arg(table, QString::fromUtf8(PQerrorMessage(m_connection)).trimmed());
+    }
+    PQclear(result);
+
+    m_active = ok;
+    return ok;
+}
+
+bool CopyStream::finish(){
+    if (!m_active){
+        return false;
+    }
+
+    bool ok = flush();
+    m_active = false;
+
+    if (PQputCopyEnd(m_connection, ok ? nullptr : "client error") != 1){
+        m_lastError = QString("COPY %1: %2").arg(m_table, QString::fromUtf8(PQerrorMessage(m_connection)).trimmed());
+        return false;
+    }
+
+    PGresult* result;
+    while ((result = PQgetResult(m_connection)) != nullptr){
+        if (PQresultStatus(result) != PGRES_COMMAND_OK){
+            m_lastError = QString("COPY %1: %2").arg(m_table, QString::fromUtf8(PQresultErrorMessage(result)).trimmed());
+            ok = false;
+        }
+        PQclear(result);
+    }
+    return ok;
+}
+
+void CopyStream::separate(){
+    if (m_rowStarted){
+        m_buffer.append('\t');
+    }
+    m_rowStarted = true;
+}
+
+CopyStream& CopyStream::field(int value){
+    return field(qint64(value));
+}
+
+CopyStream& CopyStream::field(qint64 value){
+    separate();
+    m_buffer.append(QByteArray::number(value));
+    return *this;
+}
+
+CopyStream& CopyStream::field(double value){
+    separate();
+    m_buffer.append(QByteArray::number(value, 'f', 2));
+    return *this;
+}
+
+CopyStream& CopyStream::field(bool value){
+    separate();
+    m_buffer.append(value ? 't' : 'f');
+    return *this;
+}
+
+CopyStream& CopyStream::field(const QByteArray& value){
+    separate();
+    for (char c: value){
+        switch (c){
+        case '\\': m_buffer.append("\\\\"); break;
+        case '\t': m_buffer.append("\\t"); break;
+        case '\n': m_buffer.append("\\n"); break;
+        case '\r': m_buffer.append("\\r"); break;
+        default: m_buffer.append(c);
+        }
+    }
+    return *this;
+}
+
+CopyStream& CopyStream::field(const char* value){
+    return field(QByteArray(value));
+}
+
+CopyStream& CopyStream::nullField(){
+    separate();
+    m_buffer.append("\\N");
+    return *this;
+}
+
+bool CopyStream::endRow(){
+    m_buffer.append('\n');
+    m_rowStarted = false;
+    m_rows++;
+
+    if (m_buffer.size() >= FLUSH_THRESHOLD){
+        return flush();
+    }
+    return true;
+}
+
+bool CopyStream::flush(){
+    if (m_buffer.isEmpty()){
+        return true;
+    }
+
+    if (PQputCopyData(m_connection, m_buffer.constData(), int(m_buffer.size())) != 1){
+        m_lastError = QString("COPY %1: %2").arg(m_table, QString::fromUtf8(PQerrorMessage(m_connection)).trimmed());
+        return false;
+    }
+    m_buffer.resize(0);
+    return true;
+}
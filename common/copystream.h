@@ -0,0 +1,48 @@
+#ifndef COPYSTREAM_H
+#define COPYSTREAM_H
+
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+#include <libpq-fe.h>
+
+// Streams rows into one table with COPY ... FROM STDIN in PostgreSQL text
+// format. Rows are assembled in a local buffer and handed to libpq in large
+// chunks, so the cost per row is a few appends.
+class CopyStream
+{
+public:
+    explicit CopyStream(PGconn* connection);
+    ~CopyStream();
+
+    bool begin(const QString& table, const QStringList& columns, bool freeze = false);
+    bool finish();
+
+    CopyStream& field(int value);
+    CopyStream& field(qint64 value);
+    CopyStream& field(double value);
+    CopyStream& field(bool value);
+    CopyStream& field(const QByteArray& value);
+    CopyStream& field(const char* value);
+    CopyStream& nullField();
+    bool endRow();
+
+    qint64 rowCount() const { return m_rows; }
+    QString lastError() const { return m_lastError; }
+
+private:
+    static const int FLUSH_THRESHOLD = 1024 * 1024;
+
+    void separate();
+    bool flush();
+
+    PGconn* m_connection;
+    QByteArray m_buffer;
+    bool m_active;
+    bool m_rowStarted;
+    qint64 m_rows;
+    QString m_table;
+    QString m_lastError;
+};
+
+#endif // COPYSTREAM_H
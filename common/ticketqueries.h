@@ -0,0 +1,168 @@
+#ifndef TICKETQUERIES_H
+#define TICKETQUERIES_H
+
+#include <QString>
+
+// Statements on the tickets table whose plans decide how the server scales.
+// The server runs this text and TrainTicketsDatagen --check-plans EXPLAINs
+// the same text, so a change to one is a change to both.
+namespace TicketQueries {
+
+// Whether the ticket columns of alias cover any part of the segment from
+// dep to arr. Every occupancy check shares this text.
+inline QString segmentOverlap(const QString& alias, const QString& dep, const QString& arr){
+    return QString(R"((
+          (%1.departure_station_id <= %2 AND %1.arrival_station_id > %2)
+          OR (%1.departure_station_id < %3 AND %1.arrival_station_id >= %3)
+          OR (%1.departure_station_id >= %2 AND %1.arrival_station_id <= %3)
+      ))").arg(alias, dep, arr);
+}
+
+// Live tickets on a seat whose segment overlaps the requested one. The
+// departure date lets the executor prune tickets to a single partition.
+// Parameters: :seat_id, :schedule_id, :dep_station, :arr_station.
+inline QString seatOverlap(){
+    return QString(R"(
+    SELECT COUNT(*) FROM tickets
+    WHERE seat_id = :seat_id
+      AND schedule_id = :schedule_id
+      AND departure_date = (SELECT departure_date FROM schedules WHERE id = :schedule_id)
+      AND status IN ('booked', 'paid')
+      AND %1
+)").arg(segmentOverlap("tickets", ":dep_station", ":arr_station"));
+}
+
+// The occupancy check, the insert and, with logAction, its audit row in one
+// statement. The parameters are cast because nothing else in a select
+// list gives them a type.
+// Parameters: :user_id, :schedule_id, :seat_id, :dep_station, :arr_station,
+// :ticket_number, :price, :passenger_name, :passenger_doc and, with
+// logAction, :details.
+inline QString insertTicket(bool logAction){
+    QString auditSql;
+    if (logAction){
+        auditSql = R"(
+    , audit AS (
+        INSERT INTO audit_logs (user_id, action, details, success)
+        SELECT CAST(:user_id AS integer), 'ticket_booked', CAST(:details AS text), true
+        FROM inserted
+    )
+)";
+    }
+
+    return QString(R"(
+    WITH schedule AS (
+        SELECT id, departure_date FROM schedules WHERE id = CAST(:schedule_id AS integer)
+    ), occupied AS (
+        SELECT 1 FROM tickets
+        WHERE seat_id = CAST(:seat_id AS integer)
+          AND schedule_id = CAST(:schedule_id AS integer)
+          AND departure_date = (SELECT departure_date FROM schedule)
+          AND status IN ('booked', 'paid')
+          AND %2
+        LIMIT 1
+    ), inserted AS (
+        INSERT INTO tickets
+        (user_id, schedule_id, seat_id, departure_station_id, arrival_station_id, departure_date,
+         ticket_number, price, status, passenger_name, passenger_document)
+        SELECT CAST(:user_id AS integer), id, CAST(:seat_id AS integer),
+               CAST(:dep_station AS integer), CAST(:arr_station AS integer), departure_date,
+               CAST(:ticket_number AS varchar), CAST(:price AS double precision), 'booked',
+               CAST(:passenger_name AS varchar), CAST(:passenger_doc AS varchar)
+        FROM schedule
+        WHERE NOT EXISTS (SELECT 1 FROM occupied)
+        RETURNING id
+    )
+    %1
+    SELECT EXISTS (SELECT 1 FROM schedule) AS schedule_found,
+           EXISTS (SELECT 1 FROM occupied) AS occupied
+)").arg(auditSql, segmentOverlap("tickets", "CAST(:dep_station AS integer)", "CAST(:arr_station AS integer)"));
+}
+
+// Trains between two stations on a date, with free seats counted in the
+// same statement rather than once per train.
+// Parameters: $1 departure station, $2 arrival station, $3 date.
+const char* const SEARCH_TRAINS = R"(
+    WITH found AS (
+        SELECT DISTINCT
+            s.id as schedule_id,
+            r.id as route_id,
+            t.train_number,
+            t.train_type,
+            rs1.station_id as dep_station_id,
+            st1.name as dep_station_name,
+            rs2.station_id as arr_station_id,
+            st2.name as arr_station_name,
+            rs1.departure_time as dep_time,
+            rs2.arrival_time as arr_time,
+            (rs2.price_from_start - rs1.price_from_start) as min_price
+        FROM schedules s
+        JOIN routes r ON s.route_id = r.id
+        JOIN trains t ON r.train_id = t.id
+        JOIN route_stops rs1 ON r.id = rs1.route_id AND rs1.station_id = $1
+        JOIN route_stops rs2 ON r.id = rs2.route_id AND rs2.station_id = $2
+        JOIN stations st1 ON rs1.station_id = st1.id
+        JOIN stations st2 ON rs2.station_id = st2.id
+        WHERE s.departure_date = $3
+          AND s.status = 'active'
+          AND rs1.stop_order < rs2.stop_order
+          AND t.is_active = true
+          AND $3 BETWEEN r.valid_from AND r.valid_to
+    )
+    SELECT found.*,
+           (SELECT COUNT(DISTINCT se.id)
+            FROM seats se
+            JOIN carriages c ON se.carriage_id = c.id
+            JOIN routes r ON c.train_id = r.train_id
+            WHERE r.id = found.route_id
+              AND se.id NOT IN (
+                  SELECT seat_id FROM tickets
+                  WHERE schedule_id = found.schedule_id
+                    AND departure_date = $3
+                    AND status IN ('booked', 'paid')
+              )) AS available_seats
+    FROM found
+    ORDER BY dep_time
+)";
+
+// The seat map of a schedule, each seat marked free or taken for the
+// segment asked about.
+// Parameters: $1 schedule, $2 departure station, $3 arrival station.
+inline QString availableSeats(){
+    return QString(R"(
+    SELECT s.id, s.carriage_id, s.seat_number, s.seat_type,
+           c.carriage_number, c.carriage_type,
+           NOT EXISTS (
+               SELECT 1 FROM tickets tk
+               WHERE tk.seat_id = s.id
+                 AND tk.schedule_id = sch.id
+                 AND tk.departure_date = sch.departure_date
+                 AND tk.status IN ('booked', 'paid')
+                 AND %1
+           ) AS is_available
+    FROM seats s
+    JOIN carriages c ON s.carriage_id = c.id
+    JOIN trains t ON c.train_id = t.id
+    JOIN routes r ON t.id = r.train_id
+    JOIN schedules sch ON r.id = sch.route_id
+    WHERE sch.id = $1
+    ORDER BY c.carriage_number, s.seat_number
+)").arg(segmentOverlap("tk", "$2", "$3"));
+}
+
+// Expires every unpaid booking past the timeout, whatever month it is in.
+// idx_tickets_booked_at holds only rows still in the 'booked' state, so a
+// month of history costs one probe of a near-empty index.
+inline QString expireBookings(int timeoutMinutes){
+    return QString(R"(
+    UPDATE tickets
+    SET status = 'expired', cancelled_at = CURRENT_TIMESTAMP
+    WHERE status = 'booked'
+      AND booked_at < (CURRENT_TIMESTAMP - INTERVAL '%1 minutes')
+    RETURNING schedule_id, seat_id, departure_station_id, arrival_station_id
+)").arg(timeoutMinutes);
+}
+
+} // namespace TicketQueries
+
+#endif // TICKETQUERIES_H
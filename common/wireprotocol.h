@@ -0,0 +1,137 @@
+#ifndef WIREPROTOCOL_H
+#define WIREPROTOCOL_H
+
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <QJsonParseError>
+#include <QCborValue>
+#include <QtEndian>
+
+// Messages are either newline-terminated JSON text or binary frames:
+// one marker byte, a 32-bit big-endian payload length and a CBOR payload.
+// The marker can never start a JSON text line, so both kinds can be told
+// apart per message and a peer may switch encodings at any message boundary.
+namespace WireProtocol {
+
+enum class Encoding {
+    Json,
+    Cbor
+};
+
+enum class DecodeStatus {
+    Message,
+    NeedMore,
+    Error
+};
+
+const char BINARY_FRAME_MARKER = char(0xB1);
+const int BINARY_HEADER_SIZE = 5;
+const quint32 MAX_FRAME_SIZE = 16 * 1024 * 1024;
+
+inline QString encodingName(Encoding encoding){
+    return encoding == Encoding::Cbor ? "cbor" : "json";
+}
+
+inline bool encodingFromName(const QString& name, Encoding* encoding){
+    if (name == "cbor"){
+        *encoding = Encoding::Cbor;
+        return true;
+    }
+    if (name == "json"){
+        *encoding = Encoding::Json;
+        return true;
+    }
+    return false;
+}
+
+inline QStringList supportedEncodings(){
+    return {"cbor", "json"};
+}
+
+inline QByteArray encode(const QJsonObject& message, Encoding encoding){
+    if (encoding == Encoding::Cbor){
+        QByteArray payload = QCborValue::fromJsonValue(message).toCbor();
+
+        QByteArray frame(BINARY_HEADER_SIZE, Qt::Uninitialized);
+        frame[0] = BINARY_FRAME_MARKER;
+        qToBigEndian<quint32>(quint32(payload.size()), frame.data() + 1);
+        frame.append(payload);
+        return frame;
+    }
+
+    QByteArray data = QJsonDocument(message).toJson(QJsonDocument::Compact);
+    data.append('\n');
+    return data;
+}
+
+inline DecodeStatus takeMessage(QByteArray& buffer, QByteArray* payload, Encoding* encoding){
+    if (buffer.isEmpty()){
+        return DecodeStatus::NeedMore;
+    }
+
+    if (buffer.at(0) == BINARY_FRAME_MARKER){
+        if (buffer.size() < BINARY_HEADER_SIZE){
+            return DecodeStatus::NeedMore;
+        }
+
+        quint32 length = qFromBigEndian<quint32>(buffer.constData() + 1);
+        if (length > MAX_FRAME_SIZE){
+            return DecodeStatus::Error;
+        }
+        if (quint32(buffer.size() - BINARY_HEADER_SIZE) < length){
+            return DecodeStatus::NeedMore;
+        }
+
+        *payload = buffer.mid(BINARY_HEADER_SIZE, length);
+        buffer.remove(0, BINARY_HEADER_SIZE + length);
+        *encoding = Encoding::Cbor;
+        return DecodeStatus::Message;
+    }
+
+    int newlineIndex = buffer.indexOf('\n');
+    if (newlineIndex == -1){
+        return DecodeStatus::NeedMore;
+    }
+
+    *payload = buffer.left(newlineIndex);
+    buffer.remove(0, newlineIndex + 1);
+    *encoding = Encoding::Json;
+    return DecodeStatus::Message;
+}
+
+inline bool decode(const QByteArray& payload, Encoding encoding, QJsonObject* message, QString* error){
+    if (encoding == Encoding::Cbor){
+        QCborParserError parseError;
+        QCborValue value = QCborValue::fromCbor(payload, &parseError);
+        if (parseError.error != QCborError::NoError){
+            if (error) *error = "Invalid CBOR: " + parseError.errorString();
+            return false;
+        }
+        if (!value.isMap()){
+            if (error) *error = "Message must be a CBOR map";
+            return false;
+        }
+        *message = value.toJsonValue().toObject();
+        return true;
+    }
+
+    QJsonParseError parseError;
+    QJsonDocument doc = QJsonDocument::fromJson(payload, &parseError);
+    if (parseError.error != QJsonParseError::NoError){
+        if (error) *error = "Invalid JSON: " + parseError.errorString();
+        return false;
+    }
+    if (!doc.isObject()){
+        if (error) *error = "Message must be a JSON object";
+        return false;
+    }
+    *message = doc.object();
+    return true;
+}
+
+}
+
+#endif // WIREPROTOCOL_H
@@ -1,3 +1,5 @@
+DROP TABLE IF EXISTS schema_version;
+DROP TABLE IF EXISTS reference_data_version;
 DROP TABLE IF EXISTS tickets;
 DROP TABLE IF EXISTS schedules;
 DROP TABLE IF EXISTS route_stops;
@@ -127,21 +129,78 @@ CREATE TABLE schedules (
 );
 
 CREATE TABLE tickets (
-    id SERIAL PRIMARY KEY,
+    id SERIAL,
     user_id INTEGER NOT NULL REFERENCES users(id) ON DELETE CASCADE,
     schedule_id INTEGER NOT NULL REFERENCES schedules(id) ON DELETE CASCADE,
     seat_id INTEGER NOT NULL REFERENCES seats(id) ON DELETE CASCADE,
     departure_station_id INTEGER NOT NULL REFERENCES stations(id),
     arrival_station_id INTEGER NOT NULL REFERENCES stations(id),
-    ticket_number VARCHAR(50) UNIQUE NOT NULL,
+    departure_date DATE NOT NULL,
+    ticket_number VARCHAR(50) NOT NULL,
     price DOUBLE PRECISION NOT NULL,
     status VARCHAR(20) DEFAULT 'booked',
     booked_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
     paid_at TIMESTAMP,
     cancelled_at TIMESTAMP,
     passenger_name VARCHAR(200) NOT NULL,
-    passenger_document VARCHAR(50) NOT NULL
+    passenger_document VARCHAR(50) NOT NULL,
+    updated_at TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP,
+    PRIMARY KEY (id, departure_date),
+    UNIQUE (ticket_number, departure_date)
+) PARTITION BY RANGE (departure_date);
+
+-- Monthly ticket partitions; the server creates them ahead of new schedules.
+
+CREATE OR REPLACE FUNCTION ensure_ticket_partitions(first_date DATE, last_date DATE) RETURNS INTEGER AS $$
+DECLARE
+    month_start DATE := date_trunc('month', first_date)::date;
+    partition_name TEXT;
+    created INTEGER := 0;
+BEGIN
+    WHILE month_start <= last_date LOOP
+        partition_name := 'tickets_' || to_char(month_start, 'YYYY_MM');
+        IF to_regclass(partition_name) IS NULL THEN
+            EXECUTE format('CREATE TABLE %I PARTITION OF tickets FOR VALUES FROM (%L) TO (%L)',
+                           partition_name, month_start, (month_start + INTERVAL '1 month')::date);
+            created := created + 1;
+        END IF;
+        month_start := (month_start + INTERVAL '1 month')::date;
+    END LOOP;
+    RETURN created;
+END
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION touch_updated_at() RETURNS trigger AS $$
+BEGIN
+    NEW.updated_at = clock_timestamp();
+    RETURN NEW;
+END
+$$ LANGUAGE plpgsql;
+
+CREATE TRIGGER tickets_touch_updated_at BEFORE UPDATE ON tickets FOR EACH ROW EXECUTE FUNCTION touch_updated_at();
+
+CREATE TABLE reference_data_version (
+    id BOOLEAN PRIMARY KEY DEFAULT TRUE CHECK (id),
+    version BIGINT NOT NULL DEFAULT 0,
+    updated_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
 );
+INSERT INTO reference_data_version (id, version) VALUES (TRUE, 0);
+
+CREATE OR REPLACE FUNCTION bump_reference_data_version() RETURNS trigger AS $$
+BEGIN
+    UPDATE reference_data_version SET version = version + 1, updated_at = clock_timestamp() WHERE id;
+    PERFORM pg_notify('reference_data_changed', '');
+    RETURN NULL;
+END
+$$ LANGUAGE plpgsql;
+
+CREATE TRIGGER stations_reference_version AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON stations FOR EACH STATEMENT EXECUTE FUNCTION bump_reference_data_version();
+CREATE TRIGGER trains_reference_version AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON trains FOR EACH STATEMENT EXECUTE FUNCTION bump_reference_data_version();
+CREATE TRIGGER routes_reference_version AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON routes FOR EACH STATEMENT EXECUTE FUNCTION bump_reference_data_version();
+CREATE TRIGGER route_stops_reference_version AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON route_stops FOR EACH STATEMENT EXECUTE FUNCTION bump_reference_data_version();
+CREATE TRIGGER carriages_reference_version AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON carriages FOR EACH STATEMENT EXECUTE FUNCTION bump_reference_data_version();
+CREATE TRIGGER seats_reference_version AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON seats FOR EACH STATEMENT EXECUTE FUNCTION bump_reference_data_version();
+CREATE TRIGGER schedules_reference_version AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON schedules FOR EACH STATEMENT EXECUTE FUNCTION bump_reference_data_version();
 
 CREATE INDEX IF NOT EXISTS idx_users_email ON users(email);
 CREATE INDEX IF NOT EXISTS idx_users_locked_until ON users(locked_until);
@@ -155,14 +214,28 @@ CREATE INDEX IF NOT EXISTS idx_trains_number ON trains(train_number);
 CREATE INDEX IF NOT EXISTS idx_routes_train ON routes(train_id);
 CREATE INDEX IF NOT EXISTS idx_route_stops_route ON route_stops(route_id);
 CREATE INDEX IF NOT EXISTS idx_schedules_route_date ON schedules(route_id, departure_date);
-CREATE INDEX IF NOT EXISTS idx_tickets_user ON tickets(user_id);
+CREATE INDEX IF NOT EXISTS idx_tickets_user_booked_at ON tickets(user_id, booked_at DESC, id DESC);
+CREATE INDEX IF NOT EXISTS idx_tickets_user_updated_at ON tickets(user_id, updated_at);
 CREATE INDEX IF NOT EXISTS idx_tickets_schedule ON tickets(schedule_id);
 CREATE INDEX IF NOT EXISTS idx_tickets_number ON tickets(ticket_number);
-CREATE INDEX IF NOT EXISTS idx_tickets_status ON tickets(status);
+CREATE INDEX IF NOT EXISTS idx_tickets_live_seat ON tickets(schedule_id, seat_id)
+    INCLUDE (departure_date, departure_station_id, arrival_station_id)
+    WHERE status IN ('booked', 'paid');
+CREATE INDEX IF NOT EXISTS idx_tickets_booked_at ON tickets(booked_at) INCLUDE (departure_date) WHERE status = 'booked';
+CREATE INDEX IF NOT EXISTS idx_tickets_updated_at ON tickets(updated_at);
 CREATE INDEX IF NOT EXISTS idx_verification_codes_user ON verification_codes(user_id);
 CREATE INDEX IF NOT EXISTS idx_verification_codes_code ON verification_codes(code);
 CREATE INDEX IF NOT EXISTS idx_verification_codes_expires ON verification_codes(expires_at);
 
+-- Same schema as the server migrations in server/migrations.h; keep the
+-- version below equal to the last migration there.
+CREATE TABLE schema_version (
+    id BOOLEAN PRIMARY KEY DEFAULT TRUE CHECK (id),
+    version INTEGER NOT NULL,
+    updated_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
+);
+INSERT INTO schema_version (version) VALUES (8);
+
 INSERT INTO stations (name, city, code, latitude, longitude) VALUES
 ('Ленинградский вокзал', 'Москва', 'MOS', 55.7761, 37.6553),
 ('Новосибирск-Главный', 'Новосибирск', 'NSK', 55.0345, 82.8988),
@@ -619,3 +692,5 @@ BEGIN
         END LOOP;
     END LOOP;
 END $$;
+
+SELECT ensure_ticket_partitions(CURRENT_DATE, (SELECT max(departure_date) FROM schedules));
@@ -6,8 +6,18 @@
 #include <QTemporaryFile>
 #include <QFile>
 #include <QDateTime>
+#include <QHash>
+#include <QSslCertificate>
+#include <QSslKey>
+#include <QSslConfiguration>
+#include <QLocalSocket>
+#include <QRandomGenerator>
 #include "emailconfig.h"
+#include "sockethandoff.h"
 #include "database.h"
+#include "asyncdatabase.h"
+#include "inventoryshards.h"
+#include "searchcache.h"
 #include "pdfgenerator.h"
 #include "smtpclient.h"
 #include "mimepart.h"
@@ -19,25 +29,78 @@
 #include "mimefile.h"
 #include "mimebytearrayattachment.h"
 
+#ifdef Q_OS_LINUX
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#endif
+
 ApiServer::ApiServer(QObject *parent)
     : QObject(parent)
-    , m_server(new QTcpServer(this))
+    , m_server(new TlsServer(this))
+    , m_clientCount(0)
+    , m_registryFlushScheduled(false)
+    , m_seatCheckQueued(false)
+    , m_seatCheckRunning(false)
     , m_sslEnabled(false)
     , m_maxConnections(100)
     , m_connectionTimeout(300)
     , m_bookingTimeout(15)
+    , m_drainTimeout(30)
+    , m_handoffServer(nullptr)
+    , m_draining(false)
+    , m_drainFinished(false)
+    , m_idleWheelPosition(0)
+    , m_idleTickMs(1000)
+    , m_baselineResidentBytes(0)
 {
     m_stats.activeConnections = 0;
     m_stats.totalConnections = 0;
     m_stats.bytesRecieved = 0;
     m_stats.bytesSent = 0;
     m_stats.authenticatedUsers = 0;
+    m_stats.searchCacheHits = 0;
+    m_stats.searchCacheMisses = 0;
+    m_stats.searchCacheHitRatio = 0.0;
+    m_stats.searchCacheBytes = 0;
+    m_stats.readPauses = 0;
+    m_stats.maxConnections = m_maxConnections;
+    m_stats.idleConnectionsReaped = 0;
+    m_stats.rateLimitAllowed = 0;
+    m_stats.rateLimitRejected = 0;
+    m_stats.rateLimitTrackedKeys = 0;
+    m_stats.residentBytes = 0;
+    m_stats.bytesPerConnection = 0;
+    m_stats.tlsEnabled = false;
+    m_stats.tlsHandshakes = 0;
+    m_stats.tlsHandshakeFailures = 0;
+    m_stats.replicas = 0;
+    m_stats.replicasUsable = 0;
+    m_stats.maxReplicaLagMs = -1;
+    m_stats.replicaReads = 0;
+    m_stats.primaryReads = 0;
 
     connect(m_server, &QTcpServer::newConnection, this, &ApiServer::onNewConnection);
+    connect(&Database::instance(), &Database::seatSegmentChanged, this, &ApiServer::onSeatSegmentChanged);
 
     m_cleanup_Timer = new QTimer(this);
     connect(m_cleanup_Timer, &QTimer::timeout, this, &ApiServer::onCleanupTimer);
     m_cleanup_Timer->start(60000);
+
+    m_partitionTimer = new QTimer(this);
+    connect(m_partitionTimer, &QTimer::timeout, this, &ApiServer::onPartitionTimer);
+    m_partitionTimer->start(PARTITION_MAINTENANCE_INTERVAL_MS);
+    QTimer::singleShot(0, this, &ApiServer::onPartitionTimer);
+
+    m_drainTimer = new QTimer(this);
+    m_drainTimer->setSingleShot(true);
+    connect(m_drainTimer, &QTimer::timeout, this, &ApiServer::finishDrain);
+
+    m_idleWheel.resize(IDLE_WHEEL_SLOTS);
+    m_idleTimer = new QTimer(this);
+    connect(m_idleTimer, &QTimer::timeout, this, &ApiServer::onIdleWheelTick);
+    setConnectionTimeout(m_connectionTimeout);
 }
 
 ApiServer::~ApiServer(){
@@ -51,6 +114,9 @@ bool ApiServer::startServer(quint16 port, const QString &address){
     }
 
     QHostAddress addr(address);
+#if QT_VERSION >= QT_VERSION_CHECK(6, 3, 0)
+    m_server->setListenBacklogSize(LISTEN_BACKLOG);
+#endif
     if(!m_server->listen(addr, port)){
         QString error = m_server->errorString();
         qDebug() << "Failed to start server:" << error;
@@ -58,25 +124,62 @@ bool ApiServer::startServer(quint16 port, const QString &address){
         return false;
     }
 
-    m_stats.startTime = QDateTime::currentDateTime();
-    qDebug() << "Server started on" << address << ":" << port;
-    emit serverStarted(port);
+    onListening(QString("%1:%2").arg(address).arg(port));
     return true;
 }
 
+// Takes over a listening socket received from the previous server process.
+bool ApiServer::adoptListener(qintptr listenerDescriptor){
+    if (m_server->isListening()){
+        qDebug() << "Server is already running";
+        return false;
+    }
+
+    if (!m_server->setSocketDescriptor(listenerDescriptor)){
+        QString error = m_server->errorString();
+        qDebug() << "Failed to adopt listening socket:" << error;
+        emit errorOccured(error);
+        return false;
+    }
+
+    onListening(QString("%1:%2 (inherited)").arg(m_server->serverAddress().toString()).arg(m_server->serverPort()));
+    return true;
+}
+
+void ApiServer::onListening(const QString& description){
+    m_stats.startTime = QDateTime::currentDateTime();
+    m_baselineResidentBytes = residentMemoryBytes();
+    qDebug() << "Server started on" << description
+             << "accepting up to" << m_maxConnections << "connections";
+    emit serverStarted(m_server->serverPort());
+}
+
 void ApiServer::stopServer(){
-    if (!m_server->isListening()){
+    if (!m_server->isListening() && m_clientCount == 0 && m_pendingRemovals.isEmpty()){
         return;
     }
 
+    flushRegistryChanges();
+
     QMutexLocker locker(&m_mutex);
-    for (auto it = m_clients.begin(); it != m_clients.end(); it++){
-        it.key()->disconnectFromHost();
-        delete it.value();
+    for (ClientHandler* handler: std::as_const(m_clientSlots)){
+        if (handler){
+            handler->disconnect(this);
+            delete handler;
+        }
+    }
+    m_clientSlots.clear();
+    m_freeClientSlots.clear();
+    m_clientCount = 0;
+    m_stats.activeConnections = 0;
+    m_scheduleSubscribers.clear();
+    for (QSet<ClientHandler*>& slot: m_idleWheel){
+        slot.clear();
     }
-    m_clients.clear();
 
-    m_server->close();
+    if (m_server->isListening()){
+        m_server->close();
+    }
     qDebug() << "Server stopped";
     emit serverStopped();
 }
@@ -86,11 +189,47 @@ bool ApiServer::isRunning() const
     return m_server->isListening();
 }
 
+// The certificate and key are read once here; every accepted socket gets a
+// copy of the same QSslConfiguration, which is implicitly shared.
 bool ApiServer::enableSSL(const QString &certPath, const QString &keyPath){
+    if (!QSslSocket::supportsSsl()){
+        qDebug() << "TLS is not supported by this Qt build";
+        return false;
+    }
+
+    QList<QSslCertificate> chain = QSslCertificate::fromPath(certPath, QSsl::Pem);
+    if (chain.isEmpty()){
+        qDebug() << "Failed to load TLS certificate from" << certPath;
+        return false;
+    }
+
+    QFile keyFile(keyPath);
+    if (!keyFile.open(QIODevice::ReadOnly)){
+        qDebug() << "Failed to open TLS key" << keyPath << ":" << keyFile.errorString();
+        return false;
+    }
+    QByteArray keyData = keyFile.readAll();
+
+    QSslKey key(keyData, QSsl::Rsa, QSsl::Pem);
+    if (key.isNull()){
+        key = QSslKey(keyData, QSsl::Ec, QSsl::Pem);
+    }
+    if (key.isNull()){
+        qDebug() << "Failed to parse TLS key" << keyPath;
+        return false;
+    }
+
+    QSslConfiguration configuration = QSslConfiguration::defaultConfiguration();
+    configuration.setLocalCertificateChain(chain);
+    configuration.setPrivateKey(key);
+    configuration.setPeerVerifyMode(QSslSocket::VerifyNone);
+    configuration.setProtocol(QSsl::TlsV1_2OrLater);
+    m_server->setSslConfiguration(configuration);
+
     m_certPath = certPath;
     m_keyPath = keyPath;
     m_sslEnabled = true;
-    qDebug() << "SSL enabled with cert:" << certPath;
+    qDebug() << "TLS enabled with cert:" << chain.first().subjectDisplayName();
     return true;
 }
 
@@ -105,44 +244,315 @@ void ApiServer::setMaxConnections(int max){
 
 void ApiServer::setConnectionTimeout(int seconds){
     m_connectionTimeout = seconds;
+
+    if (seconds <= 0){
+        m_idleTimer->stop();
+        return;
+    }
+
+    m_idleTickMs = qMax(250, seconds * 1000 / IDLE_WHEEL_SLOTS);
+    m_idleTimer->start(m_idleTickMs);
 }
 
 void ApiServer::setBookingTimeout(int minutes){
     m_bookingTimeout = minutes;
 }
 
+void ApiServer::setDrainTimeout(int seconds){
+    m_drainTimeout = seconds;
+}
+
+// A replacement process started with the same path connects here and is
+// sent the listening socket; this process then drains and exits.
+bool ApiServer::enableHandoff(const QString& path){
+    if (!m_handoffServer){
+        m_handoffServer = new QLocalServer(this);
+        m_handoffServer->setSocketOptions(QLocalServer::UserAccessOption);
+        connect(m_handoffServer, &QLocalServer::newConnection, this, &ApiServer::onHandoffRequested);
+    }
+
+    QLocalServer::removeServer(path);
+    if (!m_handoffServer->listen(path)){
+        qDebug() << "Failed to listen for hand-off on" << path << ":" << m_handoffServer->errorString();
+        return false;
+    }
+
+    qDebug() << "Accepting listener hand-off on" << path;
+    return true;
+}
+
+void ApiServer::onHandoffRequested(){
+    QLocalSocket* peer = m_handoffServer->nextPendingConnection();
+    if (!peer) return;
+
+    if (m_draining || !m_server->isListening()){
+        peer->abort();
+        peer->deleteLater();
+        return;
+    }
+
+    QString error;
+    if (!SocketHandoff::sendDescriptor(peer->socketDescriptor(), m_server->socketDescriptor(), &error)){
+        qWarning() << "Listener hand-off failed:" << error;
+        peer->abort();
+        peer->deleteLater();
+        return;
+    }
+
+    qDebug() << "Listening socket handed to the new server process";
+    peer->disconnectFromServer();
+    peer->deleteLater();
+    m_handoffServer->close();
+    drain();
+}
+
+// Stops accepting, lets every client finish the commands it has already sent
+// and tells it when to come back. Sessions stay valid so clients resume with
+// RESUME_SESSION instead of logging in again; the reconnect delays are spread
+// out so the next process does not see all of them at once.
+void ApiServer::drain(){
+    if (m_draining){
+        return;
+    }
+    m_draining = true;
+
+    if (m_server->isListening()){
+        m_server->close();
+    }
+    m_idleTimer->stop();
+
+    QList<ClientHandler*> handlers;
+    {
+        QMutexLocker locker(&m_mutex);
+        handlers.reserve(m_clientCount);
+        for (ClientHandler* handler: std::as_const(m_clientSlots)){
+            if (handler){
+                handlers.append(handler);
+            }
+        }
+    }
+
+    qDebug() << "Draining" << handlers.size() << "connections, timeout" << m_drainTimeout << "s";
+
+    // Handlers may disconnect synchronously here; the mutex is not held.
+    for (ClientHandler* handler: std::as_const(handlers)){
+        handler->beginDrain(QRandomGenerator::global()->bounded(DRAIN_RECONNECT_SPREAD_MS));
+    }
+
+    if (m_clientCount == 0){
+        QMetaObject::invokeMethod(this, &ApiServer::finishDrain, Qt::QueuedConnection);
+        return;
+    }
+    m_drainTimer->start(m_drainTimeout * 1000);
+}
+
+bool ApiServer::isDraining() const{
+    return m_draining;
+}
+
+void ApiServer::finishDrain(){
+    if (!m_draining || m_drainFinished){
+        return;
+    }
+    m_drainFinished = true;
+    m_drainTimer->stop();
+
+    QList<ClientHandler*> remaining;
+    {
+        QMutexLocker locker(&m_mutex);
+        for (ClientHandler* handler: std::as_const(m_clientSlots)){
+            if (handler){
+                remaining.append(handler);
+            }
+        }
+    }
+
+    if (!remaining.isEmpty()){
+        qDebug() << "Drain timeout, aborting" << remaining.size() << "connections";
+        for (ClientHandler* handler: std::as_const(remaining)){
+            handler->socket()->abort();
+        }
+    }
+
+    flushRegistryChanges();
+    qDebug() << "Drain complete";
+    emit drained();
+}
+
 ApiServer::ServerStats ApiServer::getStatistics() const{
-    return m_stats;
+    ServerStats stats = m_stats;
+
+    SearchCache::Stats cacheStats = Database::instance().searchCache().stats();
+    stats.searchCacheHits = cacheStats.hits;
+    stats.searchCacheMisses = cacheStats.misses;
+    stats.searchCacheHitRatio = cacheStats.hitRatio();
+    stats.searchCacheBytes = cacheStats.usedBytes;
+    stats.maxConnections = m_maxConnections;
+
+    stats.residentBytes = residentMemoryBytes();
+    stats.bytesPerConnection = 0;
+    if (stats.activeConnections > 0 && m_baselineResidentBytes > 0){
+        stats.bytesPerConnection = qMax<qint64>(0, stats.residentBytes - m_baselineResidentBytes) / stats.activeConnections;
+    }
+
+    stats.tlsEnabled = m_sslEnabled;
+    stats.tlsHandshakes = m_server->handshakesCompleted();
+    stats.tlsHandshakeFailures = m_server->handshakesFailed();
+
+    RateLimiter::Stats limiterStats = m_rateLimiter.stats();
+    stats.rateLimitAllowed = limiterStats.allowed;
+    stats.rateLimitRejected = limiterStats.rejectedByAddress + limiterStats.rejectedByAccount;
+    stats.rateLimitTrackedKeys = limiterStats.trackedKeys;
+
+    // Lag is -1 while no replica has been measured yet.
+    const QList<AsyncDatabase::ReplicaStatus> replicas = AsyncDatabase::instance().replicaStatus();
+    stats.replicas = replicas.size();
+    for (const AsyncDatabase::ReplicaStatus& replica: replicas){
+        if (replica.usable){
+            stats.replicasUsable++;
+        }
+        stats.maxReplicaLagMs = qMax(stats.maxReplicaLagMs, replica.lagMs);
+        stats.replicaReads += replica.reads;
+    }
+    stats.primaryReads = AsyncDatabase::instance().primaryReads();
+    return stats;
+}
+
+// Resident set size of the whole process; the difference from the value
+// taken at startup, divided by the open connections, is the per-connection
+// cost reported in the statistics.
+qint64 ApiServer::residentMemoryBytes(){
+#ifdef Q_OS_LINUX
+    QFile statm("/proc/self/statm");
+    if (statm.open(QIODevice::ReadOnly)){
+        QList<QByteArray> fields = statm.readAll().split(' ');
+        if (fields.size() > 1){
+            return fields[1].toLongLong() * sysconf(_SC_PAGESIZE);
+        }
+    }
+#endif
+    return 0;
 }
 
 void ApiServer::onNewConnection(){
     while (m_server->hasPendingConnections()){
         QTcpSocket* socket = m_server->nextPendingConnection();
 
-        if (m_clients.size() >= m_maxConnections){
+        if (m_clientCount >= m_maxConnections){
             qDebug() << "Max connections reached, rejecting" << socket->peerAddress().toString();
             socket->disconnectFromHost();
             socket->deleteLater();
             continue;
         }
 
-        ClientHandler* handler = new ClientHandler(socket, this);
+        ClientHandler* handler = new ClientHandler(socket, &m_rateLimiter, this);
         connect(handler, &ClientHandler::disconnected, this, &ApiServer::onClientDisconnected);
         connect(handler, &ClientHandler::errorOccurred, this, &ApiServer::onClientError);
         connect(handler, &ClientHandler::authenticated, this, &ApiServer::authenticationSuccess);
+        connect(handler, &ClientHandler::scheduleSubscriptionChanged, this, &ApiServer::onScheduleSubscriptionChanged);
+        connect(handler, &ClientHandler::bytesTransferred, this, &ApiServer::onClientBytesTransferred);
+        connect(handler, &ClientHandler::readPaused, this, &ApiServer::onClientReadPaused);
 
         QMutexLocker locker(&m_mutex);
-        m_clients.insert(socket, handler);
-        m_stats.activeConnections = m_clients.size();
+        registerClient(handler);
         m_stats.totalConnections++;
 
+        configureKeepAlive(socket);
+        if (m_connectionTimeout > 0){
+            scheduleIdleCheck(handler, qint64(m_connectionTimeout) * 1000);
+        }
+
         QString addr = socket->peerAddress().toString();
         quint16 port = socket->peerPort();
 
         qDebug() << "Client connected:" << addr << ":" << port;
         emit clientConnected(addr, port);
 
-        Database::instance().logAction(-1, "client_connected", addr, QString("Port: %1").arg(port), true);
+        queueAuditLog(-1, "client_connected", addr, QString("Port: %1").arg(port));
+    }
+}
+
+// Handlers carry their own index into m_clientSlots, so registering and
+// unregistering never search; freed indices are reused before the vector grows.
+void ApiServer::registerClient(ClientHandler* handler){
+    int slot;
+    if (!m_freeClientSlots.isEmpty()){
+        slot = m_freeClientSlots.takeLast();
+        m_clientSlots[slot] = handler;
+    } else {
+        slot = m_clientSlots.size();
+        m_clientSlots.append(handler);
+    }
+
+    handler->setRegistrySlot(slot);
+    m_clientCount++;
+    m_stats.activeConnections = m_clientCount;
+}
+
+void ApiServer::unregisterClient(ClientHandler* handler){
+    int slot = handler->registrySlot();
+    if (slot < 0 || slot >= m_clientSlots.size() || m_clientSlots[slot] != handler){
+        return;
+    }
+
+    m_clientSlots[slot] = nullptr;
+    m_freeClientSlots.append(slot);
+    handler->setRegistrySlot(-1);
+    m_clientCount--;
+    m_stats.activeConnections = m_clientCount;
+}
+
+void ApiServer::queueAuditLog(int userId, const QString& action, const QString& address, const QString& details){
+    AuditLog entry;
+    entry.id = 0;
+    entry.userId = userId;
+    entry.action = action;
+    entry.ipAddress = address;
+    entry.details = details;
+    entry.success = true;
+    m_pendingAuditLogs.append(entry);
+    scheduleRegistryFlush();
+}
+
+void ApiServer::scheduleRegistryFlush(){
+    if (m_registryFlushScheduled){
+        return;
+    }
+    m_registryFlushScheduled = true;
+    QMetaObject::invokeMethod(this, &ApiServer::flushRegistryChanges, Qt::QueuedConnection);
+}
+
+// Everything that needs the database or may delete a handler is collected
+// here and done once per event loop pass, so a burst of disconnects costs a
+// couple of statements instead of two round trips per client.
+void ApiServer::flushRegistryChanges(){
+    m_registryFlushScheduled = false;
+
+    QStringList sessionTokens;
+    QList<ClientHandler*> removed;
+    QList<AuditLog> auditLogs;
+    {
+        QMutexLocker locker(&m_mutex);
+        removed.swap(m_pendingRemovals);
+        auditLogs.swap(m_pendingAuditLogs);
+    }
+
+    for (ClientHandler* handler: std::as_const(removed)){
+        if (handler->isAuthenticated()){
+            sessionTokens.append(handler->getSessionToken());
+        }
+        handler->deleteLater();
+    }
+
+    if (!sessionTokens.isEmpty()){
+        Database::instance().suspendSessions(sessionTokens);
+    }
+    if (!auditLogs.isEmpty()){
+        Database::instance().logActions(auditLogs);
+    }
+
+    if (removed.size() > 1){
+        qDebug() << "Removed" << removed.size() << "disconnected clients in one pass";
     }
 }
 
@@ -151,24 +561,32 @@ void ApiServer::onClientDisconnected(){
     if (!handler) return;
 
     QMutexLocker locker(&m_mutex);
-    for(auto it = m_clients.begin(); it != m_clients.end(); it++){
-        if (it.value() == handler){
-            QString addr = handler->getAddress();
+    if (handler->registrySlot() < 0){
+        return;
+    }
 
-            if (handler->isAuthenticated()){
-                Database::instance().invalidateSession(handler->getSessionToken());
-                m_stats.authenticatedUsers--;
-            }
+    QString addr = handler->getAddress();
 
-            qDebug() <<"Client disconnected:" << addr;
-            emit clientDisconnected(addr);
+    if (handler->isAuthenticated()){
+        m_stats.authenticatedUsers--;
+    }
 
-            Database::instance().logAction(handler->getUserId(), "client_disconnected", addr, "", true);
-            m_clients.erase(it);
-            m_stats.activeConnections = m_clients.size();
-            handler->deleteLater();
-            break;
-        }
+    qDebug() <<"Client disconnected:" << addr;
+    emit clientDisconnected(addr);
+
+    unregisterClient(handler);
+    unscheduleIdleCheck(handler);
+
+    const QList<int> schedules = handler->subscribedSchedules();
+    for (int scheduleId: schedules){
+        updateSubscriber(handler, scheduleId, false);
+    }
+
+    m_pendingRemovals.append(handler);
+    queueAuditLog(handler->getUserId(), "client_disconnected", addr, "");
+
+    if (m_draining && m_clientCount == 0){
+        QMetaObject::invokeMethod(this, &ApiServer::finishDrain, Qt::QueuedConnection);
     }
 }
 
@@ -181,45 +599,270 @@ void ApiServer::onClientError(QAbstractSocket::SocketError error){
     emit errorOccured(errorStr);
 }
 
+void ApiServer::onPartitionTimer(){
+    Database::instance().maintainTicketPartitions();
+}
+
 void ApiServer::onCleanupTimer(){
     Database::instance().cleanupExpiredSessions();
     Database::instance().cleanupExpiredBookings();
     Database::instance().cleanupExpiredVerificationCodes();
+    Database::instance().refreshReferenceDataVersion();
+
+    SearchCache::Stats cacheStats = Database::instance().searchCache().stats();
+    if (cacheStats.hits + cacheStats.misses > 0){
+        qDebug() << "Search cache:" << cacheStats.entries << "entries,"
+                 << cacheStats.usedBytes << "/" << cacheStats.budgetBytes << "bytes,"
+                 << "hit ratio" << QString::number(cacheStats.hitRatio() * 100.0, 'f', 1) + "%";
+    }
+
+    m_rateLimiter.prune();
+    RateLimiter::Stats limiterStats = m_rateLimiter.stats();
+    if (limiterStats.rejectedByAddress + limiterStats.rejectedByAccount > 0){
+        qDebug() << "Rate limiter:" << limiterStats.rejectedByAddress << "rejected by address,"
+                 << limiterStats.rejectedByAccount << "by account," << limiterStats.trackedKeys << "buckets";
+    }
+
+    QStringList shardLoad;
+    for (const InventoryShards::ShardStats& shard: InventoryShards::instance().stats()){
+        shardLoad << QString("%1/%2").arg(shard.queued).arg(shard.processed);
+    }
+    if (!shardLoad.isEmpty()){
+        qDebug() << "Inventory shards (queued/processed):" << shardLoad.join(' ');
+    }
+
+    for (const AsyncDatabase::ReplicaStatus& replica: AsyncDatabase::instance().replicaStatus()){
+        qDebug() << "Replica" << replica.name << (replica.usable ? "in use," : "not in use,")
+                 << "lag" << replica.lagMs << "ms," << replica.reads << "reads";
+    }
+
+    if (m_clientCount > 0 || m_stats.idleConnectionsReaped > 0){
+        ServerStats stats = getStatistics();
+        qDebug() << "Connections:" << m_clientCount << "/" << m_maxConnections
+                 << "slots used, idle reaped:" << m_stats.idleConnectionsReaped
+                 << ", ~" << stats.bytesPerConnection << "bytes per connection";
+    }
 }
 
-void ApiServer::broadcastMessage(const QJsonObject &message, QTcpSocket *exclude){
-    QMutexLocker locker(&m_mutex);
-    for (auto it = m_clients.begin(); it != m_clients.end(); it++){
-        if (it.key() != exclude && it.value()->isAuthenticated()){
-            it.value()->sendResponse(message);
+void ApiServer::onClientBytesTransferred(qint64 received, qint64 sent){
+    m_stats.bytesRecieved += received;
+    m_stats.bytesSent += sent;
+}
+
+void ApiServer::onClientReadPaused(){
+    m_stats.readPauses++;
+}
+
+// Idle connections are tracked on a hashed timing wheel: each handler sits in
+// one slot and is only looked at when the wheel reaches it, so activity costs
+// a timestamp update and a tick touches just the connections that are due.
+void ApiServer::onIdleWheelTick(){
+    m_idleWheelPosition = (m_idleWheelPosition + 1) % IDLE_WHEEL_SLOTS;
+
+    QSet<ClientHandler*> due;
+    due.swap(m_idleWheel[m_idleWheelPosition]);
+
+    qint64 timeoutMs = qint64(m_connectionTimeout) * 1000;
+    for (ClientHandler* handler: due){
+        handler->setIdleWheelSlot(-1);
+
+        qint64 idle = handler->idleMs();
+        if (idle < timeoutMs){
+            scheduleIdleCheck(handler, timeoutMs - idle);
+            continue;
+        }
+
+        // Rescheduled first: closing may delete the handler from under us.
+        scheduleIdleCheck(handler, IDLE_CLOSE_GRACE_MS);
+        qDebug() << "Closing idle connection" << handler->getAddress() << "after" << idle / 1000 << "s";
+        if (handler->closeIdle()){
+            m_stats.idleConnectionsReaped++;
+        }
+    }
+}
+
+void ApiServer::scheduleIdleCheck(ClientHandler* handler, qint64 delayMs){
+    unscheduleIdleCheck(handler);
+
+    qint64 ticks = (delayMs + m_idleTickMs - 1) / m_idleTickMs;
+    ticks = qBound<qint64>(1, ticks, IDLE_WHEEL_SLOTS - 1);
+
+    int slot = int((m_idleWheelPosition + ticks) % IDLE_WHEEL_SLOTS);
+    m_idleWheel[slot].insert(handler);
+    handler->setIdleWheelSlot(slot);
+}
+
+void ApiServer::unscheduleIdleCheck(ClientHandler* handler){
+    int slot = handler->idleWheelSlot();
+    if (slot < 0){
+        return;
+    }
+    m_idleWheel[slot].remove(handler);
+    handler->setIdleWheelSlot(-1);
+}
+
+void ApiServer::configureKeepAlive(QTcpSocket* socket){
+    socket->setSocketOption(QAbstractSocket::KeepAliveOption, 1);
+
+#ifdef Q_OS_LINUX
+    int fd = int(socket->socketDescriptor());
+    int idle = KEEPALIVE_IDLE_SECONDS;
+    int interval = KEEPALIVE_INTERVAL_SECONDS;
+    int probes = KEEPALIVE_PROBES;
+    unsigned int userTimeout = (idle + interval * probes) * 1000;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+    setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &userTimeout, sizeof(userTimeout));
+#endif
+}
+
+// A released segment does not free the seat for a subscriber whose own
+// segment another ticket on that seat still overlaps, so releases are
+// checked against what is still occupied before they go out. Changes
+// emitted in one pass of the event loop, such as a mass expiry, share one
+// check; those that arrive while it runs wait for the next, so subscribers
+// see them in the order they happened.
+void ApiServer::onSeatSegmentChanged(int scheduleId, int seatId, int departureStationId, int arrivalStationId, bool taken){
+    if (!m_scheduleSubscribers.contains(scheduleId)){
+        return;
+    }
+
+    m_seatChanges.append(SeatChange{scheduleId, seatId, departureStationId, arrivalStationId, taken});
+    if (!m_seatCheckQueued && !m_seatCheckRunning){
+        m_seatCheckQueued = true;
+        QMetaObject::invokeMethod(this, &ApiServer::checkSeatChanges, Qt::QueuedConnection);
+    }
+}
+
+void ApiServer::checkSeatChanges(){
+    m_seatCheckQueued = false;
+    QList<SeatChange> changes;
+    changes.swap(m_seatChanges);
+
+    QList<QPair<int, int>> released;
+    for (const SeatChange& change: std::as_const(changes)){
+        QPair<int, int> seat(change.scheduleId, change.seatId);
+        if (!change.taken && !released.contains(seat)){
+            released.append(seat);
         }
     }
+    if (released.isEmpty()){
+        deliverSeatChanges(changes, true, {});
+        return;
+    }
+
+    m_seatCheckRunning = true;
+    AsyncDatabase::instance().getOccupiedSegments(released, this
+                                                  , [this, changes](bool ok, const QHash<QPair<int, int>, QList<QPair<int, int>>>& segments){
+        m_seatCheckRunning = false;
+        deliverSeatChanges(changes, ok, segments);
+        if (!m_seatChanges.isEmpty()){
+            m_seatCheckQueued = true;
+            QMetaObject::invokeMethod(this, &ApiServer::checkSeatChanges, Qt::QueuedConnection);
+        }
+    });
 }
 
+// A release whose check failed costs its subscribers a resync.
+void ApiServer::deliverSeatChanges(const QList<SeatChange>& changes, bool checked
+                                   , const QHash<QPair<int, int>, QList<QPair<int, int>>>& stillOccupied){
+    for (const SeatChange& change: changes){
+        auto it = m_scheduleSubscribers.constFind(change.scheduleId);
+        if (it == m_scheduleSubscribers.constEnd()){
+            continue;
+        }
 
+        for (ClientHandler* handler: it.value()){
+            if (!change.taken && !checked){
+                handler->queueSeatResync(change.scheduleId);
+            } else {
+                handler->queueSeatChange(change.scheduleId, change.seatId, change.departureStationId, change.arrivalStationId
+                                         , change.taken, stillOccupied.value(qMakePair(change.scheduleId, change.seatId)));
+            }
+        }
+    }
+}
 
+void ApiServer::onScheduleSubscriptionChanged(int scheduleId, bool subscribed){
+    ClientHandler* handler = qobject_cast<ClientHandler*>(sender());
+    if (!handler) return;
 
-ClientHandler::ClientHandler(QTcpSocket *socket, QObject *parent)
+    updateSubscriber(handler, scheduleId, subscribed);
+}
+
+void ApiServer::updateSubscriber(ClientHandler* handler, int scheduleId, bool subscribed){
+    if (subscribed){
+        m_scheduleSubscribers[scheduleId].insert(handler);
+        return;
+    }
+
+    auto it = m_scheduleSubscribers.find(scheduleId);
+    if (it == m_scheduleSubscribers.end()){
+        return;
+    }
+    it.value().remove(handler);
+    if (it.value().isEmpty()){
+        m_scheduleSubscribers.erase(it);
+    }
+}
+
+    }
+}
+
+
+
+
+ClientHandler::ClientHandler(QTcpSocket *socket, RateLimiter *rateLimiter, QObject *parent)
     : QObject(parent)
     , m_socket(socket)
+    , m_address(socket->peerAddress().toString())
+    , m_rateLimiter(rateLimiter)
+    , m_registrySlot(-1)
+    , m_idleWheelSlot(-1)
+    , m_encoding(WireProtocol::Encoding::Json)
+    , m_capturedResponses(nullptr)
+    , m_seatFlushScheduled(false)
+    , m_idleClosing(false)
+    , m_draining(false)
+    , m_drainNoticeSent(false)
+    , m_reconnectAfterMs(0)
+    , m_inFlight(0)
+    , m_batch(nullptr)
+    , m_resumeQueued(false)
+    , m_loginPending(false)
+    , m_flushScheduled(false)
+    , m_readPaused(false)
     , m_authenticated(false)
     , m_userId(-1)
+    , m_lastWriteAt(0)
     {
     m_socket->setParent(this);
+    m_socket->setReadBufferSize(SOCKET_READ_BUFFER_SIZE);
+    m_lastActivity.start();
 
     connect(m_socket, &QTcpSocket::readyRead, this, &ClientHandler::onReadyRead);
+    connect(m_socket, &QTcpSocket::bytesWritten, this, &ClientHandler::onBytesWritten);
     connect(m_socket, &QTcpSocket::disconnected, this, &ClientHandler::onDisconnected);
     connect(m_socket, QOverload<QAbstractSocket::SocketError>::of(&QTcpSocket::errorOccurred), this, &ClientHandler::onSocketError);
 }
 
 ClientHandler::~ClientHandler(){
+    delete m_batch;
     if (m_socket->state() == QAbstractSocket::ConnectedState){
+        flushOutput();
+        m_socket->flush();
         m_socket->disconnectFromHost();
     }
 }
 
+QTcpSocket* ClientHandler::socket() const{
+    return m_socket;
+}
+
 QString ClientHandler::getAddress() const{
-    return m_socket->peerAddress().toString();
+    return m_address;
 }
 
 quint16 ClientHandler::getPort() const{
@@ -230,26 +873,285 @@ bool ClientHandler::isAuthenticated() const{
     return m_authenticated;
 }
 
-int ClientHandler::getUserId() const{
-    return m_userId;
+int ClientHandler::getUserId() const{
+    return m_userId;
+}
+
+QString ClientHandler::getSessionToken() const {
+    return m_sessionToken;
+}
+
+int ClientHandler::registrySlot() const{
+    return m_registrySlot;
+}
+
+void ClientHandler::setRegistrySlot(int slot){
+    m_registrySlot = slot;
+}
+
+int ClientHandler::idleWheelSlot() const{
+    return m_idleWheelSlot;
+}
+
+void ClientHandler::setIdleWheelSlot(int slot){
+    m_idleWheelSlot = slot;
+}
+
+qint64 ClientHandler::idleMs() const{
+    return m_lastActivity.elapsed();
+}
+
+bool ClientHandler::closeIdle(){
+    if (m_idleClosing || m_socket->state() != QAbstractSocket::ConnectedState){
+        m_socket->abort();
+        return false;
+    }
+
+    m_idleClosing = true;
+    sendError("Connection closed due to inactivity", "IDLE_TIMEOUT");
+    flushOutput();
+    m_socket->disconnectFromHost();
+    return true;
+}
+
+// Commands the client already sent are answered before the notice, even
+// while reads are paused for backpressure, and so are commands still waiting
+// on a query or a shard. The connection closes once the last has answered.
+void ClientHandler::beginDrain(int reconnectAfterMs){
+    if (m_draining){
+        return;
+    }
+
+    m_draining = true;
+    m_reconnectAfterMs = reconnectAfterMs;
+    readMessages(true);
+    finishDrainIfIdle();
+}
+
+void ClientHandler::finishDrainIfIdle(){
+    if (!m_draining || m_drainNoticeSent || m_inFlight > 0 || dispatchHeld()){
+        return;
+    }
+    m_drainNoticeSent = true;
+
+    QJsonObject data;
+    data["reconnectAfterMs"] = m_reconnectAfterMs;
+    data["resumable"] = m_authenticated;
+
+    sendResponse(createResponse("SERVER_DRAINING", true, "Server is restarting", data));
+    flushOutput();
+    m_socket->disconnectFromHost();
+}
+
+void ClientHandler::sendResponse(const QJsonObject &response){
+    QJsonObject framed = response;
+    if (!m_currentRequestId.isUndefined() && !framed.contains("requestId")){
+        framed["requestId"] = m_currentRequestId;
+    }
+
+    if (m_capturedResponses){
+        m_capturedResponses->append(framed);
+        return;
+    }
+
+    m_outputBuffer.append(WireProtocol::encode(framed, m_encoding));
+
+    if (!m_flushScheduled){
+        m_flushScheduled = true;
+        QMetaObject::invokeMethod(this, &ClientHandler::flushOutput, Qt::QueuedConnection);
+    }
+
+    if (!m_readPaused && pendingOutputBytes() > OUTPUT_HIGH_WATERMARK){
+        m_readPaused = true;
+        emit readPaused();
+        qDebug() << "Pausing reads from" << getAddress() << "with" << pendingOutputBytes() << "bytes queued";
+    }
+}
+
+// Responses produced while handling one readyRead are written with a single
+// call once control returns to the event loop; the socket then drains them
+// without a forced flush.
+void ClientHandler::flushOutput(){
+    m_flushScheduled = false;
+    if (m_outputBuffer.isEmpty()){
+        return;
+    }
+
+    QByteArray data;
+    data.swap(m_outputBuffer);
+
+    qint64 written = m_socket->write(data);
+    if (written == -1){
+        qDebug() << "Failed to send response to" << getAddress();
+        qDebug() << "Socket error:" << m_socket->errorString();
+        return;
+    }
+
+    emit bytesTransferred(0, written);
+}
+
+qint64 ClientHandler::pendingOutputBytes() const{
+    return m_outputBuffer.size() + m_socket->bytesToWrite();
+}
+
+void ClientHandler::onBytesWritten(qint64){
+    if (m_readPaused && pendingOutputBytes() <= OUTPUT_LOW_WATERMARK){
+        m_readPaused = false;
+        qDebug() << "Resuming reads from" << getAddress();
+        onReadyRead();
+    }
+}
+
+QList<int> ClientHandler::subscribedSchedules() const{
+    return m_subscriptions.keys();
+}
+
+// Changes are coalesced per seat segment and flushed at most every
+// SEAT_UPDATE_INTERVAL_MS. A subscriber that falls too far behind gets a
+// single SEAT_RESYNC for the schedule instead of an ever-growing delta.
+void ClientHandler::queueSeatChange(int scheduleId, int seatId, int departureStationId, int arrivalStationId, bool taken
+                                    , const QList<QPair<int, int>>& stillOccupied){
+    auto subscription = m_subscriptions.constFind(scheduleId);
+    if (subscription == m_subscriptions.constEnd()){
+        return;
+    }
+
+    bool wholeTrain = subscription->departureStationId <= 0 || subscription->arrivalStationId <= 0;
+    if (!wholeTrain
+        && !Database::segmentsOverlap(departureStationId, arrivalStationId,
+                                      subscription->departureStationId, subscription->arrivalStationId)){
+        return;
+    }
+
+    // A release only counts if nothing else still holds the seat over the
+    // subscribed segment.
+    if (!taken){
+        for (const QPair<int, int>& occupied: stillOccupied){
+            if (wholeTrain
+                || Database::segmentsOverlap(occupied.first, occupied.second,
+                                             subscription->departureStationId, subscription->arrivalStationId)){
+                return;
+            }
+        }
+    }
+
+    if (m_resyncSchedules.contains(scheduleId)){
+        return;
+    }
+
+    QHash<SeatSegment, bool>& pending = m_pendingSeatChanges[scheduleId];
+    pending.insert(SeatSegment{seatId, departureStationId, arrivalStationId}, taken);
+
+    if (pending.size() > MAX_PENDING_SEAT_CHANGES){
+        m_pendingSeatChanges.remove(scheduleId);
+        m_resyncSchedules.insert(scheduleId);
+    }
+
+    scheduleSeatFlush();
+}
+
+void ClientHandler::queueSeatResync(int scheduleId){
+    if (!m_subscriptions.contains(scheduleId)){
+        return;
+    }
+    m_pendingSeatChanges.remove(scheduleId);
+    m_resyncSchedules.insert(scheduleId);
+    scheduleSeatFlush();
+}
+
+// A one-shot timer is armed only while changes are pending, so idle
+// connections do not each carry a QTimer.
+void ClientHandler::scheduleSeatFlush(){
+    if (m_seatFlushScheduled){
+        return;
+    }
+    m_seatFlushScheduled = true;
+    QTimer::singleShot(SEAT_UPDATE_INTERVAL_MS, this, &ClientHandler::flushSeatChanges);
+}
+
+void ClientHandler::flushSeatChanges(){
+    m_seatFlushScheduled = false;
+    if (m_socket->state() != QAbstractSocket::ConnectedState){
+        return;
+    }
+
+    if (pendingOutputBytes() > SEAT_UPDATE_BACKLOG_BYTES){
+        scheduleSeatFlush();
+        return;
+    }
+
+    for (int scheduleId: qAsConst(m_resyncSchedules)){
+        QJsonObject data;
+        data["scheduleId"] = scheduleId;
+        sendResponse(createResponse("SEAT_RESYNC", true, "", data));
+    }
+    m_resyncSchedules.clear();
+
+    for (auto it = m_pendingSeatChanges.cbegin(); it != m_pendingSeatChanges.cend(); it++){
+        QJsonArray taken;
+        QJsonArray released;
+        for (auto change = it.value().cbegin(); change != it.value().cend(); change++){
+            QJsonArray& target = change.value() ? taken : released;
+            target.append(change.key().seatId);
+            target.append(change.key().departureStationId);
+            target.append(change.key().arrivalStationId);
+        }
+
+        QJsonObject data;
+        data["scheduleId"] = it.key();
+        data["taken"] = taken;
+        data["released"] = released;
+        sendResponse(createResponse("SEAT_UPDATE", true, "", data));
+    }
+    m_pendingSeatChanges.clear();
+}
+
+ClientHandler::PendingRequest ClientHandler::currentRequest() const{
+    return PendingRequest{m_currentRequestId, m_capturedResponses, false};
 }
 
-QString ClientHandler::getSessionToken() const {
-    return m_sessionToken;
+// For a command answered from a callback; it counts as in flight until
+// sendResponseFor delivers its answer.
+ClientHandler::PendingRequest ClientHandler::asyncRequest(){
+    m_inFlight++;
+    return PendingRequest{m_currentRequestId, m_capturedResponses, true};
 }
 
-void ClientHandler::sendResponse(const QJsonObject &response){
-    QJsonDocument doc(response);
-    QByteArray data = doc.toJson(QJsonDocument::Compact);
+void ClientHandler::sendResponseFor(const PendingRequest& request, const QJsonObject& response){
+    QJsonValue requestId = m_currentRequestId;
+    QList<QJsonObject>* capturedResponses = m_capturedResponses;
+    m_currentRequestId = request.requestId;
+    m_capturedResponses = request.capturedResponses;
 
-    data.append("\n");
+    sendResponse(response);
 
-    qint64 written = m_socket->write(data);
-    m_socket->flush();
+    m_currentRequestId = requestId;
+    m_capturedResponses = capturedResponses;
 
-    if (written == -1){
-        qDebug() << "Failed to send response to" << getAddress();
-        qDebug() << "Socket error:" << m_socket->errorString();
+    if (request.async){
+        m_inFlight--;
+    }
+    if (m_batch && m_batch->awaiting && request.capturedResponses == &m_batch->captured){
+        runBatch();
+    }
+    finishDrainIfIdle();
+}
+
+// While a BATCH or a LOGIN is running, later commands stay unread so that
+// responses keep the order of the requests and commands after LOGIN run
+// authenticated. They are read again from the event loop, not from inside
+// the callback that ended the hold.
+bool ClientHandler::dispatchHeld() const{
+    return m_batch != nullptr || m_loginPending || m_resumeQueued;
+}
+
+void ClientHandler::resumeDispatch(){
+    m_resumeQueued = false;
+    if (m_draining){
+        readMessages(true);
+        finishDrainIfIdle();
+    } else {
+        onReadyRead();
     }
 }
 
@@ -260,20 +1162,45 @@ void ClientHandler::sendError(const QString &error, const QString &command){
 }
 
 void ClientHandler::onReadyRead(){
-    m_buffer.append(m_socket->readAll());
+    if (m_readPaused || m_draining){
+        return;
+    }
+    readMessages(false);
+}
 
-    int newlineIndex;
-    while ((newlineIndex = m_buffer.indexOf('\n')) != -1){
-        QByteArray message = m_buffer.left(newlineIndex);
-        m_buffer.remove(0, newlineIndex + 1);
+void ClientHandler::readMessages(bool ignoreBackpressure){
+    if (dispatchHeld()){
+        return;
+    }
+
+    QByteArray incoming = m_socket->readAll();
+    if (!incoming.isEmpty()){
+        m_lastActivity.restart();
+        emit bytesTransferred(incoming.size(), 0);
+        m_buffer.append(incoming);
+    }
 
+    QByteArray message;
+    WireProtocol::Encoding encoding;
+    WireProtocol::DecodeStatus status = WireProtocol::DecodeStatus::NeedMore;
+    while (!dispatchHeld() && (ignoreBackpressure || !m_readPaused)
+           && (status = WireProtocol::takeMessage(m_buffer, &message, &encoding)) == WireProtocol::DecodeStatus::Message){
         if (!message.isEmpty()){
-            processMessage(message);
+            processMessage(message, encoding);
         }
     }
 
-    if (m_buffer.size() > 1024 * 1024){
+    if (status == WireProtocol::DecodeStatus::Error){
+        qDebug() << "Oversized frame from" << getAddress();
+        m_buffer.clear();
+        flushOutput();
+        m_socket->disconnectFromHost();
+        return;
+    }
+
+    if (status == WireProtocol::DecodeStatus::NeedMore && m_buffer.size() > 1024 * 1024){
         qDebug() << "Buffer overflow from" << getAddress();
+        flushOutput();
         m_socket->disconnectFromHost();
     }
 }
@@ -286,25 +1213,27 @@ void ClientHandler::onSocketError(QAbstractSocket::SocketError error){
     emit errorOccurred(error);
 }
 
-void ClientHandler::processMessage(const QByteArray &data){
-    QJsonParseError parseError;
-    QJsonDocument doc = QJsonDocument::fromJson(data, &parseError);
-
-    if (parseError.error != QJsonParseError::NoError){
-        sendError("Invalid JSON: " + parseError.errorString());
+void ClientHandler::processMessage(const QByteArray &data, WireProtocol::Encoding encoding){
+    QJsonObject request;
+    QString parseError;
+    if (!WireProtocol::decode(data, encoding, &request, &parseError)){
+        sendError(parseError);
+        return;
     }
 
-    if (!doc.isObject()){
-        sendError("Request must be a JSON object");
+    m_currentRequestId = request.value("requestId");
+    if (!m_currentRequestId.isUndefined() && !m_currentRequestId.isDouble() && !m_currentRequestId.isString()){
+        m_currentRequestId = QJsonValue(QJsonValue::Undefined);
+        sendError("'requestId' must be a number or a string");
         return;
     }
 
-    QJsonObject request = doc.object();
     if (!request.contains("command")){
         sendError("Missing 'command' field");
-        return;
+    } else {
+        handleCommand(request);
     }
-    handleCommand(request);
+    m_currentRequestId = QJsonValue(QJsonValue::Undefined);
 }
 
 bool ClientHandler::requireAuth(const QString &command){
@@ -321,12 +1250,26 @@ void ClientHandler::handleCommand(const QJsonObject &request){
 
     qDebug() << "Command from" << getAddress() << ":" << command;
 
-    if (command == "REGISTER"){
+    if (!m_capturedResponses && !checkRateLimit(command, data)){
+        emit commandExecuted(command, false);
+        return;
+    }
+
+    if (command == "PING"){
+        handlePing();
+    }
+    else if (command == "HELLO"){
+        handleHello(data);
+    }
+    else if (command == "REGISTER"){
         handleRegister(data);
     }
     else if (command == "LOGIN"){
         handleLogin(data);
     }
+    else if (command == "RESUME_SESSION"){
+        handleResumeSession(data);
+    }
     else if (command == "GET_STATIONS"){
         if (requireAuth(command)) handleGetStations(data);
     }
@@ -349,7 +1292,7 @@ void ClientHandler::handleCommand(const QJsonObject &request){
         if (requireAuth(command)) handleCancelTicket(data);
     }
     else if (command == "GET_MY_TICKETS"){
-        if (requireAuth(command)) handleGetMyTickets();
+        if (requireAuth(command)) handleGetMyTickets(data);
     }
     else if (command == "GET_TICKET_DETAILS"){
         if (requireAuth(command)) handleGetTicketDetails(data);
@@ -366,6 +1309,15 @@ void ClientHandler::handleCommand(const QJsonObject &request){
     else if (command == "RESEND_VERIFICATION"){
         handleResendVerification(data);
     }
+    else if (command == "BATCH"){
+        if (requireAuth(command)) handleBatch(data);
+    }
+    else if (command == "SUBSCRIBE_SCHEDULE"){
+        if (requireAuth(command)) handleSubscribeSchedule(data);
+    }
+    else if (command == "UNSUBSCRIBE_SCHEDULE"){
+        if (requireAuth(command)) handleUnsubscribeSchedule(data);
+    }
     else {
         sendError("Unknown command: " + command, command);
     }
@@ -373,6 +1325,38 @@ void ClientHandler::handleCommand(const QJsonObject &request){
     emit commandExecuted(command, true);
 }
 
+// Runs before any database work. Items inside a BATCH are not charged
+// separately: the batch is charged for all of them up front.
+bool ClientHandler::checkRateLimit(const QString& command, const QJsonObject& data){
+    double cost = RateLimiter::cost(RateLimiter::costClass(command));
+    if (command == "BATCH"){
+        cost = 0.0;
+        const QJsonArray items = data["items"].toArray();
+        for (const QJsonValue& item: items){
+            cost += RateLimiter::cost(RateLimiter::costClass(item.toObject()["command"].toString()));
+        }
+    }
+
+    QString account;
+    if (m_authenticated){
+        account = QString("user:%1").arg(m_userId);
+    } else if (data.contains("email")){
+        account = "email:" + data["email"].toString().trimmed().toLower();
+    }
+
+    qint64 retryAfterMs = 0;
+    if (m_rateLimiter->acquire(getAddress(), account, cost, &retryAfterMs)){
+        return true;
+    }
+
+    QJsonObject responseData;
+    responseData["retryAfterMs"] = retryAfterMs;
+    sendResponse(createResponse(command, false,
+                                QString("Too many requests, retry in %1 s").arg((retryAfterMs + 999) / 1000),
+                                responseData));
+    return false;
+}
+
 QJsonObject ClientHandler::createResponse(const QString& command, bool success, const QString& message, const QJsonObject& data){
     QJsonObject response;
     response["command"] = command;
@@ -460,6 +1444,105 @@ QJsonObject ClientHandler::searchResultToJson(const Database::SearchResult& resu
     return obj;
 }
 
+// Seats arrive ordered by carriage and seat number, so each carriage is sent
+// once: ids and seat numbers as [start, length] runs of consecutive values,
+// seat types as [index into seatTypes, length] runs, and availability as a
+// bitmap with bit i (LSB first) set when the i-th seat of the carriage is free.
+QJsonObject ClientHandler::seatMapToJson(const QList<Seat>& seats)
+{
+    QJsonArray carriages;
+    QJsonArray seatTypes;
+    QHash<QString, int> seatTypeIndex;
+
+    auto appendRun = [](QJsonArray& runs, int value, bool consecutive){
+        int count = runs.size();
+        if (count >= 2){
+            int start = runs[count - 2].toInt();
+            int length = runs[count - 1].toInt();
+            int expected = consecutive ? start + length : start;
+            if (value == expected){
+                runs[count - 1] = length + 1;
+                return;
+            }
+        }
+        runs.append(value);
+        runs.append(1);
+    };
+
+    int i = 0;
+    while (i < seats.size()){
+        const Seat& first = seats[i];
+
+        QJsonArray seatIds;
+        QJsonArray seatNumbers;
+        QJsonArray typeRuns;
+        QByteArray available;
+
+        int seatIndex = 0;
+        for (; i < seats.size() && seats[i].carriageId == first.carriageId; i++, seatIndex++){
+            const Seat& seat = seats[i];
+
+            if (!seatTypeIndex.contains(seat.seatType)){
+                seatTypeIndex.insert(seat.seatType, seatTypes.size());
+                seatTypes.append(seat.seatType);
+            }
+
+            appendRun(seatIds, seat.id, true);
+            appendRun(seatNumbers, seat.seatNumber, true);
+            appendRun(typeRuns, seatTypeIndex.value(seat.seatType), false);
+
+            if (seatIndex % 8 == 0){
+                available.append('\0');
+            }
+            if (seat.isAvailable){
+                available[seatIndex / 8] = char(available[seatIndex / 8] | (1 << (seatIndex % 8)));
+            }
+        }
+
+        QJsonObject carriage;
+        carriage["id"] = first.carriageId;
+        carriage["number"] = first.carriageNumber;
+        carriage["type"] = first.carriageType;
+        carriage["seatCount"] = seatIndex;
+        carriage["seatIds"] = seatIds;
+        carriage["seatNumbers"] = seatNumbers;
+        carriage["seatTypes"] = typeRuns;
+        carriage["available"] = QString::fromLatin1(available.toBase64());
+        carriages.append(carriage);
+    }
+
+    QJsonObject seatMap;
+    seatMap["seatTypes"] = seatTypes;
+    seatMap["carriages"] = carriages;
+    return seatMap;
+}
+
+void ClientHandler::handlePing(){
+    sendResponse(createResponse("PING", true, "pong"));
+}
+
+void ClientHandler::handleHello(const QJsonObject& data){
+    QJsonArray offered = data["encodings"].toArray();
+
+    WireProtocol::Encoding selected = WireProtocol::Encoding::Json;
+    for (const QJsonValue& value: offered){
+        WireProtocol::Encoding encoding;
+        if (WireProtocol::encodingFromName(value.toString(), &encoding)){
+            selected = encoding;
+            break;
+        }
+    }
+
+    QJsonObject responseData;
+    responseData["encoding"] = WireProtocol::encodingName(selected);
+    responseData["encodings"] = QJsonArray::fromStringList(WireProtocol::supportedEncodings());
+
+    sendResponse(createResponse("HELLO", true, "", responseData));
+
+    m_encoding = selected;
+    qDebug() << "Client" << getAddress() << "negotiated encoding" << WireProtocol::encodingName(selected);
+}
+
 void ClientHandler::handleRegister(const QJsonObject &data){
     QString name = data["name"].toString();
     QString surname = data["surname"].toString();
@@ -504,48 +1587,76 @@ void ClientHandler::handleLogin(const QJsonObject &data){
         return;
     }
 
-    bool found;
-    User user = Database::instance().getUserByEmail(email, &found);
+    PendingRequest request = asyncRequest();
+    m_loginPending = true;
+    AsyncDatabase::instance().login(email, password, getAddress(), this
+                                    , [this, request, email](bool ok, const User& user, const QString& sessionToken, const QString& error){
+        m_loginPending = false;
+        m_resumeQueued = true;
+        QMetaObject::invokeMethod(this, &ClientHandler::resumeDispatch, Qt::QueuedConnection);
 
-    if (!found){
-        sendError("Invalid email or password", "LOGIN");
+        if (!ok){
+            sendResponseFor(request, createResponse("LOGIN", false, error));
+            return;
+        }
+
+        m_sessionToken = sessionToken;
+        m_authenticated = true;
+        m_userId = user.id;
+        m_userEmail = email;
+
+        QJsonObject responseData;
+        responseData["sessionToken"] = m_sessionToken;
+        responseData["user"] = userToJson(user);
+
+        sendResponseFor(request, createResponse("LOGIN", true, "Login successful", responseData));
+
+        qDebug() << "User logged in:" << email;
+        emit authenticated(user.id, email);
+    });
+}
+
+// Re-attaches a reconnecting client to the session it got from LOGIN. Only the
+// token lookup is needed, so a restart does not cost a password hash per user.
+void ClientHandler::handleResumeSession(const QJsonObject& data){
+    QString sessionToken = data["sessionToken"].toString();
+
+    if (sessionToken.isEmpty()){
+        sendError("Session token is required", "RESUME_SESSION");
         return;
     }
 
-    if (!user.isVerified){
-        sendError("Please verify your email first", "LOGIN");
+    if (m_authenticated){
+        sendError("Already authenticated", "RESUME_SESSION");
         return;
     }
 
-    QString errorMsg;
-    bool success = Database::instance().checkPassword(email, password, &errorMsg);
-
-    if (!success){
-        sendError(errorMsg, "LOGIN");
-        Database::instance().logAction(-1, "login_failed", getAddress(), email, false);
+    int userId = -1;
+    if (!Database::instance().resumeSession(sessionToken, &userId)){
+        sendError("Session expired, please log in again", "RESUME_SESSION");
         return;
     }
 
-    m_sessionToken = Database::instance().createSession(user.id, getAddress(), "ApiClient");
-
-    if (m_sessionToken.isEmpty()){
-        sendError("Failed to create session", "LOGIN");
+    bool found;
+    User user = Database::instance().getUserById(userId, &found);
+    if (!found){
+        sendError("Session expired, please log in again", "RESUME_SESSION");
         return;
     }
 
-    Database::instance().updateLastLogin(email, getAddress());
     m_authenticated = true;
     m_userId = user.id;
-    m_userEmail = email;
+    m_userEmail = user.email;
+    m_sessionToken = sessionToken;
 
     QJsonObject responseData;
     responseData["sessionToken"] = m_sessionToken;
     responseData["user"] = userToJson(user);
 
-    sendResponse(createResponse("LOGIN", true, "Login successful", responseData));
+    sendResponse(createResponse("RESUME_SESSION", true, "Session resumed", responseData));
 
-    qDebug() << "User logged in:" << email;
-    emit authenticated(user.id, email);
+    qDebug() << "Session resumed:" << user.email;
+    emit authenticated(user.id, user.email);
 }
 
 void ClientHandler::handleLogout()
@@ -560,31 +1671,83 @@ void ClientHandler::handleLogout()
         m_userId = -1;
         m_userEmail.clear();
         m_sessionToken.clear();
+        clearSubscriptions();
 
         sendResponse(createResponse("LOGOUT", true, "Logout successful"));
     }
 }
 
-void ClientHandler::handleGetStations(const QJsonObject &data){
-    QString search = data["search"].toString();
+void ClientHandler::handleSubscribeSchedule(const QJsonObject& data){
+    int scheduleId = data["scheduleId"].toInt();
+    int departureStationId = data["departureStationId"].toInt();
+    int arrivalStationId = data["arrivalStationId"].toInt();
 
-    QList<Station> stations;
-    if (search.isEmpty()){
-        stations = Database::instance().getAllStations();
-    } else{
-        stations = Database::instance().searchStations(search);
+    if (scheduleId <= 0){
+        sendError("Invalid schedule ID", "SUBSCRIBE_SCHEDULE");
+        return;
+    }
+
+    if (!m_subscriptions.contains(scheduleId) && m_subscriptions.size() >= MAX_SUBSCRIPTIONS){
+        sendError(QString("Too many subscriptions (max %1)").arg(MAX_SUBSCRIPTIONS), "SUBSCRIBE_SCHEDULE");
+        return;
     }
 
-    QJsonArray stationsArray;
-    for (const Station& station: stations){
-        stationsArray.append(stationToJson(station));
+    bool isNew = !m_subscriptions.contains(scheduleId);
+    m_subscriptions.insert(scheduleId, ScheduleSubscription{departureStationId, arrivalStationId});
+    m_pendingSeatChanges.remove(scheduleId);
+    m_resyncSchedules.remove(scheduleId);
+
+    if (isNew){
+        emit scheduleSubscriptionChanged(scheduleId, true);
+    }
+
+    QJsonObject responseData;
+    responseData["scheduleId"] = scheduleId;
+    sendResponse(createResponse("SUBSCRIBE_SCHEDULE", true, "Subscribed", responseData));
+}
+
+void ClientHandler::handleUnsubscribeSchedule(const QJsonObject& data){
+    int scheduleId = data["scheduleId"].toInt();
+
+    if (!m_subscriptions.remove(scheduleId)){
+        sendError("Not subscribed to this schedule", "UNSUBSCRIBE_SCHEDULE");
+        return;
     }
 
+    m_pendingSeatChanges.remove(scheduleId);
+    m_resyncSchedules.remove(scheduleId);
+    emit scheduleSubscriptionChanged(scheduleId, false);
+
     QJsonObject responseData;
-    responseData["stations"] = stationsArray;
-    responseData["count"] = stations.size();
+    responseData["scheduleId"] = scheduleId;
+    sendResponse(createResponse("UNSUBSCRIBE_SCHEDULE", true, "Unsubscribed", responseData));
+}
+
+void ClientHandler::clearSubscriptions(){
+    const QList<int> schedules = m_subscriptions.keys();
+    m_subscriptions.clear();
+    m_pendingSeatChanges.clear();
+    m_resyncSchedules.clear();
+
+    for (int scheduleId: schedules){
+        emit scheduleSubscriptionChanged(scheduleId, false);
+    }
+}
+
+void ClientHandler::handleGetStations(const QJsonObject &data){
+    PendingRequest request = asyncRequest();
+    AsyncDatabase::instance().getStations(data["search"].toString(), this, [this, request](const QList<Station>& stations){
+        QJsonArray stationsArray;
+        for (const Station& station: stations){
+            stationsArray.append(stationToJson(station));
+        }
+
+        QJsonObject responseData;
+        responseData["stations"] = stationsArray;
+        responseData["count"] = stations.size();
 
-    sendResponse(createResponse("GET_STATIONS", true, "", responseData));
+        sendResponseFor(request, createResponse("GET_STATIONS", true, "", responseData));
+    });
 }
 
 void ClientHandler::handleSearchTrains(const QJsonObject &data){
@@ -603,21 +1766,39 @@ void ClientHandler::handleSearchTrains(const QJsonObject &data){
         return;
     }
 
-    QList<Database::SearchResult> results = Database::instance().searchTrains(departureStationId, arrivalStationId, date);
+    auto respond = [this, departureStationId, arrivalStationId, dateStr](const PendingRequest& request, const QList<Database::SearchResult>& results){
+        QJsonArray resultsArray;
+        for (const auto& result: results){
+            resultsArray.append(searchResultToJson(result));
+        }
 
-    QJsonArray resultsArray;
-    for (const auto& result: results){
-        resultsArray.append(searchResultToJson(result));
-    }
+        QJsonObject responseData;
+        responseData["trains"] = resultsArray;
+        responseData["count"] = results.size();
 
-    QJsonObject responseData;
-    responseData["trains"] = resultsArray;
-    responseData["count"] = results.size();
+        sendResponseFor(request, createResponse("SEARCH_TRAINS", true, "", responseData));
+
+        qDebug() << "Search:" << departureStationId << "->" << arrivalStationId
+                 << "on" << dateStr << "found" << results.size() << "trains";
+    };
 
-    sendResponse(createResponse("SEARCH_TRAINS", true, "", responseData));
+    SearchKey key{departureStationId, arrivalStationId, date};
+    QList<Database::SearchResult> cached;
+    if (Database::instance().searchCache().lookup(key, &cached)){
+        respond(currentRequest(), cached);
+        return;
+    }
 
-    qDebug() << "Search:" << departureStationId << "->" << arrivalStationId
-             << "on" << dateStr << "found" << results.size() << "trains";
+    PendingRequest request = asyncRequest();
+    AsyncDatabase::instance().searchTrains(departureStationId, arrivalStationId, date, m_lastWriteAt, this
+                                           , [this, request, key, respond](bool ok, const QList<Database::SearchResult>& results, qint64 freshAsOf){
+        if (!ok){
+            sendResponseFor(request, createResponse("SEARCH_TRAINS", false, "Failed to search trains"));
+            return;
+        }
+        Database::instance().searchCache().insertIfCurrent(key, results, freshAsOf);
+        respond(request, results);
+    });
 }
 
 void ClientHandler::handleGetAvailableSeats(const QJsonObject &data){
@@ -630,127 +1811,278 @@ void ClientHandler::handleGetAvailableSeats(const QJsonObject &data){
         return;
     }
 
-    QList<Seat> seats = Database::instance().getAvailableSeats(scheduleId, departureStationId, arrivalStationId);
-
-    QJsonArray seatsArray;
-    for (const Seat& seat: seats){
-        QJsonObject seatObj;
-        seatObj["id"] = seat.id;
-        seatObj["carriageId"] = seat.carriageId;
-        seatObj["carriageNumber"] = seat.carriageNumber;
-        seatObj["carriageType"] = seat.carriageType;
-        seatObj["seatNumber"] = seat.seatNumber;
-        seatObj["seatType"] = seat.seatType;
-        seatObj["isAvailable"] = seat.isAvailable;
-        seatsArray.append(seatObj);
-    }
+    PendingRequest request = asyncRequest();
+    bool compact = data["compact"].toBool();
+    AsyncDatabase::instance().getAvailableSeats(scheduleId, departureStationId, arrivalStationId, m_lastWriteAt, this
+                                                , [this, request, compact](bool ok, const QList<Seat>& seats){
+        if (!ok){
+            sendResponseFor(request, createResponse("GET_AVAILABLE_SEATS", false, "Failed to get available seats"));
+            return;
+        }
+        sendResponseFor(request, createResponse("GET_AVAILABLE_SEATS", true, "", seatsToJson(seats, compact)));
+    });
+}
 
+QJsonObject ClientHandler::seatsToJson(const QList<Seat>& seats, bool compact){
     QJsonObject responseData;
-    responseData["seats"] = seatsArray;
+    if (compact){
+        responseData = seatMapToJson(seats);
+    } else {
+        QJsonArray seatsArray;
+        for (const Seat& seat: seats){
+            QJsonObject seatObj;
+            seatObj["id"] = seat.id;
+            seatObj["carriageId"] = seat.carriageId;
+            seatObj["carriageNumber"] = seat.carriageNumber;
+            seatObj["carriageType"] = seat.carriageType;
+            seatObj["seatNumber"] = seat.seatNumber;
+            seatObj["seatType"] = seat.seatType;
+            seatObj["isAvailable"] = seat.isAvailable;
+            seatsArray.append(seatObj);
+        }
+        responseData["seats"] = seatsArray;
+    }
     responseData["count"] = seats.size();
+    return responseData;
+}
 
-    sendResponse(createResponse("GET_AVAILABLE_SEATS", true, "", responseData));
+bool ClientHandler::parseBookingRequest(const QJsonObject& data, Database::BookingRequest* request){
+    request->scheduleId = data["scheduleId"].toInt();
+    request->seatId = data["seatId"].toInt();
+    request->departureStationId = data["departureStationId"].toInt();
+    request->arrivalStationId = data["arrivalStationId"].toInt();
+    request->passengerName = data["passengerName"].toString();
+    request->passengerDocument = data["passengerDocument"].toString();
+    request->price = data["price"].toDouble();
+
+    return request->scheduleId > 0 && request->seatId > 0
+           && request->departureStationId > 0 && request->arrivalStationId > 0
+           && !request->passengerName.isEmpty() && !request->passengerDocument.isEmpty()
+           && request->price > 0;
 }
 
 void ClientHandler::handleBookTicket(const QJsonObject &data){
-    int scheduleId = data["scheduleId"].toInt();
-    int seatId = data["seatId"].toInt();
-    int departureStationId = data["departureStationId"].toInt();
-    int arrivalStationId = data["arrivalStationId"].toInt();
-    QString passengerName = data["passengerName"].toString();
-    QString passengerDocument = data["passengerDocument"].toString();
-    double price = data["price"].toDouble();
-
-    if (scheduleId <= 0 || seatId <= 0 || departureStationId <= 0 ||
-        arrivalStationId <= 0 || passengerName.isEmpty() ||
-        passengerDocument.isEmpty() || price <= 0){
+    Database::BookingRequest request;
+    if (!parseBookingRequest(data, &request)){
         sendError("Invalid booking parameters", "BOOK_TICKET");
         return;
     }
 
-    QString ticketNumber = Database::instance().bookTicket(
-        m_userId, scheduleId, seatId, departureStationId, arrivalStationId,
-        passengerName, passengerDocument, price);
+    PendingRequest pending = asyncRequest();
+    InventoryShards::instance().bookTicket(m_userId, request, this
+                                           , [this, pending](bool ok, const QString& ticketNumber, const QString& error){
+        if (!ok){
+            sendResponseFor(pending, createResponse("BOOK_TICKET", false, error));
+            return;
+        }
+        m_lastWriteAt = QDateTime::currentMSecsSinceEpoch();
 
-    if (ticketNumber.isEmpty()){
-        sendError(Database::instance().lastError(), "BOOK_TICKET");
+        QJsonObject responseData;
+        responseData["ticketNumber"] = ticketNumber;
+        responseData["status"] = "booked";
+        responseData["message"] = "Билет успешно забронирован. Пожалуйста, оплатите его в течение 15 минут.";
+
+        sendResponseFor(pending, createResponse("BOOK_TICKET", true, "", responseData));
+
+        qDebug() << "Ticket booked:" << ticketNumber << "by user" << m_userId;
+    });
+}
+
+void ClientHandler::handleBatch(const QJsonObject& data){
+    static const int MAX_BATCH_ITEMS = 32;
+    static const QStringList allowedCommands = {
+        "GET_STATIONS", "SEARCH_TRAINS", "GET_AVAILABLE_SEATS", "BOOK_TICKET",
+        "PAY_TICKET", "CANCEL_TICKET", "GET_TICKET_DETAILS"
+    };
+
+    QJsonArray items = data["items"].toArray();
+    if (items.isEmpty() || items.size() > MAX_BATCH_ITEMS){
+        sendError(QString("Batch must contain 1 to %1 items").arg(MAX_BATCH_ITEMS), "BATCH");
         return;
     }
 
-    QJsonObject responseData;
-    responseData["ticketNumber"] = ticketNumber;
-    responseData["status"] = "booked";
-    responseData["message"] = "Билет успешно забронирован. Пожалуйста, оплатите его в течение 15 минут.";
+    QVector<Database::BookingRequest> bookings(items.size());
+    for (int i = 0; i < items.size(); i++){
+        QJsonObject item = items[i].toObject();
+        QString command = item["command"].toString();
 
-    sendResponse(createResponse("BOOK_TICKET", true, "", responseData));
+        if (!allowedCommands.contains(command)){
+            sendError(QString("Item %1: command '%2' is not allowed in a batch").arg(i + 1).arg(command), "BATCH");
+            return;
+        }
 
-    qDebug() << "Ticket booked:" << ticketNumber << "by user" << m_userId;
-}
+        if (command == "BOOK_TICKET" && !parseBookingRequest(item["data"].toObject(), &bookings[i])){
+            sendError(QString("Item %1: invalid booking parameters").arg(i + 1), "BATCH");
+            return;
+        }
+    }
 
-void ClientHandler::handlePayTicket(const QJsonObject& data){
-    QString ticketNumber = data["ticketNumber"].toString();
+    m_batch = new BatchState;
+    m_batch->items = items;
+    m_batch->results.resize(items.size());
+    m_batch->request = asyncRequest();
+    m_batch->next = 0;
+    m_batch->awaiting = false;
 
-    if (ticketNumber.isEmpty()){
-        sendError("Ticket number is required", "PAY_TICKET");
+    QList<int> bookingItems;
+    QList<Database::BookingRequest> group;
+    for (int i = 0; i < items.size(); i++){
+        if (items[i].toObject()["command"].toString() == "BOOK_TICKET"){
+            bookingItems.append(i);
+            group.append(bookings[i]);
+        }
+    }
+    if (group.isEmpty()){
+        runBatch();
         return;
     }
 
-    bool found;
-    Ticket ticket = Database::instance().getTicket(ticketNumber, &found);
+    // Every booking of the batch is one transaction, so either all of them
+    // take effect or none does. They commit before the other items run,
+    // whose results then already reflect them.
+    InventoryShards::instance().bookTickets(m_userId, group, this
+                                            , [this, bookingItems](bool ok, const QStringList& ticketNumbers, int failedItem, const QString& error){
+        QString message = error;
+        if (failedItem >= 0){
+            message = QString("Item %1: %2").arg(bookingItems[failedItem] + 1).arg(error);
+        }
+        if (ok){
+            m_lastWriteAt = QDateTime::currentMSecsSinceEpoch();
+            qDebug() << "Batch booked" << ticketNumbers.size() << "tickets for user" << m_userId;
+        }
 
-    if (!found){
-        sendError("Ticket not found", "PAY_TICKET");
-        return;
+        for (int j = 0; j < bookingItems.size(); j++){
+            QJsonObject item = m_batch->items[bookingItems[j]].toObject();
+            QJsonObject result;
+            if (!ok){
+                result = createResponse("BOOK_TICKET", false, message);
+            } else {
+                QJsonObject responseData;
+                responseData["ticketNumber"] = ticketNumbers[j];
+                responseData["status"] = "booked";
+                result = createResponse("BOOK_TICKET", true, "", responseData);
+            }
+            if (item.contains("requestId")){
+                result["requestId"] = item["requestId"];
+            }
+            m_batch->results[bookingItems[j]] = result;
+        }
+        runBatch();
+    });
+}
+
+// Items run in the order they were sent, one at a time; bookings already
+// have their results. An item that waits on a query leaves the batch
+// suspended; sendResponseFor resumes it with the item's response.
+void ClientHandler::runBatch(){
+    BatchState* batch = m_batch;
+    if (batch->awaiting){
+        if (batch->captured.isEmpty()){
+            return;
+        }
+        batch->results[batch->next] = batch->captured.first();
+        batch->next++;
+        batch->awaiting = false;
     }
 
-    if (ticket.userId != m_userId){
-        sendError("Access denied", "PAY_TICKET");
-        return;
+    while (batch->next < batch->items.size()){
+        int i = batch->next;
+        if (batch->items[i].toObject()["command"].toString() == "BOOK_TICKET"){
+            batch->next++;
+            continue;
+        }
+
+        QJsonObject item = batch->items[i].toObject();
+        QJsonValue requestId = m_currentRequestId;
+        QList<QJsonObject>* capturedResponses = m_capturedResponses;
+        batch->captured.clear();
+        m_capturedResponses = &batch->captured;
+        m_currentRequestId = item.value("requestId");
+
+        handleCommand(item);
+
+        m_capturedResponses = capturedResponses;
+        m_currentRequestId = requestId;
+
+        if (batch->captured.isEmpty()){
+            batch->awaiting = true;
+            return;
+        }
+        batch->results[i] = batch->captured.first();
+        batch->next++;
     }
 
-    if (ticket.status != "booked"){
-        sendError("Ticket cannot be paid (status: " + ticket.status + ")", "PAY_TICKET");
+    finishBatch();
+}
+
+void ClientHandler::finishBatch(){
+    QJsonArray resultsArray;
+    bool allSucceeded = true;
+    for (const QJsonObject& result: std::as_const(m_batch->results)){
+        resultsArray.append(result);
+        allSucceeded = allSucceeded && result["success"].toBool();
+    }
+
+    QJsonObject responseData;
+    responseData["results"] = resultsArray;
+    responseData["count"] = resultsArray.size();
+    responseData["allSucceeded"] = allSucceeded;
+
+    PendingRequest request = m_batch->request;
+    delete m_batch;
+    m_batch = nullptr;
+    m_resumeQueued = true;
+
+    sendResponseFor(request, createResponse("BATCH", true, "", responseData));
+    QMetaObject::invokeMethod(this, &ClientHandler::resumeDispatch, Qt::QueuedConnection);
+}
+
+void ClientHandler::handlePayTicket(const QJsonObject& data){
+    QString ticketNumber = data["ticketNumber"].toString();
+
+    if (ticketNumber.isEmpty()){
+        sendError("Ticket number is required", "PAY_TICKET");
         return;
     }
 
-    bool success = Database::instance().payTicket(ticketNumber);
+    PendingRequest request = asyncRequest();
+    AsyncDatabase::instance().payTicket(m_userId, ticketNumber, getAddress(), this
+                                        , [this, request, ticketNumber](bool ok, const TicketFullInfo& ticketInfo, const QString& error){
+        if (!ok){
+            sendResponseFor(request, createResponse("PAY_TICKET", false, error));
+            return;
+        }
+        m_lastWriteAt = QDateTime::currentMSecsSinceEpoch();
 
-    if (success){
         QJsonObject responseData;
         responseData["ticketNumber"] = ticketNumber;
         responseData["status"] = "paid";
 
-        sendResponse(createResponse("PAY_TICKET", true, "Payment successful", responseData));
-
-        Database::instance().logAction(m_userId, "ticket_paid", getAddress(), ticketNumber, true);
-
-        TicketFullInfo ticketInfo = Database::instance().getTicketFullInfo(ticketNumber, &found);
-
-        if (found) {
-            QByteArray pdfData = PdfGenerator::generateTicketPdf(
-                ticketInfo.ticket,
-                ticketInfo.trainNumber,
-                ticketInfo.trainType,
-                ticketInfo.departureStationName,
-                ticketInfo.arrivalStationName,
-                ticketInfo.departureTime,
-                ticketInfo.arrivalTime,
-                ticketInfo.carriageNumber,
-                ticketInfo.seatNumber
-                );
-            if (!pdfData.isEmpty()) {
-                sendTicketEmail(m_userEmail, ticketInfo.ticket, pdfData);
-                qDebug() << "PDF ticket sent to" << m_userEmail;
-            } else {
-                qWarning() << "Failed to generate PDF for ticket:" << ticketNumber;
-            }
-        } else {
+        sendResponseFor(request, createResponse("PAY_TICKET", true, "Payment successful", responseData));
+
+        if (ticketInfo.ticket.id <= 0){
             qWarning() << "Failed to get full ticket info for:" << ticketNumber;
+            return;
         }
 
-    } else {
-        sendError(Database::instance().lastError(), "PAY_TICKET");
-    }
+        QByteArray pdfData = PdfGenerator::generateTicketPdf(
+            ticketInfo.ticket,
+            ticketInfo.trainNumber,
+            ticketInfo.trainType,
+            ticketInfo.departureStationName,
+            ticketInfo.arrivalStationName,
+            ticketInfo.departureTime,
+            ticketInfo.arrivalTime,
+            ticketInfo.carriageNumber,
+            ticketInfo.seatNumber
+            );
+        if (!pdfData.isEmpty()) {
+            sendTicketEmail(m_userEmail, ticketInfo.ticket, pdfData);
+            qDebug() << "PDF ticket sent to" << m_userEmail;
+        } else {
+            qWarning() << "Failed to generate PDF for ticket:" << ticketNumber;
+        }
+    });
 }
 
 void ClientHandler::sendTicketEmail(const QString& recipientEmail, const Ticket& ticket, const QByteArray& pdfData){
@@ -838,46 +2170,81 @@ void ClientHandler::handleCancelTicket(const QJsonObject& data){
         return;
     }
 
-    bool found;
-    Ticket ticket = Database::instance().getTicket(ticketNumber, &found);
-
-    if (!found){
-        sendError("Ticket not found", "CANCEL_TICKET");
-        return;
-    }
-
-    if (ticket.userId != m_userId){
-        sendError("Access denied", "CANCEL_TICKET");
-        return;
-    }
-
-    bool success = Database::instance().cancelTicket(ticketNumber, reason);
+    auto respond = [this, ticketNumber](const PendingRequest& request, bool ok, const QString& error){
+        if (!ok){
+            sendResponseFor(request, createResponse("CANCEL_TICKET", false, error));
+            return;
+        }
+        m_lastWriteAt = QDateTime::currentMSecsSinceEpoch();
 
-    if (success){
         QJsonObject responseData;
         responseData["ticketNumber"] = ticketNumber;
         responseData["status"] = "cancelled";
 
-        sendResponse(createResponse("CANCEL_TICKET", true, "Ticket cancelled", responseData));
+        sendResponseFor(request, createResponse("CANCEL_TICKET", true, "Ticket cancelled", responseData));
+    };
+
+    // The ticket's schedule picks the shard; the lookup also turns away
+    // unknown and foreign tickets without queueing on a shard.
+    PendingRequest request = asyncRequest();
+    QString ipAddress = getAddress();
+    AsyncDatabase::instance().getUserTicket(m_userId, ticketNumber, this
+                                            , [this, request, respond, ticketNumber, reason, ipAddress](bool ok, const Ticket& ticket, const QString& error){
+        if (!ok){
+            respond(request, false, error);
+            return;
+        }
+        InventoryShards::instance().cancelTicket(m_userId, ticket.scheduleId, ticketNumber, ipAddress, this
+                                                 , [request, respond, ticketNumber, reason](bool ok, const QString& error){
+            if (ok){
+                qDebug() << "Ticket cancelled:" << ticketNumber << "Reason:" << reason;
+            }
+            respond(request, ok, error);
+        });
+    });
+}
+
+// With "since" only tickets changed after that sync token are returned;
+// otherwise one page, newest first, continuing from "cursor" when given.
+// When the delta is too large "resync" tells the client to page from scratch.
+void ClientHandler::handleGetMyTickets(const QJsonObject& data)
+{
+    int limit = qBound(1, data["limit"].toInt(TICKETS_PAGE_SIZE), MAX_TICKETS_PAGE_SIZE);
+    QString since = data["since"].toString();
 
-        Database::instance().logAction(m_userId, "ticket_cancelled", getAddress(), ticketNumber, true);
+    QList<Ticket> tickets;
+    QString syncToken;
+    QJsonObject responseData;
+    bool ok;
+    if (!since.isEmpty()){
+        bool complete;
+        ok = Database::instance().getUserTicketsChangedSince(m_userId, since, limit, &tickets, &complete, &syncToken);
+        responseData["incremental"] = true;
+        responseData["resync"] = !complete;
+        responseData["hasMore"] = false;
     } else {
-        sendError(Database::instance().lastError(), "CANCEL_TICKET");
+        QString nextCursor;
+        ok = Database::instance().getUserTicketsPage(m_userId, data["cursor"].toString(), limit, &tickets, &nextCursor, &syncToken);
+        responseData["incremental"] = false;
+        responseData["hasMore"] = !nextCursor.isEmpty();
+        if (!nextCursor.isEmpty()){
+            responseData["nextCursor"] = nextCursor;
+        }
     }
-}
 
-void ClientHandler::handleGetMyTickets()
-{
-    QList<Ticket> tickets = Database::instance().getUserTickets(m_userId);
+    if (!ok){
+        sendError(Database::instance().lastError(), "GET_MY_TICKETS");
+        return;
+    }
 
     QJsonArray ticketsArray;
     for (const Ticket& ticket: tickets){
         ticketsArray.append(ticketToJson(ticket));
     }
 
-    QJsonObject responseData;
     responseData["tickets"] = ticketsArray;
     responseData["count"] = tickets.size();
+    responseData["syncToken"] = syncToken;
 
     sendResponse(createResponse("GET_MY_TICKETS", true, "", responseData));
 }
@@ -891,23 +2258,18 @@ void ClientHandler::handleGetTicketDetails(const QJsonObject& data)
         return;
     }
 
-    bool found;
-    Ticket ticket = Database::instance().getTicket(ticketNumber, &found);
-
-    if (!found){
-        sendError("Ticket not found", "GET_TICKET_DETAILS");
-        return;
-    }
-
-    if (ticket.userId != m_userId){
-        sendError("Access denied", "GET_TICKET_DETAILS");
-        return;
-    }
+    PendingRequest request = asyncRequest();
+    AsyncDatabase::instance().getUserTicket(m_userId, ticketNumber, this, [this, request](bool ok, const Ticket& ticket, const QString& error){
+        if (!ok){
+            sendResponseFor(request, createResponse("GET_TICKET_DETAILS", false, error));
+            return;
+        }
 
-    QJsonObject responseData;
-    responseData["ticket"] = ticketToJson(ticket);
+        QJsonObject responseData;
+        responseData["ticket"] = ticketToJson(ticket);
 
-    sendResponse(createResponse("GET_TICKET_DETAILS", true, "", responseData));
+        sendResponseFor(request, createResponse("GET_TICKET_DETAILS", true, "", responseData));
+    });
 }
 
 void ClientHandler::handleChangePassword(const QJsonObject& data)
@@ -5,16 +5,40 @@
 #include <QTcpServer>
 #include <QTcpSocket>
 #include <QSslSocket>
+#include <QLocalServer>
 #include <QMap>
+#include <QHash>
+#include <QSet>
+#include <QVector>
+#include <QElapsedTimer>
 #include <QTimer>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QJsonArray>
 #include <QMutex>
 #include "database.h"
+#include "wireprotocol.h"
+#include "ratelimiter.h"
+#include "tlsserver.h"
 
 class ClientHandler;
 
+struct SeatSegment {
+    int seatId;
+    int departureStationId;
+    int arrivalStationId;
+
+    bool operator==(const SeatSegment& other) const {
+        return seatId == other.seatId
+               && departureStationId == other.departureStationId
+               && arrivalStationId == other.arrivalStationId;
+    }
+};
+
+inline size_t qHash(const SeatSegment& segment, size_t seed = 0){
+    return qHashMulti(seed, segment.seatId, segment.departureStationId, segment.arrivalStationId);
+}
+
 class ApiServer : public QObject
 {
     Q_OBJECT
@@ -24,9 +48,14 @@ public:
     ~ApiServer();
 
     bool startServer(quint16 port = 8080, const QString& address = "0.0.0.0");
+    bool adoptListener(qintptr listenerDescriptor);
     void stopServer();
     bool isRunning() const;
 
+    bool enableHandoff(const QString& path);
+    void drain();
+    bool isDraining() const;
+
     bool enableSSL(const QString& certPath, const QString& keyPath);
     bool isSSLEnabled() const;
 
@@ -37,16 +66,38 @@ public:
         quint64 bytesSent;
         QDateTime startTime;
         int authenticatedUsers;
+        quint64 searchCacheHits;
+        quint64 searchCacheMisses;
+        double searchCacheHitRatio;
+        qint64 searchCacheBytes;
+        quint64 readPauses;
+        int maxConnections;
+        quint64 idleConnectionsReaped;
+        qint64 residentBytes;
+        qint64 bytesPerConnection;
+        quint64 rateLimitAllowed;
+        quint64 rateLimitRejected;
+        int rateLimitTrackedKeys;
+        bool tlsEnabled;
+        quint64 tlsHandshakes;
+        quint64 tlsHandshakeFailures;
+        int replicas;
+        int replicasUsable;
+        qint64 maxReplicaLagMs;
+        quint64 replicaReads;
+        quint64 primaryReads;
     };
     ServerStats getStatistics() const;
 
     void setMaxConnections(int max);
     void setConnectionTimeout(int seconds);
     void setBookingTimeout(int minutes);
+    void setDrainTimeout(int seconds);
 
 signals:
     void serverStarted(quint16 port);
     void serverStopped();
+    void drained();
     void clientConnected(QString address, quint16 port);
     void clientDisconnected(QString address);
     void errorOccured(QString error);
@@ -59,10 +110,40 @@ private slots:
     void onClientDisconnected();
     void onClientError(QAbstractSocket::SocketError error);
     void onCleanupTimer();
+    void onPartitionTimer();
+    void onSeatSegmentChanged(int scheduleId
+                              , int seatId
+                              , int departureStationId
+                              , int arrivalStationId
+                              , bool taken);
+    void onScheduleSubscriptionChanged(int scheduleId, bool subscribed);
+    void onClientBytesTransferred(qint64 received, qint64 sent);
+    void onClientReadPaused();
+    void onIdleWheelTick();
+    void flushRegistryChanges();
+    void onHandoffRequested();
+    void finishDrain();
 
 private:
-    QTcpServer* m_server;
-    QMap<QTcpSocket*, ClientHandler*> m_clients;
+    struct SeatChange {
+        int scheduleId;
+        int seatId;
+        int departureStationId;
+        int arrivalStationId;
+        bool taken;
+    };
+
+    TlsServer* m_server;
+    QVector<ClientHandler*> m_clientSlots;
+    QVector<int> m_freeClientSlots;
+    int m_clientCount;
+    QList<ClientHandler*> m_pendingRemovals;
+    QList<AuditLog> m_pendingAuditLogs;
+    bool m_registryFlushScheduled;
+    QHash<int, QSet<ClientHandler*>> m_scheduleSubscribers;
+    QList<SeatChange> m_seatChanges;
+    bool m_seatCheckQueued;
+    bool m_seatCheckRunning;
     QMutex m_mutex;
 
     bool m_sslEnabled;
@@ -72,32 +153,88 @@ private:
     int m_maxConnections;
     int m_connectionTimeout;
     int m_bookingTimeout;
+    int m_drainTimeout;
+
+    QLocalServer* m_handoffServer;
+    bool m_draining;
+    bool m_drainFinished;
+    QTimer* m_drainTimer;
 
     ServerStats m_stats;
     QTimer* m_cleanup_Timer;
+    QTimer* m_partitionTimer;
+    RateLimiter m_rateLimiter;
+
+    static const int LISTEN_BACKLOG = 1024;
+    static const int DRAIN_RECONNECT_SPREAD_MS = 5000;
+    static const int PARTITION_MAINTENANCE_INTERVAL_MS = 3600000;
+    static const int IDLE_WHEEL_SLOTS = 64;
+    static const int IDLE_CLOSE_GRACE_MS = 10000;
+    static const int KEEPALIVE_IDLE_SECONDS = 60;
+    static const int KEEPALIVE_INTERVAL_SECONDS = 10;
+    static const int KEEPALIVE_PROBES = 3;
 
-    void removeClient(QTcpSocket* socket);
-    void broadcastMessage(const QJsonObject& message, QTcpSocket* exclude = nullptr);
+    QVector<QSet<ClientHandler*>> m_idleWheel;
+    int m_idleWheelPosition;
+    int m_idleTickMs;
+    QTimer* m_idleTimer;
+    qint64 m_baselineResidentBytes;
+
+    void registerClient(ClientHandler* handler);
+    void unregisterClient(ClientHandler* handler);
+    void queueAuditLog(int userId, const QString& action, const QString& address, const QString& details);
+    void scheduleRegistryFlush();
+    void checkSeatChanges();
+    void deliverSeatChanges(const QList<SeatChange>& changes
+                            , bool checked
+                            , const QHash<QPair<int, int>, QList<QPair<int, int>>>& stillOccupied);
+    void updateSubscriber(ClientHandler* handler, int scheduleId, bool subscribed);
+    void scheduleIdleCheck(ClientHandler* handler, qint64 delayMs);
+    void unscheduleIdleCheck(ClientHandler* handler);
+    void configureKeepAlive(QTcpSocket* socket);
+    void onListening(const QString& description);
+    static qint64 residentMemoryBytes();
 };
 
 class ClientHandler : public QObject{
     Q_OBJECT
 
 public:
-    explicit ClientHandler(QTcpSocket* socket, QObject* parent = nullptr);
+    explicit ClientHandler(QTcpSocket* socket, RateLimiter* rateLimiter, QObject* parent = nullptr);
     ~ClientHandler();
 
+    QTcpSocket* socket() const;
     QString getAddress() const;
     quint16 getPort() const;
     bool isAuthenticated() const;
     int getUserId() const;
     QString getSessionToken() const;
+    qint64 idleMs() const;
+    bool closeIdle();
+    void beginDrain(int reconnectAfterMs);
+
+    int registrySlot() const;
+    void setRegistrySlot(int slot);
+    int idleWheelSlot() const;
+    void setIdleWheelSlot(int slot);
 
     void sendResponse(const QJsonObject& response);
     void sendError(const QString& error, const QString& command = "");
 
+    QList<int> subscribedSchedules() const;
+    void queueSeatChange(int scheduleId
+                         , int seatId
+                         , int departureStationId
+                         , int arrivalStationId
+                         , bool taken
+                         , const QList<QPair<int, int>>& stillOccupied = {});
+    void queueSeatResync(int scheduleId);
+
 signals:
     void disconnected();
+    void scheduleSubscriptionChanged(int scheduleId, bool subscribed);
+    void bytesTransferred(qint64 received, qint64 sent);
+    void readPaused();
     void errorOccurred(QAbstractSocket::SocketError error);
     void authenticated(int userId, QString email);
     void commandExecuted(QString command, bool success);
@@ -106,25 +243,104 @@ private slots:
     void onReadyRead();
     void onDisconnected();
     void onSocketError(QAbstractSocket::SocketError error);
+    void flushSeatChanges();
+    void flushOutput();
+    void onBytesWritten(qint64 bytes);
+    void resumeDispatch();
 
 private:
+    struct ScheduleSubscription {
+        int departureStationId;
+        int arrivalStationId;
+    };
+
+    // Where the response to a command goes once an async query for it
+    // completes, by which time other commands may have been processed.
+    struct PendingRequest {
+        QJsonValue requestId;
+        QList<QJsonObject>* capturedResponses;
+        bool async;
+    };
+
+    // A BATCH whose items are still running. next is the item being run;
+    // when it waits on a query, its response arrives in captured.
+    struct BatchState {
+        QJsonArray items;
+        QVector<QJsonObject> results;
+        QList<QJsonObject> captured;
+        PendingRequest request;
+        int next;
+        bool awaiting;
+    };
+
+    static const int MAX_SUBSCRIPTIONS = 8;
+    static const int SEAT_UPDATE_INTERVAL_MS = 200;
+    static const int MAX_PENDING_SEAT_CHANGES = 256;
+    static const int TICKETS_PAGE_SIZE = 50;
+    static const int MAX_TICKETS_PAGE_SIZE = 200;
+    static const qint64 SEAT_UPDATE_BACKLOG_BYTES = 256 * 1024;
+    static const qint64 OUTPUT_HIGH_WATERMARK = 4 * 1024 * 1024;
+    static const qint64 OUTPUT_LOW_WATERMARK = 1024 * 1024;
+    static const qint64 SOCKET_READ_BUFFER_SIZE = 1024 * 1024;
+
     QTcpSocket* m_socket;
+    QString m_address;
+    RateLimiter* m_rateLimiter;
+    int m_registrySlot;
+    int m_idleWheelSlot;
     QByteArray m_buffer;
+    WireProtocol::Encoding m_encoding;
+    QJsonValue m_currentRequestId;
+    QList<QJsonObject>* m_capturedResponses;
+
+    QHash<int, ScheduleSubscription> m_subscriptions;
+    QHash<int, QHash<SeatSegment, bool>> m_pendingSeatChanges;
+    QSet<int> m_resyncSchedules;
+    bool m_seatFlushScheduled;
+
+    QElapsedTimer m_lastActivity;
+    bool m_idleClosing;
+    bool m_draining;
+    bool m_drainNoticeSent;
+    int m_reconnectAfterMs;
+    // Commands answered from a callback that have not answered yet.
+    int m_inFlight;
+    BatchState* m_batch;
+    bool m_resumeQueued;
+    // Set while LOGIN is checking the password, so that the commands after
+    // it are not dispatched before the session exists.
+    bool m_loginPending;
+
+    QByteArray m_outputBuffer;
+    bool m_flushScheduled;
+    bool m_readPaused;
 
     bool m_authenticated;
     int m_userId;
     QString m_userEmail;
     QString m_sessionToken;
+    // When this session last changed data, in ms since the epoch; its reads
+    // go to a replica only once the replica has caught up with that.
+    qint64 m_lastWriteAt;
 
-    void processMessage(const QByteArray& data);
+    qint64 pendingOutputBytes() const;
+    PendingRequest currentRequest() const;
+    PendingRequest asyncRequest();
+    void sendResponseFor(const PendingRequest& request, const QJsonObject& response);
+    bool dispatchHeld() const;
+    void finishDrainIfIdle();
+    void readMessages(bool ignoreBackpressure);
+    void processMessage(const QByteArray& data, WireProtocol::Encoding encoding);
     void handleCommand(const QJsonObject& request);
     void sendVerificationEmail(const QString& recipientEmail, const QString& code);
     void sendTicketEmail(const QString& recipientEmail
                         , const Ticket& ticket
                         , const QByteArray& pdfData);
 
+    void handleHello(const QJsonObject& data);
     void handleRegister(const QJsonObject& data);
     void handleLogin(const QJsonObject& data);
+    void handleResumeSession(const QJsonObject& data);
     void handleLogout();
     void handleResendVerification(const QJsonObject& data);
     void handleVerifyEmail(const QJsonObject& data);
@@ -134,12 +350,23 @@ private:
     void handleBookTicket(const QJsonObject& data);
     void handlePayTicket(const QJsonObject& data);
     void handleCancelTicket(const QJsonObject& data);
-    void handleGetMyTickets();
+    void handleGetMyTickets(const QJsonObject& data);
     void handleGetTicketDetails(const QJsonObject& data);
     void handleChangePassword(const QJsonObject& data);
     void handleGetProfile();
+    void handleBatch(const QJsonObject& data);
+    void runBatch();
+    void finishBatch();
+    void handlePing();
+    void handleSubscribeSchedule(const QJsonObject& data);
+    void handleUnsubscribeSchedule(const QJsonObject& data);
+    void clearSubscriptions();
+    void scheduleSeatFlush();
+
+    bool parseBookingRequest(const QJsonObject& data, Database::BookingRequest* request);
 
     bool requireAuth(const QString& command);
+    bool checkRateLimit(const QString& command, const QJsonObject& data);
     QJsonObject createResponse(const QString& command
                                , bool success
                                , const QString& message = ""
@@ -148,5 +375,7 @@ private:
     QJsonObject stationToJson(const Station& station);
     QJsonObject ticketToJson(const Ticket& ticket);
     QJsonObject searchResultToJson(const Database::SearchResult& result);
+    QJsonObject seatMapToJson(const QList<Seat>& seats);
+    QJsonObject seatsToJson(const QList<Seat>& seats, bool compact);
 };
 #endif
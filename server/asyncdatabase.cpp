@@ -0,0 +1,1179 @@
+#include "asyncdatabase.h"
+#include <QDebug>
+#include <QFile>
+#include <QSettings>
+#include <QSocketNotifier>
+#include <QThreadPool>
+#include <QTimer>
+#include "searchcache.h"
+#include "ticketqueries.h"
+
+int AsyncDatabase::Result::rows() const{
+    return m_result ? PQntuples(m_result.get()) : 0;
+}
+
+int AsyncDatabase::Result::columnIndex(const char* column) const{
+    int index = m_result ? PQfnumber(m_result.get(), column) : -1;
+    if (index < 0){
+        qWarning() << "No column" << column << "in query result";
+    }
+    return index;
+}
+
+bool AsyncDatabase::Result::isNull(int row, const char* column) const{
+    int index = columnIndex(column);
+    return index < 0 || PQgetisnull(m_result.get(), row, index);
+}
+
+QString AsyncDatabase::Result::value(int row, const char* column) const{
+    int index = columnIndex(column);
+    if (index < 0 || PQgetisnull(m_result.get(), row, index)){
+        return QString();
+    }
+    return QString::fromUtf8(PQgetvalue(m_result.get(), row, index));
+}
+
+int AsyncDatabase::Result::intValue(int row, const char* column) const{
+    return value(row, column).toInt();
+}
+
+double AsyncDatabase::Result::doubleValue(int row, const char* column) const{
+    return value(row, column).toDouble();
+}
+
+bool AsyncDatabase::Result::boolValue(int row, const char* column) const{
+    return value(row, column) == "t";
+}
+
+// Timestamps come as "2024-05-01 12:30:00.123456", local time like QPSQL.
+QDateTime AsyncDatabase::Result::dateTimeValue(int row, const char* column) const{
+    QString text = value(row, column);
+    if (text.size() <= 10){
+        return QDateTime();
+    }
+    text[10] = 'T';
+    return QDateTime::fromString(text, Qt::ISODateWithMs);
+}
+
+QDate AsyncDatabase::Result::dateValue(int row, const char* column) const{
+    return QDate::fromString(value(row, column), Qt::ISODate);
+}
+
+QTime AsyncDatabase::Result::timeValue(int row, const char* column) const{
+    return QTime::fromString(value(row, column), Qt::ISODateWithMs);
+}
+
+AsyncDatabase& AsyncDatabase::instance(){
+    static AsyncDatabase instance;
+    return instance;
+}
+
+AsyncDatabase::~AsyncDatabase(){
+    disconnect();
+}
+
+bool AsyncDatabase::connect(const QString& host, int port, const QString& dbName, const QString& username, const QString& password, int connections){
+    if (!m_connections.isEmpty()){
+        qDebug() << "Async database is already connected";
+        return true;
+    }
+
+    m_dbName = dbName;
+    m_username = username;
+    m_password = password;
+    if (!openPool(host, port, connections, &m_connections)){
+        return false;
+    }
+
+    qDebug() << "Async database pool ready:" << m_connections.size() << "connections";
+    return true;
+}
+
+// An unreachable replica is reported and skipped: the primary can serve
+// every read on its own.
+// The search cache needs the same bound to know how long a schedule change
+// can still matter for a replica result.
+void AsyncDatabase::setMaxReplicaLag(int milliseconds){
+    m_maxReplicaLagMs = milliseconds;
+    Database::instance().searchCache().setMaxReplicaLag(milliseconds);
+}
+
+bool AsyncDatabase::addReplica(const QString& host, int port, int connections){
+    Replica* replica = new Replica;
+    replica->name = QString("%1:%2").arg(host).arg(port);
+    if (!openPool(host, port, connections, &replica->connections)){
+        qWarning() << "Replica" << replica->name << "is not reachable:" << m_lastError;
+        delete replica;
+        return false;
+    }
+    m_replicas.append(replica);
+
+    if (!m_lagTimer){
+        m_lagTimer = new QTimer(this);
+        QObject::connect(m_lagTimer, &QTimer::timeout, this, &AsyncDatabase::probeReplicaLag);
+        m_lagTimer->start(LAG_PROBE_INTERVAL_MS);
+    }
+    probeReplicaLag();
+
+    qDebug() << "Async database replica ready:" << replica->name << replica->connections.size() << "connections";
+    return true;
+}
+
+bool AsyncDatabase::connectFromConfig(const QString& configPath){
+    if (!QFile::exists(configPath)){
+        m_lastError = QString("Configuration file not found: %1").arg(configPath);
+        return false;
+    }
+
+    QSettings settings(configPath, QSettings::IniFormat);
+    int connections = settings.value("database/async_connections", DEFAULT_CONNECTIONS).toInt();
+    if (!connect(settings.value("database/host", "localhost").toString(),
+                 settings.value("database/port", 5432).toInt(),
+                 settings.value("database/name", "train_tickets").toString(),
+                 settings.value("database/username", "").toString(),
+                 settings.value("database/password", "").toString(),
+                 connections)){
+        return false;
+    }
+
+    // replicas = host:port, host:port
+    setMaxReplicaLag(settings.value("database/max_replica_lag_ms", DEFAULT_MAX_REPLICA_LAG_MS).toInt());
+    for (const QString& endpoint: settings.value("database/replicas").toStringList()){
+        QString host = endpoint.section(':', 0, 0).trimmed();
+        int port = endpoint.section(':', 1, 1).trimmed().toInt();
+        if (!host.isEmpty()){
+            addReplica(host, port > 0 ? port : 5432, connections);
+        }
+    }
+    return true;
+}
+
+// The pools are emptied first, so a callback failed here cannot queue a
+// query on a connection about to be deleted.
+void AsyncDatabase::disconnect(){
+    if (m_lagTimer){
+        m_lagTimer->stop();
+    }
+    QList<Connection*> connections = allConnections();
+    m_connections.clear();
+    qDeleteAll(m_replicas);
+    m_replicas.clear();
+    m_walSamples.clear();
+
+    for (Connection* connection: std::as_const(connections)){
+        failConnection(connection, "Database connection closed");
+        closeConnection(connection);
+        delete connection;
+    }
+}
+
+QList<AsyncDatabase::Connection*> AsyncDatabase::allConnections() const{
+    QList<Connection*> connections = m_connections;
+    for (const Replica* replica: m_replicas){
+        connections += replica->connections;
+    }
+    return connections;
+}
+
+QByteArray AsyncDatabase::connectionString(const QString& host, int port) const{
+    QStringList parts;
+    auto add = [&parts](const char* key, const QString& value){
+        QString escaped = value;
+        escaped.replace("\\", "\\\\").replace("'", "\\'");
+        parts << QString("%1='%2'").arg(key, escaped);
+    };
+    add("host", host);
+    add("port", QString::number(port));
+    add("dbname", m_dbName);
+    add("user", m_username);
+    add("password", m_password);
+    add("connect_timeout", "10");
+    add("sslmode", "prefer");
+    return parts.join(' ').toUtf8();
+}
+
+bool AsyncDatabase::openPool(const QString& host, int port, int connections, QList<Connection*>* pool){
+    QByteArray conninfo = connectionString(host, port);
+    for (int i = 0; i < qMax(1, connections); i++){
+        Connection* connection = new Connection;
+        connection->connectionString = conninfo;
+        if (!openConnection(connection)){
+            delete connection;
+            for (Connection* opened: std::as_const(*pool)){
+                closeConnection(opened);
+                delete opened;
+            }
+            pool->clear();
+            return false;
+        }
+        pool->append(connection);
+    }
+    return true;
+}
+
+// Connecting blocks, but only at startup; a connection that broke later is
+// opened again by startConnecting. The connection enters pipeline mode once
+// and stays in it.
+bool AsyncDatabase::openConnection(Connection* connection){
+    connection->conn = PQconnectdb(connection->connectionString.constData());
+    if (!prepareConnection(connection)){
+        m_lastError = connection->connectError;
+        qDebug() << "Async database connection failed:" << m_lastError;
+        PQfinish(connection->conn);
+        connection->conn = nullptr;
+        return false;
+    }
+    watchSocket(connection);
+    return true;
+}
+
+bool AsyncDatabase::prepareConnection(Connection* connection){
+    bool ready = PQstatus(connection->conn) == CONNECTION_OK && PQsetnonblocking(connection->conn, 1) == 0;
+#ifdef LIBPQ_HAS_PIPELINING
+    ready = ready && PQenterPipelineMode(connection->conn);
+#endif
+    if (!ready){
+        connection->connectError = QString::fromUtf8(PQerrorMessage(connection->conn)).trimmed();
+    }
+    return ready;
+}
+
+// Reconnecting must not stall the event loop, so it runs on PQconnectPoll,
+// driven by the socket notifiers, and libpq's connect_timeout is enforced by
+// a timer instead. After a failed attempt the queries that arrive within
+// RECONNECT_INTERVAL_MS fail at once rather than each trying again.
+bool AsyncDatabase::startConnecting(Connection* connection){
+    if (QDateTime::currentMSecsSinceEpoch() < connection->retryAt){
+        return false;
+    }
+
+    connection->conn = PQconnectStart(connection->connectionString.constData());
+    if (PQstatus(connection->conn) == CONNECTION_BAD){
+        connection->connectError = QString::fromUtf8(PQerrorMessage(connection->conn)).trimmed();
+        connection->retryAt = QDateTime::currentMSecsSinceEpoch() + RECONNECT_INTERVAL_MS;
+        qWarning() << "Async database reconnect failed:" << connection->connectError;
+        PQfinish(connection->conn);
+        connection->conn = nullptr;
+        return false;
+    }
+
+    connection->connecting = true;
+    connection->connectTimer = new QTimer(this);
+    connection->connectTimer->setSingleShot(true);
+    QObject::connect(connection->connectTimer, &QTimer::timeout, this, [this, connection](){
+        connectFailed(connection, "Timed out connecting to database");
+    });
+    connection->connectTimer->start(CONNECT_TIMEOUT_MS);
+
+    // PQconnectStart behaves as if PQconnectPoll had asked to write.
+    watchSocket(connection);
+    connection->readNotifier->setEnabled(false);
+    connection->writeNotifier->setEnabled(true);
+    return true;
+}
+
+void AsyncDatabase::pollConnection(Connection* connection){
+    PostgresPollingStatusType status = PQconnectPoll(connection->conn);
+    if (status == PGRES_POLLING_FAILED){
+        connectFailed(connection, QString::fromUtf8(PQerrorMessage(connection->conn)).trimmed());
+        return;
+    }
+
+    if (status != PGRES_POLLING_OK){
+        watchSocket(connection);
+        connection->readNotifier->setEnabled(status == PGRES_POLLING_READING);
+        connection->writeNotifier->setEnabled(status == PGRES_POLLING_WRITING);
+        return;
+    }
+
+    if (!prepareConnection(connection)){
+        connectFailed(connection, connection->connectError);
+        return;
+    }
+    connection->connecting = false;
+    connection->connectTimer->stop();
+    connection->connectTimer->deleteLater();
+    connection->connectTimer = nullptr;
+    watchSocket(connection);
+    connection->readNotifier->setEnabled(true);
+    connection->writeNotifier->setEnabled(false);
+    qDebug() << "Async database connection restored";
+    startNext(connection);
+}
+
+void AsyncDatabase::connectFailed(Connection* connection, const QString& error){
+    qWarning() << "Async database reconnect failed:" << error;
+    connection->connectError = error;
+    connection->retryAt = QDateTime::currentMSecsSinceEpoch() + RECONNECT_INTERVAL_MS;
+    closeConnection(connection);
+    failConnection(connection, error);
+}
+
+// While connecting, libpq may move to another socket, for instance when the
+// host has several addresses; the notifiers follow it.
+void AsyncDatabase::watchSocket(Connection* connection){
+    int socket = PQsocket(connection->conn);
+    if (connection->readNotifier && connection->readNotifier->socket() == socket){
+        return;
+    }
+    dropNotifiers(connection);
+
+    connection->readNotifier = new QSocketNotifier(socket, QSocketNotifier::Read, this);
+    connection->writeNotifier = new QSocketNotifier(socket, QSocketNotifier::Write, this);
+    connection->writeNotifier->setEnabled(false);
+    QObject::connect(connection->readNotifier, &QSocketNotifier::activated, this, [this, connection](){
+        if (connection->connecting){
+            pollConnection(connection);
+        } else {
+            readResults(connection);
+        }
+    });
+    QObject::connect(connection->writeNotifier, &QSocketNotifier::activated, this, [this, connection](){
+        if (connection->connecting){
+            pollConnection(connection);
+        } else {
+            flushOutput(connection);
+        }
+    });
+}
+
+// Notifiers and the timer are deleted later: this may run inside one of
+// their signals.
+void AsyncDatabase::dropNotifiers(Connection* connection){
+    for (QSocketNotifier* notifier: {connection->readNotifier, connection->writeNotifier}){
+        if (notifier){
+            notifier->setEnabled(false);
+            notifier->deleteLater();
+        }
+    }
+    connection->readNotifier = nullptr;
+    connection->writeNotifier = nullptr;
+}
+
+void AsyncDatabase::closeConnection(Connection* connection){
+    dropNotifiers(connection);
+    if (connection->connectTimer){
+        connection->connectTimer->stop();
+        connection->connectTimer->deleteLater();
+        connection->connectTimer = nullptr;
+    }
+    if (connection->conn){
+        PQfinish(connection->conn);
+        connection->conn = nullptr;
+    }
+    connection->connecting = false;
+    connection->inFlight = 0;
+}
+
+AsyncDatabase::Connection* AsyncDatabase::pickConnection(const QList<Connection*>& pool){
+    Connection* best = nullptr;
+    for (Connection* connection: pool){
+        if (!best || connection->queue.size() < best->queue.size()){
+            best = connection;
+        }
+    }
+    return best;
+}
+
+AsyncDatabase::Statement AsyncDatabase::makeStatement(const Query& query){
+    Statement statement;
+    statement.sql = query.sql.toUtf8();
+    for (const QVariant& param: query.params){
+        bool null = param.isNull();
+        QByteArray text;
+        if (param.typeId() == QMetaType::Bool){
+            text = param.toBool() ? "t" : "f";
+        } else if (param.typeId() == QMetaType::QDateTime){
+            text = param.toDateTime().toString(Qt::ISODateWithMs).toUtf8();
+        } else if (!null){
+            text = param.toString().toUtf8();
+        }
+        statement.params.append(text);
+        statement.nulls.append(null);
+    }
+    return statement;
+}
+
+void AsyncDatabase::exec(const QString& sql, const QVariantList& params, QObject* context, Callback callback){
+    execPipeline({Query{sql, params}}, context, [callback](const QList<Result>& results){
+        callback(results.first());
+    });
+}
+
+void AsyncDatabase::execPipeline(const QList<Query>& queries, QObject* context, PipelineCallback callback){
+    Pending pending;
+    for (const Query& query: queries){
+        pending.statements.append(makeStatement(query));
+    }
+    pending.context = context;
+    pending.hasContext = context != nullptr;
+    pending.callback = std::move(callback);
+    enqueue(m_connections, pending);
+}
+
+void AsyncDatabase::execRead(const QString& sql, const QVariantList& params, qint64 freshAfter, QObject* context, Callback callback){
+    Replica* replica = pickReplica(freshAfter);
+    if (!replica){
+        readOnPrimary(sql, params, context, callback);
+        return;
+    }
+
+    replica->reads++;
+    Pending pending;
+    pending.statements.append(makeStatement(Query{sql, params}));
+    pending.context = context;
+    pending.hasContext = context != nullptr;
+    QPointer<QObject> guard(context);
+    pending.callback = [this, sql, params, guard, callback, caughtUpTo = replica->caughtUpTo, name = replica->name](const QList<Result>& results){
+        if (results.first().ok()){
+            Result fresh = results.first();
+            fresh.m_freshAsOf = caughtUpTo;
+            callback(fresh);
+            return;
+        }
+        // A failed replica is left alone for a while: reconnecting blocks,
+        // and the primary can answer the read.
+        qDebug() << "Read on replica" << name << "failed, retrying on primary:" << results.first().error();
+        for (Replica* replica: std::as_const(m_replicas)){
+            if (replica->name == name){
+                replica->retryAt = QDateTime::currentMSecsSinceEpoch() + REPLICA_RETRY_INTERVAL_MS;
+            }
+        }
+        readOnPrimary(sql, params, guard, callback);
+    };
+    enqueue(replica->connections, pending);
+}
+
+void AsyncDatabase::readOnPrimary(const QString& sql, const QVariantList& params, QObject* context, Callback callback){
+    m_primaryReads++;
+    qint64 sentAt = QDateTime::currentMSecsSinceEpoch();
+    exec(sql, params, context, [callback, sentAt](const Result& result){
+        Result fresh = result;
+        fresh.m_freshAsOf = sentAt;
+        callback(fresh);
+    });
+}
+
+// The least loaded of the replicas that are fresh enough.
+AsyncDatabase::Replica* AsyncDatabase::pickReplica(qint64 freshAfter) const{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    Replica* best = nullptr;
+    int bestQueued = 0;
+    for (Replica* replica: m_replicas){
+        if (!replica->inRecovery || now < replica->retryAt
+            || now - replica->caughtUpTo > m_maxReplicaLagMs || replica->caughtUpTo <= freshAfter){
+            continue;
+        }
+        int queued = 0;
+        for (const Connection* connection: std::as_const(replica->connections)){
+            queued += connection->queue.size();
+        }
+        if (!best || queued < bestQueued){
+            best = replica;
+            bestQueued = queued;
+        }
+    }
+    return best;
+}
+
+// Samples the primary's WAL position, then asks each replica how far it has
+// replayed. A replica that has replayed a sample's position has every commit
+// made before the sample was taken.
+void AsyncDatabase::probeReplicaLag(){
+    qint64 takenAt = QDateTime::currentMSecsSinceEpoch();
+    exec("SELECT pg_current_wal_lsn()::text AS lsn", {}, this, [this, takenAt](const Result& result){
+        if (!result.ok() || result.rows() == 0){
+            return;
+        }
+        m_walSamples.append(WalSample{takenAt, parseLsn(result.value(0, "lsn"))});
+        while (m_walSamples.size() > 1 && m_walSamples.first().takenAt < takenAt - WAL_SAMPLE_WINDOW_MS){
+            m_walSamples.removeFirst();
+        }
+
+        qint64 now = QDateTime::currentMSecsSinceEpoch();
+        for (Replica* replica: std::as_const(m_replicas)){
+            if (replica->probing || now < replica->retryAt){
+                continue;
+            }
+            replica->probing = true;
+            QString name = replica->name;
+            Pending pending;
+            pending.statements.append(makeStatement(Query{"SELECT pg_is_in_recovery() AS in_recovery, pg_last_wal_replay_lsn()::text AS lsn", {}}));
+            pending.context = this;
+            pending.hasContext = true;
+            pending.callback = [this, name](const QList<Result>& results){
+                Replica* replica = nullptr;
+                for (Replica* candidate: std::as_const(m_replicas)){
+                    if (candidate->name == name){
+                        replica = candidate;
+                    }
+                }
+                if (!replica){
+                    return;
+                }
+                replica->probing = false;
+
+                const Result& result = results.first();
+                if (!result.ok() || result.rows() == 0){
+                    qWarning() << "Replica" << name << "lag probe failed:" << result.error();
+                    replica->retryAt = QDateTime::currentMSecsSinceEpoch() + REPLICA_RETRY_INTERVAL_MS;
+                    return;
+                }
+
+                bool inRecovery = result.boolValue(0, "in_recovery");
+                if (!inRecovery && replica->inRecovery != inRecovery){
+                    qWarning() << "Replica" << name << "is not in recovery; no reads are sent to it";
+                }
+                replica->inRecovery = inRecovery;
+
+                quint64 replayed = parseLsn(result.value(0, "lsn"));
+                for (const WalSample& sample: std::as_const(m_walSamples)){
+                    if (sample.lsn <= replayed){
+                        replica->caughtUpTo = qMax(replica->caughtUpTo, sample.takenAt);
+                    }
+                }
+            };
+            enqueue(replica->connections, pending);
+        }
+    });
+}
+
+// "16/B374D848" is the high and low 32 bits in hex.
+quint64 AsyncDatabase::parseLsn(const QString& text){
+    return (text.section('/', 0, 0).toULongLong(nullptr, 16) << 32) | text.section('/', 1, 1).toULongLong(nullptr, 16);
+}
+
+QList<AsyncDatabase::ReplicaStatus> AsyncDatabase::replicaStatus() const{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QList<ReplicaStatus> status;
+    for (const Replica* replica: m_replicas){
+        qint64 lag = replica->caughtUpTo > 0 ? now - replica->caughtUpTo : -1;
+        bool usable = replica->inRecovery && now >= replica->retryAt && lag >= 0 && lag <= m_maxReplicaLagMs;
+        status.append(ReplicaStatus{replica->name, usable, lag, replica->reads});
+    }
+    return status;
+}
+
+void AsyncDatabase::enqueue(const QList<Connection*>& pool, Pending pending){
+    Connection* connection = pickConnection(pool);
+    if (!connection){
+        Result result;
+        result.m_error = "No connection to database";
+        invoke(pending, QList<Result>(pending.statements.size(), result));
+        return;
+    }
+
+    connection->queue.enqueue(pending);
+    startNext(connection);
+}
+
+bool AsyncDatabase::sendStatement(Connection* connection, const Statement& statement){
+    QVector<const char*> values(statement.params.size());
+    for (int i = 0; i < statement.params.size(); i++){
+        values[i] = statement.nulls[i] ? nullptr : statement.params[i].constData();
+    }
+    return PQsendQueryParams(connection->conn, statement.sql.constData(), values.size(),
+                             nullptr, values.constData(), nullptr, nullptr, 0);
+}
+
+// In pipeline mode every queued query that fits the depth goes out behind
+// the ones already running. Each ends with its own sync, so it costs no
+// round trip of its own and commits or rolls back alone. Without pipeline
+// support in libpq only the head is sent, its statements one by one between
+// BEGIN and COMMIT.
+void AsyncDatabase::startNext(Connection* connection){
+    if (connection->queue.size() <= connection->inFlight){
+        return;
+    }
+
+    if (connection->connecting){
+        return;
+    }
+    if (!connection->conn){
+        if (!startConnecting(connection)){
+            failConnection(connection, connection->connectError);
+        }
+        return;
+    }
+
+    bool sent = true;
+#ifdef LIBPQ_HAS_PIPELINING
+    int depth = qMin(int(connection->queue.size()), MAX_PIPELINE_DEPTH);
+    while (sent && connection->inFlight < depth){
+        const Pending& pending = connection->queue.at(connection->inFlight);
+        for (const Statement& statement: pending.statements){
+            sent = sent && sendStatement(connection, statement);
+        }
+        sent = sent && PQpipelineSync(connection->conn);
+        connection->inFlight++;
+    }
+#else
+    if (connection->inFlight > 0){
+        return;
+    }
+
+    connection->wire = connection->queue.head().statements;
+    connection->wrapped = false;
+    connection->rollingBack = false;
+    if (connection->wire.size() > 1){
+        connection->wire.prepend(makeStatement(Query{"BEGIN", {}}));
+        connection->wire.append(makeStatement(Query{"COMMIT", {}}));
+        connection->wrapped = true;
+    }
+    connection->results = QList<Result>(connection->wire.size());
+    connection->current = 0;
+    sent = sendStatement(connection, connection->wire.first());
+    connection->inFlight = 1;
+#endif
+
+    if (!sent){
+        failConnection(connection, QString::fromUtf8(PQerrorMessage(connection->conn)).trimmed());
+        return;
+    }
+    flushOutput(connection);
+}
+
+// A large statement may not fit the socket buffer; the rest goes out when the
+// socket becomes writable again. Reading stays enabled meanwhile, as libpq
+// requires.
+void AsyncDatabase::flushOutput(Connection* connection){
+    int status = PQflush(connection->conn);
+    if (status < 0){
+        failConnection(connection, QString::fromUtf8(PQerrorMessage(connection->conn)).trimmed());
+        return;
+    }
+    connection->writeNotifier->setEnabled(status == 1);
+}
+
+void AsyncDatabase::readResults(Connection* connection){
+    if (!PQconsumeInput(connection->conn)){
+        failConnection(connection, QString::fromUtf8(PQerrorMessage(connection->conn)).trimmed());
+        return;
+    }
+
+    while (connection->inFlight > 0 && !PQisBusy(connection->conn)){
+        handleResult(connection, PQgetResult(connection->conn));
+    }
+
+    // A callback may have failed the connection already.
+    if (!connection->conn){
+        return;
+    }
+    if (PQstatus(connection->conn) == CONNECTION_BAD){
+        failConnection(connection, QString::fromUtf8(PQerrorMessage(connection->conn)).trimmed());
+    }
+}
+
+// libpq ends the results of each statement with a null result; in pipeline
+// mode each query then ends with its sync.
+void AsyncDatabase::handleResult(Connection* connection, PGresult* result){
+#ifdef LIBPQ_HAS_PIPELINING
+    if (connection->results.isEmpty()){
+        connection->results = QList<Result>(connection->queue.head().statements.size());
+        connection->current = 0;
+    }
+    if (result && PQresultStatus(result) == PGRES_PIPELINE_SYNC){
+        PQclear(result);
+        complete(connection);
+    } else if (result){
+        collectResult(connection, result);
+    } else {
+        connection->current++;
+    }
+#else
+    if (result){
+        collectResult(connection, result);
+        return;
+    }
+
+    bool failed = !connection->results[connection->current].ok();
+    connection->current++;
+    if (connection->rollingBack || connection->current >= connection->wire.size()){
+        complete(connection);
+        return;
+    }
+
+    const Statement* next = &connection->wire[connection->current];
+    Statement rollback;
+    if (failed && connection->wrapped){
+        for (int i = connection->current; i < connection->wire.size(); i++){
+            connection->results[i].m_error = "Not executed: an earlier statement failed";
+        }
+        rollback = makeStatement(Query{"ROLLBACK", {}});
+        next = &rollback;
+        connection->rollingBack = true;
+    }
+
+    if (!sendStatement(connection, *next)){
+        failConnection(connection, QString::fromUtf8(PQerrorMessage(connection->conn)).trimmed());
+        return;
+    }
+    flushOutput(connection);
+#endif
+}
+
+// A statement yields one result; the first error wins if it yields more.
+void AsyncDatabase::collectResult(Connection* connection, PGresult* result){
+    Result& target = connection->results[qMin(connection->current, int(connection->results.size()) - 1)];
+    ExecStatusType status = PQresultStatus(result);
+    if (status != PGRES_TUPLES_OK && status != PGRES_COMMAND_OK){
+        if (target.m_error.isEmpty()){
+            target.m_error = status == PGRES_PIPELINE_ABORTED
+                             ? QString("Not executed: an earlier statement failed")
+                             : QString::fromUtf8(PQresultErrorMessage(result)).trimmed();
+        }
+        PQclear(result);
+        return;
+    }
+    target.m_result = std::shared_ptr<PGresult>(result, PQclear);
+}
+
+// The next query is sent before the callback runs, so the connection is not
+// idle while the caller builds its response.
+void AsyncDatabase::complete(Connection* connection){
+    Pending pending = connection->queue.dequeue();
+    connection->inFlight--;
+    QList<Result> results = connection->results;
+    if (connection->wrapped){
+        Result commit = results.takeLast();
+        results.removeFirst();
+        if (!commit.ok() && !connection->rollingBack){
+            for (Result& result: results){
+                result.m_error = commit.m_error;
+            }
+        }
+    }
+    connection->results.clear();
+    connection->wire.clear();
+    connection->wrapped = false;
+
+    startNext(connection);
+    invoke(pending, results);
+}
+
+// Everything queued on a broken connection fails; the connection is opened
+// again for the next query.
+void AsyncDatabase::failConnection(Connection* connection, const QString& error){
+    QQueue<Pending> failed;
+    failed.swap(connection->queue);
+    if (connection->conn && (connection->inFlight > 0 || PQstatus(connection->conn) == CONNECTION_BAD)){
+        qWarning() << "Async database connection lost:" << error;
+        closeConnection(connection);
+    }
+    connection->results.clear();
+    connection->wire.clear();
+
+    Result result;
+    result.m_error = error.isEmpty() ? QString("Database connection lost") : error;
+    for (const Pending& pending: std::as_const(failed)){
+        invoke(pending, QList<Result>(pending.statements.size(), result));
+    }
+}
+
+void AsyncDatabase::invoke(const Pending& pending, const QList<Result>& results){
+    if (pending.hasContext && !pending.context){
+        return;
+    }
+    if (pending.callback){
+        pending.callback(results);
+    }
+}
+
+int AsyncDatabase::pendingCount() const{
+    int count = 0;
+    for (const Connection* connection: allConnections()){
+        count += connection->queue.size();
+    }
+    return count;
+}
+
+void AsyncDatabase::getStations(const QString& search, QObject* context, std::function<void(const QList<Station>&)> callback){
+    QString sql = "SELECT * FROM stations ORDER BY name";
+    QVariantList params;
+    if (!search.isEmpty()){
+        sql = R"(
+            SELECT * FROM stations
+            WHERE LOWER(name) LIKE $1
+               OR LOWER(city) LIKE $1
+               OR LOWER(code) LIKE $1
+            ORDER BY name
+        )";
+        params << "%" + search.toLower() + "%";
+    }
+
+    execRead(sql, params, 0, context, [callback](const Result& result){
+        QList<Station> stations;
+        if (!result.ok()){
+            qDebug() << "Error getting stations:" << result.error();
+        }
+        for (int row = 0; row < result.rows(); row++){
+            Station station;
+            station.id = result.intValue(row, "id");
+            station.name = result.value(row, "name");
+            station.city = result.value(row, "city");
+            station.code = result.value(row, "code");
+            station.latitude = result.doubleValue(row, "latitude");
+            station.longitude = result.doubleValue(row, "longitude");
+            stations.append(station);
+        }
+        callback(stations);
+    });
+}
+
+void AsyncDatabase::searchTrains(int departureStationId, int arrivalStationId, const QDate& date, qint64 freshAfter, QObject* context
+                                 , std::function<void(bool ok, const QList<Database::SearchResult>&, qint64 freshAsOf)> callback){
+    execRead(TicketQueries::SEARCH_TRAINS, {departureStationId, arrivalStationId, date}, freshAfter, context, [callback, date](const Result& result){
+        QList<Database::SearchResult> results;
+        if (!result.ok()){
+            qDebug() << "Error searching trains:" << result.error();
+            callback(false, results, 0);
+            return;
+        }
+
+        for (int row = 0; row < result.rows(); row++){
+            Database::SearchResult found;
+            found.scheduleId = result.intValue(row, "schedule_id");
+            found.routeId = result.intValue(row, "route_id");
+            found.trainNumber = result.value(row, "train_number");
+            found.trainType = result.value(row, "train_type");
+            found.departureStationId = result.intValue(row, "dep_station_id");
+            found.departureStationName = result.value(row, "dep_station_name");
+            found.arrivalStationId = result.intValue(row, "arr_station_id");
+            found.arrivalStationName = result.value(row, "arr_station_name");
+
+            QTime depTime = result.timeValue(row, "dep_time");
+            QTime arrTime = result.timeValue(row, "arr_time");
+            found.departureTime = QDateTime(date, depTime);
+            found.arrivalTime = QDateTime(date, arrTime);
+            if (arrTime < depTime){
+                found.arrivalTime = found.arrivalTime.addDays(1);
+            }
+
+            found.travelTimeMinutes = found.departureTime.secsTo(found.arrivalTime) / 60;
+            found.minPrice = result.doubleValue(row, "min_price");
+            found.availableSeats = result.intValue(row, "available_seats");
+            results.append(found);
+        }
+        callback(true, results, result.freshAsOf());
+    });
+}
+
+// Availability uses the overlap predicate of Database::isSeatOccupiedInternal,
+// evaluated for every seat in one statement.
+void AsyncDatabase::getAvailableSeats(int scheduleId, int departureStationId, int arrivalStationId, qint64 freshAfter, QObject* context
+                                      , std::function<void(bool ok, const QList<Seat>&)> callback){
+    execRead(TicketQueries::availableSeats(), {scheduleId, departureStationId, arrivalStationId}, freshAfter, context, [callback](const Result& result){
+        QList<Seat> seats;
+        if (!result.ok()){
+            qDebug() << "Error getting seats:" << result.error();
+            callback(false, seats);
+            return;
+        }
+
+        for (int row = 0; row < result.rows(); row++){
+            Seat seat;
+            seat.id = result.intValue(row, "id");
+            seat.carriageId = result.intValue(row, "carriage_id");
+            seat.carriageNumber = result.intValue(row, "carriage_number");
+            seat.carriageType = result.value(row, "carriage_type");
+            seat.seatNumber = result.intValue(row, "seat_number");
+            seat.seatType = result.value(row, "seat_type");
+            seat.isAvailable = result.boolValue(row, "is_available");
+            seats.append(seat);
+        }
+        callback(true, seats);
+    });
+}
+
+void AsyncDatabase::getOccupiedSegments(const QList<QPair<int, int>>& seats, QObject* context
+                                        , std::function<void(bool ok, const QHash<QPair<int, int>, QList<QPair<int, int>>>& segments)> callback){
+    QStringList scheduleIds;
+    QStringList seatIds;
+    for (const QPair<int, int>& seat: seats){
+        scheduleIds << QString::number(seat.first);
+        seatIds << QString::number(seat.second);
+    }
+
+    QString sql = R"(
+        SELECT released.schedule_id, released.seat_id, tk.departure_station_id, tk.arrival_station_id
+        FROM unnest(CAST($1 AS integer[]), CAST($2 AS integer[])) AS released(schedule_id, seat_id)
+        JOIN schedules sch ON sch.id = released.schedule_id
+        JOIN tickets tk ON tk.schedule_id = released.schedule_id
+                       AND tk.seat_id = released.seat_id
+                       AND tk.departure_date = sch.departure_date
+                       AND tk.status IN ('booked', 'paid')
+    )";
+
+    QVariantList params{QString("{%1}").arg(scheduleIds.join(',')), QString("{%1}").arg(seatIds.join(','))};
+    exec(sql, params, context, [callback](const Result& result){
+        QHash<QPair<int, int>, QList<QPair<int, int>>> segments;
+        if (!result.ok()){
+            qDebug() << "Error getting occupied segments:" << result.error();
+            callback(false, segments);
+            return;
+        }
+
+        for (int row = 0; row < result.rows(); row++){
+            QPair<int, int> seat(result.intValue(row, "schedule_id"), result.intValue(row, "seat_id"));
+            segments[seat].append(qMakePair(result.intValue(row, "departure_station_id"),
+                                            result.intValue(row, "arrival_station_id")));
+        }
+        callback(true, segments);
+    });
+}
+
+void AsyncDatabase::getUserTicket(int userId, const QString& ticketNumber, QObject* context
+                                  , std::function<void(bool ok, const Ticket&, const QString& error)> callback){
+    exec("SELECT * FROM tickets WHERE ticket_number = $1", {ticketNumber}, context, [userId, callback](const Result& result){
+        Ticket ticket;
+        ticket.id = -1;
+        if (!result.ok()){
+            callback(false, ticket, result.error());
+            return;
+        }
+        if (result.rows() == 0){
+            callback(false, ticket, "Ticket not found");
+            return;
+        }
+        if (result.intValue(0, "user_id") != userId){
+            callback(false, ticket, "Access denied");
+            return;
+        }
+
+        callback(true, ticketFromResult(result, 0), QString());
+    });
+}
+
+// The ticket is looked up separately from the update so a refusal can say
+// why without another round trip; the update repeats the owner and status
+// conditions so a concurrent change is re-checked on the locked row.
+void AsyncDatabase::payTicket(int userId, const QString& ticketNumber, const QString& ipAddress, QObject* context
+                              , std::function<void(bool ok, const TicketFullInfo& info, const QString& error)> callback){
+    QString sql = QString(R"(
+        WITH target AS (
+            SELECT id, departure_date, user_id, status FROM tickets
+            WHERE ticket_number = $1
+        ), paid AS (
+            UPDATE tickets tk
+            SET status = 'paid', paid_at = CURRENT_TIMESTAMP
+            FROM target
+            WHERE tk.id = target.id AND tk.departure_date = target.departure_date
+              AND tk.user_id = $2 AND tk.status = 'booked'
+            RETURNING tk.*
+        ), logged AS (
+            INSERT INTO audit_logs (user_id, action, ip_address, details, success)
+            SELECT user_id, 'ticket_paid', CAST($3 AS varchar), ticket_number, TRUE FROM paid
+        )
+        SELECT target.user_id AS owner_id, target.status AS current_status,
+               EXISTS (SELECT 1 FROM paid) AS changed, details.*
+        FROM (SELECT 1) one
+        LEFT JOIN target ON TRUE
+        LEFT JOIN (%1) details ON TRUE
+    )").arg(Database::ticketDetailsSql("paid"));
+    QVariantList params{ticketNumber, userId, ipAddress.isEmpty() ? QVariant() : QVariant(ipAddress)};
+
+    exec(sql, params, context, [userId, ticketNumber, callback](const Result& result){
+        TicketFullInfo info;
+        info.ticket.id = -1;
+        if (!result.ok() || result.rows() == 0){
+            callback(false, info, result.error());
+            return;
+        }
+        if (!result.boolValue(0, "changed")){
+            QVariant ownerId = result.isNull(0, "owner_id") ? QVariant() : QVariant(result.intValue(0, "owner_id"));
+            callback(false, info, Database::ticketAccessError(ownerId, result.value(0, "current_status"), userId, "paid"));
+            return;
+        }
+
+        if (!result.isNull(0, "id")){
+            info = ticketFullInfoFromResult(result, 0);
+        }
+        Database::instance().notifyTicketPaid(ticketNumber);
+        qDebug() << "Ticket paid:" << ticketNumber;
+        callback(true, info, QString());
+    });
+}
+
+Ticket AsyncDatabase::ticketFromResult(const Result& result, int row){
+    Ticket ticket;
+    ticket.id = result.intValue(row, "id");
+    ticket.userId = result.intValue(row, "user_id");
+    ticket.scheduleId = result.intValue(row, "schedule_id");
+    ticket.seatId = result.intValue(row, "seat_id");
+    ticket.departureStationId = result.intValue(row, "departure_station_id");
+    ticket.arrivalStationId = result.intValue(row, "arrival_station_id");
+    ticket.ticketNumber = result.value(row, "ticket_number");
+    ticket.price = result.doubleValue(row, "price");
+    ticket.status = result.value(row, "status");
+    ticket.bookedAt = result.dateTimeValue(row, "booked_at");
+    ticket.paidAt = result.dateTimeValue(row, "paid_at");
+    ticket.cancelledAt = result.dateTimeValue(row, "cancelled_at");
+    ticket.passengerName = result.value(row, "passenger_name");
+    ticket.passengerDocument = result.value(row, "passenger_document");
+    return ticket;
+}
+
+TicketFullInfo AsyncDatabase::ticketFullInfoFromResult(const Result& result, int row){
+    TicketFullInfo info;
+    info.ticket = ticketFromResult(result, row);
+
+    info.trainNumber = result.value(row, "train_number");
+    info.trainType = result.value(row, "train_type");
+    info.departureStationName = result.value(row, "dep_station_name");
+    info.arrivalStationName = result.value(row, "arr_station_name");
+
+    QTime depTime = result.timeValue(row, "departure_time");
+    QTime arrTime = result.timeValue(row, "arrival_time");
+    QDate scheduleDate = result.dateValue(row, "departure_date");
+
+    info.departureTime = QDateTime(scheduleDate, depTime);
+    info.arrivalTime = QDateTime(scheduleDate, arrTime);
+    if (arrTime < depTime){
+        info.arrivalTime = info.arrivalTime.addDays(1);
+    }
+
+    info.carriageNumber = result.intValue(row, "carriage_number");
+    info.seatNumber = result.intValue(row, "seat_number");
+    return info;
+}
+
+static AsyncDatabase::Query auditQuery(int userId, const QString& action, const QString& ip, const QString& details, bool success){
+    return AsyncDatabase::Query{R"(
+                                    INSERT INTO audit_logs (user_id, action, ip_address, details, success)
+                                    VALUES ($1, $2, $3, $4, $5)
+                                )", {userId > 0 ? QVariant(userId) : QVariant(),
+                                     action,
+                                     ip.isEmpty() ? QVariant() : QVariant(ip),
+                                     details,
+                                     success}};
+}
+
+void AsyncDatabase::login(const QString& email, const QString& password, const QString& ipAddress, QObject* context
+                          , std::function<void(bool ok, const User&, const QString& sessionToken, const QString& error)> callback){
+    QString normalized = email.toLower().trimmed();
+    QString userSql = R"(
+        SELECT id, name, surname, email, password_hash, password_salt,
+               created_at, is_verified, last_login,
+               failed_login_attempts, locked_until,
+               COALESCE(locked_until > CURRENT_TIMESTAMP, false) AS locked
+        FROM users
+        WHERE email = $1
+    )";
+
+    exec(userSql, {normalized}, context, [=](const Result& result){
+        User user;
+        user.id = -1;
+        if (!result.ok()){
+            callback(false, user, QString(), result.error());
+            return;
+        }
+        if (result.rows() == 0){
+            callback(false, user, QString(), "Invalid email or password");
+            return;
+        }
+
+        user.id = result.intValue(0, "id");
+        user.name = result.value(0, "name");
+        user.surname = result.value(0, "surname");
+        user.email = result.value(0, "email");
+        user.passwordHash = result.value(0, "password_hash");
+        user.passwordSalt = result.value(0, "password_salt");
+        user.createdAt = result.dateTimeValue(0, "created_at");
+        user.isVerified = result.boolValue(0, "is_verified");
+        user.lastLogin = result.dateTimeValue(0, "last_login");
+        user.failedLoginAttempts = result.intValue(0, "failed_login_attempts");
+        user.lockedUntil = result.dateTimeValue(0, "locked_until");
+
+        if (!user.isVerified){
+            callback(false, user, QString(), "Please verify your email first");
+            return;
+        }
+
+        bool locked = result.boolValue(0, "locked");
+        if (locked || user.failedLoginAttempts >= Database::MAX_FAILED_ATTEMPTS){
+            QList<Query> writes;
+            if (!locked){
+                QDateTime lockUntil = QDateTime::currentDateTime().addSecs(Database::LOCKOUT_DURATION_MINUTES * 60);
+                writes << Query{"UPDATE users SET locked_until = $1 WHERE id = $2", {lockUntil, user.id}}
+                       << auditQuery(-1, "account_locked", "", QString("Account locked until %1").arg(lockUntil.toString()), false);
+                qDebug() << "Account locked:" << email << "until" << lockUntil.toString();
+            }
+            writes << auditQuery(-1, "login_blocked", "", email, false)
+                   << auditQuery(-1, "login_failed", ipAddress, email, false);
+            qWarning() << "Login attempt to locked account:" << email;
+            Database::instance().notifyLoginBlocked(email, !locked);
+
+            execPipeline(writes, context, [callback, user](const QList<Result>& results){
+                if (!results.first().ok()){
+                    qWarning() << "Error recording failed login:" << results.first().error();
+                }
+                callback(false, user, QString(), "Account is temporarily locked due to multiple failed login settings");
+            });
+            return;
+        }
+
+        // The hash is deliberately slow, so it would stall every client if
+        // it ran on the event loop.
+        QPointer<QObject> guard(context);
+        bool hasContext = context != nullptr;
+        QThreadPool::globalInstance()->start([this, user, password, email, ipAddress, guard, hasContext, callback](){
+            bool matches = user.passwordHash == Database::hashPassword(password, user.passwordSalt);
+            QMetaObject::invokeMethod(this, [=](){
+                finishLogin(user, matches, email, ipAddress, guard, hasContext, callback);
+            }, Qt::QueuedConnection);
+        });
+    });
+}
+
+// Back on the owning thread with the outcome of the hash. The writes are
+// made even if the context went away meanwhile; only the callback is dropped.
+// A wrong password leaves two login_failed rows, as it always has: the one
+// checkPassword writes for the user and the one handleLogin wrote with the
+// address.
+void AsyncDatabase::finishLogin(const User& user, bool passwordMatches, const QString& email, const QString& ipAddress
+                                , QPointer<QObject> context, bool hasContext
+                                , std::function<void(bool ok, const User&, const QString& sessionToken, const QString& error)> callback){
+    auto deliver = [context, hasContext, callback](bool ok, const User& user, const QString& sessionToken, const QString& error){
+        if (!hasContext || context){
+            callback(ok, user, sessionToken, error);
+        }
+    };
+
+    QList<Query> writes;
+    if (!passwordMatches){
+        writes << Query{"UPDATE users SET failed_login_attempts = failed_login_attempts + 1 WHERE id = $1", {user.id}}
+               << auditQuery(user.id, "login_failed", "", "Incorrect password", false)
+               << auditQuery(-1, "login_failed", ipAddress, email, false);
+        execPipeline(writes, this, [deliver, user](const QList<Result>& results){
+            if (!results.first().ok()){
+                qWarning() << "Error recording failed login:" << results.first().error();
+            }
+            deliver(false, user, QString(), "Invalid email or password");
+        });
+        return;
+    }
+
+    QString sessionToken = Database::generateToken(32);
+    writes << Query{R"(
+                        UPDATE users
+                        SET failed_login_attempts = 0, locked_until = NULL, last_login = CURRENT_TIMESTAMP
+                        WHERE id = $1
+                    )", {user.id}}
+           << Query{R"(
+                        INSERT INTO sessions (user_id, session_token, ip_address, user_agent, expires_at)
+                        VALUES ($1, $2, $3, 'ApiClient', CURRENT_TIMESTAMP + make_interval(hours => $4))
+                    )", {user.id, sessionToken, ipAddress, Database::SESSION_LIFETIME_HOURS}}
+           << auditQuery(user.id, "login", ipAddress, "Successful login", true);
+
+    execPipeline(writes, this, [deliver, user, sessionToken](const QList<Result>& results){
+        for (const Result& result: results){
+            if (!result.ok()){
+                qDebug() << "Error creating session:" << result.error();
+                deliver(false, user, QString(), "Failed to create session");
+                return;
+            }
+        }
+        qDebug() << "Session created for user:" << user.id;
+        deliver(true, user, sessionToken, QString());
+    });
+}
@@ -0,0 +1,277 @@
+#ifndef ASYNCDATABASE_H
+#define ASYNCDATABASE_H
+
+#include <QObject>
+#include <QPointer>
+#include <QQueue>
+#include <QHash>
+#include <QPair>
+#include <QList>
+#include <QVariant>
+#include <QDateTime>
+#include <functional>
+#include <memory>
+#include <libpq-fe.h>
+#include "database.h"
+
+class QSocketNotifier;
+class QTimer;
+
+// Queries on a small pool of libpq connections in non-blocking mode. The
+// event loop watches each connection's socket, so a query costs no thread
+// and no wait: the caller hands over a callback and returns. Each connection
+// stays in pipeline mode and keeps up to MAX_PIPELINE_DEPTH queries on the
+// wire behind one another, so a pool of a few connections serves many
+// concurrent clients without queueing them one round trip at a time. Callbacks run
+// on the thread that owns AsyncDatabase once the whole result is in; one
+// whose context object has been destroyed is dropped. Parameters are sent
+// separately from the statement text ($1, $2, ...), always as text.
+//
+// Reads that tolerate stale data may go to streaming replicas listed in the
+// configuration. Each replica's lag is measured against the primary's WAL
+// position once a second; a replica is used only while it is within the
+// allowed lag and has replayed everything the caller needs to see.
+class AsyncDatabase : public QObject{
+    Q_OBJECT
+
+public:
+    class Result {
+    public:
+        bool ok() const { return m_error.isEmpty(); }
+        QString error() const { return m_error; }
+        int rows() const;
+
+        bool isNull(int row, const char* column) const;
+        QString value(int row, const char* column) const;
+        int intValue(int row, const char* column) const;
+        double doubleValue(int row, const char* column) const;
+        bool boolValue(int row, const char* column) const;
+        QDateTime dateTimeValue(int row, const char* column) const;
+        QDate dateValue(int row, const char* column) const;
+        QTime timeValue(int row, const char* column) const;
+
+        // The data reflects every commit on the primary before this moment,
+        // in milliseconds since the epoch.
+        qint64 freshAsOf() const { return m_freshAsOf; }
+
+    private:
+        friend class AsyncDatabase;
+        int columnIndex(const char* column) const;
+
+        std::shared_ptr<PGresult> m_result;
+        QString m_error;
+        qint64 m_freshAsOf = 0;
+    };
+
+    struct ReplicaStatus {
+        QString name;
+        bool usable;
+        qint64 lagMs;
+        quint64 reads;
+    };
+
+    struct Query {
+        QString sql;
+        QVariantList params;
+    };
+
+    using Callback = std::function<void(const Result&)>;
+    using PipelineCallback = std::function<void(const QList<Result>&)>;
+
+    static AsyncDatabase& instance();
+
+    bool connect(const QString& host
+                 , int port
+                 , const QString& dbName
+                 , const QString& username
+                 , const QString& password
+                 , int connections = DEFAULT_CONNECTIONS);
+    bool connectFromConfig(const QString& configPath = "config/database.conf");
+    void disconnect();
+    bool isConnected() const { return !m_connections.isEmpty(); }
+
+    // A streaming replica of the primary, with the primary's database and
+    // credentials. Call after connect.
+    bool addReplica(const QString& host, int port, int connections = DEFAULT_CONNECTIONS);
+    void setMaxReplicaLag(int milliseconds);
+    QList<ReplicaStatus> replicaStatus() const;
+    quint64 primaryReads() const { return m_primaryReads; }
+
+    void exec(const QString& sql, const QVariantList& params, QObject* context, Callback callback);
+    // Runs the queries as one transaction in a single round trip: either all
+    // of them take effect or none does, and the callback gets one result per
+    // query. After a failure the later queries report that they did not run.
+    void execPipeline(const QList<Query>& queries, QObject* context, PipelineCallback callback);
+    // A read that may be answered by a replica, provided the replica has
+    // replayed every commit made before freshAfter (milliseconds since the
+    // epoch, 0 for any). Falls back to the primary when no replica
+    // qualifies or the replica fails.
+    void execRead(const QString& sql, const QVariantList& params, qint64 freshAfter, QObject* context, Callback callback);
+
+    int pendingCount() const;
+    QString lastError() const { return m_lastError; }
+
+    void getStations(const QString& search
+                     , QObject* context
+                     , std::function<void(const QList<Station>&)> callback);
+    // TicketQueries::SEARCH_TRAINS and availableSeats, read through execRead.
+    void searchTrains(int departureStationId
+                      , int arrivalStationId
+                      , const QDate& date
+                      , qint64 freshAfter
+                      , QObject* context
+                      , std::function<void(bool ok, const QList<Database::SearchResult>&, qint64 freshAsOf)> callback);
+    void getAvailableSeats(int scheduleId
+                           , int departureStationId
+                           , int arrivalStationId
+                           , qint64 freshAfter
+                           , QObject* context
+                           , std::function<void(bool ok, const QList<Seat>&)> callback);
+    // The segments booked or paid tickets still hold on each (schedule, seat)
+    // pair, as (departure station, arrival station) pairs. One query, on the
+    // primary, so it sees every change committed before the call.
+    void getOccupiedSegments(const QList<QPair<int, int>>& seats
+                             , QObject* context
+                             , std::function<void(bool ok, const QHash<QPair<int, int>, QList<QPair<int, int>>>& segments)> callback);
+    // Same rules and messages as Database::getUserTicket.
+    void getUserTicket(int userId
+                       , const QString& ticketNumber
+                       , QObject* context
+                       , std::function<void(bool ok, const Ticket&, const QString& error)> callback);
+    // Ownership check, state change, audit record and the details for the
+    // PDF ticket in one statement. Acts only on a ticket of userId; on
+    // refusal error says whether the ticket is missing, someone else's or
+    // not booked. info.ticket.id is -1 if the trip could not be resolved.
+    void payTicket(int userId
+                   , const QString& ticketNumber
+                   , const QString& ipAddress
+                   , QObject* context
+                   , std::function<void(bool ok, const TicketFullInfo& info, const QString& error)> callback);
+    // Checks the password and opens a session: one round trip for the user
+    // row, whose salt the hash needs, and one pipeline for everything the
+    // outcome writes. The hash itself runs on the global thread pool. Same
+    // rules, messages and signals as Database::checkPassword, and the same
+    // audit rows checkPassword and the synchronous LOGIN handler wrote
+    // between them, details carrying the email as the client sent it.
+    void login(const QString& email
+               , const QString& password
+               , const QString& ipAddress
+               , QObject* context
+               , std::function<void(bool ok, const User&, const QString& sessionToken, const QString& error)> callback);
+
+private:
+    AsyncDatabase() = default;
+    ~AsyncDatabase();
+    AsyncDatabase(const AsyncDatabase&) = delete;
+    AsyncDatabase& operator=(const AsyncDatabase&) = delete;
+
+    struct Statement {
+        QByteArray sql;
+        QList<QByteArray> params;
+        QList<bool> nulls;
+    };
+
+    struct Pending {
+        QList<Statement> statements;
+        QPointer<QObject> context;
+        bool hasContext;
+        PipelineCallback callback;
+    };
+
+    // The first inFlight entries of the queue have been sent; results always
+    // belong to the head. Without pipeline support in libpq only the head is
+    // sent, and wire holds its statements wrapped in BEGIN and COMMIT.
+    struct Connection {
+        QByteArray connectionString;
+        PGconn* conn = nullptr;
+        QSocketNotifier* readNotifier = nullptr;
+        QSocketNotifier* writeNotifier = nullptr;
+        QTimer* connectTimer = nullptr;
+        bool connecting = false;
+        qint64 retryAt = 0;
+        QString connectError;
+        QQueue<Pending> queue;
+        int inFlight = 0;
+        QList<Statement> wire;
+        QList<Result> results;
+        int current = 0;
+        bool wrapped = false;
+        bool rollingBack = false;
+    };
+
+    // caughtUpTo is the latest moment whose primary WAL position the
+    // replica is known to have replayed.
+    struct Replica {
+        QString name;
+        QList<Connection*> connections;
+        bool inRecovery = false;
+        bool probing = false;
+        qint64 caughtUpTo = 0;
+        qint64 retryAt = 0;
+        quint64 reads = 0;
+    };
+
+    struct WalSample {
+        qint64 takenAt;
+        quint64 lsn;
+    };
+
+    static const int DEFAULT_CONNECTIONS = 4;
+    static const int MAX_PIPELINE_DEPTH = 64;
+    static const int DEFAULT_MAX_REPLICA_LAG_MS = 5000;
+    static const int LAG_PROBE_INTERVAL_MS = 1000;
+    static const int WAL_SAMPLE_WINDOW_MS = 60000;
+    static const int REPLICA_RETRY_INTERVAL_MS = 30000;
+    static const int CONNECT_TIMEOUT_MS = 10000;
+    static const int RECONNECT_INTERVAL_MS = 1000;
+
+    QByteArray connectionString(const QString& host, int port) const;
+    bool openPool(const QString& host, int port, int connections, QList<Connection*>* pool);
+    bool openConnection(Connection* connection);
+    bool prepareConnection(Connection* connection);
+    bool startConnecting(Connection* connection);
+    void pollConnection(Connection* connection);
+    void connectFailed(Connection* connection, const QString& error);
+    void watchSocket(Connection* connection);
+    void dropNotifiers(Connection* connection);
+    void closeConnection(Connection* connection);
+    QList<Connection*> allConnections() const;
+    static Connection* pickConnection(const QList<Connection*>& pool);
+    void enqueue(const QList<Connection*>& pool, Pending pending);
+    Replica* pickReplica(qint64 freshAfter) const;
+    void readOnPrimary(const QString& sql, const QVariantList& params, QObject* context, Callback callback);
+    void probeReplicaLag();
+    static quint64 parseLsn(const QString& text);
+    static Statement makeStatement(const Query& query);
+    bool sendStatement(Connection* connection, const Statement& statement);
+    void startNext(Connection* connection);
+    void flushOutput(Connection* connection);
+    void readResults(Connection* connection);
+    void handleResult(Connection* connection, PGresult* result);
+    void collectResult(Connection* connection, PGresult* result);
+    void complete(Connection* connection);
+    void failConnection(Connection* connection, const QString& error);
+    static void invoke(const Pending& pending, const QList<Result>& results);
+    static Ticket ticketFromResult(const Result& result, int row);
+    static TicketFullInfo ticketFullInfoFromResult(const Result& result, int row);
+    void finishLogin(const User& user
+                     , bool passwordMatches
+                     , const QString& email
+                     , const QString& ipAddress
+                     , QPointer<QObject> context
+                     , bool hasContext
+                     , std::function<void(bool ok, const User&, const QString& sessionToken, const QString& error)> callback);
+
+    QString m_dbName;
+    QString m_username;
+    QString m_password;
+    QList<Connection*> m_connections;
+    QList<Replica*> m_replicas;
+    QList<WalSample> m_walSamples;
+    QTimer* m_lagTimer = nullptr;
+    int m_maxReplicaLagMs = DEFAULT_MAX_REPLICA_LAG_MS;
+    quint64 m_primaryReads = 0;
+    QString m_lastError;
+};
+
+#endif // ASYNCDATABASE_H
@@ -2,17 +2,134 @@
 #include <QDebug>
 #include <QSettings>
 #include <QSqlRecord>
+#include <QSqlDriver>
 #include <QFile>
 #include <QVariant>
 #include <QRegularExpression>
 #include <QUuid>
-
-Database::Database(){
+#include <QSet>
+#include <QElapsedTimer>
+#include "searchcache.h"
+#include "warmsnapshot.h"
+#include "copystream.h"
+#include "ticketqueries.h"
+#include "ticketkey.h"
+
+Database::Database()
+    : m_searchCache(new SearchCache())
+    , m_referenceDataVersion(-1)
+{
     m_db = QSqlDatabase::addDatabase("QPSQL");
 }
 
 Database::~Database(){
     disconnect();
+    delete m_searchCache;
+}
+
+SearchCache& Database::searchCache(){
+    return *m_searchCache;
+}
+
+// The reference data version is bumped by triggers on every table search
+// results are derived from, so any insert, update or delete there discards
+// the whole snapshot; seat sales are handled per schedule through
+// tickets.updated_at.
+bool Database::snapshotStateInternal(QDateTime* now, QString* referenceFingerprint){
+    QSqlQuery query(m_db);
+    bool success = query.exec(R"(
+        SELECT clock_timestamp()::timestamp AS now,
+               (SELECT version FROM reference_data_version WHERE id)::text AS fingerprint
+    )");
+
+    if (!success || !query.next()){
+        m_lastError = query.lastError().text();
+        return false;
+    }
+
+    *now = query.value("now").toDateTime();
+    *referenceFingerprint = query.value("fingerprint").toString();
+    return true;
+}
+
+bool Database::saveWarmSnapshot(const QString& path){
+    QMutexLocker locker(&m_mutex);
+    if (!isConnectedInternal()) return false;
+
+    WarmSnapshot::Mark mark;
+    mark.schemaVersion = schemaVersionInternal();
+    if (!snapshotStateInternal(&mark.writtenAt, &mark.referenceFingerprint)){
+        qDebug() << "Warm-start snapshot skipped:" << m_lastError;
+        return false;
+    }
+    // Tickets written by transactions still open at this instant carry an
+    // earlier timestamp, so the delta on load starts a little before it.
+    mark.ticketsMark = mark.writtenAt.addSecs(-SNAPSHOT_CLOCK_MARGIN_SECONDS);
+
+    QList<SearchCache::SnapshotEntry> entries = m_searchCache->snapshotEntries();
+    QString error;
+    if (!WarmSnapshot::write(path, mark, entries, &error)){
+        qDebug() << "Failed to write warm-start snapshot:" << error;
+        return false;
+    }
+
+    qDebug() << "Warm-start snapshot written:" << entries.size() << "search results to" << path;
+    return true;
+}
+
+bool Database::loadWarmSnapshot(const QString& path){
+    if (!QFile::exists(path)){
+        return false;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    WarmSnapshot::Mark mark;
+    QList<SearchCache::SnapshotEntry> entries;
+    QString error;
+    if (!WarmSnapshot::read(path, &mark, &entries, &error)){
+        qDebug() << "Ignoring warm-start snapshot:" << error;
+        return false;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    if (!isConnectedInternal()) return false;
+
+    QDateTime now;
+    QString fingerprint;
+    if (mark.schemaVersion != schemaVersionInternal()
+        || !snapshotStateInternal(&now, &fingerprint)
+        || fingerprint != mark.referenceFingerprint){
+        qDebug() << "Ignoring warm-start snapshot: reference data changed since it was written";
+        return false;
+    }
+
+    qint64 downtimeMs = qMax<qint64>(0, mark.writtenAt.msecsTo(now));
+    for (SearchCache::SnapshotEntry& entry: entries){
+        entry.ageMs += downtimeMs;
+    }
+    int restored = m_searchCache->restore(entries);
+
+    QSqlQuery query(m_db);
+    query.prepare("SELECT DISTINCT schedule_id FROM tickets WHERE updated_at > :mark");
+    query.bindValue(":mark", mark.ticketsMark);
+    if (!query.exec()){
+        m_lastError = query.lastError().text();
+        qDebug() << "Cannot replay ticket changes, dropping warm-start snapshot:" << m_lastError;
+        m_searchCache->invalidateAll();
+        return false;
+    }
+
+    int changedSchedules = 0;
+    while (query.next()){
+        m_searchCache->bumpScheduleVersion(query.value(0).toInt());
+        changedSchedules++;
+    }
+
+    qDebug() << "Warm start:" << restored << "search results restored," << changedSchedules
+             << "schedules changed while down, in" << timer.elapsed() << "ms";
+    return true;
 }
 
 Database& Database::instance(){
@@ -43,9 +160,46 @@ bool Database::connect(const QString& host, int port, const QString& dbName, con
     }
     qDebug() << "Succesfull connection to PostgreSQL";
 
-    if (!initializeTables()){
-        qDebug() << "Warning: failed to initialize tables";
+    if (!migrateSchema()){
+        qDebug() << "Warning: failed to migrate database schema";
+    }
+
+    // The reference data triggers notify on this channel, so an import run
+    // by another process reaches this server's cache right after it commits.
+    if (m_db.driver()->subscribeToNotification("reference_data_changed")){
+        QObject::connect(m_db.driver(), &QSqlDriver::notification, this, &Database::onNotification, Qt::UniqueConnection);
+    } else {
+        qWarning() << "Cannot listen for reference data changes:" << m_db.driver()->lastError().text();
+    }
+    refreshReferenceDataVersion();
+    return true;
+}
+
+void Database::onNotification(const QString& name, QSqlDriver::NotificationSource source, const QVariant& payload){
+    Q_UNUSED(source);
+    Q_UNUSED(payload);
+    if (name == "reference_data_changed"){
+        refreshReferenceDataVersion();
+    }
+}
+
+bool Database::refreshReferenceDataVersion(){
+    QMutexLocker locker(&m_mutex);
+    if (!isConnectedInternal()) return false;
+
+    QSqlQuery query(m_db);
+    if (!query.exec("SELECT version FROM reference_data_version WHERE id") || !query.next()){
+        m_lastError = query.lastError().text();
+        qDebug() << "Error reading reference data version:" << m_lastError;
+        return false;
+    }
+
+    qint64 version = query.value(0).toLongLong();
+    if (m_referenceDataVersion >= 0 && version != m_referenceDataVersion){
+        m_searchCache->invalidateAll();
+        qDebug() << "Reference data changed (version" << version << "), search cache cleared";
     }
+    m_referenceDataVersion = version;
     return true;
 }
 
@@ -91,251 +245,101 @@ bool Database::isConnected() const{
     return isConnectedInternal();
 }
 
-bool Database::initializeTables(){
-    QSqlQuery query(m_db);
-
-    QString createUsersTable = R"(
-        CREATE TABLE IF NOT EXISTS users (
-            id SERIAL PRIMARY KEY,
-            name VARCHAR(100) NOT NULL,
-            surname VARCHAR(100) NOT NULL,
-            email VARCHAR(255) UNIQUE NOT NULL,
-            password_hash VARCHAR(255) NOT NULL,
-            password_salt VARCHAR(32) NOT NULL,
-            created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
-            is_verified BOOLEAN DEFAULT FALSE,
-            last_login TIMESTAMP,
-            failed_login_attempts INTEGER DEFAULT 0,
-            locked_until TIMESTAMP,
-            CONSTRAINT email_format CHECK (email ~* '^[A-Za-z0-9._%+-]+@[A-Za-z0-9.-]+\.[A-Z|a-z]{2,}$')
-        )
-    )";
+// Fast path: one single-row read. Only when the recorded version is behind
+// does the server take the advisory lock, so several instances starting at
+// once apply each migration exactly once and the rest wait, then re-check.
+bool Database::migrateSchema(){
+    QElapsedTimer timer;
+    timer.start();
 
-    if (!query.exec(createUsersTable)){
-        m_lastError = query.lastError().text();
-        qDebug() << "Error during creating table 'users':" << m_lastError;
-        return false;
+    int latest = Migrations::latestVersion();
+    int current = schemaVersionInternal();
+    if (current == latest){
+        qDebug() << "Schema is up to date (version" << current << ") checked in" << timer.elapsed() << "ms";
+        return true;
+    }
+    if (current > latest){
+        qWarning() << "Database schema version" << current << "is newer than this server knows (" << latest << ")";
+        return true;
     }
 
-    QString createAuditTable = R"(
-        CREATE TABLE IF NOT EXISTS audit_logs (
-            id SERIAL PRIMARY KEY,
-            user_id INTEGER REFERENCES users(id) ON DELETE SET NULL,
-            action VARCHAR(100) NOT NULL,
-            ip_address VARCHAR(45),
-            timestamp TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
-            details TEXT,
-            success BOOLEAN DEFAULT TRUE
-        )
-    )";
-
-    if (!query.exec(createAuditTable)){
+    QSqlQuery query(m_db);
+    if (!query.exec(QString("SELECT pg_advisory_lock(%1)").arg(SCHEMA_LOCK_KEY))){
         m_lastError = query.lastError().text();
-        qDebug() << "Error during creating table 'audit_logs':" << m_lastError;
+        qDebug() << "Error acquiring schema lock:" << m_lastError;
         return false;
     }
 
-    QString createStationsTable = R"(
-        CREATE TABLE IF NOT EXISTS stations (
-            id SERIAL PRIMARY KEY,
-            name VARCHAR(255) NOT NULL,
-            city VARCHAR(100) NOT NULL,
-            code VARCHAR(10) UNIQUE NOT NULL,
-            latitude DOUBLE PRECISION NOT NULL,
-            longitude DOUBLE PRECISION NOT NULL,
-            created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
+    bool success = query.exec(R"(
+        CREATE TABLE IF NOT EXISTS schema_version (
+            id BOOLEAN PRIMARY KEY DEFAULT TRUE CHECK (id),
+            version INTEGER NOT NULL,
+            updated_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
         )
-    )";
-
-    if (!query.exec(createStationsTable)){
+    )");
+    if (!success){
         m_lastError = query.lastError().text();
-        qDebug() << "Error during creating table 'stations':" << m_lastError;
-        return false;
+        qDebug() << "Error creating table 'schema_version':" << m_lastError;
     }
 
-    QString createSessionsTable = R"(
-        CREATE TABLE IF NOT EXISTS sessions (
-            id SERIAL PRIMARY KEY,
-            user_id INTEGER NOT NULL REFERENCES users(id) ON DELETE CASCADE,
-            session_token VARCHAR(64) UNIQUE NOT NULL,
-            ip_address VARCHAR(45),
-            user_agent TEXT,
-            created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
-            expires_at TIMESTAMP NOT NULL,
-            is_active BOOLEAN DEFAULT TRUE
-        )
-    )";
-
-    if (!query.exec(createSessionsTable)){
-        m_lastError = query.lastError().text();
-        qDebug() << "Error during creating table 'sessions':" << m_lastError;
-        return false;
+    current = success ? schemaVersionInternal() : current;
+    for (const Migrations::Migration& migration: Migrations::all()){
+        if (!success || migration.version <= current){
+            continue;
+        }
+        success = applyMigrationInternal(migration);
+        if (success){
+            current = migration.version;
+        }
     }
 
-    QString createVerificationCodesTable = R"(
-        CREATE TABLE IF NOT EXISTS verification_codes (
-            id SERIAL PRIMARY KEY,
-            user_id INTEGER NOT NULL REFERENCES users(id) ON DELETE CASCADE,
-            email VARCHAR(255) NOT NULL,
-            code VARCHAR(6) NOT NULL,
-            created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
-            expires_at TIMESTAMP NOT NULL,
-            is_used BOOLEAN DEFAULT FALSE
-        )
-    )";
+    query.exec(QString("SELECT pg_advisory_unlock(%1)").arg(SCHEMA_LOCK_KEY));
 
-    if (!query.exec(createVerificationCodesTable)){
-        m_lastError = query.lastError().text();
-        qDebug() << "Error during creating table 'verification_codes':" << m_lastError;
-        return false;
+    if (success){
+        qDebug() << "Schema migrated to version" << current << "in" << timer.elapsed() << "ms";
     }
+    return success;
+}
 
-    QString createTrainsTable = R"(
-        CREATE TABLE IF NOT EXISTS trains (
-            id SERIAL PRIMARY KEY,
-            train_number VARCHAR(20) UNIQUE NOT NULL,
-            train_type VARCHAR(50) NOT NULL,
-            total_seats INTEGER NOT NULL,
-            is_active BOOLEAN DEFAULT TRUE,
-            created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
-        )
-    )";
-    if (!query.exec(createTrainsTable)){
-        m_lastError = query.lastError().text();
-        qDebug() << "Error during creating table 'trains':" << m_lastError;
-        return false;
+int Database::schemaVersionInternal(){
+    QSqlQuery query(m_db);
+    if (!query.exec("SELECT version FROM schema_version WHERE id") || !query.next()){
+        return 0;
     }
+    return query.value(0).toInt();
+}
 
-    QString createCarriagesTable = R"(
-        CREATE TABLE IF NOT EXISTS carriages (
-            id SERIAL PRIMARY KEY,
-            train_id INTEGER NOT NULL REFERENCES trains(id) ON DELETE CASCADE,
-            carriage_number INTEGER NOT NULL,
-            carriage_type VARCHAR(50) NOT NULL,
-            total_seats INTEGER NOT NULL,
-            price_multiplier DOUBLE PRECISION DEFAULT 1.0,
-            UNIQUE(train_id, carriage_number)
-        )
-    )";
-    if (!query.exec(createCarriagesTable)){
-        m_lastError = query.lastError().text();
-        qDebug() << "Error during creating table 'carriages':" << m_lastError;
+bool Database::applyMigrationInternal(const Migrations::Migration& migration){
+    qDebug() << "Applying migration" << migration.version << ":" << migration.description;
+
+    if (!m_db.transaction()){
+        m_lastError = m_db.lastError().text();
         return false;
     }
 
-    QString createSeatsTable = R"(
-        CREATE TABLE IF NOT EXISTS seats (
-            id SERIAL PRIMARY KEY,
-            carriage_id INTEGER NOT NULL REFERENCES carriages(id) ON DELETE CASCADE,
-            seat_number INTEGER NOT NULL,
-            seat_type VARCHAR(50) NOT NULL,
-            is_available BOOLEAN DEFAULT TRUE,
-            UNIQUE(carriage_id, seat_number)
-        )
-    )";
-    if (!query.exec(createSeatsTable)){
-        m_lastError = query.lastError().text();
-        qDebug() << "Error during creating table 'seats':" << m_lastError;
-        return false;
+    QSqlQuery query(m_db);
+    for (const QString& statement: migration.statements){
+        if (!query.exec(statement)){
+            m_lastError = query.lastError().text();
+            qDebug() << "Migration" << migration.version << "failed:" << m_lastError;
+            m_db.rollback();
+            return false;
+        }
     }
 
-    QString createRoutesTable = R"(
-        CREATE TABLE IF NOT EXISTS routes (
-            id SERIAL PRIMARY KEY,
-            train_id INTEGER NOT NULL REFERENCES trains(id) ON DELETE CASCADE,
-            route_name VARCHAR(255) NOT NULL,
-            valid_from DATE NOT NULL,
-            valid_to DATE NOT NULL,
-            created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
-        )
-    )";
-    if (!query.exec(createRoutesTable)){
-        m_lastError = query.lastError().text();
-        qDebug() << "Error during creating table 'routes':" << m_lastError;
-        return false;
-    }
-
-    QString createRouteStopsTable = R"(
-        CREATE TABLE IF NOT EXISTS route_stops (
-            id SERIAL PRIMARY KEY,
-            route_id INTEGER NOT NULL REFERENCES routes(id) ON DELETE CASCADE,
-            station_id INTEGER NOT NULL REFERENCES stations(id) ON DELETE CASCADE,
-            stop_order INTEGER NOT NULL,
-            arrival_time TIME,
-            departure_time TIME NOT NULL,
-            stop_duration_minutes INTEGER DEFAULT 0,
-            price_from_start DOUBLE PRECISION NOT NULL,
-            UNIQUE(route_id, stop_order),
-            UNIQUE(route_id, station_id)
-        )
-    )";
-    if (!query.exec(createRouteStopsTable)){
+    query.prepare(R"(
+        INSERT INTO schema_version (id, version, updated_at)
+        VALUES (TRUE, :version, CURRENT_TIMESTAMP)
+        ON CONFLICT (id) DO UPDATE SET version = EXCLUDED.version, updated_at = EXCLUDED.updated_at
+    )");
+    query.bindValue(":version", migration.version);
+    if (!query.exec()){
         m_lastError = query.lastError().text();
-        qDebug() << "Error during creating table 'route_stops':" << m_lastError;
+        m_db.rollback();
         return false;
     }
 
-        QString createSchedulesTable = R"(
-        CREATE TABLE IF NOT EXISTS schedules (
-            id SERIAL PRIMARY KEY,
-            route_id INTEGER NOT NULL REFERENCES routes(id) ON DELETE CASCADE,
-            departure_date DATE NOT NULL,
-            status VARCHAR(20) DEFAULT 'active',
-            created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
-            UNIQUE(route_id, departure_date)
-        )
-    )";
-    if (!query.exec(createSchedulesTable)){
-        m_lastError = query.lastError().text();
-        qDebug() << "Error during creating table 'schedules':" << m_lastError;
-        return false;
-    }
-
-    QString createTicketsTable = R"(
-        CREATE TABLE IF NOT EXISTS tickets (
-            id SERIAL PRIMARY KEY,
-            user_id INTEGER NOT NULL REFERENCES users(id) ON DELETE CASCADE,
-            schedule_id INTEGER NOT NULL REFERENCES schedules(id) ON DELETE CASCADE,
-            seat_id INTEGER NOT NULL REFERENCES seats(id) ON DELETE CASCADE,
-            departure_station_id INTEGER NOT NULL REFERENCES stations(id),
-            arrival_station_id INTEGER NOT NULL REFERENCES stations(id),
-            ticket_number VARCHAR(20) UNIQUE NOT NULL,
-            price DOUBLE PRECISION NOT NULL,
-            status VARCHAR(20) DEFAULT 'booked',
-            booked_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
-            paid_at TIMESTAMP,
-            cancelled_at TIMESTAMP,
-            passenger_name VARCHAR(200) NOT NULL,
-            passenger_document VARCHAR(50) NOT NULL
-        )
-    )";
-    if (!query.exec(createTicketsTable)){
-        m_lastError = query.lastError().text();
-        qDebug() << "Error during creating table 'tickets':" << m_lastError;
-        return false;
-    }
-
-    query.exec("CREATE INDEX IF NOT EXISTS idx_users_email ON users(email)");
-    query.exec("CREATE INDEX IF NOT EXISTS idx_users_locked_until ON users(locked_until)");
-    query.exec("CREATE INDEX IF NOT EXISTS idx_audit_user ON audit_logs(user_id)");
-    query.exec("CREATE INDEX IF NOT EXISTS idx_audit_timestamp ON audit_logs(timestamp)");
-    query.exec("CREATE INDEX IF NOT EXISTS idx_sessions_token ON sessions(session_token)");
-    query.exec("CREATE INDEX IF NOT EXISTS idx_sessions_user ON sessions(user_id)");
-    query.exec("CREATE INDEX IF NOT EXISTS idx_sessions_expires ON sessions(expires_at)");
-    query.exec("CREATE INDEX IF NOT EXISTS idx_stations_code ON stations(code)");
-    query.exec("CREATE INDEX IF NOT EXISTS idx_trains_number ON trains(train_number)");
-    query.exec("CREATE INDEX IF NOT EXISTS idx_routes_train ON routes(train_id)");
-    query.exec("CREATE INDEX IF NOT EXISTS idx_route_stops_route ON route_stops(route_id)");
-    query.exec("CREATE INDEX IF NOT EXISTS idx_schedules_route_date ON schedules(route_id, departure_date)");
-    query.exec("CREATE INDEX IF NOT EXISTS idx_tickets_user ON tickets(user_id)");
-    query.exec("CREATE INDEX IF NOT EXISTS idx_tickets_schedule ON tickets(schedule_id)");
-    query.exec("CREATE INDEX IF NOT EXISTS idx_tickets_number ON tickets(ticket_number)");
-    query.exec("CREATE INDEX IF NOT EXISTS idx_tickets_status ON tickets(status)");
-    query.exec("CREATE INDEX IF NOT EXISTS idx_verification_codes_user ON verification_codes(user_id)");
-    query.exec("CREATE INDEX IF NOT EXISTS idx_verification_codes_code ON verification_codes(code)");
-    query.exec("CREATE INDEX IF NOT EXISTS idx_verification_codes_expires ON verification_codes(expires_at)");
-    qDebug() << "All tables initialized successfully";
-    return true;
+    return m_db.commit();
 }
 
 QString Database::generateSalt(){
@@ -580,17 +584,7 @@ bool Database::logActionInternal(int userId, const QString& action, const QStrin
 
 bool Database::isSeatOccupiedInternal(int seatId, int scheduleId, int departureStationId, int arrivalStationId) {
     QSqlQuery query(m_db);
-    query.prepare(R"(
-        SELECT COUNT(*) FROM tickets
-        WHERE seat_id = :seat_id
-          AND schedule_id = :schedule_id
-          AND status IN ('booked', 'paid')
-          AND (
-              (departure_station_id <= :dep_station AND arrival_station_id > :dep_station)
-              OR (departure_station_id < :arr_station AND arrival_station_id >= :arr_station)
-              OR (departure_station_id >= :dep_station AND arrival_station_id <= :arr_station)
-          )
-    )");
+    query.prepare(TicketQueries::seatOverlap());
 
     query.bindValue(":seat_id", seatId);
     query.bindValue(":schedule_id", scheduleId);
@@ -652,6 +646,41 @@ bool Database::logAction(int userId, const QString& action, const QString& ipAdd
     return logActionInternal(userId, action, ipAddress, details, success);
 }
 
+// Rows go out as multi-row INSERTs of up to BULK_STATEMENT_ROWS each, so a
+// burst of connection events is a handful of statements.
+bool Database::logActions(const QList<AuditLog>& entries){
+    QMutexLocker locker(&m_mutex);
+    if (!isConnectedInternal()) return false;
+
+    for (int offset = 0; offset < entries.size(); offset += BULK_STATEMENT_ROWS){
+        int count = qMin(BULK_STATEMENT_ROWS, int(entries.size()) - offset);
+
+        QStringList rows;
+        rows.reserve(count);
+        for (int i = 0; i < count; i++){
+            rows.append("(?, ?, ?, ?, ?)");
+        }
+
+        QSqlQuery query(m_db);
+        query.prepare("INSERT INTO audit_logs (user_id, action, ip_address, details, success) VALUES " + rows.join(", "));
+        for (int i = offset; i < offset + count; i++){
+            const AuditLog& entry = entries[i];
+            query.addBindValue(entry.userId > 0 ? entry.userId : QVariant(QMetaType::fromType<int>()));
+            query.addBindValue(entry.action);
+            query.addBindValue(entry.ipAddress.isEmpty() ? QVariant(QMetaType::fromType<QString>()) : entry.ipAddress);
+            query.addBindValue(entry.details);
+            query.addBindValue(entry.success);
+        }
+
+        if (!query.exec()){
+            qWarning() << "Error logging actions:" << query.lastError().text();
+            return false;
+        }
+    }
+
+    return true;
+}
+
 bool Database::createUser(const QString& name, const QString& surname, const QString& email, const QString& password, int* userId){
     QMutexLocker locker(&m_mutex);
 
@@ -980,6 +1009,69 @@ bool Database::invalidateSession(const QString &sessionToken){
     return query.exec();
 }
 
+bool Database::suspendSessions(const QStringList& sessionTokens){
+    QMutexLocker locker(&m_mutex);
+    if (!isConnectedInternal()) return false;
+
+    QDateTime reconnectDeadline = QDateTime::currentDateTime().addSecs(SESSION_RECONNECT_WINDOW_SECONDS);
+
+    for (int offset = 0; offset < sessionTokens.size(); offset += BULK_STATEMENT_ROWS){
+        int count = qMin(BULK_STATEMENT_ROWS, int(sessionTokens.size()) - offset);
+
+        QStringList placeholders;
+        placeholders.reserve(count);
+        for (int i = 0; i < count; i++){
+            placeholders.append("?");
+        }
+
+        QSqlQuery query(m_db);
+        query.prepare("UPDATE sessions SET expires_at = LEAST(expires_at, ?) "
+                      "WHERE is_active AND session_token IN (" + placeholders.join(", ") + ")");
+        query.addBindValue(reconnectDeadline);
+        for (int i = offset; i < offset + count; i++){
+            query.addBindValue(sessionTokens[i]);
+        }
+
+        if (!query.exec()){
+            qWarning() << "Error suspending sessions:" << query.lastError().text();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Database::resumeSession(const QString& sessionToken, int* userId){
+    QMutexLocker locker(&m_mutex);
+    if (!isConnectedInternal()) return false;
+
+    QSqlQuery query(m_db);
+    query.prepare(R"(
+        UPDATE sessions
+        SET expires_at = created_at + make_interval(hours => CAST(:lifetime AS int))
+        WHERE session_token = :token
+          AND is_active
+          AND expires_at >= :now
+        RETURNING user_id, expires_at
+    )");
+    query.bindValue(":lifetime", SESSION_LIFETIME_HOURS);
+    query.bindValue(":token", sessionToken);
+    query.bindValue(":now", QDateTime::currentDateTime());
+
+    if (!query.exec()){
+        m_lastError = query.lastError().text();
+        qWarning() << "Error resuming session:" << m_lastError;
+        return false;
+    }
+    // The restored expiry is still bounded by when the user logged in.
+    if (!query.next() || query.value(1).toDateTime() < QDateTime::currentDateTime()){
+        return false;
+    }
+
+    *userId = query.value(0).toInt();
+    return true;
+}
+
 void Database::cleanupExpiredSessions(){
     QMutexLocker locker(&m_mutex);
     if (!isConnectedInternal()) return;
@@ -1106,6 +1198,15 @@ bool Database::isValidEmail(const QString& email)
     return regex.match(email).hasMatch();
 }
 
+// Same predicate as isSeatOccupiedInternal: segment A is an existing ticket,
+// segment B the one being checked.
+bool Database::segmentsOverlap(int departureA, int arrivalA, int departureB, int arrivalB)
+{
+    return (departureA <= departureB && arrivalA > departureB)
+           || (departureA < arrivalB && arrivalA >= arrivalB)
+           || (departureA >= departureB && arrivalA <= arrivalB);
+}
+
 QString Database::lastError() const
 {
     QMutexLocker locker(&m_mutex);
@@ -1420,102 +1521,228 @@ int Database::createSchedule(int routeId, const QDate &departureDate){
         qDebug() << "Error creating schedule:" << m_lastError;
         return -1;
     }
+    int scheduleId = query.value(0).toInt();
 
-    return query.value(0).toInt();
+    if (!ensureTicketPartitionsInternal(departureDate, departureDate)){
+        qWarning() << "No ticket partition for" << departureDate << ":" << m_lastError;
+    }
+
+    m_searchCache->invalidateAll();
+    return scheduleId;
 }
 
-QList<Database::SearchResult> Database::searchTrains(int departureStationId, int arrivalStationId, const QDate &date){
+// The whole file goes in through COPY inside one transaction. Ids are taken
+// from the sequences up front so rows can reference each other without
+// reading anything back; the table lock keeps concurrent inserts from
+// drawing ids inside the reserved ranges.
+bool Database::importTimetable(const TimetableImport& timetable, TimetableImport::Summary* summary){
     QMutexLocker locker(&m_mutex);
-    QList<SearchResult> results;
-    if (!isConnectedInternal()) return results;
+    if (!isConnectedInternal()){
+        m_lastError = "No connection to database";
+        return false;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    if (!m_db.transaction()){
+        m_lastError = m_db.lastError().text();
+        return false;
+    }
+
+    QSqlQuery query(m_db);
+    if (!query.exec("LOCK TABLE trains, carriages, seats, routes, route_stops, schedules IN SHARE ROW EXCLUSIVE MODE")){
+        m_lastError = query.lastError().text();
+        m_db.rollback();
+        return false;
+    }
+
+    QHash<QString, int> stationIds;
+    QHash<QString, int> trainIds;
+    bool loaded = query.exec("SELECT id, code FROM stations");
+    while (loaded && query.next()){
+        stationIds.insert(query.value(1).toString(), query.value(0).toInt());
+    }
+    loaded = loaded && query.exec("SELECT id, train_number FROM trains");
+    while (loaded && query.next()){
+        trainIds.insert(query.value(1).toString(), query.value(0).toInt());
+    }
+    if (!loaded){
+        m_lastError = query.lastError().text();
+        m_db.rollback();
+        return false;
+    }
+
+    QString error;
+    if (!timetable.validate(stationIds, trainIds, &error)){
+        m_lastError = error;
+        m_db.rollback();
+        return false;
+    }
+
+    QDate firstDeparture;
+    QDate lastDeparture;
+    for (const TimetableImport::ScheduleRow& schedule: timetable.schedules()){
+        if (!firstDeparture.isValid() || schedule.from < firstDeparture) firstDeparture = schedule.from;
+        if (!lastDeparture.isValid() || schedule.to > lastDeparture) lastDeparture = schedule.to;
+    }
+
+    if (!copyTimetableInternal(timetable, stationIds, trainIds)
+        || (firstDeparture.isValid() && !ensureTicketPartitionsInternal(firstDeparture, lastDeparture))){
+        qDebug() << "Timetable import failed:" << m_lastError;
+        m_db.rollback();
+        return false;
+    }
+
+    if (!m_db.commit()){
+        m_lastError = m_db.lastError().text();
+        m_db.rollback();
+        return false;
+    }
+
+    m_searchCache->invalidateAll();
+
+    TimetableImport::Summary counts = timetable.summary();
+    QString details = QString("%1 trains, %2 carriages, %3 seats, %4 routes, %5 stops, %6 schedules")
+                          .arg(counts.trains).arg(counts.carriages).arg(counts.seats)
+                          .arg(counts.routes).arg(counts.stops).arg(counts.schedules);
+    logActionInternal(-1, "timetable_imported", "", details, true);
+    qDebug() << "Timetable imported:" << details << "in" << timer.elapsed() << "ms";
+
+    if (summary) *summary = counts;
+    return true;
+}
+
+qint64 Database::reserveIdsInternal(const QString& table, qint64 count){
+    if (count == 0){
+        return 0;
+    }
 
     QSqlQuery query(m_db);
     query.prepare(R"(
-        SELECT DISTINCT
-            s.id as schedule_id,
-            r.id as route_id,
-            t.train_number,
-            t.train_type,
-            rs1.station_id as dep_station_id,
-            st1.name as dep_station_name,
-            rs2.station_id as arr_station_id,
-            st2.name as arr_station_name,
-            rs1.departure_time as dep_time,
-            rs2.arrival_time as arr_time,
-            (rs2.price_from_start - rs1.price_from_start) as min_price
-        FROM schedules s
-        JOIN routes r ON s.route_id = r.id
-        JOIN trains t ON r.train_id = t.id
-        JOIN route_stops rs1 ON r.id = rs1.route_id AND rs1.station_id = :dep_station
-        JOIN route_stops rs2 ON r.id = rs2.route_id AND rs2.station_id = :arr_station
-        JOIN stations st1 ON rs1.station_id = st1.id
-        JOIN stations st2 ON rs2.station_id = st2.id
-        WHERE s.departure_date = :date
-          AND s.status = 'active'
-          AND rs1.stop_order < rs2.stop_order
-          AND t.is_active = true
-          AND :date BETWEEN r.valid_from AND r.valid_to
-        ORDER BY rs1.departure_time
+        SELECT setval(pg_get_serial_sequence(:table, 'id'), nextval(pg_get_serial_sequence(:table, 'id')) + :count - 1) - :count + 1
     )");
+    query.bindValue(":table", table);
+    query.bindValue(":count", count);
 
-    query.bindValue(":dep_station", departureStationId);
-    query.bindValue(":arr_station", arrivalStationId);
-    query.bindValue(":date", date);
-
-    if (!query.exec()){
+    if (!query.exec() || !query.next()){
         m_lastError = query.lastError().text();
-        qDebug() << "Error searching trains:" << m_lastError;
-        return results;
+        return -1;
     }
+    return query.value(0).toLongLong();
+}
 
-    while (query.next()){
-        SearchResult result;
-        result.scheduleId = query.value("schedule_id").toInt();
-        result.routeId = query.value("route_id").toInt();
-        result.trainNumber = query.value("train_number").toString();
-        result.trainType = query.value("train_type").toString();
-        result.departureStationId = query.value("dep_station_id").toInt();
-        result.departureStationName = query.value("dep_station_name").toString();
-        result.arrivalStationId = query.value("arr_station_id").toInt();
-        result.arrivalStationName = query.value("arr_station_name").toString();
-
-        QTime depTime = query.value("dep_time").toTime();
-        QTime arrTime = query.value("arr_time").toTime();
-        result.departureTime = QDateTime(date, depTime);
-        result.arrivalTime = QDateTime(date, arrTime);
-
-        if (arrTime < depTime){
-            result.arrivalTime = result.arrivalTime.addDays(1);
+bool Database::copyTimetableInternal(const TimetableImport& timetable, const QHash<QString, int>& stationIds, const QHash<QString, int>& existingTrainIds){
+    QVariant handle = m_db.driver()->handle();
+    if (!handle.isValid() || qstrcmp(handle.typeName(), "PGconn*") != 0){
+        m_lastError = "Bulk import requires the QPSQL driver";
+        return false;
+    }
+    PGconn* connection = *static_cast<PGconn**>(handle.data());
+
+    TimetableImport::Summary counts = timetable.summary();
+    qint64 trainId = reserveIdsInternal("trains", counts.trains);
+    qint64 carriageId = reserveIdsInternal("carriages", counts.carriages);
+    qint64 seatId = reserveIdsInternal("seats", counts.seats);
+    qint64 routeId = reserveIdsInternal("routes", counts.routes);
+    qint64 stopId = reserveIdsInternal("route_stops", counts.stops);
+    qint64 scheduleId = reserveIdsInternal("schedules", counts.schedules);
+    if (trainId < 0 || carriageId < 0 || seatId < 0 || routeId < 0 || stopId < 0 || scheduleId < 0){
+        return false;
+    }
+
+    QHash<QString, int> trainSeats;
+    for (const TimetableImport::CarriageRow& carriage: timetable.carriages()){
+        trainSeats[carriage.trainNumber] += carriage.seats;
+    }
+
+    CopyStream copy(connection);
+    auto failed = [this, &copy](){
+        m_lastError = copy.lastError();
+        return false;
+    };
+
+    QHash<QString, int> trainIds = existingTrainIds;
+    if (!copy.begin("trains", {"id", "train_number", "train_type", "total_seats", "is_active"})) return failed();
+    for (const TimetableImport::TrainRow& train: timetable.trains()){
+        trainIds.insert(train.number, int(trainId));
+        copy.field(trainId++).field(train.number.toUtf8()).field(train.type.toUtf8())
+            .field(trainSeats.value(train.number)).field(true);
+        if (!copy.endRow()) return failed();
+    }
+    if (!copy.finish()) return failed();
+
+    QHash<QString, qint64> carriageIds;
+    if (!copy.begin("carriages", {"id", "train_id", "carriage_number", "carriage_type", "total_seats", "price_multiplier"})) return failed();
+    for (const TimetableImport::CarriageRow& carriage: timetable.carriages()){
+        carriageIds.insert(carriage.trainNumber + '#' + QString::number(carriage.number), carriageId);
+        copy.field(carriageId++).field(trainIds.value(carriage.trainNumber)).field(carriage.number)
+            .field(carriage.type.toUtf8()).field(carriage.seats).field(carriage.priceMultiplier);
+        if (!copy.endRow()) return failed();
+    }
+    if (!copy.finish()) return failed();
+
+    if (!copy.begin("seats", {"id", "carriage_id", "seat_number", "seat_type", "is_available"})) return failed();
+    for (const TimetableImport::SeatRow& seat: timetable.seats()){
+        copy.field(seatId++).field(carriageIds.value(seat.trainNumber + '#' + QString::number(seat.carriageNumber)))
+            .field(seat.seatNumber).field(seat.seatType.toUtf8()).field(true);
+        if (!copy.endRow()) return failed();
+    }
+    for (const TimetableImport::CarriageRow& carriage: timetable.carriages()){
+        if (timetable.hasExplicitSeats(carriage.trainNumber, carriage.number)){
+            continue;
+        }
+        qint64 id = carriageIds.value(carriage.trainNumber + '#' + QString::number(carriage.number));
+        for (int number = 1; number <= carriage.seats; number++){
+            copy.field(seatId++).field(id).field(number)
+                .field(TimetableImport::generatedSeatType(number).toUtf8()).field(true);
+            if (!copy.endRow()) return failed();
         }
+    }
+    if (!copy.finish()) return failed();
 
-        result.travelTimeMinutes = result.departureTime.secsTo(result.arrivalTime) / 60;
-        result.minPrice = query.value("min_price").toDouble();
-
-        QSqlQuery seatQuery(m_db);
-        seatQuery.prepare(R"(
-            SELECT COUNT(DISTINCT s.id)
-            FROM seats s
-            JOIN carriages c ON s.carriage_id = c.id
-            JOIN trains t ON c.train_id = t.id
-            JOIN routes r ON t.id = r.train_id
-            WHERE r.id = :route_id
-              AND s.id NOT IN (
-                  SELECT seat_id FROM tickets
-                  WHERE schedule_id = :schedule_id
-                    AND status IN ('booked', 'paid')
-              )
-        )");
-        seatQuery.bindValue(":route_id", result.routeId);
-        seatQuery.bindValue(":schedule_id", result.scheduleId);
+    QHash<QString, qint64> routeIds;
+    if (!copy.begin("routes", {"id", "train_id", "route_name", "valid_from", "valid_to"})) return failed();
+    for (const TimetableImport::RouteRow& route: timetable.routes()){
+        routeIds.insert(route.key, routeId);
+        copy.field(routeId++).field(trainIds.value(route.trainNumber)).field(route.name.toUtf8())
+            .field(route.validFrom.toString(Qt::ISODate).toLatin1()).field(route.validTo.toString(Qt::ISODate).toLatin1());
+        if (!copy.endRow()) return failed();
+    }
+    if (!copy.finish()) return failed();
 
-        if (seatQuery.exec() && seatQuery.next()){
-            result.availableSeats = seatQuery.value(0).toInt();
+    // As in addRouteStop, the first stop of a route has no arrival time.
+    QHash<QString, int> firstOrders;
+    for (const TimetableImport::StopRow& stop: timetable.stops()){
+        auto it = firstOrders.find(stop.routeKey);
+        if (it == firstOrders.end() || stop.order < it.value()){
+            firstOrders.insert(stop.routeKey, stop.order);
+        }
+    }
+
+    if (!copy.begin("route_stops", {"id", "route_id", "station_id", "stop_order", "arrival_time", "departure_time",
+                                    "stop_duration_minutes", "price_from_start"})) return failed();
+    for (const TimetableImport::StopRow& stop: timetable.stops()){
+        copy.field(stopId++).field(routeIds.value(stop.routeKey)).field(stationIds.value(stop.stationCode)).field(stop.order);
+        if (stop.order == firstOrders.value(stop.routeKey) || !stop.arrival.isValid()){
+            copy.nullField();
         } else {
-            result.availableSeats = 0;
+            copy.field(stop.arrival.toString("HH:mm:ss").toLatin1());
+        }
+        copy.field(stop.departure.toString("HH:mm:ss").toLatin1()).field(stop.dwellMinutes).field(stop.price);
+        if (!copy.endRow()) return failed();
+    }
+    if (!copy.finish()) return failed();
+
+    if (!copy.begin("schedules", {"id", "route_id", "departure_date", "status"})) return failed();
+    for (const TimetableImport::ScheduleRow& schedule: timetable.schedules()){
+        qint64 id = routeIds.value(schedule.routeKey);
+        for (QDate date = schedule.from; date <= schedule.to; date = date.addDays(1)){
+            copy.field(scheduleId++).field(id).field(date.toString(Qt::ISODate).toLatin1()).field("active");
+            if (!copy.endRow()) return failed();
         }
-        results.append(result);
     }
-    return results;
+    return copy.finish() || failed();
 }
 
 QString Database::generateTicketNumber(){
@@ -1524,48 +1751,128 @@ QString Database::generateTicketNumber(){
     return QString("TK%1%2").arg(msec).arg(random);
 }
 
-QString Database::bookTicket(int userId, int scheduleId, int seatId, int departureStationId, int arrivalStationId, const QString &passengerName, const QString &passengerDocument, double price){
-    QMutexLocker locker(&m_mutex);
-    if (!isConnectedInternal()) return QString();
+// A booking costs a single round trip; see TicketQueries::insertTicket.
+bool Database::execInsertTicket(QSqlDatabase& db, int userId, const BookingRequest& request, bool logAction, QString* ticketNumber, QString* error){
+    QString number = generateTicketNumber();
 
-    if (isSeatOccupiedInternal(seatId, scheduleId, departureStationId, arrivalStationId)){
-        m_lastError = "Seat is already occupied";
-        return QString();
+    QSqlQuery query(db);
+    query.prepare(TicketQueries::insertTicket(logAction));
+
+    query.bindValue(":user_id", userId);
+    query.bindValue(":schedule_id", request.scheduleId);
+    query.bindValue(":seat_id", request.seatId);
+    query.bindValue(":dep_station", request.departureStationId);
+    query.bindValue(":arr_station", request.arrivalStationId);
+    query.bindValue(":ticket_number", number);
+    query.bindValue(":price", request.price);
+    query.bindValue(":passenger_name", sanitizeInput(request.passengerName));
+    query.bindValue(":passenger_doc", sanitizeInput(request.passengerDocument));
+    if (logAction){
+        query.bindValue(":details", QString("Ticket %1 booked").arg(number));
     }
 
-    QString ticketNumber = generateTicketNumber();
+    if (!query.exec() || !query.next()){
+        *error = query.lastError().text();
+        qDebug() << "Error booking ticket:" << *error;
+        return false;
+    }
 
-    QSqlQuery query(m_db);
+    if (query.value("occupied").toBool()){
+        *error = "Seat is already occupied";
+        return false;
+    }
+
+    if (!query.value("schedule_found").toBool()){
+        *error = "Schedule not found";
+        return false;
+    }
+
+    if (ticketNumber) *ticketNumber = number;
+    return true;
+}
+
+bool Database::insertTicketInternal(int userId, const BookingRequest& request, QString* ticketNumber, bool logAction){
+    return execInsertTicket(m_db, userId, request, logAction, ticketNumber, &m_lastError);
+}
+
+// Bookings of a schedule are serialized across connections and server
+// instances by a transaction-scoped advisory lock. The locks are taken in
+// schedule order, so two batches sharing schedules cannot deadlock.
+bool Database::lockSchedules(QSqlDatabase& db, const QList<int>& scheduleIds, QString* error){
+    QStringList ids;
+    for (int scheduleId: scheduleIds){
+        ids << QString::number(scheduleId);
+    }
+
+    QSqlQuery query(db);
     query.prepare(R"(
-        INSERT INTO tickets
-        (user_id, schedule_id, seat_id, departure_station_id, arrival_station_id,
-         ticket_number, price, status, passenger_name, passenger_document)
-        VALUES (:user_id, :schedule_id, :seat_id, :dep_station, :arr_station,
-                :ticket_number, :price, 'booked', :passenger_name, :passenger_doc)
+        SELECT pg_advisory_xact_lock(CAST(:lock_class AS integer), id)
+        FROM (SELECT DISTINCT unnest(CAST(:ids AS integer[])) AS id ORDER BY id) ids
     )");
-
-    query.bindValue(":user_id", userId);
-    query.bindValue(":schedule_id", scheduleId);
-    query.bindValue(":seat_id", seatId);
-    query.bindValue(":dep_station", departureStationId);
-    query.bindValue(":arr_station", arrivalStationId);
-    query.bindValue(":ticket_number", ticketNumber);
-    query.bindValue(":price", price);
-    query.bindValue(":passenger_name", sanitizeInput(passengerName));
-    query.bindValue(":passenger_doc", sanitizeInput(passengerDocument));
+    query.bindValue(":lock_class", INVENTORY_LOCK_CLASS);
+    query.bindValue(":ids", "{" + ids.join(',') + "}");
 
     if (!query.exec()){
-        m_lastError = query.lastError().text();
-        qDebug() << "Error booking ticket:" << m_lastError;
+        *error = query.lastError().text();
+        qDebug() << "Error locking schedules:" << *error;
+        return false;
+    }
+    return true;
+}
+
+QString Database::bookTicket(int userId, int scheduleId, int seatId, int departureStationId, int arrivalStationId, const QString &passengerName, const QString &passengerDocument, double price){
+    QMutexLocker locker(&m_mutex);
+    if (!isConnectedInternal()) return QString();
+
+    BookingRequest request{scheduleId, seatId, departureStationId, arrivalStationId,
+                           passengerName, passengerDocument, price};
+
+    if (!m_db.transaction()){
+        m_lastError = m_db.lastError().text();
         return QString();
     }
 
-    logActionInternal(userId, "ticket_booked", "", QString("Ticket %1 booked").arg(ticketNumber), true);
-    emit ticketBooked(ticketNumber);
+    QString ticketNumber;
+    if (!lockSchedules(m_db, {scheduleId}, &m_lastError) || !insertTicketInternal(userId, request, &ticketNumber, true)){
+        m_db.rollback();
+        return QString();
+    }
+
+    if (!m_db.commit()){
+        m_lastError = m_db.lastError().text();
+        m_db.rollback();
+        return QString();
+    }
+
+    notifyTicketBooked(ticketNumber, request);
     qDebug() << "Ticket booked:" << ticketNumber;
     return ticketNumber;
 }
 
+void Database::notifyTicketBooked(const QString& ticketNumber, const BookingRequest& request){
+    m_searchCache->bumpScheduleVersion(request.scheduleId);
+    emit ticketBooked(ticketNumber);
+    emit seatSegmentChanged(request.scheduleId, request.seatId, request.departureStationId, request.arrivalStationId, true);
+}
+
+void Database::notifyTicketCancelled(const QString& ticketNumber, const Ticket& ticket){
+    m_searchCache->bumpScheduleVersion(ticket.scheduleId);
+    emit ticketCancelled(ticketNumber);
+    emit seatSegmentChanged(ticket.scheduleId, ticket.seatId, ticket.departureStationId, ticket.arrivalStationId, false);
+}
+
+void Database::notifyTicketPaid(const QString& ticketNumber){
+    emit ticketPaid(ticketNumber);
+}
+
+void Database::notifyLoginBlocked(const QString& email, bool lockedNow){
+    if (lockedNow){
+        emit accountLocked(email);
+        emit securityAlert(QString("Account locked due to failed attempts:  %1").arg(email));
+    }
+    emit securityAlert(QString("Login attempt to locked account: %1").arg(email));
+}
+
 Ticket Database::getTicket(const QString& ticketNumber, bool* found){
     QMutexLocker locker(&m_mutex);
     Ticket ticket;
@@ -1604,161 +1911,287 @@ Ticket Database::getTicket(const QString& ticketNumber, bool* found){
     return ticket;
 }
 
-bool Database::payTicket(const QString &ticketNumber){
+QString Database::ticketDetailsSql(const QString& source){
+    return QString(R"(
+        SELECT
+            tk.id, tk.user_id, tk.schedule_id, tk.seat_id,
+            tk.departure_station_id, tk.arrival_station_id,
+            tk.ticket_number, tk.price, tk.status,
+            tk.booked_at, tk.paid_at, tk.cancelled_at,
+            tk.passenger_name, tk.passenger_document,
+            t.train_number, t.train_type,
+            st_dep.name as dep_station_name,
+            st_arr.name as arr_station_name,
+            rs_dep.departure_time,
+            rs_arr.arrival_time,
+            s.departure_date,
+            c.carriage_number,
+            se.seat_number
+        FROM %1 tk
+        JOIN schedules s ON tk.schedule_id = s.id
+        JOIN routes r ON s.route_id = r.id
+        JOIN trains t ON r.train_id = t.id
+        JOIN seats se ON tk.seat_id = se.id
+        JOIN carriages c ON se.carriage_id = c.id
+        JOIN route_stops rs_dep ON r.id = rs_dep.route_id
+            AND rs_dep.station_id = tk.departure_station_id
+        JOIN route_stops rs_arr ON r.id = rs_arr.route_id
+            AND rs_arr.station_id = tk.arrival_station_id
+        JOIN stations st_dep ON tk.departure_station_id = st_dep.id
+        JOIN stations st_arr ON tk.arrival_station_id = st_arr.id
+    )").arg(source);
+}
+
+QString Database::ticketAccessError(const QVariant& ownerId, const QString& status, int userId, const QString& action){
+    if (ownerId.isNull()){
+        return "Ticket not found";
+    }
+    if (ownerId.toInt() != userId){
+        return "Access denied";
+    }
+    return QString("Ticket cannot be %1 (status: %2)").arg(action, status);
+}
+
+bool Database::getUserTicket(int userId, const QString& ticketNumber, Ticket* ticket){
     QMutexLocker locker(&m_mutex);
-    if (!isConnectedInternal()) return false;
+    if (!isConnectedInternal()){
+        m_lastError = "No connection to database";
+        return false;
+    }
 
     QSqlQuery query(m_db);
-    query.prepare(R"(
-        UPDATE tickets
-        SET status = 'paid', paid_at = CURRENT_TIMESTAMP
-        WHERE ticket_number = :ticket_number AND status = 'booked'
-    )");
+    query.prepare("SELECT * FROM tickets WHERE ticket_number = :ticket_number");
     query.bindValue(":ticket_number", ticketNumber);
 
     if (!query.exec()){
         m_lastError = query.lastError().text();
         return false;
     }
-
-    if (query.numRowsAffected() == 0){
-        m_lastError = "Ticket not found or already paid";
+    if (!query.next()){
+        m_lastError = "Ticket not found";
+        return false;
+    }
+    if (query.value("user_id").toInt() != userId){
+        m_lastError = "Access denied";
         return false;
     }
 
-    emit ticketPaid(ticketNumber);
-    qDebug() << "Ticket paid:" << ticketNumber;
+    *ticket = ticketFromQuery(query);
     return true;
 }
 
-bool Database::cancelTicket(const QString &ticketNumber, const QString &reason){
+bool Database::cancelTicket(int userId, const QString& ticketNumber, const QString& reason, const QString& ipAddress){
     QMutexLocker locker(&m_mutex);
-    if (!isConnectedInternal()) return false;
+    if (!isConnectedInternal()){
+        m_lastError = "No connection to database";
+        return false;
+    }
 
-    QSqlQuery query(m_db);
+    Ticket cancelled;
+    if (!execCancelTicket(m_db, userId, ticketNumber, ipAddress, &cancelled, &m_lastError)){
+        return false;
+    }
+
+    notifyTicketCancelled(ticketNumber, cancelled);
+    qDebug() << "Ticket cancelled:" << ticketNumber << "Reason:" << reason;
+    return true;
+}
+
+// The statement behind cancelTicket, on any connection. cancelled gets the
+// schedule and seat segment the ticket held.
+bool Database::execCancelTicket(QSqlDatabase& db, int userId, const QString& ticketNumber, const QString& ipAddress, Ticket* cancelled, QString* error){
+    QSqlQuery query(db);
     query.prepare(R"(
-        UPDATE tickets
-        SET status = 'cancelled', cancelled_at = CURRENT_TIMESTAMP
-        WHERE ticket_number = :ticket_number AND status IN ('booked', 'paid')
+        WITH target AS (
+            SELECT id, departure_date, user_id, status FROM tickets
+            WHERE ticket_number = :ticket_number
+        ), cancelled AS (
+            UPDATE tickets tk
+            SET status = 'cancelled', cancelled_at = CURRENT_TIMESTAMP
+            FROM target
+            WHERE tk.id = target.id AND tk.departure_date = target.departure_date
+              AND tk.user_id = :user_id AND tk.status IN ('booked', 'paid')
+            RETURNING tk.ticket_number, tk.user_id, tk.schedule_id, tk.seat_id,
+                      tk.departure_station_id, tk.arrival_station_id
+        ), logged AS (
+            INSERT INTO audit_logs (user_id, action, ip_address, details, success)
+            SELECT user_id, 'ticket_cancelled', CAST(:ip_address AS varchar), ticket_number, TRUE FROM cancelled
+        )
+        SELECT target.user_id AS owner_id, target.status AS current_status,
+               cancelled.schedule_id, cancelled.seat_id,
+               cancelled.departure_station_id, cancelled.arrival_station_id
+        FROM (SELECT 1) one
+        LEFT JOIN target ON TRUE
+        LEFT JOIN cancelled ON TRUE
     )");
     query.bindValue(":ticket_number", ticketNumber);
+    query.bindValue(":user_id", userId);
+    query.bindValue(":ip_address", ipAddress.isEmpty() ? QVariant(QMetaType::fromType<QString>()) : ipAddress);
 
-    if (!query.exec()){
-        m_lastError = query.lastError().text();
+    if (!query.exec() || !query.next()){
+        *error = query.lastError().text();
         return false;
     }
 
-    if (query.numRowsAffected() == 0){
-        m_lastError = "Ticket not found or already cancelled";
+    if (query.value("schedule_id").isNull()){
+        *error = ticketAccessError(query.value("owner_id"), query.value("current_status").toString(), userId, "cancelled");
         return false;
     }
 
-    emit ticketCancelled(ticketNumber);
-    qDebug() << "Ticket cancelled:" << ticketNumber << "Reason:" << reason;
+    cancelled->ticketNumber = ticketNumber;
+    cancelled->userId = userId;
+    cancelled->scheduleId = query.value("schedule_id").toInt();
+    cancelled->seatId = query.value("seat_id").toInt();
+    cancelled->departureStationId = query.value("departure_station_id").toInt();
+    cancelled->arrivalStationId = query.value("arrival_station_id").toInt();
+    cancelled->status = "cancelled";
     return true;
 }
 
-QList<Ticket> Database::getUserTickets(int userId){
+Ticket Database::ticketFromQuery(const QSqlQuery& query){
+    Ticket ticket;
+    ticket.id = query.value("id").toInt();
+    ticket.userId = query.value("user_id").toInt();
+    ticket.scheduleId = query.value("schedule_id").toInt();
+    ticket.seatId = query.value("seat_id").toInt();
+    ticket.departureStationId = query.value("departure_station_id").toInt();
+    ticket.arrivalStationId = query.value("arrival_station_id").toInt();
+    ticket.ticketNumber = query.value("ticket_number").toString();
+    ticket.price = query.value("price").toDouble();
+    ticket.status = query.value("status").toString();
+    ticket.bookedAt = query.value("booked_at").toDateTime();
+    ticket.paidAt = query.value("paid_at").toDateTime();
+    ticket.cancelledAt = query.value("cancelled_at").toDateTime();
+    ticket.passengerName = query.value("passenger_name").toString();
+    ticket.passengerDocument = query.value("passenger_document").toString();
+    return ticket;
+}
+
+// Taken before the tickets are read and moved back by the clock margin:
+// updated_at is stamped when a row is written, not when its transaction
+// commits, so a change that becomes visible later still sorts after it.
+bool Database::ticketSyncTokenInternal(QString* syncToken){
+    QSqlQuery query(m_db);
+    query.prepare("SELECT (clock_timestamp()::timestamp - make_interval(secs => :margin))::text");
+    query.bindValue(":margin", SNAPSHOT_CLOCK_MARGIN_SECONDS);
+
+    if (!query.exec() || !query.next()){
+        m_lastError = query.lastError().text();
+        return false;
+    }
+    *syncToken = TicketKey::encode(query.value(0).toString());
+    return true;
+}
+
+bool Database::getUserTicketsPage(int userId, const QString& cursor, int limit
+                                  , QList<Ticket>* tickets, QString* nextCursor, QString* syncToken){
     QMutexLocker locker(&m_mutex);
-    QList<Ticket> tickets;
-    if (!isConnectedInternal()) return tickets;
+    tickets->clear();
+    nextCursor->clear();
+    if (!isConnectedInternal()){
+        m_lastError = "No connection to database";
+        return false;
+    }
+
+    QString afterBookedAt;
+    int afterId = 0;
+    if (!cursor.isEmpty() && !TicketKey::decode(cursor, true, &afterBookedAt, &afterId)){
+        m_lastError = "Invalid cursor";
+        return false;
+    }
+    if (!ticketSyncTokenInternal(syncToken)){
+        return false;
+    }
 
+    // One row past the page tells whether another page exists. The row
+    // comparison walks idx_tickets_user_booked_at from the cursor onwards.
     QSqlQuery query(m_db);
-    query.prepare(R"(
-        SELECT * FROM tickets
+    query.prepare(QString(R"(
+        SELECT *, booked_at::text AS booked_at_key FROM tickets
         WHERE user_id = :user_id
-        ORDER BY booked_at DESC
-    )");
+          %1
+        ORDER BY booked_at DESC, id DESC
+        LIMIT :limit
+    )").arg(cursor.isEmpty() ? "" : "AND (booked_at, id) < (CAST(:after_booked_at AS timestamp), :after_id)"));
     query.bindValue(":user_id", userId);
+    query.bindValue(":limit", limit + 1);
+    if (!cursor.isEmpty()){
+        query.bindValue(":after_booked_at", afterBookedAt);
+        query.bindValue(":after_id", afterId);
+    }
 
     if (!query.exec()){
-        qDebug() << "Error getting user tickets:" << query.lastError().text();
-        return tickets;
+        m_lastError = query.lastError().text();
+        qDebug() << "Error getting user tickets:" << m_lastError;
+        return false;
     }
 
+    QString lastKey;
+    int lastId = 0;
     while (query.next()){
-        Ticket ticket;
-        ticket.id = query.value("id").toInt();
-        ticket.userId = query.value("user_id").toInt();
-        ticket.scheduleId = query.value("schedule_id").toInt();
-        ticket.seatId = query.value("seat_id").toInt();
-        ticket.departureStationId = query.value("departure_station_id").toInt();
-        ticket.arrivalStationId = query.value("arrival_station_id").toInt();
-        ticket.ticketNumber = query.value("ticket_number").toString();
-        ticket.price = query.value("price").toDouble();
-        ticket.status = query.value("status").toString();
-        ticket.bookedAt = query.value("booked_at").toDateTime();
-        ticket.paidAt = query.value("paid_at").toDateTime();
-        ticket.cancelledAt = query.value("cancelled_at").toDateTime();
-        ticket.passengerName = query.value("passenger_name").toString();
-        ticket.passengerDocument = query.value("passenger_document").toString();
-        tickets.append(ticket);
-    }
-    return tickets;
+        if (tickets->size() == limit){
+            *nextCursor = TicketKey::encode(lastKey, lastId);
+            break;
+        }
+        tickets->append(ticketFromQuery(query));
+        lastKey = query.value("booked_at_key").toString();
+        lastId = tickets->last().id;
+    }
+    return true;
 }
 
-TicketFullInfo Database::getTicketFullInfo(const QString& ticketNumber, bool* found){
+bool Database::getUserTicketsChangedSince(int userId, const QString& since, int limit
+                                          , QList<Ticket>* tickets, bool* complete, QString* syncToken){
     QMutexLocker locker(&m_mutex);
-    TicketFullInfo info;
-    info.ticket.id = -1;
+    tickets->clear();
+    *complete = false;
+    if (!isConnectedInternal()){
+        m_lastError = "No connection to database";
+        return false;
+    }
 
-    if (!isConnected()) {
-        if (found) *found = false;
-        return info;
+    QString changedAfter;
+    if (!TicketKey::decode(since, false, &changedAfter, nullptr)){
+        m_lastError = "Invalid sync token";
+        return false;
+    }
+    if (!ticketSyncTokenInternal(syncToken)){
+        return false;
     }
 
     QSqlQuery query(m_db);
     query.prepare(R"(
-        SELECT
-            tk.id, tk.user_id, tk.schedule_id, tk.seat_id,
-            tk.departure_station_id, tk.arrival_station_id,
-            tk.ticket_number, tk.price, tk.status,
-            tk.booked_at, tk.paid_at, tk.cancelled_at,
-            tk.passenger_name, tk.passenger_document,
-            t.train_number, t.train_type,
-            st_dep.name as dep_station_name,
-            st_arr.name as arr_station_name,
-            rs_dep.departure_time,
-            rs_arr.arrival_time,
-            s.departure_date,
-            c.carriage_number,
-            se.seat_number
-        FROM tickets tk
-        JOIN schedules s ON tk.schedule_id = s.id
-        JOIN routes r ON s.route_id = r.id
-        JOIN trains t ON r.train_id = t.id
-        JOIN seats se ON tk.seat_id = se.id
-        JOIN carriages c ON se.carriage_id = c.id
-        JOIN route_stops rs_dep ON r.id = rs_dep.route_id
-            AND rs_dep.station_id = tk.departure_station_id
-        JOIN route_stops rs_arr ON r.id = rs_arr.route_id
-            AND rs_arr.station_id = tk.arrival_station_id
-        JOIN stations st_dep ON tk.departure_station_id = st_dep.id
-        JOIN stations st_arr ON tk.arrival_station_id = st_arr.id
-        WHERE tk.ticket_number = :ticket_number
+        SELECT * FROM tickets
+        WHERE user_id = :user_id
+          AND updated_at > CAST(:since AS timestamp)
+        ORDER BY updated_at
+        LIMIT :limit
     )");
+    query.bindValue(":user_id", userId);
+    query.bindValue(":since", changedAfter);
+    query.bindValue(":limit", limit + 1);
 
-    query.bindValue(":ticket_number", ticketNumber);
+    if (!query.exec()){
+        m_lastError = query.lastError().text();
+        qDebug() << "Error getting changed user tickets:" << m_lastError;
+        return false;
+    }
 
-    if (!query.exec() || !query.next()) {
-        if (found) *found = false;
-        return info;
+    while (query.next()){
+        if (tickets->size() == limit){
+            // Too much changed to send as a delta; the caller starts over.
+            tickets->clear();
+            return true;
+        }
+        tickets->append(ticketFromQuery(query));
     }
+    *complete = true;
+    return true;
+}
 
-    info.ticket.id = query.value("id").toInt();
-    info.ticket.userId = query.value("user_id").toInt();
-    info.ticket.scheduleId = query.value("schedule_id").toInt();
-    info.ticket.seatId = query.value("seat_id").toInt();
-    info.ticket.departureStationId = query.value("departure_station_id").toInt();
-    info.ticket.arrivalStationId = query.value("arrival_station_id").toInt();
-    info.ticket.ticketNumber = query.value("ticket_number").toString();
-    info.ticket.price = query.value("price").toDouble();
-    info.ticket.status = query.value("status").toString();
-    info.ticket.bookedAt = query.value("booked_at").toDateTime();
-    info.ticket.paidAt = query.value("paid_at").toDateTime();
-    info.ticket.cancelledAt = query.value("cancelled_at").toDateTime();
-    info.ticket.passengerName = query.value("passenger_name").toString();
-    info.ticket.passengerDocument = query.value("passenger_document").toString();
+TicketFullInfo Database::ticketFullInfoFromQuery(const QSqlQuery& query){
+    TicketFullInfo info;
+    info.ticket = ticketFromQuery(query);
 
     info.trainNumber = query.value("train_number").toString();
     info.trainType = query.value("train_type").toString();
@@ -1778,7 +2211,29 @@ TicketFullInfo Database::getTicketFullInfo(const QString& ticketNumber, bool* fo
 
     info.carriageNumber = query.value("carriage_number").toInt();
     info.seatNumber = query.value("seat_number").toInt();
+    return info;
+}
+
+TicketFullInfo Database::getTicketFullInfo(const QString& ticketNumber, bool* found){
+    QMutexLocker locker(&m_mutex);
+    TicketFullInfo info;
+    info.ticket.id = -1;
+
+    if (!isConnectedInternal()) {
+        if (found) *found = false;
+        return info;
+    }
 
+    QSqlQuery query(m_db);
+    query.prepare(ticketDetailsSql("tickets") + "WHERE tk.ticket_number = :ticket_number");
+    query.bindValue(":ticket_number", ticketNumber);
+
+    if (!query.exec() || !query.next()) {
+        if (found) *found = false;
+        return info;
+    }
+
+    info = ticketFullInfoFromQuery(query);
     if (found) *found = true;
     return info;
 }
@@ -1824,20 +2279,70 @@ QList<Seat> Database::getAvailableSeats(int scheduleId, int departureStationId,
     return seats;
 }
 
+bool Database::ensureTicketPartitionsInternal(const QDate& firstDate, const QDate& lastDate){
+    QSqlQuery query(m_db);
+    query.prepare("SELECT ensure_ticket_partitions(:first, :last)");
+    query.bindValue(":first", firstDate);
+    query.bindValue(":last", lastDate);
+
+    if (!query.exec() || !query.next()){
+        m_lastError = query.lastError().text();
+        return false;
+    }
+
+    int created = query.value(0).toInt();
+    if (created > 0){
+        qDebug() << "Ticket partitions created:" << created;
+    }
+    return true;
+}
+
+// Keeps a partition ready for every scheduled month. Past months stay
+// attached: queries that know the departure date prune to their own
+// partition anyway, while a user's ticket history, payment and the sync
+// feed must still find old tickets.
+void Database::maintainTicketPartitions(){
+    QMutexLocker locker(&m_mutex);
+    if (!isConnectedInternal()) return;
+
+    QSqlQuery query(m_db);
+    if (!query.exec("SELECT COALESCE(max(departure_date), CURRENT_DATE) FROM schedules") || !query.next()){
+        qWarning() << "Ticket partition maintenance failed:" << query.lastError().text();
+        return;
+    }
+    QDate lastDeparture = qMax(query.value(0).toDate(), QDate::currentDate());
+    if (!ensureTicketPartitionsInternal(QDate::currentDate(), lastDeparture)){
+        qWarning() << "Ticket partition maintenance failed:" << m_lastError;
+    }
+}
+
+// Every unpaid booking past the timeout expires, whatever month it is in.
 void Database::cleanupExpiredBookings(int timeoutMinutes){
     QMutexLocker locker(&m_mutex);
     if (!isConnectedInternal()) return;
 
     QSqlQuery query(m_db);
-    QString sql = QString(R"(
-        UPDATE tickets
-        SET status = 'expired', cancelled_at = CURRENT_TIMESTAMP
-        WHERE status = 'booked'
-          AND booked_at < (CURRENT_TIMESTAMP - INTERVAL '%1 minutes')
-    )").arg(timeoutMinutes);
+    QString sql = TicketQueries::expireBookings(timeoutMinutes);
 
     if (query.exec(sql)){
-        int expired = query.numRowsAffected();
+        int expired = 0;
+        QSet<int> affectedSchedules;
+        while (query.next()){
+            int scheduleId = query.value("schedule_id").toInt();
+            affectedSchedules.insert(scheduleId);
+            expired++;
+
+            emit seatSegmentChanged(scheduleId,
+                                    query.value("seat_id").toInt(),
+                                    query.value("departure_station_id").toInt(),
+                                    query.value("arrival_station_id").toInt(),
+                                    false);
+        }
+
+        for (int scheduleId: affectedSchedules){
+            m_searchCache->bumpScheduleVersion(scheduleId);
+        }
+
         if (expired > 0){
             qDebug() << "Expired bookings cleaned:" << expired;
         }
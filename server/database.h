@@ -3,15 +3,21 @@
 
 #include <QObject>
 #include <QSqlDatabase>
+#include <QSqlDriver>
 #include <QSqlQuery>
 #include <QSqlError>
 #include <QString>
+#include <QStringList>
 #include <QDateTime>
 #include <QCryptographicHash>
 #include <QRecursiveMutex>
 #include <QMutexLocker>
 #include <QMap>
 #include <QRandomGenerator>
+#include "migrations.h"
+#include "timetableimport.h"
+
+class SearchCache;
 
 struct User {
     int id;
@@ -177,6 +183,7 @@ public:
                    , const QString& ipAddress
                    , const QString& details = ""
                    , bool success = true);
+    bool logActions(const QList<AuditLog>& entries);
     QList<AuditLog> getAuditLogs(int userId = -1, int limit = 100);
 
     QString createSession(int userId
@@ -184,6 +191,10 @@ public:
                           , const QString& userAgent = "");
     bool validateSession(const QString& sessionToken, int* userId = nullptr);
     bool invalidateSession(const QString& sessionToken);
+    // Sessions of dropped connections stay valid only for a short reconnect
+    // window; RESUME_SESSION within it restores the full lifetime.
+    bool suspendSessions(const QStringList& sessionTokens);
+    bool resumeSession(const QString& sessionToken, int* userId);
     void cleanupExpiredSessions();
 
     int createStation(const QString& name
@@ -251,6 +262,11 @@ public:
     bool setScheduleStatus(int scheduleId, const QString& status);
     bool deleteSchedule(int scheduleId);
 
+    bool importTimetable(const TimetableImport& timetable, TimetableImport::Summary* summary = nullptr);
+    // Clears the search cache when the reference data version moved, for
+    // instance after an import run by another process.
+    bool refreshReferenceDataVersion();
+
     struct SearchResult {
         int scheduleId;
         int routeId;
@@ -267,9 +283,15 @@ public:
         int availableSeats;
     };
 
-    QList<SearchResult> searchTrains(int departureStationId
-                                     , int arrivalStationId
-                                     , const QDate& date);
+    struct BookingRequest {
+        int scheduleId;
+        int seatId;
+        int departureStationId;
+        int arrivalStationId;
+        QString passengerName;
+        QString passengerDocument;
+        double price;
+    };
 
     QString bookTicket(int userId
                        , int scheduleId
@@ -279,24 +301,65 @@ public:
                        , const QString& passengerName
                        , const QString& passengerDocument
                        , double price);
-    bool payTicket(const QString& ticketNumber);
-    bool cancelTicket(const QString& ticketNumber, const QString& reason = "");
+    // What bookTicket, cancelTicket and checkPassword do after their commit,
+    // for changes committed on another connection such as an inventory
+    // shard's or the async pool's.
+    void notifyTicketBooked(const QString& ticketNumber, const BookingRequest& request);
+    void notifyTicketCancelled(const QString& ticketNumber, const Ticket& ticket);
+    void notifyTicketPaid(const QString& ticketNumber);
+    void notifyLoginBlocked(const QString& email, bool lockedNow);
+    // Acts only on a ticket of userId and records the change in the audit
+    // log. On refusal lastError says whether the ticket is missing, someone
+    // else's or in the wrong state.
+    bool cancelTicket(int userId
+                      , const QString& ticketNumber
+                      , const QString& reason
+                      , const QString& ipAddress);
     Ticket getTicket(const QString& ticketNumber, bool* found = nullptr);
     Ticket getTicketById(int ticketId, bool* found = nullptr);
-    QList<Ticket> getUserTickets(int userId);
+    bool getUserTicket(int userId, const QString& ticketNumber, Ticket* ticket);
+    // Newest first, keyset-paginated: pass the returned nextCursor to get the
+    // following page; it is empty on the last one. The sync token names the
+    // moment the page was read and is what getUserTicketsChangedSince takes.
+    bool getUserTicketsPage(int userId
+                            , const QString& cursor
+                            , int limit
+                            , QList<Ticket>* tickets
+                            , QString* nextCursor
+                            , QString* syncToken);
+    // Tickets written since the token was issued, oldest change first. With
+    // more than limit changes nothing is returned and complete stays false.
+    bool getUserTicketsChangedSince(int userId
+                                    , const QString& since
+                                    , int limit
+                                    , QList<Ticket>* tickets
+                                    , bool* complete
+                                    , QString* syncToken);
     QList<Ticket> getScheduleTickets(int scheduleId);
     TicketFullInfo getTicketFullInfo(const QString& ticketNumber, bool* found = nullptr);
 
     void cleanupExpiredBookings(int timeoutMinutes = 15);
+    void maintainTicketPartitions();
+
+    SearchCache& searchCache();
+    bool saveWarmSnapshot(const QString& path);
+    bool loadWarmSnapshot(const QString& path);
 
     static QString hashPassword(const QString& password, const QString& salt = "");
     static QString generateSalt();
     static QString generateToken(int length = 32);
     static QString generateTicketNumber();
+    // Everything the PDF ticket shows, for the ticket rows of source, which
+    // is aliased tk: the tickets table or a CTE returning its rows.
+    static QString ticketDetailsSql(const QString& source);
+    // Why a ticket a statement looked up was not changed or returned. A null
+    // owner means no ticket has that number.
+    static QString ticketAccessError(const QVariant& ownerId, const QString& status, int userId, const QString& action);
 
     QString lastError() const;
     static QString sanitizeInput(const QString& input);
     static bool isValidEmail(const QString& email);
+    static bool segmentsOverlap(int departureA, int arrivalA, int departureB, int arrivalB);
 
 signals:
     void userCreated(int userId);
@@ -307,8 +370,20 @@ signals:
     void ticketBooked(QString ticketNumber);
     void ticketCancelled(QString ticketNumber);
     void ticketPaid(QString ticketNumber);
+    void seatSegmentChanged(int scheduleId
+                            , int seatId
+                            , int departureStationId
+                            , int arrivalStationId
+                            , bool taken);
+
+private slots:
+    void onNotification(const QString& name, QSqlDriver::NotificationSource source, const QVariant& payload);
 
 private:
+    // Share the login limits and the booking statements below.
+    friend class AsyncDatabase;
+    friend class InventoryShard;
+
     Database();
     ~Database();
 
@@ -318,12 +393,19 @@ private:
     QSqlDatabase m_db;
     QString m_lastError;
     mutable QRecursiveMutex m_mutex;
+    SearchCache* m_searchCache;
+    qint64 m_referenceDataVersion;
 
     static const int MAX_FAILED_ATTEMPTS = 5;
     static const int LOCKOUT_DURATION_MINUTES = 5;
     static const int SESSION_LIFETIME_HOURS = 24;
+    static const int SESSION_RECONNECT_WINDOW_SECONDS = 300;
     static const int PASSWORD_SALT_LENGTH = 16;
     static const int BOOKING_TIMEOUT_MINUTES = 15;
+    static const int BULK_STATEMENT_ROWS = 500;
+    static const qint64 SCHEMA_LOCK_KEY = 7305142901;
+    static const int SNAPSHOT_CLOCK_MARGIN_SECONDS = 60;
+    static const int INVENTORY_LOCK_CLASS = 7305;
 
     User getUserByEmailInternal(const QString& email, bool* found);
     User getUserByIdInternal(int id, bool* found);
@@ -339,11 +421,38 @@ private:
                            , const QString& ipAddress
                            , const QString& details
                            , bool success);
+    bool insertTicketInternal(int userId, const BookingRequest& request, QString* ticketNumber, bool logAction);
+    // The booking and cancellation statements on a given connection, so
+    // they can run outside m_mutex; errors go to *error.
+    static bool execInsertTicket(QSqlDatabase& db
+                                 , int userId
+                                 , const BookingRequest& request
+                                 , bool logAction
+                                 , QString* ticketNumber
+                                 , QString* error);
+    static bool execCancelTicket(QSqlDatabase& db
+                                 , int userId
+                                 , const QString& ticketNumber
+                                 , const QString& ipAddress
+                                 , Ticket* cancelled
+                                 , QString* error);
+    static bool lockSchedules(QSqlDatabase& db, const QList<int>& scheduleIds, QString* error);
     bool isSeatOccupiedInternal(int seatId
                                 , int scheduleId
                                 ,int departureStationId
                                 , int arrivalStationId);
-    bool initializeTables();
+    bool migrateSchema();
+    int schemaVersionInternal();
+    bool snapshotStateInternal(QDateTime* now, QString* referenceFingerprint);
+    bool ticketSyncTokenInternal(QString* syncToken);
+    static Ticket ticketFromQuery(const QSqlQuery& query);
+    static TicketFullInfo ticketFullInfoFromQuery(const QSqlQuery& query);
+    bool applyMigrationInternal(const Migrations::Migration& migration);
+    qint64 reserveIdsInternal(const QString& table, qint64 count);
+    bool ensureTicketPartitionsInternal(const QDate& firstDate, const QDate& lastDate);
+    bool copyTimetableInternal(const TimetableImport& timetable
+                               , const QHash<QString, int>& stationIds
+                               , const QHash<QString, int>& existingTrainIds);
 };
 
 #endif
@@ -0,0 +1,302 @@
+#include "inventoryshards.h"
+#include <QDebug>
+#include <QFile>
+#include <QSettings>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QThread>
+#include <memory>
+
+InventoryShard::InventoryShard(int index)
+    : m_connectionName(QString("inventory_shard_%1").arg(index))
+    , m_queued(0)
+    , m_processed(0)
+{
+}
+
+// Runs on the shard's thread: a connection may only be used by the thread
+// that opened it.
+bool InventoryShard::open(const QString& host, int port, const QString& dbName, const QString& username, const QString& password){
+    m_db = QSqlDatabase::addDatabase("QPSQL", m_connectionName);
+    m_db.setHostName(host);
+    m_db.setPort(port);
+    m_db.setDatabaseName(dbName);
+    m_db.setUserName(username);
+    m_db.setPassword(password);
+    m_db.setConnectOptions("connect_timeout=10;sslmode=prefer");
+
+    if (!m_db.open()){
+        qDebug() << "Inventory shard connection failed:" << m_db.lastError().text();
+        return false;
+    }
+    return true;
+}
+
+void InventoryShard::close(){
+    m_db.close();
+    m_db = QSqlDatabase();
+    QSqlDatabase::removeDatabase(m_connectionName);
+}
+
+// The advisory lock is uncontended unless a batch or another server
+// instance books on the same schedule.
+bool InventoryShard::bookTicket(int userId, const Database::BookingRequest& request, QString* ticketNumber, QString* error){
+    if (!m_db.transaction()){
+        *error = m_db.lastError().text();
+        return false;
+    }
+
+    if (!Database::lockSchedules(m_db, {request.scheduleId}, error)
+        || !Database::execInsertTicket(m_db, userId, request, true, ticketNumber, error)){
+        m_db.rollback();
+        return false;
+    }
+
+    if (!m_db.commit()){
+        *error = m_db.lastError().text();
+        m_db.rollback();
+        return false;
+    }
+    return true;
+}
+
+bool InventoryShard::bookTickets(int userId, const QList<Database::BookingRequest>& requests, QStringList* ticketNumbers, int* failedItem, QString* error){
+    *failedItem = -1;
+    if (!m_db.transaction()){
+        *error = m_db.lastError().text();
+        return false;
+    }
+
+    QList<int> scheduleIds;
+    for (const Database::BookingRequest& request: requests){
+        scheduleIds.append(request.scheduleId);
+    }
+    if (!Database::lockSchedules(m_db, scheduleIds, error)){
+        m_db.rollback();
+        return false;
+    }
+
+    QStringList numbers;
+    for (int i = 0; i < requests.size(); i++){
+        QString ticketNumber;
+        if (!Database::execInsertTicket(m_db, userId, requests[i], false, &ticketNumber, error)){
+            *failedItem = i;
+            m_db.rollback();
+            return false;
+        }
+        numbers.append(ticketNumber);
+    }
+
+    QSqlQuery audit(m_db);
+    audit.prepare(R"(
+        INSERT INTO audit_logs (user_id, action, details, success)
+        VALUES (:user_id, 'tickets_booked', :details, true)
+    )");
+    audit.bindValue(":user_id", userId);
+    audit.bindValue(":details", QString("Tickets %1 booked").arg(numbers.join(", ")));
+    if (!audit.exec()){
+        *error = audit.lastError().text();
+        m_db.rollback();
+        return false;
+    }
+    if (!m_db.commit()){
+        *error = m_db.lastError().text();
+        m_db.rollback();
+        return false;
+    }
+
+    *ticketNumbers = numbers;
+    return true;
+}
+
+bool InventoryShard::cancelTicket(int userId, const QString& ticketNumber, const QString& ipAddress, Ticket* cancelled, QString* error){
+    return Database::execCancelTicket(m_db, userId, ticketNumber, ipAddress, cancelled, error);
+}
+
+InventoryShards& InventoryShards::instance(){
+    static InventoryShards instance;
+    return instance;
+}
+
+InventoryShards::~InventoryShards(){
+    stop();
+}
+
+bool InventoryShards::start(const QString& host, int port, const QString& dbName, const QString& username, const QString& password, int shards){
+    if (!m_shards.isEmpty()){
+        qDebug() << "Inventory shards are already running";
+        return true;
+    }
+
+    for (int i = 0; i < qMax(1, shards); i++){
+        InventoryShard* shard = new InventoryShard(i);
+        QThread* thread = new QThread;
+        thread->setObjectName(QString("inventory-shard-%1").arg(i));
+        shard->moveToThread(thread);
+        thread->start();
+        m_shards.append(shard);
+        m_threads.append(thread);
+
+        bool opened = false;
+        QMetaObject::invokeMethod(shard, [&](){
+            opened = shard->open(host, port, dbName, username, password);
+        }, Qt::BlockingQueuedConnection);
+
+        if (!opened){
+            m_lastError = QString("Inventory shard %1 could not connect to the database").arg(i);
+            stop();
+            return false;
+        }
+    }
+
+    qDebug() << "Inventory shards ready:" << m_shards.size();
+    return true;
+}
+
+bool InventoryShards::startFromConfig(const QString& configPath){
+    if (!QFile::exists(configPath)){
+        m_lastError = QString("Configuration file not found: %1").arg(configPath);
+        return false;
+    }
+
+    QSettings settings(configPath, QSettings::IniFormat);
+    return start(settings.value("database/host", "localhost").toString(),
+                 settings.value("database/port", 5432).toInt(),
+                 settings.value("database/name", "train_tickets").toString(),
+                 settings.value("database/username", "").toString(),
+                 settings.value("database/password", "").toString(),
+                 settings.value("database/inventory_shards", DEFAULT_SHARDS).toInt());
+}
+
+// Jobs are queued ahead of the close, so they all run first.
+void InventoryShards::stop(){
+    for (int i = 0; i < m_shards.size(); i++){
+        InventoryShard* shard = m_shards[i];
+        QThread* thread = m_threads[i];
+        if (thread->isRunning()){
+            QMetaObject::invokeMethod(shard, [shard](){
+                shard->close();
+            }, Qt::BlockingQueuedConnection);
+            thread->quit();
+            thread->wait();
+        }
+        delete shard;
+        delete thread;
+    }
+    m_shards.clear();
+    m_threads.clear();
+}
+
+int InventoryShards::shardFor(int scheduleId) const{
+    return int(uint(scheduleId) % uint(m_shards.size()));
+}
+
+QList<InventoryShards::ShardStats> InventoryShards::stats() const{
+    QList<ShardStats> stats;
+    for (const InventoryShard* shard: m_shards){
+        stats.append(ShardStats{shard->m_queued.load(), shard->m_processed.load()});
+    }
+    return stats;
+}
+
+void InventoryShards::post(int scheduleId, std::function<void(InventoryShard*)> job){
+    InventoryShard* shard = m_shards[shardFor(scheduleId)];
+    shard->m_queued++;
+    QMetaObject::invokeMethod(shard, [shard, job](){
+        job(shard);
+        shard->m_queued--;
+        shard->m_processed++;
+    }, Qt::QueuedConnection);
+}
+
+// The completion runs on this thread; the shard's thread only hands the
+// shared pointer back, so it never touches the context guard.
+void InventoryShards::bookTicket(int userId, const Database::BookingRequest& request, QObject* context
+                                 , std::function<void(bool ok, const QString& ticketNumber, const QString& error)> callback){
+    if (m_shards.isEmpty()){
+        callback(false, QString(), "No connection to database");
+        return;
+    }
+
+    auto finish = std::make_shared<std::function<void(bool, const QString&, const QString&)>>(
+        [request, guard = QPointer<QObject>(context), hasContext = context != nullptr, callback]
+        (bool ok, const QString& ticketNumber, const QString& error){
+            if (ok){
+                Database::instance().notifyTicketBooked(ticketNumber, request);
+            }
+            if (hasContext && !guard){
+                return;
+            }
+            callback(ok, ticketNumber, error);
+        });
+
+    post(request.scheduleId, [this, userId, request, finish](InventoryShard* shard){
+        QString ticketNumber;
+        QString error;
+        bool ok = shard->bookTicket(userId, request, &ticketNumber, &error);
+        QMetaObject::invokeMethod(this, [finish, ok, ticketNumber, error](){
+            (*finish)(ok, ticketNumber, error);
+        }, Qt::QueuedConnection);
+    });
+}
+
+void InventoryShards::bookTickets(int userId, const QList<Database::BookingRequest>& requests, QObject* context
+                                  , std::function<void(bool ok, const QStringList& ticketNumbers, int failedItem, const QString& error)> callback){
+    if (m_shards.isEmpty() || requests.isEmpty()){
+        callback(false, QStringList(), -1, m_shards.isEmpty() ? "No connection to database" : "Nothing to book");
+        return;
+    }
+
+    auto finish = std::make_shared<std::function<void(bool, const QStringList&, int, const QString&)>>(
+        [requests, guard = QPointer<QObject>(context), hasContext = context != nullptr, callback]
+        (bool ok, const QStringList& ticketNumbers, int failedItem, const QString& error){
+            if (ok){
+                for (int i = 0; i < ticketNumbers.size(); i++){
+                    Database::instance().notifyTicketBooked(ticketNumbers[i], requests[i]);
+                }
+            }
+            if (hasContext && !guard){
+                return;
+            }
+            callback(ok, ticketNumbers, failedItem, error);
+        });
+
+    post(requests.first().scheduleId, [this, userId, requests, finish](InventoryShard* shard){
+        QStringList ticketNumbers;
+        int failedItem = -1;
+        QString error;
+        bool ok = shard->bookTickets(userId, requests, &ticketNumbers, &failedItem, &error);
+        QMetaObject::invokeMethod(this, [finish, ok, ticketNumbers, failedItem, error](){
+            (*finish)(ok, ticketNumbers, failedItem, error);
+        }, Qt::QueuedConnection);
+    });
+}
+
+void InventoryShards::cancelTicket(int userId, int scheduleId, const QString& ticketNumber, const QString& ipAddress, QObject* context
+                                   , std::function<void(bool ok, const QString& error)> callback){
+    if (m_shards.isEmpty()){
+        callback(false, "No connection to database");
+        return;
+    }
+
+    auto finish = std::make_shared<std::function<void(bool, const Ticket&, const QString&)>>(
+        [ticketNumber, guard = QPointer<QObject>(context), hasContext = context != nullptr, callback]
+        (bool ok, const Ticket& cancelled, const QString& error){
+            if (ok){
+                Database::instance().notifyTicketCancelled(ticketNumber, cancelled);
+            }
+            if (hasContext && !guard){
+                return;
+            }
+            callback(ok, error);
+        });
+
+    post(scheduleId, [this, userId, ticketNumber, ipAddress, finish](InventoryShard* shard){
+        Ticket cancelled;
+        QString error;
+        bool ok = shard->cancelTicket(userId, ticketNumber, ipAddress, &cancelled, &error);
+        QMetaObject::invokeMethod(this, [finish, ok, cancelled, error](){
+            (*finish)(ok, cancelled, error);
+        }, Qt::QueuedConnection);
+    });
+}
@@ -0,0 +1,109 @@
+#ifndef INVENTORYSHARDS_H
+#define INVENTORYSHARDS_H
+
+#include <QObject>
+#include <QPointer>
+#include <QSqlDatabase>
+#include <QList>
+#include <atomic>
+#include <functional>
+#include "database.h"
+
+class QThread;
+
+// One shard: a thread with its own database connection that runs the jobs
+// posted to it one at a time, in order. Its event queue is the mailbox.
+class InventoryShard : public QObject{
+    Q_OBJECT
+
+public:
+    explicit InventoryShard(int index);
+
+    bool open(const QString& host, int port, const QString& dbName, const QString& username, const QString& password);
+    void close();
+
+    bool bookTicket(int userId, const Database::BookingRequest& request, QString* ticketNumber, QString* error);
+    bool bookTickets(int userId, const QList<Database::BookingRequest>& requests, QStringList* ticketNumbers, int* failedItem, QString* error);
+    bool cancelTicket(int userId, const QString& ticketNumber, const QString& ipAddress, Ticket* cancelled, QString* error);
+
+private:
+    friend class InventoryShards;
+
+    QString m_connectionName;
+    QSqlDatabase m_db;
+    std::atomic<int> m_queued;
+    std::atomic<quint64> m_processed;
+};
+
+// Bookings and cancellations, split over shards by schedule. A schedule
+// always lands on the same shard, so single bookings and cancellations of
+// a schedule have one writer, and those of schedules on different shards
+// never wait for one another: not on a lock and not on a connection. A
+// group booking is one transaction and can span schedules of several
+// shards; it runs on the shard of its first schedule, and the advisory
+// schedule locks every writer takes keep it from selling a seat that
+// another shard is booking at the same time. Results come back on the
+// thread that owns InventoryShards; a callback whose context object has
+// been destroyed is dropped, but the search cache and seat map subscribers
+// hear of the change either way.
+class InventoryShards : public QObject{
+    Q_OBJECT
+
+public:
+    struct ShardStats {
+        int queued;
+        quint64 processed;
+    };
+
+    static InventoryShards& instance();
+
+    bool start(const QString& host
+               , int port
+               , const QString& dbName
+               , const QString& username
+               , const QString& password
+               , int shards = DEFAULT_SHARDS);
+    bool startFromConfig(const QString& configPath = "config/database.conf");
+    // Finishes the jobs already posted, then closes the connections.
+    void stop();
+    bool isRunning() const { return !m_shards.isEmpty(); }
+    int shardFor(int scheduleId) const;
+    QList<ShardStats> stats() const;
+    QString lastError() const { return m_lastError; }
+
+    // Same rules and messages as Database::bookTicket.
+    void bookTicket(int userId
+                    , const Database::BookingRequest& request
+                    , QObject* context
+                    , std::function<void(bool ok, const QString& ticketNumber, const QString& error)> callback);
+    // All of the bookings or none, in one transaction. When one of them is
+    // refused failedItem is its index in requests, otherwise -1.
+    void bookTickets(int userId
+                     , const QList<Database::BookingRequest>& requests
+                     , QObject* context
+                     , std::function<void(bool ok, const QStringList& ticketNumbers, int failedItem, const QString& error)> callback);
+    // Same rules and messages as Database::cancelTicket. The schedule picks
+    // the shard, so the caller looks the ticket up first.
+    void cancelTicket(int userId
+                      , int scheduleId
+                      , const QString& ticketNumber
+                      , const QString& ipAddress
+                      , QObject* context
+                      , std::function<void(bool ok, const QString& error)> callback);
+
+private:
+    InventoryShards() = default;
+    ~InventoryShards();
+    InventoryShards(const InventoryShards&) = delete;
+    InventoryShards& operator=(const InventoryShards&) = delete;
+
+    static const int DEFAULT_SHARDS = 4;
+
+    void post(int scheduleId, std::function<void(InventoryShard*)> job);
+
+    QList<InventoryShard*> m_shards;
+    QList<QThread*> m_threads;
+    QString m_lastError;
+};
+
+#endif // INVENTORYSHARDS_H
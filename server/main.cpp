@@ -2,8 +2,21 @@
 #include <QDebug>
 #include <QDateTime>
 #include <QTextStream>
+#include <QSocketNotifier>
 #include "apiserver.h"
 #include "database.h"
+#include "asyncdatabase.h"
+#include "inventoryshards.h"
+#include "sockethandoff.h"
+
+#include <climits>
+
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
 
 void printBanner()
 {
@@ -28,6 +41,76 @@ void printServerInfo(quint16 port, const QString& host)
     out.flush();
 }
 
+// Every connection holds a file descriptor, so the soft limit is raised to
+// the hard limit. Returns the resulting limit, or -1 if it is unknown.
+int raiseOpenFileLimit()
+{
+#ifdef Q_OS_UNIX
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+        return -1;
+    }
+
+    if (limit.rlim_cur != limit.rlim_max) {
+        rlim_t previous = limit.rlim_cur;
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+            limit.rlim_cur = previous;
+        }
+    }
+
+    if (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > rlim_t(INT_MAX)) {
+        return INT_MAX;
+    }
+    return int(limit.rlim_cur);
+#else
+    return -1;
+#endif
+}
+
+#ifdef Q_OS_UNIX
+static int signalPipe[2] = {-1, -1};
+
+static void onTerminationSignal(int signalNumber)
+{
+    char byte = char(signalNumber);
+    ssize_t written = ::write(signalPipe[1], &byte, 1);
+    Q_UNUSED(written);
+}
+
+// Signal handlers may only write to the pipe; the notifier turns that into
+// an event on the main loop. The first signal drains, a second one exits.
+static void installTerminationHandler(ApiServer* server)
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, signalPipe) != 0) {
+        qWarning() << "Cannot install signal handler, SIGTERM will not drain";
+        return;
+    }
+
+    QSocketNotifier* notifier = new QSocketNotifier(signalPipe[0], QSocketNotifier::Read, server);
+    QObject::connect(notifier, &QSocketNotifier::activated, server, [server]() {
+        char byte;
+        if (::read(signalPipe[0], &byte, 1) != 1) {
+            return;
+        }
+        if (server->isDraining()) {
+            qDebug() << "Second termination signal, exiting now";
+            QCoreApplication::quit();
+            return;
+        }
+        qDebug() << "Termination signal received, draining connections";
+        server->drain();
+    });
+
+    struct sigaction action;
+    action.sa_handler = onTerminationSignal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGTERM, &action, nullptr);
+    sigaction(SIGINT, &action, nullptr);
+}
+#endif
+
 int main(int argc, char *argv[])
 {
     QApplication app(argc, argv);
@@ -52,6 +135,14 @@ int main(int argc, char *argv[])
 
     QString host = "0.0.0.0";
     quint16 port = 8080;
+    int idleTimeout = 300;
+    int maxConnections = 1000;
+    int drainTimeout = 30;
+    QString tlsCertPath;
+    QString tlsKeyPath;
+    QString handoffPath;
+    QString snapshotPath = "config/warmstart.snapshot";
+    QString timetablePath;
 
     QStringList args = app.arguments();
     for (int i = 1; i < args.size(); ++i) {
@@ -63,6 +154,38 @@ int main(int argc, char *argv[])
             if (i + 1 < args.size()) {
                 host = args[++i];
             }
+        } else if (args[i] == "--idle-timeout") {
+            if (i + 1 < args.size()) {
+                idleTimeout = args[++i].toInt();
+            }
+        } else if (args[i] == "--max-connections") {
+            if (i + 1 < args.size()) {
+                maxConnections = args[++i].toInt();
+            }
+        } else if (args[i] == "--drain-timeout") {
+            if (i + 1 < args.size()) {
+                drainTimeout = args[++i].toInt();
+            }
+        } else if (args[i] == "--handoff-socket") {
+            if (i + 1 < args.size()) {
+                handoffPath = args[++i];
+            }
+        } else if (args[i] == "--snapshot") {
+            if (i + 1 < args.size()) {
+                snapshotPath = args[++i];
+            }
+        } else if (args[i] == "--import-timetable") {
+            if (i + 1 < args.size()) {
+                timetablePath = args[++i];
+            }
+        } else if (args[i] == "--tls-cert") {
+            if (i + 1 < args.size()) {
+                tlsCertPath = args[++i];
+            }
+        } else if (args[i] == "--tls-key") {
+            if (i + 1 < args.size()) {
+                tlsKeyPath = args[++i];
+            }
         } else if (args[i] == "--help") {
             QTextStream out(stdout);
             out << "Usage: " << args[0] << " [OPTIONS]\n";
@@ -70,25 +193,109 @@ int main(int argc, char *argv[])
             out << "Options:\n";
             out << "  -p, --port PORT    Set server port (default: 8080)\n";
             out << "  -h, --host HOST    Set server host (default: 0.0.0.0)\n";
+            out << "  --max-connections N Accept at most N simultaneous clients (default: 1000)\n";
+            out << "  --idle-timeout SEC Close connections idle for SEC seconds, 0 disables (default: 300)\n";
+            out << "  --drain-timeout SEC Wait up to SEC seconds for clients on shutdown (default: 30)\n";
+            out << "  --handoff-socket PATH Take the listening socket from a server on PATH, then serve PATH\n";
+            out << "  --snapshot FILE    Warm-start cache snapshot, empty disables (default: config/warmstart.snapshot)\n";
+            out << "  --import-timetable FILE Load trains, routes and schedules from a CSV file, then exit\n";
+            out << "  --tls-cert FILE    PEM certificate chain; enables TLS together with --tls-key\n";
+            out << "  --tls-key FILE     PEM private key (RSA or EC)\n";
             out << "  --help             Show this help message\n";
             out << "\n";
             out << "Examples:\n";
             out << "  " << args[0] << " --port 9090\n";
             out << "  " << args[0] << " --host 127.0.0.1 --port 8080\n";
+            out << "  " << args[0] << " --handoff-socket /run/railway/handoff   (restart without dropping the port)\n";
             out.flush();
             return 0;
         }
     }
 
-    server.setMaxConnections(100);
-    server.setConnectionTimeout(300);
+    if (!timetablePath.isEmpty()) {
+        TimetableImport timetable;
+        TimetableImport::Summary summary;
+        if (!timetable.parseFile(timetablePath)) {
+            qCritical() << "Failed to read timetable:" << timetable.lastError();
+            return 1;
+        }
+        if (!Database::instance().importTimetable(timetable, &summary)) {
+            qCritical() << "Failed to import timetable:" << Database::instance().lastError();
+            return 1;
+        }
+        qDebug() << "Imported" << summary.trains << "trains," << summary.routes << "routes and"
+                 << summary.schedules << "schedules from" << timetablePath;
+        return 0;
+    }
+
+    if (!AsyncDatabase::instance().connectFromConfig("config/database.conf")) {
+        qCritical() << "Failed to open the async database connections!";
+        qCritical() << "Error:" << AsyncDatabase::instance().lastError();
+        return 1;
+    }
+
+    if (!InventoryShards::instance().startFromConfig("config/database.conf")) {
+        qCritical() << "Failed to start the inventory shards!";
+        qCritical() << "Error:" << InventoryShards::instance().lastError();
+        return 1;
+    }
+
+    if (!snapshotPath.isEmpty()) {
+        Database::instance().loadWarmSnapshot(snapshotPath);
+    }
+
+    const int reservedDescriptors = 64;
+    int fileLimit = raiseOpenFileLimit();
+    if (fileLimit > 0 && maxConnections > fileLimit - reservedDescriptors) {
+        qWarning() << "Open file limit is" << fileLimit << "- lowering max connections from"
+                   << maxConnections << "to" << fileLimit - reservedDescriptors;
+        maxConnections = qMax(1, fileLimit - reservedDescriptors);
+    }
+
+    server.setMaxConnections(maxConnections);
+    server.setConnectionTimeout(idleTimeout);
     server.setBookingTimeout(15);
-    if (!server.startServer(port, host)) {
+    server.setDrainTimeout(drainTimeout);
+    if (!tlsCertPath.isEmpty() || !tlsKeyPath.isEmpty()) {
+        if (tlsCertPath.isEmpty() || tlsKeyPath.isEmpty()) {
+            qCritical() << "Both --tls-cert and --tls-key are required to enable TLS";
+            return 1;
+        }
+        if (!server.enableSSL(tlsCertPath, tlsKeyPath)) {
+            qCritical() << "Failed to enable TLS!";
+            return 1;
+        }
+    }
+
+    qintptr inheritedListener = -1;
+    if (!handoffPath.isEmpty()) {
+        QString handoffError;
+        inheritedListener = SocketHandoff::receiveListener(handoffPath, 5000, &handoffError);
+        if (inheritedListener < 0) {
+            qDebug() << "No listening socket inherited:" << handoffError;
+        }
+    }
+
+    if (inheritedListener >= 0) {
+        if (!server.adoptListener(inheritedListener)) {
+            qCritical() << "Failed to take over the listening socket!";
+            return 1;
+        }
+    } else if (!server.startServer(port, host)) {
         qCritical() << "Failed to start server!";
         qCritical() << "Make sure port" << port << "is not already in use.";
         return 1;
     }
 
+    if (!handoffPath.isEmpty()) {
+        server.enableHandoff(handoffPath);
+    }
+
+    QObject::connect(&server, &ApiServer::drained, &app, &QCoreApplication::quit);
+#ifdef Q_OS_UNIX
+    installTerminationHandler(&server);
+#endif
+
     printServerInfo(port, host);
 
     QObject::connect(&server, &ApiServer::clientConnected, [](QString address, quint16 port) {
@@ -110,7 +317,16 @@ int main(int argc, char *argv[])
     int result = app.exec();
 
     qDebug() << "\nShutting down server...";
+    // Bookings still queued on the shards finish first. Their completions
+    // answer clients, notify seat map subscribers and update the search
+    // cache, so they are delivered while the clients are connected and
+    // before the snapshot is written.
+    InventoryShards::instance().stop();
+    QCoreApplication::processEvents(QEventLoop::AllEvents, 1000);
     server.stopServer();
+    if (!snapshotPath.isEmpty()) {
+        Database::instance().saveWarmSnapshot(snapshotPath);
+    }
 
     qDebug() << "Server stopped.";
     qDebug() << "Goodbye!";
@@ -0,0 +1,363 @@
+#ifndef MIGRATIONS_H
+#define MIGRATIONS_H
+
+#include <QList>
+#include <QString>
+#include <QStringList>
+
+// Ordered schema changes. Database applies every migration above the version
+// recorded in schema_version, each in its own transaction, and never edits
+// one that has shipped: a change to the schema is always a new entry at the
+// end. init_db.sql creates the same schema directly and records the latest
+// version, so both must be updated together.
+namespace Migrations {
+
+struct Migration {
+    int version;
+    QString description;
+    QStringList statements;
+};
+
+inline const QList<Migration>& all(){
+    static const QList<Migration> migrations = {
+        {1, "Initial schema", {
+            R"(
+            CREATE TABLE IF NOT EXISTS users (
+                id SERIAL PRIMARY KEY,
+                name VARCHAR(100) NOT NULL,
+                surname VARCHAR(100) NOT NULL,
+                email VARCHAR(255) UNIQUE NOT NULL,
+                password_hash VARCHAR(255) NOT NULL,
+                password_salt VARCHAR(32) NOT NULL,
+                created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+                is_verified BOOLEAN DEFAULT FALSE,
+                last_login TIMESTAMP,
+                failed_login_attempts INTEGER DEFAULT 0,
+                locked_until TIMESTAMP,
+                CONSTRAINT email_format CHECK (email ~* '^[A-Za-z0-9._%+-]+@[A-Za-z0-9.-]+\.[A-Z|a-z]{2,}$')
+            )
+            )",
+            R"(
+            CREATE TABLE IF NOT EXISTS audit_logs (
+                id SERIAL PRIMARY KEY,
+                user_id INTEGER REFERENCES users(id) ON DELETE SET NULL,
+                action VARCHAR(100) NOT NULL,
+                ip_address VARCHAR(45),
+                timestamp TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+                details TEXT,
+                success BOOLEAN DEFAULT TRUE
+            )
+            )",
+            R"(
+            CREATE TABLE IF NOT EXISTS verification_codes (
+                id SERIAL PRIMARY KEY,
+                user_id INTEGER NOT NULL REFERENCES users(id) ON DELETE CASCADE,
+                email VARCHAR(255) NOT NULL,
+                code VARCHAR(6) NOT NULL,
+                created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+                expires_at TIMESTAMP NOT NULL,
+                is_used BOOLEAN DEFAULT FALSE
+            )
+            )",
+            R"(
+            CREATE TABLE IF NOT EXISTS sessions (
+                id SERIAL PRIMARY KEY,
+                user_id INTEGER NOT NULL REFERENCES users(id) ON DELETE CASCADE,
+                session_token VARCHAR(64) UNIQUE NOT NULL,
+                ip_address VARCHAR(45),
+                user_agent TEXT,
+                created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+                expires_at TIMESTAMP NOT NULL,
+                is_active BOOLEAN DEFAULT TRUE
+            )
+            )",
+            R"(
+            CREATE TABLE IF NOT EXISTS stations (
+                id SERIAL PRIMARY KEY,
+                name VARCHAR(255) NOT NULL,
+                city VARCHAR(100) NOT NULL,
+                code VARCHAR(10) UNIQUE NOT NULL,
+                latitude DOUBLE PRECISION NOT NULL,
+                longitude DOUBLE PRECISION NOT NULL,
+                created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
+            )
+            )",
+            R"(
+            CREATE TABLE IF NOT EXISTS trains (
+                id SERIAL PRIMARY KEY,
+                train_number VARCHAR(20) UNIQUE NOT NULL,
+                train_type VARCHAR(50) NOT NULL,
+                total_seats INTEGER NOT NULL,
+                is_active BOOLEAN DEFAULT TRUE,
+                created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
+            )
+            )",
+            R"(
+            CREATE TABLE IF NOT EXISTS routes (
+                id SERIAL PRIMARY KEY,
+                train_id INTEGER NOT NULL REFERENCES trains(id) ON DELETE CASCADE,
+                route_name VARCHAR(255) NOT NULL,
+                valid_from DATE NOT NULL,
+                valid_to DATE NOT NULL,
+                created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
+            )
+            )",
+            R"(
+            CREATE TABLE IF NOT EXISTS route_stops (
+                id SERIAL PRIMARY KEY,
+                route_id INTEGER NOT NULL REFERENCES routes(id) ON DELETE CASCADE,
+                station_id INTEGER NOT NULL REFERENCES stations(id) ON DELETE CASCADE,
+                stop_order INTEGER NOT NULL,
+                arrival_time TIME,
+                departure_time TIME NOT NULL,
+                stop_duration_minutes INTEGER DEFAULT 0,
+                price_from_start DOUBLE PRECISION NOT NULL,
+                UNIQUE(route_id, stop_order),
+                UNIQUE(route_id, station_id)
+            )
+            )",
+            R"(
+            CREATE TABLE IF NOT EXISTS carriages (
+                id SERIAL PRIMARY KEY,
+                train_id INTEGER NOT NULL REFERENCES trains(id) ON DELETE CASCADE,
+                carriage_number INTEGER NOT NULL,
+                carriage_type VARCHAR(50) NOT NULL,
+                total_seats INTEGER NOT NULL,
+                price_multiplier DOUBLE PRECISION DEFAULT 1.0,
+                UNIQUE(train_id, carriage_number)
+            )
+            )",
+            R"(
+            CREATE TABLE IF NOT EXISTS seats (
+                id SERIAL PRIMARY KEY,
+                carriage_id INTEGER NOT NULL REFERENCES carriages(id) ON DELETE CASCADE,
+                seat_number INTEGER NOT NULL,
+                seat_type VARCHAR(50) NOT NULL,
+                is_available BOOLEAN DEFAULT TRUE,
+                UNIQUE(carriage_id, seat_number)
+            )
+            )",
+            R"(
+            CREATE TABLE IF NOT EXISTS schedules (
+                id SERIAL PRIMARY KEY,
+                route_id INTEGER NOT NULL REFERENCES routes(id) ON DELETE CASCADE,
+                departure_date DATE NOT NULL,
+                status VARCHAR(20) DEFAULT 'active',
+                created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+                UNIQUE(route_id, departure_date)
+            )
+            )",
+            R"(
+            CREATE TABLE IF NOT EXISTS tickets (
+                id SERIAL PRIMARY KEY,
+                user_id INTEGER NOT NULL REFERENCES users(id) ON DELETE CASCADE,
+                schedule_id INTEGER NOT NULL REFERENCES schedules(id) ON DELETE CASCADE,
+                seat_id INTEGER NOT NULL REFERENCES seats(id) ON DELETE CASCADE,
+                departure_station_id INTEGER NOT NULL REFERENCES stations(id),
+                arrival_station_id INTEGER NOT NULL REFERENCES stations(id),
+                ticket_number VARCHAR(50) UNIQUE NOT NULL,
+                price DOUBLE PRECISION NOT NULL,
+                status VARCHAR(20) DEFAULT 'booked',
+                booked_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+                paid_at TIMESTAMP,
+                cancelled_at TIMESTAMP,
+                passenger_name VARCHAR(200) NOT NULL,
+                passenger_document VARCHAR(50) NOT NULL
+            )
+            )",
+            "CREATE INDEX IF NOT EXISTS idx_users_email ON users(email)",
+            "CREATE INDEX IF NOT EXISTS idx_users_locked_until ON users(locked_until)",
+            "CREATE INDEX IF NOT EXISTS idx_audit_user ON audit_logs(user_id)",
+            "CREATE INDEX IF NOT EXISTS idx_audit_timestamp ON audit_logs(timestamp)",
+            "CREATE INDEX IF NOT EXISTS idx_sessions_token ON sessions(session_token)",
+            "CREATE INDEX IF NOT EXISTS idx_sessions_user ON sessions(user_id)",
+            "CREATE INDEX IF NOT EXISTS idx_sessions_expires ON sessions(expires_at)",
+            "CREATE INDEX IF NOT EXISTS idx_stations_code ON stations(code)",
+            "CREATE INDEX IF NOT EXISTS idx_trains_number ON trains(train_number)",
+            "CREATE INDEX IF NOT EXISTS idx_routes_train ON routes(train_id)",
+            "CREATE INDEX IF NOT EXISTS idx_route_stops_route ON route_stops(route_id)",
+            "CREATE INDEX IF NOT EXISTS idx_schedules_route_date ON schedules(route_id, departure_date)",
+            "CREATE INDEX IF NOT EXISTS idx_tickets_user ON tickets(user_id)",
+            "CREATE INDEX IF NOT EXISTS idx_tickets_schedule ON tickets(schedule_id)",
+            "CREATE INDEX IF NOT EXISTS idx_tickets_number ON tickets(ticket_number)",
+            "CREATE INDEX IF NOT EXISTS idx_tickets_status ON tickets(status)",
+            "CREATE INDEX IF NOT EXISTS idx_verification_codes_user ON verification_codes(user_id)",
+            "CREATE INDEX IF NOT EXISTS idx_verification_codes_code ON verification_codes(code)",
+            "CREATE INDEX IF NOT EXISTS idx_verification_codes_expires ON verification_codes(expires_at)"
+        }},
+        // Databases created by the server before migrations existed got a
+        // narrower column than init_db.sql; widening a varchar is catalog-only.
+        {2, "Widen tickets.ticket_number to match init_db.sql", {
+            "ALTER TABLE tickets ALTER COLUMN ticket_number TYPE VARCHAR(50)"
+        }},
+        // Lets a warm-start snapshot find the schedules whose tickets changed
+        // while the server was down.
+        {3, "Track ticket modification time", {
+            "ALTER TABLE tickets ADD COLUMN IF NOT EXISTS updated_at TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP",
+            R"(
+            CREATE OR REPLACE FUNCTION touch_updated_at() RETURNS trigger AS $$
+            BEGIN
+                NEW.updated_at = clock_timestamp();
+                RETURN NEW;
+            END
+            $$ LANGUAGE plpgsql
+            )",
+            "DROP TRIGGER IF EXISTS tickets_touch_updated_at ON tickets",
+            "CREATE TRIGGER tickets_touch_updated_at BEFORE UPDATE ON tickets FOR EACH ROW EXECUTE FUNCTION touch_updated_at()",
+            "CREATE INDEX IF NOT EXISTS idx_tickets_updated_at ON tickets(updated_at)"
+        }},
+        // Tickets are range-partitioned by the departure date of their
+        // schedule, one partition per month, so queries that know the date
+        // touch a single partition.
+        // A partition key has to be part of every unique index, which makes
+        // ticket_number unique per month rather than globally; generated
+        // numbers embed a millisecond timestamp, so this loses nothing.
+        {4, "Partition tickets by departure month", {
+            R"(
+            CREATE OR REPLACE FUNCTION ensure_ticket_partitions(first_date DATE, last_date DATE) RETURNS INTEGER AS $$
+            DECLARE
+                month_start DATE := date_trunc('month', first_date)::date;
+                partition_name TEXT;
+                created INTEGER := 0;
+            BEGIN
+                WHILE month_start <= last_date LOOP
+                    partition_name := 'tickets_' || to_char(month_start, 'YYYY_MM');
+                    IF to_regclass(partition_name) IS NULL THEN
+                        EXECUTE format('CREATE TABLE %I PARTITION OF tickets FOR VALUES FROM (%L) TO (%L)',
+                                       partition_name, month_start, (month_start + INTERVAL '1 month')::date);
+                        created := created + 1;
+                    END IF;
+                    month_start := (month_start + INTERVAL '1 month')::date;
+                END LOOP;
+                RETURN created;
+            END
+            $$ LANGUAGE plpgsql
+            )",
+            "ALTER TABLE tickets RENAME TO tickets_unpartitioned",
+            "ALTER TABLE tickets_unpartitioned RENAME CONSTRAINT tickets_pkey TO tickets_unpartitioned_pkey",
+            "ALTER TABLE tickets_unpartitioned RENAME CONSTRAINT tickets_ticket_number_key TO tickets_unpartitioned_ticket_number_key",
+            "DROP TRIGGER IF EXISTS tickets_touch_updated_at ON tickets_unpartitioned",
+            "DROP INDEX IF EXISTS idx_tickets_user, idx_tickets_schedule, idx_tickets_number, idx_tickets_status, idx_tickets_updated_at",
+            R"(
+            CREATE TABLE tickets (
+                id INTEGER NOT NULL DEFAULT nextval('tickets_id_seq'),
+                user_id INTEGER NOT NULL REFERENCES users(id) ON DELETE CASCADE,
+                schedule_id INTEGER NOT NULL REFERENCES schedules(id) ON DELETE CASCADE,
+                seat_id INTEGER NOT NULL REFERENCES seats(id) ON DELETE CASCADE,
+                departure_station_id INTEGER NOT NULL REFERENCES stations(id),
+                arrival_station_id INTEGER NOT NULL REFERENCES stations(id),
+                departure_date DATE NOT NULL,
+                ticket_number VARCHAR(50) NOT NULL,
+                price DOUBLE PRECISION NOT NULL,
+                status VARCHAR(20) DEFAULT 'booked',
+                booked_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+                paid_at TIMESTAMP,
+                cancelled_at TIMESTAMP,
+                passenger_name VARCHAR(200) NOT NULL,
+                passenger_document VARCHAR(50) NOT NULL,
+                updated_at TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP,
+                PRIMARY KEY (id, departure_date),
+                UNIQUE (ticket_number, departure_date)
+            ) PARTITION BY RANGE (departure_date)
+            )",
+            "ALTER SEQUENCE tickets_id_seq OWNED BY tickets.id",
+            R"(
+            SELECT ensure_ticket_partitions(
+                LEAST(CURRENT_DATE, COALESCE((SELECT min(departure_date) FROM schedules), CURRENT_DATE)),
+                GREATEST(CURRENT_DATE, COALESCE((SELECT max(departure_date) FROM schedules), CURRENT_DATE)))
+            )",
+            R"(
+            INSERT INTO tickets
+                (id, user_id, schedule_id, seat_id, departure_station_id, arrival_station_id, departure_date,
+                 ticket_number, price, status, booked_at, paid_at, cancelled_at,
+                 passenger_name, passenger_document, updated_at)
+            SELECT t.id, t.user_id, t.schedule_id, t.seat_id, t.departure_station_id, t.arrival_station_id, s.departure_date,
+                   t.ticket_number, t.price, t.status, t.booked_at, t.paid_at, t.cancelled_at,
+                   t.passenger_name, t.passenger_document, t.updated_at
+            FROM tickets_unpartitioned t
+            JOIN schedules s ON s.id = t.schedule_id
+            )",
+            "DROP TABLE tickets_unpartitioned",
+            "CREATE TRIGGER tickets_touch_updated_at BEFORE UPDATE ON tickets FOR EACH ROW EXECUTE FUNCTION touch_updated_at()",
+            "CREATE INDEX idx_tickets_user ON tickets(user_id)",
+            "CREATE INDEX idx_tickets_schedule ON tickets(schedule_id)",
+            "CREATE INDEX idx_tickets_number ON tickets(ticket_number)",
+            "CREATE INDEX idx_tickets_status ON tickets(status)",
+            "CREATE INDEX idx_tickets_updated_at ON tickets(updated_at)"
+        }},
+        // The seat-overlap check and the search availability count read only
+        // live tickets of one schedule; with these columns in the index they
+        // become index-only scans. Expiry looks at a small set of unpaid rows.
+        // Both partial indexes stay small because most tickets are paid,
+        // cancelled or expired, and together they replace the status index.
+        {5, "Partial covering indexes for live tickets", {
+            R"(
+            CREATE INDEX IF NOT EXISTS idx_tickets_live_seat ON tickets(schedule_id, seat_id)
+                INCLUDE (departure_date, departure_station_id, arrival_station_id)
+                WHERE status IN ('booked', 'paid')
+            )",
+            "CREATE INDEX IF NOT EXISTS idx_tickets_booked_at ON tickets(booked_at) INCLUDE (departure_date) WHERE status = 'booked'",
+            "DROP INDEX IF EXISTS idx_tickets_status"
+        }},
+        // GET_MY_TICKETS pages through a user's tickets newest first and
+        // syncs changes by updated_at; both walk one index per partition
+        // instead of sorting everything the user ever bought. The first
+        // index starts with user_id, so it replaces idx_tickets_user.
+        {6, "User ticket pagination indexes", {
+            "CREATE INDEX IF NOT EXISTS idx_tickets_user_booked_at ON tickets(user_id, booked_at DESC, id DESC)",
+            "CREATE INDEX IF NOT EXISTS idx_tickets_user_updated_at ON tickets(user_id, updated_at)",
+            "DROP INDEX IF EXISTS idx_tickets_user"
+        }},
+        // Any write to the timetable or the rolling stock bumps one counter,
+        // so caches built from that data can tell whether it is still current
+        // with a single-row read. Statement-level triggers keep bulk loads to
+        // one bump per statement.
+        {7, "Reference data version", {
+            R"(
+            CREATE TABLE IF NOT EXISTS reference_data_version (
+                id BOOLEAN PRIMARY KEY DEFAULT TRUE CHECK (id),
+                version BIGINT NOT NULL DEFAULT 0,
+                updated_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
+            )
+            )",
+            "INSERT INTO reference_data_version (id, version) VALUES (TRUE, 0) ON CONFLICT (id) DO NOTHING",
+            R"(
+            CREATE OR REPLACE FUNCTION bump_reference_data_version() RETURNS trigger AS $$
+            BEGIN
+                UPDATE reference_data_version SET version = version + 1, updated_at = clock_timestamp() WHERE id;
+                RETURN NULL;
+            END
+            $$ LANGUAGE plpgsql
+            )",
+            "CREATE TRIGGER stations_reference_version AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON stations FOR EACH STATEMENT EXECUTE FUNCTION bump_reference_data_version()",
+            "CREATE TRIGGER trains_reference_version AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON trains FOR EACH STATEMENT EXECUTE FUNCTION bump_reference_data_version()",
+            "CREATE TRIGGER routes_reference_version AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON routes FOR EACH STATEMENT EXECUTE FUNCTION bump_reference_data_version()",
+            "CREATE TRIGGER route_stops_reference_version AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON route_stops FOR EACH STATEMENT EXECUTE FUNCTION bump_reference_data_version()",
+            "CREATE TRIGGER carriages_reference_version AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON carriages FOR EACH STATEMENT EXECUTE FUNCTION bump_reference_data_version()",
+            "CREATE TRIGGER seats_reference_version AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON seats FOR EACH STATEMENT EXECUTE FUNCTION bump_reference_data_version()",
+            "CREATE TRIGGER schedules_reference_version AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON schedules FOR EACH STATEMENT EXECUTE FUNCTION bump_reference_data_version()"
+        }},
+        // Lets running servers drop their search caches as soon as another
+        // process, such as --import-timetable, commits a change.
+        {8, "Notify reference data changes", {
+            R"(
+            CREATE OR REPLACE FUNCTION bump_reference_data_version() RETURNS trigger AS $$
+            BEGIN
+                UPDATE reference_data_version SET version = version + 1, updated_at = clock_timestamp() WHERE id;
+                PERFORM pg_notify('reference_data_changed', '');
+                RETURN NULL;
+            END
+            $$ LANGUAGE plpgsql
+            )"
+        }}
+    };
+    return migrations;
+}
+
+inline int latestVersion(){
+    return all().isEmpty() ? 0 : all().last().version;
+}
+
+}
+
+#endif // MIGRATIONS_H
@@ -0,0 +1,176 @@
+#include "ratelimiter.h"
+#include <QtMath>
+
+RateLimiter::RateLimiter()
+    : m_addressLimits{40.0, 2.0}
+    , m_accountLimits{20.0, 0.5}
+    , m_allowed(0)
+    , m_rejectedByAddress(0)
+    , m_rejectedByAccount(0)
+{
+    m_clock.start();
+}
+
+RateLimiter::CostClass RateLimiter::costClass(const QString& command){
+    static const QHash<QString, CostClass> classes = {
+        {"PING", CostClass::Free},
+        {"HELLO", CostClass::Free},
+        {"LOGOUT", CostClass::Light},
+        {"RESUME_SESSION", CostClass::Light},
+        {"GET_STATIONS", CostClass::Light},
+        {"GET_AVAILABLE_SEATS", CostClass::Light},
+        {"GET_MY_TICKETS", CostClass::Light},
+        {"GET_TICKET_DETAILS", CostClass::Light},
+        {"GET_PROFILE", CostClass::Light},
+        {"SUBSCRIBE_SCHEDULE", CostClass::Light},
+        {"UNSUBSCRIBE_SCHEDULE", CostClass::Light},
+        {"SEARCH_TRAINS", CostClass::Search},
+        {"BOOK_TICKET", CostClass::Booking},
+        {"PAY_TICKET", CostClass::Booking},
+        {"CANCEL_TICKET", CostClass::Booking},
+        {"BATCH", CostClass::Booking},
+        {"LOGIN", CostClass::Credentials},
+        {"CHANGE_PASSWORD", CostClass::Credentials},
+        {"VERIFY_EMAIL", CostClass::Credentials},
+        {"REGISTER", CostClass::Email},
+        {"RESEND_VERIFICATION", CostClass::Email}
+    };
+    return classes.value(command, CostClass::Light);
+}
+
+double RateLimiter::cost(CostClass costClass){
+    switch (costClass){
+    case CostClass::Free:
+        return 0.0;
+    case CostClass::Light:
+        return 1.0;
+    case CostClass::Search:
+        return 2.0;
+    case CostClass::Booking:
+        return 3.0;
+    case CostClass::Credentials:
+        return 8.0;
+    case CostClass::Email:
+        return 15.0;
+    }
+    return 1.0;
+}
+
+// Both buckets are checked before either is charged, so a request the
+// account bucket turns away does not still cost the address its tokens.
+bool RateLimiter::acquire(const QString& address, const QString& account, double cost, qint64* retryAfterMs){
+    if (cost <= 0.0){
+        m_allowed++;
+        return true;
+    }
+
+    qint64 now = m_clock.elapsed();
+    QString addressKey = "addr:" + address;
+    QString accountKey = account.isEmpty() ? QString() : "acct:" + account;
+
+    Shard& addressShard = shardFor(addressKey);
+    Shard* accountShard = accountKey.isEmpty() ? nullptr : &shardFor(accountKey);
+
+    // Shards are always locked in address order so two requests cannot
+    // deadlock on the same pair.
+    Shard* first = &addressShard;
+    Shard* second = accountShard == &addressShard ? nullptr : accountShard;
+    if (second && second < first){
+        qSwap(first, second);
+    }
+    QMutexLocker firstLocker(&first->mutex);
+    QMutexLocker secondLocker(second ? &second->mutex : nullptr);
+
+    Bucket& addressBucket = refill(addressShard, addressKey, m_addressLimits, now);
+    if (!canTake(addressBucket, m_addressLimits, cost, retryAfterMs)){
+        m_rejectedByAddress++;
+        return false;
+    }
+
+    Bucket* accountBucket = nullptr;
+    if (accountShard){
+        accountBucket = &refill(*accountShard, accountKey, m_accountLimits, now);
+        if (!canTake(*accountBucket, m_accountLimits, cost, retryAfterMs)){
+            m_rejectedByAccount++;
+            return false;
+        }
+    }
+
+    addressBucket.tokens -= qMin(cost, m_addressLimits.capacity);
+    if (accountBucket){
+        accountBucket->tokens -= qMin(cost, m_accountLimits.capacity);
+    }
+
+    m_allowed++;
+    return true;
+}
+
+RateLimiter::Bucket& RateLimiter::refill(Shard& shard, const QString& key, const Limits& limits, qint64 now){
+    auto it = shard.buckets.find(key);
+    if (it == shard.buckets.end()){
+        it = shard.buckets.insert(key, Bucket{limits.capacity, now});
+    }
+
+    Bucket& bucket = it.value();
+    double elapsedSeconds = (now - bucket.updatedAt) / 1000.0;
+    bucket.tokens = qMin(limits.capacity, bucket.tokens + elapsedSeconds * limits.refillPerSecond);
+    bucket.updatedAt = now;
+    return bucket;
+}
+
+bool RateLimiter::canTake(const Bucket& bucket, const Limits& limits, double cost, qint64* retryAfterMs){
+    // A full bucket always admits a single request, however expensive.
+    double needed = qMin(cost, limits.capacity);
+    if (bucket.tokens >= needed){
+        return true;
+    }
+
+    if (retryAfterMs){
+        *retryAfterMs = qCeil((needed - bucket.tokens) / limits.refillPerSecond * 1000.0);
+    }
+    return false;
+}
+
+RateLimiter::Shard& RateLimiter::shardFor(const QString& key){
+    return m_shards[qHash(key) % SHARD_COUNT];
+}
+
+void RateLimiter::setAddressLimits(const Limits& limits){
+    m_addressLimits = limits;
+}
+
+void RateLimiter::setAccountLimits(const Limits& limits){
+    m_accountLimits = limits;
+}
+
+// A bucket left alone long enough to refill completely carries no state, so
+// dropping it is indistinguishable from keeping it.
+void RateLimiter::prune(){
+    qint64 now = m_clock.elapsed();
+    qint64 fullAfterMs = qCeil(qMax(m_addressLimits.capacity / m_addressLimits.refillPerSecond,
+                                    m_accountLimits.capacity / m_accountLimits.refillPerSecond) * 1000.0);
+
+    for (Shard& shard: m_shards){
+        QMutexLocker locker(&shard.mutex);
+        for (auto it = shard.buckets.begin(); it != shard.buckets.end();){
+            if (now - it.value().updatedAt >= fullAfterMs){
+                it = shard.buckets.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+}
+
+RateLimiter::Stats RateLimiter::stats() const{
+    Stats stats;
+    stats.allowed = m_allowed.loadRelaxed();
+    stats.rejectedByAddress = m_rejectedByAddress.loadRelaxed();
+    stats.rejectedByAccount = m_rejectedByAccount.loadRelaxed();
+    stats.trackedKeys = 0;
+    for (const Shard& shard: m_shards){
+        QMutexLocker locker(&shard.mutex);
+        stats.trackedKeys += shard.buckets.size();
+    }
+    return stats;
+}
@@ -0,0 +1,79 @@
+#ifndef RATELIMITER_H
+#define RATELIMITER_H
+
+#include <QHash>
+#include <QString>
+#include <QMutex>
+#include <QElapsedTimer>
+#include <QAtomicInteger>
+#include <array>
+
+class RateLimiter
+{
+public:
+    enum class CostClass {
+        Free,
+        Light,
+        Search,
+        Booking,
+        Credentials,
+        Email
+    };
+
+    struct Limits {
+        double capacity;
+        double refillPerSecond;
+    };
+
+    struct Stats {
+        quint64 allowed;
+        quint64 rejectedByAddress;
+        quint64 rejectedByAccount;
+        int trackedKeys;
+    };
+
+    RateLimiter();
+
+    static CostClass costClass(const QString& command);
+    static double cost(CostClass costClass);
+
+    bool acquire(const QString& address
+                 , const QString& account
+                 , double cost
+                 , qint64* retryAfterMs = nullptr);
+
+    void setAddressLimits(const Limits& limits);
+    void setAccountLimits(const Limits& limits);
+
+    void prune();
+    Stats stats() const;
+
+private:
+    static const int SHARD_COUNT = 16;
+
+    struct Bucket {
+        double tokens;
+        qint64 updatedAt;
+    };
+
+    struct Shard {
+        mutable QMutex mutex;
+        QHash<QString, Bucket> buckets;
+    };
+
+    Bucket& refill(Shard& shard, const QString& key, const Limits& limits, qint64 now);
+    static bool canTake(const Bucket& bucket, const Limits& limits, double cost, qint64* retryAfterMs);
+    Shard& shardFor(const QString& key);
+
+    std::array<Shard, SHARD_COUNT> m_shards;
+    QElapsedTimer m_clock;
+
+    Limits m_addressLimits;
+    Limits m_accountLimits;
+
+    QAtomicInteger<quint64> m_allowed;
+    QAtomicInteger<quint64> m_rejectedByAddress;
+    QAtomicInteger<quint64> m_rejectedByAccount;
+};
+
+#endif // RATELIMITER_H
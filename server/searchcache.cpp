@@ -0,0 +1,216 @@
+#include "searchcache.h"
+#include <QDebug>
+#include <QDateTime>
+
+SearchCache::SearchCache(qint64 budgetBytes, int maxAgeSeconds)
+    : m_invalidatedAt(0)
+    , m_maxReplicaLagMs(DEFAULT_MAX_REPLICA_LAG_MS)
+    , m_prunedAt(0)
+    , m_maxAgeMs(qint64(maxAgeSeconds) * 1000)
+    , m_hits(0)
+    , m_misses(0)
+    , m_insertions(0)
+    , m_invalidations(0)
+{
+    m_entries.setMaxCost(budgetBytes);
+    m_clock.start();
+}
+
+bool SearchCache::isEntryFresh(const Entry* entry) const{
+    if (m_clock.elapsed() - entry->createdAt > m_maxAgeMs){
+        return false;
+    }
+
+    for (auto it = entry->scheduleVersions.cbegin(); it != entry->scheduleVersions.cend(); it++){
+        if (m_scheduleVersions.value(it.key(), 0) != it.value()){
+            return false;
+        }
+    }
+    return true;
+}
+
+bool SearchCache::lookup(const SearchKey& key, QList<Database::SearchResult>* results){
+    QMutexLocker locker(&m_mutex);
+
+    Entry* entry = m_entries.object(key);
+    if (!entry){
+        m_misses++;
+        return false;
+    }
+
+    if (!isEntryFresh(entry)){
+        m_entries.remove(key);
+        m_invalidations++;
+        m_misses++;
+        return false;
+    }
+
+    if (results) *results = entry->results;
+    m_hits++;
+    return true;
+}
+
+bool SearchCache::insertIfCurrent(const SearchKey& key, const QList<Database::SearchResult>& results, qint64 freshAsOf){
+    QMutexLocker locker(&m_mutex);
+
+    if (freshAsOf <= m_invalidatedAt){
+        return false;
+    }
+    for (const auto& result: results){
+        if (freshAsOf <= m_scheduleChangedAt.value(result.scheduleId, 0)){
+            return false;
+        }
+    }
+    return insertEntry(key, results, m_clock.elapsed());
+}
+
+bool SearchCache::insertEntry(const SearchKey& key, const QList<Database::SearchResult>& results, qint64 createdAt){
+    Entry* entry = new Entry;
+    entry->results = results;
+    entry->createdAt = createdAt;
+    for (const auto& result: results){
+        entry->scheduleVersions.insert(result.scheduleId, m_scheduleVersions.value(result.scheduleId, 0));
+    }
+
+    QList<int> scheduleIds = entry->scheduleVersions.keys();
+    if (!m_entries.insert(key, entry, estimateCost(results))){
+        return false;
+    }
+
+    for (int scheduleId: scheduleIds){
+        m_scheduleIndex[scheduleId].insert(key);
+    }
+    m_insertions++;
+
+    if (m_scheduleIndex.size() > 4 * m_entries.size() + 1024){
+        rebuildIndex();
+    }
+    return true;
+}
+
+// Fresh entries only, with their age so a restore keeps the same expiry.
+QList<SearchCache::SnapshotEntry> SearchCache::snapshotEntries() const{
+    QMutexLocker locker(&m_mutex);
+
+    QList<SnapshotEntry> entries;
+    const QList<SearchKey> keys = m_entries.keys();
+    entries.reserve(keys.size());
+    for (const SearchKey& key: keys){
+        const Entry* entry = m_entries.object(key);
+        if (!isEntryFresh(entry)){
+            continue;
+        }
+        entries.append(SnapshotEntry{key, entry->results, m_clock.elapsed() - entry->createdAt});
+    }
+    return entries;
+}
+
+// Restored entries are tied to the current schedule versions, so bumping a
+// schedule afterwards drops the ones that depend on it.
+int SearchCache::restore(const QList<SnapshotEntry>& entries){
+    QMutexLocker locker(&m_mutex);
+
+    int restored = 0;
+    qint64 now = m_clock.elapsed();
+    for (const SnapshotEntry& entry: entries){
+        if (entry.ageMs < 0 || entry.ageMs > m_maxAgeMs){
+            continue;
+        }
+        if (insertEntry(entry.key, entry.results, now - entry.ageMs)){
+            restored++;
+        }
+    }
+    return restored;
+}
+
+void SearchCache::rebuildIndex(){
+    m_scheduleIndex.clear();
+
+    const QList<SearchKey> keys = m_entries.keys();
+    for (const SearchKey& key: keys){
+        const Entry* entry = m_entries.object(key);
+        for (auto it = entry->scheduleVersions.cbegin(); it != entry->scheduleVersions.cend(); it++){
+            m_scheduleIndex[it.key()].insert(key);
+        }
+    }
+}
+
+void SearchCache::bumpScheduleVersion(int scheduleId){
+    QMutexLocker locker(&m_mutex);
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    m_scheduleVersions[scheduleId]++;
+    m_scheduleChangedAt[scheduleId] = now;
+    if (now - m_prunedAt > m_maxReplicaLagMs){
+        pruneChangeTimes(now);
+    }
+
+    QSet<SearchKey> keys = m_scheduleIndex.take(scheduleId);
+    for (const SearchKey& key: keys){
+        if (m_entries.remove(key)){
+            m_invalidations++;
+        }
+    }
+}
+
+// A change older than the allowed replica lag is behind every result a
+// replica may still return. Forgetting it raises m_invalidatedAt instead, so
+// a result that was delayed longer than that is still refused.
+void SearchCache::pruneChangeTimes(qint64 now){
+    qint64 cutoff = now - m_maxReplicaLagMs;
+    for (auto it = m_scheduleChangedAt.begin(); it != m_scheduleChangedAt.end();){
+        if (it.value() < cutoff){
+            m_invalidatedAt = qMax(m_invalidatedAt, it.value());
+            it = m_scheduleChangedAt.erase(it);
+        } else {
+            it++;
+        }
+    }
+    m_prunedAt = now;
+}
+
+void SearchCache::invalidateAll(){
+    QMutexLocker locker(&m_mutex);
+
+    m_invalidations += m_entries.size();
+    m_entries.clear();
+    m_scheduleIndex.clear();
+    m_scheduleChangedAt.clear();
+    m_invalidatedAt = QDateTime::currentMSecsSinceEpoch();
+}
+
+void SearchCache::setBudget(qint64 budgetBytes){
+    QMutexLocker locker(&m_mutex);
+    m_entries.setMaxCost(budgetBytes);
+}
+
+void SearchCache::setMaxReplicaLag(int milliseconds){
+    QMutexLocker locker(&m_mutex);
+    m_maxReplicaLagMs = milliseconds;
+}
+
+SearchCache::Stats SearchCache::stats() const{
+    QMutexLocker locker(&m_mutex);
+
+    Stats stats;
+    stats.hits = m_hits;
+    stats.misses = m_misses;
+    stats.insertions = m_insertions;
+    stats.invalidations = m_invalidations;
+    stats.entries = m_entries.size();
+    stats.usedBytes = m_entries.totalCost();
+    stats.budgetBytes = m_entries.maxCost();
+    return stats;
+}
+
+qint64 SearchCache::estimateCost(const QList<Database::SearchResult>& results){
+    qint64 cost = sizeof(Entry);
+    for (const auto& result: results){
+        cost += sizeof(Database::SearchResult) + sizeof(int) + sizeof(quint64);
+        cost += (result.trainNumber.size()
+                 + result.trainType.size()
+                 + result.departureStationName.size()
+                 + result.arrivalStationName.size()) * sizeof(QChar);
+    }
+    return cost;
+}
@@ -0,0 +1,107 @@
+#ifndef SEARCHCACHE_H
+#define SEARCHCACHE_H
+
+#include <QCache>
+#include <QHash>
+#include <QSet>
+#include <QDate>
+#include <QMutex>
+#include <QElapsedTimer>
+#include "database.h"
+
+struct SearchKey {
+    int departureStationId;
+    int arrivalStationId;
+    QDate date;
+
+    bool operator==(const SearchKey& other) const {
+        return departureStationId == other.departureStationId
+               && arrivalStationId == other.arrivalStationId
+               && date == other.date;
+    }
+};
+
+inline size_t qHash(const SearchKey& key, size_t seed = 0){
+    return qHashMulti(seed, key.departureStationId, key.arrivalStationId, key.date);
+}
+
+class SearchCache
+{
+public:
+    struct Stats {
+        quint64 hits;
+        quint64 misses;
+        quint64 insertions;
+        quint64 invalidations;
+        int entries;
+        qint64 usedBytes;
+        qint64 budgetBytes;
+
+        double hitRatio() const {
+            quint64 total = hits + misses;
+            return total == 0 ? 0.0 : double(hits) / double(total);
+        }
+    };
+
+    struct SnapshotEntry {
+        SearchKey key;
+        QList<Database::SearchResult> results;
+        qint64 ageMs;
+    };
+
+    explicit SearchCache(qint64 budgetBytes = 8 * 1024 * 1024, int maxAgeSeconds = 300);
+
+    bool lookup(const SearchKey& key, QList<Database::SearchResult>* results);
+    // Results may be stale, for instance when read from a replica:
+    // freshAsOf is the moment (ms since the epoch) the data reflects. They
+    // are dropped if any of their schedules changed since then, as they
+    // would otherwise be stored under the new version.
+    bool insertIfCurrent(const SearchKey& key, const QList<Database::SearchResult>& results, qint64 freshAsOf);
+
+    QList<SnapshotEntry> snapshotEntries() const;
+    int restore(const QList<SnapshotEntry>& entries);
+
+    void bumpScheduleVersion(int scheduleId);
+    void invalidateAll();
+
+    void setBudget(qint64 budgetBytes);
+    // The oldest data insertIfCurrent is expected to see, in milliseconds.
+    // Change times older than that are forgotten.
+    void setMaxReplicaLag(int milliseconds);
+    Stats stats() const;
+
+private:
+    struct Entry {
+        QList<Database::SearchResult> results;
+        QHash<int, quint64> scheduleVersions;
+        qint64 createdAt;
+    };
+
+    static const int DEFAULT_MAX_REPLICA_LAG_MS = 5000;
+
+    static qint64 estimateCost(const QList<Database::SearchResult>& results);
+    bool isEntryFresh(const Entry* entry) const;
+    bool insertEntry(const SearchKey& key, const QList<Database::SearchResult>& results, qint64 createdAt);
+    void rebuildIndex();
+    void pruneChangeTimes(qint64 now);
+
+    mutable QMutex m_mutex;
+    QCache<SearchKey, Entry> m_entries;
+    QHash<int, quint64> m_scheduleVersions;
+    QHash<int, QSet<SearchKey>> m_scheduleIndex;
+    QHash<int, qint64> m_scheduleChangedAt;
+    // Results as old as this are never cached: everything was invalidated
+    // then, or a change time up to then has been forgotten.
+    qint64 m_invalidatedAt;
+    qint64 m_maxReplicaLagMs;
+    qint64 m_prunedAt;
+    QElapsedTimer m_clock;
+    qint64 m_maxAgeMs;
+
+    quint64 m_hits;
+    quint64 m_misses;
+    quint64 m_insertions;
+    quint64 m_invalidations;
+};
+
+#endif // SEARCHCACHE_H
@@ -0,0 +1,132 @@
+#include "sockethandoff.h"
+#include <QLocalSocket>
+
+#ifdef Q_OS_UNIX
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#endif
+
+namespace SocketHandoff {
+
+static const char HANDOFF_TAG = 'L';
+
+bool sendDescriptor(qintptr channel, qintptr descriptor, QString* error){
+#ifdef Q_OS_UNIX
+    char tag = HANDOFF_TAG;
+    struct iovec iov;
+    iov.iov_base = &tag;
+    iov.iov_len = sizeof(tag);
+
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    int fd = int(descriptor);
+    memcpy(CMSG_DATA(header), &fd, sizeof(fd));
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(int(channel), &message, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+
+    if (sent != 1){
+        if (error) *error = QString("sendmsg failed: %1").arg(strerror(errno));
+        return false;
+    }
+    return true;
+#else
+    Q_UNUSED(channel);
+    Q_UNUSED(descriptor);
+    if (error) *error = "Socket hand-off is only supported on Unix";
+    return false;
+#endif
+}
+
+// Blocks for at most timeoutMs; meant to run once at startup, before the
+// event loop. The message is read with recvmsg directly because QLocalSocket
+// would consume the byte and drop the attached descriptor.
+qintptr receiveListener(const QString& path, int timeoutMs, QString* error){
+#ifdef Q_OS_UNIX
+    QLocalSocket channel;
+    channel.connectToServer(path, QIODevice::ReadWrite);
+    if (!channel.waitForConnected(timeoutMs)){
+        if (error) *error = "Cannot reach running server: " + channel.errorString();
+        return -1;
+    }
+
+    int fd = int(channel.socketDescriptor());
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    int ready;
+    do {
+        ready = poll(&pfd, 1, timeoutMs);
+    } while (ready < 0 && errno == EINTR);
+
+    if (ready <= 0){
+        if (error) *error = "Timed out waiting for the listening socket";
+        return -1;
+    }
+
+    char tag = 0;
+    struct iovec iov;
+    iov.iov_base = &tag;
+    iov.iov_len = sizeof(tag);
+
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    ssize_t received;
+    do {
+        received = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    if (received != 1 || tag != HANDOFF_TAG || !header
+        || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS){
+        if (error) *error = "Running server did not send a listening socket";
+        return -1;
+    }
+
+    int descriptor = -1;
+    memcpy(&descriptor, CMSG_DATA(header), sizeof(descriptor));
+    channel.disconnectFromServer();
+    return descriptor;
+#else
+    Q_UNUSED(path);
+    Q_UNUSED(timeoutMs);
+    if (error) *error = "Socket hand-off is only supported on Unix";
+    return -1;
+#endif
+}
+
+}
@@ -0,0 +1,16 @@
+#ifndef SOCKETHANDOFF_H
+#define SOCKETHANDOFF_H
+
+#include <QString>
+
+// Passes the listening socket from a running server to its replacement over
+// a Unix domain socket (SCM_RIGHTS). The kernel keeps one accept queue for
+// both processes, so no connection attempt is refused during a restart.
+namespace SocketHandoff {
+
+bool sendDescriptor(qintptr channel, qintptr descriptor, QString* error = nullptr);
+qintptr receiveListener(const QString& path, int timeoutMs, QString* error = nullptr);
+
+}
+
+#endif // SOCKETHANDOFF_H
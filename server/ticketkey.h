@@ -0,0 +1,50 @@
+#ifndef TICKETKEY_H
+#define TICKETKEY_H
+
+#include <QByteArray>
+#include <QString>
+#include <QRegularExpression>
+
+// Keyset cursors and sync tokens of GET_MY_TICKETS. They carry the timestamp
+// as PostgreSQL prints it, so the microseconds QDateTime would drop survive
+// the round trip to the client; cursors also carry the ticket id.
+namespace TicketKey {
+
+inline QString encode(const QString& timestamp, int id = 0){
+    QString key = id > 0 ? timestamp + '|' + QString::number(id) : timestamp;
+    return QString::fromLatin1(key.toUtf8().toBase64(QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals));
+}
+
+// \z rather than $, which would also accept a trailing newline.
+inline bool decode(const QString& encoded, bool withId, QString* timestamp, int* id){
+    static const QRegularExpression pattern(R"(^(\d{4}-\d{2}-\d{2} \d{2}:\d{2}:\d{2}(?:\.\d{1,6})?)(?:\|(\d+))?\z)");
+
+    QByteArray::FromBase64Result decoded = QByteArray::fromBase64Encoding(
+        encoded.toLatin1(), QByteArray::Base64UrlEncoding | QByteArray::AbortOnBase64DecodingErrors);
+    if (!decoded){
+        return false;
+    }
+    QRegularExpressionMatch match = pattern.match(QString::fromUtf8(*decoded));
+    if (!match.hasMatch() || match.hasCaptured(2) != withId){
+        return false;
+    }
+
+    int decodedId = 0;
+    if (withId){
+        bool ok = false;
+        decodedId = match.captured(2).toInt(&ok);
+        if (!ok || decodedId <= 0){
+            return false;
+        }
+    }
+
+    *timestamp = match.captured(1);
+    if (withId){
+        *id = decodedId;
+    }
+    return true;
+}
+
+}
+
+#endif // TICKETKEY_H
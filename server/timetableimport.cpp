@@ -0,0 +1,293 @@
+#include "timetableimport.h"
+#include <QFile>
+#include <QIODevice>
+#include <QMap>
+
+static QString carriageKey(const QString& trainNumber, int carriageNumber){
+    return trainNumber + '#' + QString::number(carriageNumber);
+}
+
+bool TimetableImport::parseFile(const QString& path){
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)){
+        m_lastError = QString("Cannot open %1: %2").arg(path, file.errorString());
+        return false;
+    }
+    return parse(&file);
+}
+
+bool TimetableImport::parse(QIODevice* device){
+    int line = 0;
+    while (!device->atEnd()){
+        QString text = QString::fromUtf8(device->readLine()).trimmed();
+        line++;
+        if (text.isEmpty() || text.startsWith('#')){
+            continue;
+        }
+
+        bool ok;
+        QStringList fields = splitRecord(text, &ok);
+        if (!ok){
+            m_lastError = QString("Line %1: unterminated quoted field").arg(line);
+            return false;
+        }
+        if (!parseRecord(line, fields)){
+            return false;
+        }
+    }
+    return true;
+}
+
+// RFC 4180 style: fields may be quoted, and a doubled quote inside a quoted
+// field stands for one quote character. Records never span lines.
+QStringList TimetableImport::splitRecord(const QString& line, bool* ok){
+    QStringList fields;
+    QString current;
+    bool quoted = false;
+
+    for (int i = 0; i < line.size(); i++){
+        QChar c = line[i];
+        if (quoted){
+            if (c == '"' && i + 1 < line.size() && line[i + 1] == '"'){
+                current.append('"');
+                i++;
+            } else if (c == '"'){
+                quoted = false;
+            } else {
+                current.append(c);
+            }
+        } else if (c == '"'){
+            quoted = true;
+        } else if (c == ','){
+            fields.append(current.trimmed());
+            current.clear();
+        } else {
+            current.append(c);
+        }
+    }
+    fields.append(current.trimmed());
+
+    *ok = !quoted;
+    return fields;
+}
+
+bool TimetableImport::parseRecord(int line, const QStringList& fields){
+    static const QHash<QString, int> fieldCounts = {
+        {"train", 3}, {"carriage", 6}, {"seat", 5},
+        {"route", 6}, {"stop", 8}, {"schedule", 3}
+    };
+
+    QString type = fields[0].toLower();
+    if (!fieldCounts.contains(type)){
+        m_lastError = QString("Line %1: unknown record type '%2'").arg(line).arg(fields[0]);
+        return false;
+    }
+
+    int expected = fieldCounts.value(type);
+    bool countOk = fields.size() == expected || (type == "schedule" && fields.size() == expected + 1);
+    if (!countOk){
+        m_lastError = QString("Line %1: %2 record needs %3 fields, got %4").arg(line).arg(type).arg(expected).arg(fields.size());
+        return false;
+    }
+
+    bool ok = true;
+    auto toInt = [&ok](const QString& value){
+        bool valid;
+        int result = value.toInt(&valid);
+        ok = ok && valid;
+        return result;
+    };
+    auto toDouble = [&ok](const QString& value){
+        bool valid;
+        double result = value.toDouble(&valid);
+        ok = ok && valid;
+        return result;
+    };
+    auto toDate = [&ok](const QString& value){
+        QDate result = QDate::fromString(value, Qt::ISODate);
+        ok = ok && result.isValid();
+        return result;
+    };
+    auto toTime = [&ok](const QString& value, bool optional){
+        if (optional && value.isEmpty()){
+            return QTime();
+        }
+        QTime result = QTime::fromString(value, value.size() > 5 ? "HH:mm:ss" : "HH:mm");
+        ok = ok && result.isValid();
+        return result;
+    };
+
+    if (type == "train"){
+        m_trains.append(TrainRow{line, fields[1], fields[2]});
+    } else if (type == "carriage"){
+        m_carriages.append(CarriageRow{line, fields[1], toInt(fields[2]), fields[3], toInt(fields[4]), toDouble(fields[5])});
+    } else if (type == "seat"){
+        m_seats.append(SeatRow{line, fields[1], toInt(fields[2]), toInt(fields[3]), fields[4]});
+        m_explicitSeatCarriages.insert(carriageKey(m_seats.last().trainNumber, m_seats.last().carriageNumber));
+    } else if (type == "route"){
+        m_routes.append(RouteRow{line, fields[1], fields[2], fields[3], toDate(fields[4]), toDate(fields[5])});
+    } else if (type == "stop"){
+        m_stops.append(StopRow{line, fields[1], fields[2].toUpper(), toInt(fields[3]),
+                               toTime(fields[4], true), toTime(fields[5], false), toInt(fields[6]), toDouble(fields[7])});
+    } else {
+        QDate from = toDate(fields[2]);
+        QDate to = fields.size() > 3 ? toDate(fields[3]) : from;
+        m_schedules.append(ScheduleRow{line, fields[1], from, to});
+    }
+
+    if (!ok){
+        m_lastError = QString("Line %1: malformed %2 record").arg(line).arg(type);
+        return false;
+    }
+    return true;
+}
+
+bool TimetableImport::validate(const QHash<QString, int>& stationIds, const QHash<QString, int>& existingTrainIds, QString* error) const{
+    auto fail = [error](int line, const QString& message){
+        *error = QString("Line %1: %2").arg(line).arg(message);
+        return false;
+    };
+
+    QSet<QString> trainNumbers;
+    for (const TrainRow& train: m_trains){
+        if (train.number.isEmpty() || train.type.isEmpty()){
+            return fail(train.line, "train number and type are required");
+        }
+        if (existingTrainIds.contains(train.number) || trainNumbers.contains(train.number)){
+            return fail(train.line, QString("train %1 already exists").arg(train.number));
+        }
+        trainNumbers.insert(train.number);
+    }
+
+    QHash<QString, int> carriageSeats;
+    for (const CarriageRow& carriage: m_carriages){
+        if (!trainNumbers.contains(carriage.trainNumber)){
+            return fail(carriage.line, QString("train %1 is not defined in this file").arg(carriage.trainNumber));
+        }
+        QString key = carriageKey(carriage.trainNumber, carriage.number);
+        if (carriageSeats.contains(key)){
+            return fail(carriage.line, QString("duplicate carriage %1").arg(carriage.number));
+        }
+        if (carriage.seats <= 0 || carriage.priceMultiplier <= 0.0 || carriage.type.isEmpty()){
+            return fail(carriage.line, "carriage needs a type, seats and a positive price multiplier");
+        }
+        carriageSeats.insert(key, carriage.seats);
+    }
+
+    QSet<QString> seatKeys;
+    for (const SeatRow& seat: m_seats){
+        QString key = carriageKey(seat.trainNumber, seat.carriageNumber);
+        if (!carriageSeats.contains(key)){
+            return fail(seat.line, QString("carriage %1 of train %2 is not defined").arg(seat.carriageNumber).arg(seat.trainNumber));
+        }
+        if (seat.seatNumber < 1 || seat.seatNumber > carriageSeats.value(key)){
+            return fail(seat.line, QString("seat %1 is outside the carriage").arg(seat.seatNumber));
+        }
+        if (seat.seatType.isEmpty()){
+            return fail(seat.line, "seat type is required");
+        }
+        QString seatKey = key + '#' + QString::number(seat.seatNumber);
+        if (seatKeys.contains(seatKey)){
+            return fail(seat.line, QString("duplicate seat %1").arg(seat.seatNumber));
+        }
+        seatKeys.insert(seatKey);
+    }
+
+    QHash<QString, const RouteRow*> routes;
+    for (const RouteRow& route: m_routes){
+        if (route.key.isEmpty() || routes.contains(route.key)){
+            return fail(route.line, QString("route key '%1' is empty or repeated").arg(route.key));
+        }
+        if (!trainNumbers.contains(route.trainNumber) && !existingTrainIds.contains(route.trainNumber)){
+            return fail(route.line, QString("unknown train %1").arg(route.trainNumber));
+        }
+        if (route.validFrom > route.validTo){
+            return fail(route.line, "valid_from is after valid_to");
+        }
+        routes.insert(route.key, &route);
+    }
+
+    QHash<QString, QSet<int>> stopOrders;
+    QHash<QString, QSet<QString>> stopStations;
+    QHash<QString, QMap<int, const StopRow*>> orderedStops;
+    for (const StopRow& stop: m_stops){
+        if (!routes.contains(stop.routeKey)){
+            return fail(stop.line, QString("unknown route %1").arg(stop.routeKey));
+        }
+        if (!stationIds.contains(stop.stationCode)){
+            return fail(stop.line, QString("unknown station code %1").arg(stop.stationCode));
+        }
+        if (stopOrders[stop.routeKey].contains(stop.order) || stopStations[stop.routeKey].contains(stop.stationCode)){
+            return fail(stop.line, "route visits the same stop order or station twice");
+        }
+        if (stop.dwellMinutes < 0 || stop.price < 0.0){
+            return fail(stop.line, "dwell time and price must not be negative");
+        }
+        stopOrders[stop.routeKey].insert(stop.order);
+        stopStations[stop.routeKey].insert(stop.stationCode);
+        orderedStops[stop.routeKey].insert(stop.order, &stop);
+    }
+
+    for (const RouteRow& route: m_routes){
+        const QMap<int, const StopRow*>& stops = orderedStops.value(route.key);
+        if (stops.size() < 2){
+            return fail(route.line, QString("route %1 needs at least two stops").arg(route.key));
+        }
+        double price = 0.0;
+        for (const StopRow* stop: stops){
+            if (stop->price < price){
+                return fail(stop->line, "price_from_start decreases along the route");
+            }
+            price = stop->price;
+        }
+    }
+
+    QHash<QString, QSet<qint64>> departures;
+    for (const ScheduleRow& schedule: m_schedules){
+        const RouteRow* route = routes.value(schedule.routeKey);
+        if (!route){
+            return fail(schedule.line, QString("unknown route %1").arg(schedule.routeKey));
+        }
+        if (schedule.from > schedule.to || schedule.from < route->validFrom || schedule.to > route->validTo){
+            return fail(schedule.line, "dates fall outside the route validity period");
+        }
+        QSet<qint64>& days = departures[schedule.routeKey];
+        for (qint64 day = schedule.from.toJulianDay(); day <= schedule.to.toJulianDay(); day++){
+            if (days.contains(day)){
+                return fail(schedule.line, QString("route %1 already departs on %2").arg(schedule.routeKey, QDate::fromJulianDay(day).toString(Qt::ISODate)));
+            }
+            days.insert(day);
+        }
+    }
+
+    return true;
+}
+
+TimetableImport::Summary TimetableImport::summary() const{
+    Summary summary;
+    summary.trains = m_trains.size();
+    summary.carriages = m_carriages.size();
+    summary.routes = m_routes.size();
+    summary.stops = m_stops.size();
+
+    summary.seats = m_seats.size();
+    for (const CarriageRow& carriage: m_carriages){
+        if (!hasExplicitSeats(carriage.trainNumber, carriage.number)){
+            summary.seats += carriage.seats;
+        }
+    }
+
+    summary.schedules = 0;
+    for (const ScheduleRow& schedule: m_schedules){
+        summary.schedules += schedule.from.daysTo(schedule.to) + 1;
+    }
+    return summary;
+}
+
+bool TimetableImport::hasExplicitSeats(const QString& trainNumber, int carriageNumber) const{
+    return m_explicitSeatCarriages.contains(carriageKey(trainNumber, carriageNumber));
+}
+
+QString TimetableImport::generatedSeatType(int seatNumber){
+    return seatNumber % 2 == 1 ? "Нижнее" : "Верхнее";
+}
@@ -0,0 +1,127 @@
+#ifndef TIMETABLEIMPORT_H
+#define TIMETABLEIMPORT_H
+
+#include <QString>
+#include <QStringList>
+#include <QHash>
+#include <QSet>
+#include <QDate>
+#include <QTime>
+
+class QIODevice;
+
+// A timetable read from CSV, one record per line with the record type in the
+// first column:
+//
+//   train,NUMBER,TYPE
+//   carriage,TRAIN,NUMBER,TYPE,SEATS,PRICE_MULTIPLIER
+//   seat,TRAIN,CARRIAGE,SEAT,SEAT_TYPE
+//   route,KEY,TRAIN,NAME,VALID_FROM,VALID_TO
+//   stop,ROUTE_KEY,STATION_CODE,ORDER,ARRIVAL,DEPARTURE,DWELL_MINUTES,PRICE
+//   schedule,ROUTE_KEY,FROM_DATE[,TO_DATE]
+//
+// Trains, carriages and seats in the file are new; routes may run existing
+// trains. Stations are referenced by code and must already exist. Carriages
+// without seat records get seats 1..SEATS. A schedule with TO_DATE departs
+// daily over the whole range. Empty lines and lines starting with # are
+// skipped.
+class TimetableImport
+{
+public:
+    struct TrainRow {
+        int line;
+        QString number;
+        QString type;
+    };
+
+    struct CarriageRow {
+        int line;
+        QString trainNumber;
+        int number;
+        QString type;
+        int seats;
+        double priceMultiplier;
+    };
+
+    struct SeatRow {
+        int line;
+        QString trainNumber;
+        int carriageNumber;
+        int seatNumber;
+        QString seatType;
+    };
+
+    struct RouteRow {
+        int line;
+        QString key;
+        QString trainNumber;
+        QString name;
+        QDate validFrom;
+        QDate validTo;
+    };
+
+    struct StopRow {
+        int line;
+        QString routeKey;
+        QString stationCode;
+        int order;
+        QTime arrival;
+        QTime departure;
+        int dwellMinutes;
+        double price;
+    };
+
+    struct ScheduleRow {
+        int line;
+        QString routeKey;
+        QDate from;
+        QDate to;
+    };
+
+    struct Summary {
+        int trains;
+        int carriages;
+        qint64 seats;
+        int routes;
+        int stops;
+        qint64 schedules;
+    };
+
+    bool parse(QIODevice* device);
+    bool parseFile(const QString& path);
+
+    // Checks every reference and uniqueness rule the schema enforces, so a
+    // bad file is rejected before anything is sent to the database.
+    bool validate(const QHash<QString, int>& stationIds
+                  , const QHash<QString, int>& existingTrainIds
+                  , QString* error) const;
+
+    Summary summary() const;
+
+    const QList<TrainRow>& trains() const { return m_trains; }
+    const QList<CarriageRow>& carriages() const { return m_carriages; }
+    const QList<SeatRow>& seats() const { return m_seats; }
+    const QList<RouteRow>& routes() const { return m_routes; }
+    const QList<StopRow>& stops() const { return m_stops; }
+    const QList<ScheduleRow>& schedules() const { return m_schedules; }
+
+    bool hasExplicitSeats(const QString& trainNumber, int carriageNumber) const;
+    static QString generatedSeatType(int seatNumber);
+
+    QString lastError() const { return m_lastError; }
+
+private:
+    static QStringList splitRecord(const QString& line, bool* ok);
+    bool parseRecord(int line, const QStringList& fields);
+
+    QList<TrainRow> m_trains;
+    QList<CarriageRow> m_carriages;
+    QList<SeatRow> m_seats;
+    QList<RouteRow> m_routes;
+    QList<StopRow> m_stops;
+    QList<ScheduleRow> m_schedules;
+    QSet<QString> m_explicitSeatCarriages;
+    QString m_lastError;
+};
+
+#endif // TIMETABLEIMPORT_H
@@ -0,0 +1,49 @@
+#include "tlsserver.h"
+#include <QDebug>
+
+TlsServer::TlsServer(QObject *parent)
+    : QTcpServer(parent)
+    , m_tlsEnabled(false)
+    , m_handshakesCompleted(0)
+    , m_handshakesFailed(0)
+{
+}
+
+void TlsServer::setSslConfiguration(const QSslConfiguration &configuration){
+    m_configuration = configuration;
+    m_tlsEnabled = true;
+}
+
+bool TlsServer::isTlsEnabled() const{
+    return m_tlsEnabled;
+}
+
+void TlsServer::incomingConnection(qintptr socketDescriptor){
+    if (!m_tlsEnabled){
+        QTcpServer::incomingConnection(socketDescriptor);
+        return;
+    }
+
+    QSslSocket* socket = new QSslSocket(this);
+    if (!socket->setSocketDescriptor(socketDescriptor)){
+        qDebug() << "Failed to adopt socket descriptor:" << socket->errorString();
+        delete socket;
+        return;
+    }
+
+    socket->setSslConfiguration(m_configuration);
+
+    connect(socket, &QSslSocket::encrypted, this, [this](){
+        m_handshakesCompleted++;
+    });
+    connect(socket, &QSslSocket::errorOccurred, this, [this, socket](QAbstractSocket::SocketError error){
+        if (error == QAbstractSocket::SslHandshakeFailedError){
+            m_handshakesFailed++;
+            qDebug() << "TLS handshake failed from" << socket->peerAddress().toString()
+                     << ":" << socket->errorString();
+        }
+    });
+
+    addPendingConnection(socket);
+    socket->startServerEncryption();
+}
@@ -0,0 +1,36 @@
+#ifndef TLSSERVER_H
+#define TLSSERVER_H
+
+#include <QTcpServer>
+#include <QSslSocket>
+#include <QSslConfiguration>
+
+// Accepts plain QTcpSockets until a TLS configuration is set, then wraps every
+// accepted descriptor in a QSslSocket sharing that configuration. The
+// handshake runs asynchronously on the event loop; the socket is handed out
+// immediately and only delivers data once it is encrypted.
+class TlsServer : public QTcpServer
+{
+    Q_OBJECT
+
+public:
+    explicit TlsServer(QObject* parent = nullptr);
+
+    void setSslConfiguration(const QSslConfiguration& configuration);
+    bool isTlsEnabled() const;
+
+    quint64 handshakesCompleted() const { return m_handshakesCompleted; }
+    quint64 handshakesFailed() const { return m_handshakesFailed; }
+
+protected:
+    void incomingConnection(qintptr socketDescriptor) override;
+
+private:
+    QSslConfiguration m_configuration;
+    bool m_tlsEnabled;
+
+    quint64 m_handshakesCompleted;
+    quint64 m_handshakesFailed;
+};
+
+#endif // TLSSERVER_H
@@ -0,0 +1,160 @@
+#include "warmsnapshot.h"
+#include <QFile>
+#include <QSaveFile>
+#include <QDataStream>
+#include <QtEndian>
+
+namespace WarmSnapshot {
+
+// Layout: magic, format version, payload length, CRC-16 of the payload, then
+// the QDataStream payload. Any mismatch makes the whole file unusable.
+static const quint32 SNAPSHOT_MAGIC = 0x52575353;
+static const quint32 SNAPSHOT_FORMAT = 1;
+static const int SNAPSHOT_HEADER_SIZE = 14;
+static const QDataStream::Version STREAM_VERSION = QDataStream::Qt_6_0;
+
+static void writeResult(QDataStream& out, const Database::SearchResult& result){
+    out << qint32(result.scheduleId) << qint32(result.routeId)
+        << result.trainNumber << result.trainType
+        << qint32(result.departureStationId) << result.departureStationName
+        << qint32(result.arrivalStationId) << result.arrivalStationName
+        << result.departureTime << result.arrivalTime
+        << qint32(result.travelTimeMinutes) << result.minPrice << qint32(result.availableSeats);
+}
+
+static void readResult(QDataStream& in, Database::SearchResult* result){
+    qint32 scheduleId, routeId, departureStationId, arrivalStationId, travelTimeMinutes, availableSeats;
+    in >> scheduleId >> routeId
+       >> result->trainNumber >> result->trainType
+       >> departureStationId >> result->departureStationName
+       >> arrivalStationId >> result->arrivalStationName
+       >> result->departureTime >> result->arrivalTime
+       >> travelTimeMinutes >> result->minPrice >> availableSeats;
+
+    result->scheduleId = scheduleId;
+    result->routeId = routeId;
+    result->departureStationId = departureStationId;
+    result->arrivalStationId = arrivalStationId;
+    result->travelTimeMinutes = travelTimeMinutes;
+    result->availableSeats = availableSeats;
+}
+
+bool write(const QString& path, const Mark& mark, const QList<SearchCache::SnapshotEntry>& entries, QString* error){
+    QByteArray payload;
+    {
+        QDataStream out(&payload, QIODevice::WriteOnly);
+        out.setVersion(STREAM_VERSION);
+        out << qint32(mark.schemaVersion) << mark.ticketsMark << mark.referenceFingerprint << mark.writtenAt;
+
+        out << qint32(entries.size());
+        for (const SearchCache::SnapshotEntry& entry: entries){
+            out << qint32(entry.key.departureStationId) << qint32(entry.key.arrivalStationId) << entry.key.date;
+            out << qint64(entry.ageMs) << qint32(entry.results.size());
+            for (const Database::SearchResult& result: entry.results){
+                writeResult(out, result);
+            }
+        }
+    }
+
+    QByteArray header(SNAPSHOT_HEADER_SIZE, Qt::Uninitialized);
+    qToBigEndian<quint32>(SNAPSHOT_MAGIC, header.data());
+    qToBigEndian<quint32>(SNAPSHOT_FORMAT, header.data() + 4);
+    qToBigEndian<quint32>(quint32(payload.size()), header.data() + 8);
+    qToBigEndian<quint16>(qChecksum(QByteArrayView(payload)), header.data() + 12);
+
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)
+        || file.write(header) != header.size()
+        || file.write(payload) != payload.size()
+        || !file.commit()){
+        if (error) *error = file.errorString();
+        return false;
+    }
+    return true;
+}
+
+// The file is mapped rather than read so a large snapshot is paged in only
+// as the stream walks it, without an intermediate copy.
+bool read(const QString& path, Mark* mark, QList<SearchCache::SnapshotEntry>* entries, QString* error){
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)){
+        if (error) *error = file.errorString();
+        return false;
+    }
+
+    qint64 size = file.size();
+    if (size < SNAPSHOT_HEADER_SIZE){
+        if (error) *error = "Snapshot is truncated";
+        return false;
+    }
+
+    const uchar* data = file.map(0, size);
+    if (!data){
+        if (error) *error = "Cannot map snapshot: " + file.errorString();
+        return false;
+    }
+
+    const char* bytes = reinterpret_cast<const char*>(data);
+    quint32 magic = qFromBigEndian<quint32>(bytes);
+    quint32 format = qFromBigEndian<quint32>(bytes + 4);
+    quint32 payloadSize = qFromBigEndian<quint32>(bytes + 8);
+    quint16 checksum = qFromBigEndian<quint16>(bytes + 12);
+
+    if (magic != SNAPSHOT_MAGIC || format != SNAPSHOT_FORMAT){
+        if (error) *error = "Unknown snapshot format";
+        file.unmap(const_cast<uchar*>(data));
+        return false;
+    }
+
+    if (qint64(payloadSize) != size - SNAPSHOT_HEADER_SIZE){
+        if (error) *error = "Snapshot is truncated";
+        file.unmap(const_cast<uchar*>(data));
+        return false;
+    }
+
+    QByteArray payload = QByteArray::fromRawData(bytes + SNAPSHOT_HEADER_SIZE, payloadSize);
+    if (qChecksum(QByteArrayView(payload)) != checksum){
+        if (error) *error = "Snapshot checksum mismatch";
+        file.unmap(const_cast<uchar*>(data));
+        return false;
+    }
+
+    QDataStream in(payload);
+    in.setVersion(STREAM_VERSION);
+
+    qint32 schemaVersion;
+    in >> schemaVersion >> mark->ticketsMark >> mark->referenceFingerprint >> mark->writtenAt;
+    mark->schemaVersion = schemaVersion;
+
+    qint32 entryCount;
+    in >> entryCount;
+    entries->clear();
+    entries->reserve(qMax(0, entryCount));
+    for (qint32 i = 0; i < entryCount && in.status() == QDataStream::Ok; i++){
+        SearchCache::SnapshotEntry entry;
+        qint32 departureStationId, arrivalStationId, resultCount;
+        qint64 ageMs;
+        in >> departureStationId >> arrivalStationId >> entry.key.date >> ageMs >> resultCount;
+        entry.key.departureStationId = departureStationId;
+        entry.key.arrivalStationId = arrivalStationId;
+        entry.ageMs = ageMs;
+
+        for (qint32 j = 0; j < resultCount && in.status() == QDataStream::Ok; j++){
+            Database::SearchResult result;
+            readResult(in, &result);
+            entry.results.append(result);
+        }
+        entries->append(entry);
+    }
+
+    bool ok = in.status() == QDataStream::Ok;
+    file.unmap(const_cast<uchar*>(data));
+
+    if (!ok){
+        entries->clear();
+        if (error) *error = "Snapshot payload is corrupt";
+    }
+    return ok;
+}
+
+}
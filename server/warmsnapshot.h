@@ -0,0 +1,34 @@
+#ifndef WARMSNAPSHOT_H
+#define WARMSNAPSHOT_H
+
+#include <QString>
+#include <QDateTime>
+#include <QList>
+#include "searchcache.h"
+
+// On-disk copy of the search cache written at shutdown. The mark records the
+// database state the entries were computed from: on the next start the
+// reference fingerprint must match exactly, and tickets modified after
+// ticketsMark identify the schedules whose entries are dropped.
+namespace WarmSnapshot {
+
+struct Mark {
+    int schemaVersion;
+    QDateTime ticketsMark;
+    QString referenceFingerprint;
+    QDateTime writtenAt;
+};
+
+bool write(const QString& path
+           , const Mark& mark
+           , const QList<SearchCache::SnapshotEntry>& entries
+           , QString* error = nullptr);
+
+bool read(const QString& path
+          , Mark* mark
+          , QList<SearchCache::SnapshotEntry>* entries
+          , QString* error = nullptr);
+
+}
+
+#endif // WARMSNAPSHOT_H
@@ -0,0 +1,81 @@
+#include <QtTest>
+#include "ratelimiter.h"
+
+class TestRateLimiter : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void accountRejectionDoesNotChargeAddress();
+    void addressRejectionDoesNotChargeAccount();
+    void pruneDropsRefilledBuckets();
+};
+
+// Refill is slow enough that no token comes back while a case runs.
+void TestRateLimiter::accountRejectionDoesNotChargeAddress(){
+    RateLimiter limiter;
+    limiter.setAddressLimits(RateLimiter::Limits{10.0, 0.001});
+    limiter.setAccountLimits(RateLimiter::Limits{3.0, 0.001});
+
+    QVERIFY(limiter.acquire("10.0.0.1", "a@example.com", 3.0));
+
+    qint64 retryAfterMs = 0;
+    for (int i = 0; i < 5; i++){
+        QVERIFY(!limiter.acquire("10.0.0.1", "a@example.com", 3.0, &retryAfterMs));
+    }
+    QVERIFY(retryAfterMs > 0);
+
+    // Seven address tokens are left; the refused requests would have
+    // taken all of them.
+    QVERIFY(limiter.acquire("10.0.0.1", "b@example.com", 3.0));
+    QVERIFY(limiter.acquire("10.0.0.1", "c@example.com", 3.0));
+    QVERIFY(!limiter.acquire("10.0.0.1", "d@example.com", 3.0));
+
+    RateLimiter::Stats stats = limiter.stats();
+    QCOMPARE(stats.allowed, quint64(3));
+    QCOMPARE(stats.rejectedByAccount, quint64(5));
+    QCOMPARE(stats.rejectedByAddress, quint64(1));
+}
+
+void TestRateLimiter::addressRejectionDoesNotChargeAccount(){
+    RateLimiter limiter;
+    limiter.setAddressLimits(RateLimiter::Limits{3.0, 0.001});
+    limiter.setAccountLimits(RateLimiter::Limits{6.0, 0.001});
+
+    QVERIFY(limiter.acquire("10.0.0.1", "a@example.com", 3.0));
+    QVERIFY(!limiter.acquire("10.0.0.1", "a@example.com", 3.0));
+    QVERIFY(!limiter.acquire("10.0.0.1", "a@example.com", 3.0));
+
+    QVERIFY(limiter.acquire("10.0.0.2", "a@example.com", 3.0));
+    QVERIFY(!limiter.acquire("10.0.0.3", "a@example.com", 3.0));
+    QCOMPARE(limiter.stats().rejectedByAccount, quint64(1));
+}
+
+void TestRateLimiter::pruneDropsRefilledBuckets(){
+    RateLimiter limiter;
+    limiter.setAddressLimits(RateLimiter::Limits{2.0, 0.001});
+    limiter.setAccountLimits(RateLimiter::Limits{2.0, 0.001});
+
+    QVERIFY(limiter.acquire("10.0.0.1", "a@example.com", 1.0));
+    QVERIFY(limiter.acquire("10.0.0.2", QString(), 1.0));
+    // Free requests are never tracked.
+    QVERIFY(limiter.acquire("10.0.0.3", "b@example.com", 0.0));
+    QCOMPARE(limiter.stats().trackedKeys, 3);
+
+    // Still far from full, so pruning must keep them.
+    limiter.prune();
+    QCOMPARE(limiter.stats().trackedKeys, 3);
+
+    // With these limits a bucket is full again 10 ms after its last use.
+    limiter.setAddressLimits(RateLimiter::Limits{2.0, 200.0});
+    limiter.setAccountLimits(RateLimiter::Limits{2.0, 200.0});
+    QTest::qSleep(20);
+    limiter.prune();
+    QCOMPARE(limiter.stats().trackedKeys, 0);
+
+    QVERIFY(limiter.acquire("10.0.0.1", "a@example.com", 2.0));
+    QCOMPARE(limiter.stats().trackedKeys, 2);
+}
+
+QTEST_APPLESS_MAIN(TestRateLimiter)
+#include "tst_ratelimiter.moc"
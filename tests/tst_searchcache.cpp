@@ -0,0 +1,127 @@
+#include <QtTest>
+#include "searchcache.h"
+
+class TestSearchCache : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void insertIfCurrentRefusesResultsOlderThanChange();
+    void bumpDropsDependentEntries();
+    void invalidateAllRefusesOlderResults();
+    void forgottenChangeStillRefusesOlderResults();
+    void restoreKeepsAges();
+};
+
+static Database::SearchResult searchResult(int scheduleId){
+    Database::SearchResult result{};
+    result.scheduleId = scheduleId;
+    result.trainNumber = QString("%1A").arg(scheduleId);
+    result.trainType = "express";
+    return result;
+}
+
+static SearchKey key(int departureStationId){
+    return SearchKey{departureStationId, 100, QDate(2026, 10, 19)};
+}
+
+void TestSearchCache::insertIfCurrentRefusesResultsOlderThanChange(){
+    SearchCache cache;
+
+    qint64 readAt = QDateTime::currentMSecsSinceEpoch();
+    QTest::qSleep(2);
+    cache.bumpScheduleVersion(1);
+    QTest::qSleep(2);
+
+    // Read before the change: storing it would tag it with the new version.
+    QVERIFY(!cache.insertIfCurrent(key(1), {searchResult(2), searchResult(1)}, readAt));
+    QVERIFY(!cache.lookup(key(1), nullptr));
+
+    QVERIFY(cache.insertIfCurrent(key(2), {searchResult(2)}, readAt));
+    QVERIFY(cache.insertIfCurrent(key(1), {searchResult(2), searchResult(1)}, QDateTime::currentMSecsSinceEpoch()));
+
+    QList<Database::SearchResult> results;
+    QVERIFY(cache.lookup(key(1), &results));
+    QCOMPARE(results.size(), 2);
+    QCOMPARE(results[1].scheduleId, 1);
+}
+
+void TestSearchCache::bumpDropsDependentEntries(){
+    SearchCache cache;
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QVERIFY(cache.insertIfCurrent(key(1), {searchResult(1), searchResult(2)}, now));
+    QVERIFY(cache.insertIfCurrent(key(2), {searchResult(2)}, now));
+    QVERIFY(cache.insertIfCurrent(key(3), {searchResult(3)}, now));
+
+    cache.bumpScheduleVersion(2);
+    QVERIFY(!cache.lookup(key(1), nullptr));
+    QVERIFY(!cache.lookup(key(2), nullptr));
+    QVERIFY(cache.lookup(key(3), nullptr));
+
+    SearchCache::Stats stats = cache.stats();
+    QCOMPARE(stats.entries, 1);
+    QCOMPARE(stats.invalidations, quint64(2));
+    QCOMPARE(stats.hits, quint64(1));
+    QCOMPARE(stats.misses, quint64(2));
+}
+
+void TestSearchCache::invalidateAllRefusesOlderResults(){
+    SearchCache cache;
+
+    qint64 readAt = QDateTime::currentMSecsSinceEpoch();
+    QTest::qSleep(2);
+    cache.invalidateAll();
+    QTest::qSleep(2);
+
+    QVERIFY(!cache.insertIfCurrent(key(1), {searchResult(1)}, readAt));
+    QVERIFY(!cache.insertIfCurrent(key(1), {}, readAt));
+    QVERIFY(cache.insertIfCurrent(key(1), {searchResult(1)}, QDateTime::currentMSecsSinceEpoch()));
+}
+
+// Once a change time is older than the replica lag it is forgotten, but
+// results read before it must still be refused.
+void TestSearchCache::forgottenChangeStillRefusesOlderResults(){
+    SearchCache cache;
+    cache.setMaxReplicaLag(1);
+
+    qint64 readAt = QDateTime::currentMSecsSinceEpoch();
+    QTest::qSleep(2);
+    cache.bumpScheduleVersion(1);
+    QTest::qSleep(5);
+    cache.bumpScheduleVersion(2);
+
+    QVERIFY(!cache.insertIfCurrent(key(1), {searchResult(1)}, readAt));
+    QVERIFY(!cache.insertIfCurrent(key(3), {searchResult(3)}, readAt));
+}
+
+void TestSearchCache::restoreKeepsAges(){
+    SearchCache cache(8 * 1024 * 1024, 1);
+
+    QList<SearchCache::SnapshotEntry> entries = {
+        SearchCache::SnapshotEntry{key(1), {searchResult(1)}, 100},
+        SearchCache::SnapshotEntry{key(2), {searchResult(2)}, 900},
+        SearchCache::SnapshotEntry{key(3), {searchResult(3)}, 1500},
+        SearchCache::SnapshotEntry{key(4), {searchResult(4)}, -1}
+    };
+    QCOMPARE(cache.restore(entries), 2);
+
+    QList<SearchCache::SnapshotEntry> snapshot = cache.snapshotEntries();
+    QCOMPARE(snapshot.size(), 2);
+    for (const SearchCache::SnapshotEntry& entry: snapshot){
+        qint64 restoredAge = entry.key == key(1) ? 100 : 900;
+        QVERIFY(entry.ageMs >= restoredAge);
+        QVERIFY(entry.ageMs < restoredAge + 100);
+    }
+
+    // The older entry runs out first, as it would have without a restart.
+    QTest::qSleep(200);
+    QVERIFY(cache.lookup(key(1), nullptr));
+    QVERIFY(!cache.lookup(key(2), nullptr));
+
+    // Restored entries follow the current schedule versions.
+    cache.bumpScheduleVersion(1);
+    QVERIFY(!cache.lookup(key(1), nullptr));
+}
+
+QTEST_APPLESS_MAIN(TestSearchCache)
+#include "tst_searchcache.moc"
@@ -0,0 +1,91 @@
+#include <QtTest>
+#include "ticketkey.h"
+
+class TestTicketKey : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void roundTrip_data();
+    void roundTrip();
+    void syncToken();
+    void idPresenceMustMatch();
+    void rejectsGarbage_data();
+    void rejectsGarbage();
+};
+
+void TestTicketKey::roundTrip_data(){
+    QTest::addColumn<QString>("timestamp");
+    QTest::addColumn<int>("id");
+
+    QTest::newRow("microseconds") << "2026-10-19 08:30:15.123456" << 42;
+    QTest::newRow("milliseconds") << "2026-10-19 08:30:15.5" << 1;
+    QTest::newRow("whole seconds") << "2026-10-19 08:30:15" << 2147483647;
+}
+
+void TestTicketKey::roundTrip(){
+    QFETCH(QString, timestamp);
+    QFETCH(int, id);
+
+    QString cursor = TicketKey::encode(timestamp, id);
+    QVERIFY(!cursor.contains('='));
+    QVERIFY(!cursor.contains('+'));
+    QVERIFY(!cursor.contains('/'));
+
+    QString decodedTimestamp;
+    int decodedId = 0;
+    QVERIFY(TicketKey::decode(cursor, true, &decodedTimestamp, &decodedId));
+    QCOMPARE(decodedTimestamp, timestamp);
+    QCOMPARE(decodedId, id);
+}
+
+void TestTicketKey::syncToken(){
+    QString token = TicketKey::encode("2026-10-19 08:30:15.000001");
+
+    QString timestamp;
+    QVERIFY(TicketKey::decode(token, false, &timestamp, nullptr));
+    QCOMPARE(timestamp, QString("2026-10-19 08:30:15.000001"));
+}
+
+// A sync token is not accepted as a cursor, nor the reverse.
+void TestTicketKey::idPresenceMustMatch(){
+    QString timestamp;
+    int id = 0;
+    QVERIFY(!TicketKey::decode(TicketKey::encode("2026-10-19 08:30:15"), true, &timestamp, &id));
+    QVERIFY(!TicketKey::decode(TicketKey::encode("2026-10-19 08:30:15", 7), false, &timestamp, nullptr));
+    QVERIFY(timestamp.isEmpty());
+}
+
+static QString base64Url(const QByteArray& data){
+    return QString::fromLatin1(data.toBase64(QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals));
+}
+
+void TestTicketKey::rejectsGarbage_data(){
+    QTest::addColumn<QString>("cursor");
+
+    QTest::newRow("empty") << QString();
+    QTest::newRow("not base64") << "!!!not-a-cursor!!!";
+    QTest::newRow("plain text") << base64Url("hello|1");
+    QTest::newRow("sql") << base64Url("2026-10-19 08:30:15'; DROP TABLE tickets; --|1");
+    QTest::newRow("date only") << base64Url("2026-10-19|1");
+    QTest::newRow("seven fraction digits") << base64Url("2026-10-19 08:30:15.1234567|1");
+    QTest::newRow("time zone") << base64Url("2026-10-19 08:30:15+03|1");
+    QTest::newRow("negative id") << base64Url("2026-10-19 08:30:15|-1");
+    QTest::newRow("zero id") << base64Url("2026-10-19 08:30:15|0");
+    QTest::newRow("id overflow") << base64Url("2026-10-19 08:30:15|99999999999");
+    QTest::newRow("trailing newline") << base64Url("2026-10-19 08:30:15|1\n");
+    QTest::newRow("non-ascii digits") << base64Url(QString::fromUtf8("٢٠٢٦-10-19 08:30:15|1").toUtf8());
+}
+
+void TestTicketKey::rejectsGarbage(){
+    QFETCH(QString, cursor);
+
+    QString timestamp;
+    int id = -1;
+    QVERIFY(!TicketKey::decode(cursor, true, &timestamp, &id));
+    QVERIFY(timestamp.isEmpty());
+    QCOMPARE(id, -1);
+}
+
+QTEST_APPLESS_MAIN(TestTicketKey)
+#include "tst_ticketkey.moc"
@@ -0,0 +1,213 @@
+#include <QtTest>
+#include <QTemporaryDir>
+#include "warmsnapshot.h"
+
+class TestWarmSnapshot : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void roundTrip();
+    void truncatedFile();
+    void checksumMismatch();
+    void unknownFormat();
+    void missingFile();
+
+private:
+    static bool writeSample(const QString& path);
+    static QByteArray readFile(const QString& path);
+    static void writeFile(const QString& path, const QByteArray& data);
+};
+
+static const int HEADER_SIZE = 14;
+
+static WarmSnapshot::Mark sampleMark(){
+    return WarmSnapshot::Mark{12,
+                              QDateTime(QDate(2026, 10, 19), QTime(8, 30, 15, 250)),
+                              "stations:3f2a;routes:91c0",
+                              QDateTime(QDate(2026, 10, 19), QTime(9, 0))};
+}
+
+static QList<SearchCache::SnapshotEntry> sampleEntries(){
+    Database::SearchResult result;
+    result.scheduleId = 41;
+    result.routeId = 7;
+    result.trainNumber = "016А";
+    result.trainType = "Фирменный";
+    result.departureStationId = 1;
+    result.departureStationName = "Москва";
+    result.arrivalStationId = 2;
+    result.arrivalStationName = "Санкт-Петербург";
+    result.departureTime = QDateTime(QDate(2026, 10, 20), QTime(23, 55));
+    result.arrivalTime = QDateTime(QDate(2026, 10, 21), QTime(7, 40));
+    result.travelTimeMinutes = 465;
+    result.minPrice = 3120.5;
+    result.availableSeats = 118;
+
+    Database::SearchResult other = result;
+    other.scheduleId = 42;
+    other.availableSeats = 0;
+
+    return {
+        SearchCache::SnapshotEntry{SearchKey{1, 2, QDate(2026, 10, 20)}, {result, other}, 12000},
+        SearchCache::SnapshotEntry{SearchKey{2, 1, QDate(2026, 10, 21)}, {}, 250}
+    };
+}
+
+bool TestWarmSnapshot::writeSample(const QString& path){
+    QString error;
+    bool ok = WarmSnapshot::write(path, sampleMark(), sampleEntries(), &error);
+    if (!ok){
+        qWarning() << "Cannot write snapshot:" << error;
+    }
+    return ok;
+}
+
+QByteArray TestWarmSnapshot::readFile(const QString& path){
+    QFile file(path);
+    return file.open(QIODevice::ReadOnly) ? file.readAll() : QByteArray();
+}
+
+void TestWarmSnapshot::writeFile(const QString& path, const QByteArray& data){
+    QFile file(path);
+    if (file.open(QIODevice::WriteOnly | QIODevice::Truncate)){
+        file.write(data);
+    }
+}
+
+void TestWarmSnapshot::roundTrip(){
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QString path = dir.filePath("warmstart.snapshot");
+    QVERIFY(writeSample(path));
+
+    WarmSnapshot::Mark mark;
+    QList<SearchCache::SnapshotEntry> entries;
+    QString error;
+    QVERIFY2(WarmSnapshot::read(path, &mark, &entries, &error), qPrintable(error));
+
+    WarmSnapshot::Mark expectedMark = sampleMark();
+    QCOMPARE(mark.schemaVersion, expectedMark.schemaVersion);
+    QCOMPARE(mark.ticketsMark, expectedMark.ticketsMark);
+    QCOMPARE(mark.referenceFingerprint, expectedMark.referenceFingerprint);
+    QCOMPARE(mark.writtenAt, expectedMark.writtenAt);
+
+    QList<SearchCache::SnapshotEntry> expected = sampleEntries();
+    QCOMPARE(entries.size(), expected.size());
+    for (int i = 0; i < expected.size(); i++){
+        QVERIFY(entries[i].key == expected[i].key);
+        QCOMPARE(entries[i].ageMs, expected[i].ageMs);
+        QCOMPARE(entries[i].results.size(), expected[i].results.size());
+        for (int j = 0; j < expected[i].results.size(); j++){
+            const Database::SearchResult& got = entries[i].results[j];
+            const Database::SearchResult& want = expected[i].results[j];
+            QCOMPARE(got.scheduleId, want.scheduleId);
+            QCOMPARE(got.routeId, want.routeId);
+            QCOMPARE(got.trainNumber, want.trainNumber);
+            QCOMPARE(got.trainType, want.trainType);
+            QCOMPARE(got.departureStationId, want.departureStationId);
+            QCOMPARE(got.departureStationName, want.departureStationName);
+            QCOMPARE(got.arrivalStationId, want.arrivalStationId);
+            QCOMPARE(got.arrivalStationName, want.arrivalStationName);
+            QCOMPARE(got.departureTime, want.departureTime);
+            QCOMPARE(got.arrivalTime, want.arrivalTime);
+            QCOMPARE(got.travelTimeMinutes, want.travelTimeMinutes);
+            QCOMPARE(got.minPrice, want.minPrice);
+            QCOMPARE(got.availableSeats, want.availableSeats);
+        }
+    }
+}
+
+void TestWarmSnapshot::truncatedFile(){
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QString path = dir.filePath("warmstart.snapshot");
+    QVERIFY(writeSample(path));
+    QByteArray data = readFile(path);
+    QVERIFY(data.size() > HEADER_SIZE);
+
+    // Cut inside the payload, inside the header, and right after it.
+    for (int size: {int(data.size()) - 1, HEADER_SIZE / 2, HEADER_SIZE, 0}){
+        writeFile(path, data.left(size));
+
+        WarmSnapshot::Mark mark;
+        QList<SearchCache::SnapshotEntry> entries;
+        QString error;
+        QVERIFY(!WarmSnapshot::read(path, &mark, &entries, &error));
+        QCOMPARE(error, QString("Snapshot is truncated"));
+        QVERIFY(entries.isEmpty());
+    }
+
+    // Trailing bytes are as wrong as missing ones.
+    writeFile(path, data + QByteArray(1, '\0'));
+    WarmSnapshot::Mark mark;
+    QList<SearchCache::SnapshotEntry> entries;
+    QString error;
+    QVERIFY(!WarmSnapshot::read(path, &mark, &entries, &error));
+    QCOMPARE(error, QString("Snapshot is truncated"));
+}
+
+void TestWarmSnapshot::checksumMismatch(){
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QString path = dir.filePath("warmstart.snapshot");
+    QVERIFY(writeSample(path));
+    QByteArray data = readFile(path);
+
+    for (int offset: {HEADER_SIZE, int(data.size()) / 2, int(data.size()) - 1}){
+        QByteArray damaged = data;
+        damaged[offset] = char(damaged.at(offset) ^ 0x01);
+        writeFile(path, damaged);
+
+        WarmSnapshot::Mark mark;
+        QList<SearchCache::SnapshotEntry> entries;
+        QString error;
+        QVERIFY(!WarmSnapshot::read(path, &mark, &entries, &error));
+        QCOMPARE(error, QString("Snapshot checksum mismatch"));
+        QVERIFY(entries.isEmpty());
+    }
+
+    // A wrong checksum in the header is caught the same way.
+    QByteArray damaged = data;
+    damaged[13] = char(damaged.at(13) ^ 0x01);
+    writeFile(path, damaged);
+    WarmSnapshot::Mark mark;
+    QList<SearchCache::SnapshotEntry> entries;
+    QString error;
+    QVERIFY(!WarmSnapshot::read(path, &mark, &entries, &error));
+    QCOMPARE(error, QString("Snapshot checksum mismatch"));
+}
+
+void TestWarmSnapshot::unknownFormat(){
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QString path = dir.filePath("warmstart.snapshot");
+    QVERIFY(writeSample(path));
+    QByteArray data = readFile(path);
+
+    for (int offset: {0, 7}){
+        QByteArray damaged = data;
+        damaged[offset] = char(damaged.at(offset) ^ 0x01);
+        writeFile(path, damaged);
+
+        WarmSnapshot::Mark mark;
+        QList<SearchCache::SnapshotEntry> entries;
+        QString error;
+        QVERIFY(!WarmSnapshot::read(path, &mark, &entries, &error));
+        QCOMPARE(error, QString("Unknown snapshot format"));
+    }
+}
+
+void TestWarmSnapshot::missingFile(){
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+
+    WarmSnapshot::Mark mark;
+    QList<SearchCache::SnapshotEntry> entries;
+    QString error;
+    QVERIFY(!WarmSnapshot::read(dir.filePath("absent.snapshot"), &mark, &entries, &error));
+    QVERIFY(!error.isEmpty());
+}
+
+QTEST_APPLESS_MAIN(TestWarmSnapshot)
+#include "tst_warmsnapshot.moc"
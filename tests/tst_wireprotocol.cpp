@@ -0,0 +1,137 @@
+#include <QtTest>
+#include <QCborArray>
+#include <QCborMap>
+#include "wireprotocol.h"
+
+using namespace WireProtocol;
+
+class TestWireProtocol : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void partialJsonLine();
+    void partialBinaryFrame();
+    void oversizeFrame();
+    void mixedEncodings();
+    void invalidPayloads();
+};
+
+void TestWireProtocol::partialJsonLine(){
+    QJsonObject message{{"command", "PING"}};
+    QByteArray data = encode(message, Encoding::Json);
+
+    QByteArray buffer;
+    QByteArray payload;
+    Encoding encoding = Encoding::Cbor;
+    for (int i = 0; i < data.size() - 1; i++){
+        buffer.append(data.at(i));
+        QCOMPARE(takeMessage(buffer, &payload, &encoding), DecodeStatus::NeedMore);
+        QCOMPARE(buffer.size(), i + 1);
+    }
+
+    buffer.append(data.back());
+    QCOMPARE(takeMessage(buffer, &payload, &encoding), DecodeStatus::Message);
+    QCOMPARE(encoding, Encoding::Json);
+    QCOMPARE(payload, data.chopped(1));
+    QVERIFY(buffer.isEmpty());
+}
+
+// Every split of a frame, including one inside the five-byte header, must
+// wait for the rest and leave the buffer untouched.
+void TestWireProtocol::partialBinaryFrame(){
+    QJsonObject message{{"command", "SEARCH_TRAINS"}, {"date", "2026-10-19"}};
+    QByteArray frame = encode(message, Encoding::Cbor);
+    QCOMPARE(frame.at(0), BINARY_FRAME_MARKER);
+
+    for (int split = 1; split < frame.size(); split++){
+        QByteArray buffer = frame.left(split);
+        QByteArray payload;
+        Encoding encoding = Encoding::Json;
+        QCOMPARE(takeMessage(buffer, &payload, &encoding), DecodeStatus::NeedMore);
+        QCOMPARE(buffer, frame.left(split));
+
+        buffer.append(frame.mid(split));
+        QCOMPARE(takeMessage(buffer, &payload, &encoding), DecodeStatus::Message);
+        QCOMPARE(encoding, Encoding::Cbor);
+        QVERIFY(buffer.isEmpty());
+
+        QJsonObject decoded;
+        QVERIFY(decode(payload, encoding, &decoded, nullptr));
+        QCOMPARE(decoded, message);
+    }
+}
+
+// The length is refused as soon as the header is in, before the payload
+// it announces would be buffered.
+void TestWireProtocol::oversizeFrame(){
+    QByteArray header(BINARY_HEADER_SIZE, Qt::Uninitialized);
+    header[0] = BINARY_FRAME_MARKER;
+
+    QByteArray payload;
+    Encoding encoding = Encoding::Json;
+
+    qToBigEndian<quint32>(MAX_FRAME_SIZE + 1, header.data() + 1);
+    QByteArray buffer = header;
+    QCOMPARE(takeMessage(buffer, &payload, &encoding), DecodeStatus::Error);
+
+    qToBigEndian<quint32>(0xFFFFFFFFu, header.data() + 1);
+    buffer = header;
+    QCOMPARE(takeMessage(buffer, &payload, &encoding), DecodeStatus::Error);
+
+    qToBigEndian<quint32>(MAX_FRAME_SIZE, header.data() + 1);
+    buffer = header;
+    QCOMPARE(takeMessage(buffer, &payload, &encoding), DecodeStatus::NeedMore);
+}
+
+void TestWireProtocol::mixedEncodings(){
+    // The CBOR messages carry newline bytes, which must not end a frame.
+    QList<QJsonObject> messages = {
+        QJsonObject{{"command", "HELLO"}, {"encoding", "cbor"}},
+        QJsonObject{{"command", "LOGIN"}, {"email", "line\nbreak"}},
+        QJsonObject{{"command", "PING"}},
+        QJsonObject{{"command", "GET_STATIONS"}, {"note", "\n\n"}}
+    };
+    QList<Encoding> encodings = {Encoding::Json, Encoding::Cbor, Encoding::Json, Encoding::Cbor};
+
+    QByteArray buffer;
+    for (int i = 0; i < messages.size(); i++){
+        buffer.append(encode(messages[i], encodings[i]));
+    }
+
+    for (int i = 0; i < messages.size(); i++){
+        QByteArray payload;
+        Encoding encoding;
+        QCOMPARE(takeMessage(buffer, &payload, &encoding), DecodeStatus::Message);
+        QCOMPARE(encoding, encodings[i]);
+
+        QJsonObject decoded;
+        QString error;
+        QVERIFY2(decode(payload, encoding, &decoded, &error), qPrintable(error));
+        QCOMPARE(decoded, messages[i]);
+    }
+
+    QByteArray payload;
+    Encoding encoding;
+    QCOMPARE(takeMessage(buffer, &payload, &encoding), DecodeStatus::NeedMore);
+    QVERIFY(buffer.isEmpty());
+}
+
+void TestWireProtocol::invalidPayloads(){
+    QJsonObject decoded;
+    QString error;
+
+    QVERIFY(!decode("{\"command\":", Encoding::Json, &decoded, &error));
+    QVERIFY(error.startsWith("Invalid JSON"));
+    QVERIFY(!decode("[1, 2]", Encoding::Json, &decoded, &error));
+    QCOMPARE(error, QString("Message must be a JSON object"));
+
+    QByteArray truncated = QCborValue(QCborMap{{"command", "PING"}}).toCbor().chopped(2);
+    QVERIFY(!decode(truncated, Encoding::Cbor, &decoded, &error));
+    QVERIFY(error.startsWith("Invalid CBOR"));
+    QVERIFY(!decode(QCborValue(QCborArray{1, 2}).toCbor(), Encoding::Cbor, &decoded, &error));
+    QCOMPARE(error, QString("Message must be a CBOR map"));
+}
+
+QTEST_APPLESS_MAIN(TestWireProtocol)
+#include "tst_wireprotocol.moc"
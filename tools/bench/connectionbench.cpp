@@ -0,0 +1,163 @@
+#include "connectionbench.h"
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonObject>
+#include "wireprotocol.h"
+
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#include <climits>
+#endif
+
+ConnectionBench::ConnectionBench(const QString& host, quint16 port, int connections)
+    : m_host(host)
+    , m_port(port)
+    , m_connections(connections)
+    , m_serverPid(0)
+    , m_closeAll(false)
+{
+}
+
+ConnectionBench::~ConnectionBench()
+{
+    closeSockets();
+}
+
+// Same as the server: every socket is a descriptor, so the soft limit is
+// raised to the hard one.
+int ConnectionBench::raiseOpenFileLimit()
+{
+#ifdef Q_OS_UNIX
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+        return -1;
+    }
+
+    if (limit.rlim_cur != limit.rlim_max) {
+        rlim_t previous = limit.rlim_cur;
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+            limit.rlim_cur = previous;
+        }
+    }
+
+    if (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > rlim_t(INT_MAX)) {
+        return INT_MAX;
+    }
+    return int(limit.rlim_cur);
+#else
+    return -1;
+#endif
+}
+
+bool ConnectionBench::run(Result* result)
+{
+    result->requested = m_connections;
+    result->opened = 0;
+    result->bytesPerConnection = -1;
+    result->pingMillisAfterClose = -1;
+
+    if (!ping(&result->pingMillisBefore)) {
+        return false;
+    }
+    result->residentBefore = residentBytes();
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < m_connections; ++i) {
+        QTcpSocket* socket = new QTcpSocket();
+        socket->connectToHost(m_host, m_port);
+        m_sockets.append(socket);
+    }
+    for (QTcpSocket* socket: m_sockets) {
+        if (socket->waitForConnected(CONNECT_TIMEOUT_MS)) {
+            result->opened++;
+        }
+    }
+
+    // The server accepts in order, so once a fresh connection is answered
+    // every earlier one has been accepted and registered.
+    if (!ping(&result->pingMillisOpen)) {
+        return false;
+    }
+    result->openMillis = timer.elapsed();
+    result->residentAfter = residentBytes();
+    if (result->residentBefore >= 0 && result->residentAfter >= 0 && result->opened > 0) {
+        result->bytesPerConnection = qMax<qint64>(0, result->residentAfter - result->residentBefore) / result->opened;
+    }
+
+    if (m_closeAll) {
+        closeSockets();
+        if (!ping(&result->pingMillisAfterClose)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ConnectionBench::ping(qint64* millis)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    QTcpSocket socket;
+    socket.connectToHost(m_host, m_port);
+    if (!socket.waitForConnected(PING_TIMEOUT_MS)) {
+        m_lastError = "Cannot connect to server: " + socket.errorString();
+        return false;
+    }
+
+    QJsonObject request;
+    request["command"] = "PING";
+    socket.write(WireProtocol::encode(request, WireProtocol::Encoding::Json));
+
+    QByteArray buffer;
+    while (timer.elapsed() < PING_TIMEOUT_MS) {
+        if (!socket.waitForReadyRead(PING_TIMEOUT_MS - timer.elapsed())) {
+            break;
+        }
+        buffer.append(socket.readAll());
+
+        QByteArray payload;
+        WireProtocol::Encoding encoding;
+        if (WireProtocol::takeMessage(buffer, &payload, &encoding) == WireProtocol::DecodeStatus::Message) {
+            *millis = timer.elapsed();
+            socket.abort();
+            return true;
+        }
+    }
+
+    m_lastError = "No PING response from server: " + socket.errorString();
+    return false;
+}
+
+qint64 ConnectionBench::residentBytes() const
+{
+    if (m_serverPid <= 0) {
+        return -1;
+    }
+
+    QFile status(QString("/proc/%1/status").arg(m_serverPid));
+    if (!status.open(QIODevice::ReadOnly)) {
+        return -1;
+    }
+
+    for (const QByteArray& line: status.readAll().split('\n')) {
+        if (line.startsWith("VmRSS:")) {
+            QList<QByteArray> fields = line.simplified().split(' ');
+            return fields.size() >= 2 ? fields[1].toLongLong() * 1024 : -1;
+        }
+    }
+    return -1;
+}
+
+// abort() resets every connection at once, without a graceful close the
+// server could pace.
+void ConnectionBench::closeSockets()
+{
+    for (QTcpSocket* socket: m_sockets) {
+        socket->abort();
+        delete socket;
+    }
+    m_sockets.clear();
+}
@@ -0,0 +1,56 @@
+#ifndef CONNECTIONBENCH_H
+#define CONNECTIONBENCH_H
+
+#include <QList>
+#include <QString>
+#include <QTcpSocket>
+
+// Opens many idle connections to a running server, the way a crowd of
+// logged-out clients would, and measures what they cost it. With the
+// server's pid the resident memory per connection is read from /proc.
+// Closing the whole crowd at once then shows how long the server takes to
+// get back to answering a fresh connection.
+class ConnectionBench
+{
+public:
+    struct Result {
+        int requested;
+        int opened;
+        qint64 openMillis;
+        qint64 residentBefore;
+        qint64 residentAfter;
+        qint64 bytesPerConnection;
+        qint64 pingMillisBefore;
+        qint64 pingMillisOpen;
+        qint64 pingMillisAfterClose;
+    };
+
+    ConnectionBench(const QString& host, quint16 port, int connections);
+    ~ConnectionBench();
+
+    void setServerPid(qint64 pid) { m_serverPid = pid; }
+    void setCloseAll(bool closeAll) { m_closeAll = closeAll; }
+
+    bool run(Result* result);
+    QString lastError() const { return m_lastError; }
+
+    static int raiseOpenFileLimit();
+
+private:
+    static const int CONNECT_TIMEOUT_MS = 10000;
+    static const int PING_TIMEOUT_MS = 60000;
+
+    bool ping(qint64* millis);
+    qint64 residentBytes() const;
+    void closeSockets();
+
+    QString m_host;
+    quint16 m_port;
+    int m_connections;
+    qint64 m_serverPid;
+    bool m_closeAll;
+    QList<QTcpSocket*> m_sockets;
+    QString m_lastError;
+};
+
+#endif // CONNECTIONBENCH_H
@@ -0,0 +1,204 @@
+#include <QCoreApplication>
+#include <QTextStream>
+#include <algorithm>
+#include "connectionbench.h"
+#include "shardbench.h"
+#include "wirebench.h"
+
+namespace {
+
+int runWire(const QStringList& args, QTextStream& out, QTextStream& err){
+    int seats = 900;
+    int iterations = 2000;
+    for (int i = 0; i < args.size(); ++i) {
+        if (args[i] == "--seats" && i + 1 < args.size()) {
+            seats = args[++i].toInt();
+        } else if (args[i] == "--iterations" && i + 1 < args.size()) {
+            iterations = args[++i].toInt();
+        }
+    }
+    if (seats < 1 || iterations < 1) {
+        err << "Invalid wire benchmark parameters, see --help" << Qt::endl;
+        return 1;
+    }
+
+    WireBench bench(seats, iterations);
+    QList<WireBench::Result> results;
+    if (!bench.run(&results)) {
+        err << "Wire benchmark failed: " << bench.lastError() << Qt::endl;
+        return 1;
+    }
+
+    out << QString("Seat map of %1 seats, %2 iterations").arg(seats).arg(iterations) << Qt::endl;
+    out << QString("%1 %2 %3 %4").arg(QString("encoding"), -10).arg(QString("bytes"), 10).arg(QString("encode us"), 12).arg(QString("decode us"), 12) << Qt::endl;
+    for (const WireBench::Result& result: results) {
+        out << QString("%1 %2 %3 %4")
+                   .arg(WireProtocol::encodingName(result.encoding), -10)
+                   .arg(result.frameBytes, 10)
+                   .arg(result.encodeMicros, 12, 'f', 1)
+                   .arg(result.decodeMicros, 12, 'f', 1)
+            << Qt::endl;
+    }
+    return 0;
+}
+
+QString formatMillis(qint64 millis){
+    return millis < 0 ? QString("-") : QString("%1 ms").arg(millis);
+}
+
+QString formatBytes(qint64 bytes){
+    return bytes < 0 ? QString("unknown (pass --server-pid)") : QString("%1 KiB").arg(bytes / 1024);
+}
+
+int runConnections(const QStringList& args, QTextStream& out, QTextStream& err){
+    QString host = "127.0.0.1";
+    quint16 port = 8080;
+    int connections = 10000;
+    qint64 serverPid = 0;
+    bool closeAll = false;
+    for (int i = 0; i < args.size(); ++i) {
+        if (args[i] == "--host" && i + 1 < args.size()) {
+            host = args[++i];
+        } else if (args[i] == "--port" && i + 1 < args.size()) {
+            port = args[++i].toUShort();
+        } else if (args[i] == "--connections" && i + 1 < args.size()) {
+            connections = args[++i].toInt();
+        } else if (args[i] == "--server-pid" && i + 1 < args.size()) {
+            serverPid = args[++i].toLongLong();
+        } else if (args[i] == "--close-all") {
+            closeAll = true;
+        }
+    }
+    if (connections < 1 || port == 0) {
+        err << "Invalid connection benchmark parameters, see --help" << Qt::endl;
+        return 1;
+    }
+
+    int fileLimit = ConnectionBench::raiseOpenFileLimit();
+    if (fileLimit > 0 && connections > fileLimit - 16) {
+        err << QString("Open file limit is %1, too low for %2 connections").arg(fileLimit).arg(connections) << Qt::endl;
+        return 1;
+    }
+
+    ConnectionBench bench(host, port, connections);
+    bench.setServerPid(serverPid);
+    bench.setCloseAll(closeAll);
+
+    ConnectionBench::Result result;
+    if (!bench.run(&result)) {
+        err << "Connection benchmark failed: " << bench.lastError() << Qt::endl;
+        return 1;
+    }
+
+    out << QString("Opened %1 of %2 connections in %3").arg(result.opened).arg(result.requested).arg(formatMillis(result.openMillis)) << Qt::endl;
+    out << "Server resident memory before: " << formatBytes(result.residentBefore) << Qt::endl;
+    out << "Server resident memory after:  " << formatBytes(result.residentAfter) << Qt::endl;
+    out << "Per connection:                " << (result.bytesPerConnection < 0 ? formatBytes(-1) : QString("%1 bytes").arg(result.bytesPerConnection)) << Qt::endl;
+    out << "PING before opening:           " << formatMillis(result.pingMillisBefore) << Qt::endl;
+    out << "PING with all open:            " << formatMillis(result.pingMillisOpen) << Qt::endl;
+    if (closeAll) {
+        out << "PING right after closing all:  " << formatMillis(result.pingMillisAfterClose) << Qt::endl;
+    }
+    return 0;
+}
+
+int runShards(const QStringList& args, QTextStream& out, QTextStream& err){
+    QString configPath = "config/database.conf";
+    QList<int> shardCounts{1, 2, 4, 8};
+    int bookings = 2000;
+    int schedules = 64;
+    for (int i = 0; i < args.size(); ++i) {
+        if (args[i] == "--config" && i + 1 < args.size()) {
+            configPath = args[++i];
+        } else if (args[i] == "--shards" && i + 1 < args.size()) {
+            shardCounts.clear();
+            for (const QString& count: args[++i].split(',', Qt::SkipEmptyParts)) {
+                shardCounts.append(count.toInt());
+            }
+        } else if (args[i] == "--bookings" && i + 1 < args.size()) {
+            bookings = args[++i].toInt();
+        } else if (args[i] == "--schedules" && i + 1 < args.size()) {
+            schedules = args[++i].toInt();
+        }
+    }
+    if (shardCounts.isEmpty() || *std::min_element(shardCounts.cbegin(), shardCounts.cend()) < 1
+        || bookings < 1 || schedules < 1) {
+        err << "Invalid shard benchmark parameters, see --help" << Qt::endl;
+        return 1;
+    }
+
+    ShardBench bench(configPath, shardCounts, bookings, schedules);
+    QList<ShardBench::Result> results;
+    if (!bench.run(&results)) {
+        err << "Shard benchmark failed: " << bench.lastError() << Qt::endl;
+        return 1;
+    }
+
+    out << QString("%1 bookings per run over %2 schedules").arg(bookings).arg(schedules) << Qt::endl;
+    out << QString("%1 %2 %3 %4").arg(QString("shards"), -8).arg(QString("ms"), 10).arg(QString("bookings/s"), 12).arg(QString("failed"), 8) << Qt::endl;
+    for (const ShardBench::Result& result: results) {
+        double perSecond = result.millis > 0 ? (result.bookings - result.failed) * 1000.0 / result.millis : 0.0;
+        out << QString("%1 %2 %3 %4")
+                   .arg(result.shards, -8)
+                   .arg(result.millis, 10)
+                   .arg(perSecond, 12, 'f', 0)
+                   .arg(result.failed, 8)
+            << Qt::endl;
+    }
+    return 0;
+}
+
+void printHelp(const QString& program, QTextStream& out){
+    out << "Usage: " << program << " SCENARIO [OPTIONS]\n";
+    out << "\n";
+    out << "Scenarios:\n";
+    out << "  wire               Size and CPU cost of a seat map in each wire encoding (no server needed)\n";
+    out << "      --seats N          Seats in the map (default: 900)\n";
+    out << "      --iterations N     Messages encoded and decoded per encoding (default: 2000)\n";
+    out << "  connections        Memory per idle connection and disconnect storms (needs a running server)\n";
+    out << "      --host HOST        Server address (default: 127.0.0.1)\n";
+    out << "      --port PORT        Server port (default: 8080)\n";
+    out << "      --connections N    Idle connections to open; the server's --max-connections must exceed it (default: 10000)\n";
+    out << "      --server-pid PID   Read the server's resident memory from /proc to report bytes per connection\n";
+    out << "      --close-all        Reset every connection at once and time the next PING\n";
+    out << "  shards             Booking throughput for each number of inventory shards (needs a generated database)\n";
+    out << "      --config FILE      Database settings (default: config/database.conf)\n";
+    out << "      --shards LIST      Comma-separated shard counts to compare (default: 1,2,4,8)\n";
+    out << "      --bookings N       Bookings per shard count; the tickets are deleted afterwards (default: 2000)\n";
+    out << "      --schedules N      Upcoming schedules the bookings are spread over (default: 64)\n";
+    out << "\n";
+    out << "  --help             Show this help message\n";
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    app.setApplicationName("Railway Benchmarks");
+    app.setApplicationVersion("1.0.0");
+
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+
+    QStringList args = app.arguments();
+    if (args.size() < 2 || args[1] == "--help") {
+        printHelp(args[0], out);
+        return args.size() < 2 ? 1 : 0;
+    }
+
+    QString scenario = args[1];
+    QStringList options = args.mid(2);
+    if (scenario == "wire") {
+        return runWire(options, out, err);
+    }
+    if (scenario == "connections") {
+        return runConnections(options, out, err);
+    }
+    if (scenario == "shards") {
+        return runShards(options, out, err);
+    }
+
+    err << "Unknown scenario: " << scenario << ", see --help" << Qt::endl;
+    return 1;
+}
@@ -0,0 +1,295 @@
+#include "shardbench.h"
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QSemaphore>
+#include <QSettings>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QThread>
+#include <QVector>
+#include <atomic>
+#include "ticketqueries.h"
+
+ShardBench::ShardBench(const QString& configPath, const QList<int>& shardCounts, int bookings, int schedules)
+    : m_configPath(configPath)
+    , m_port(5432)
+    , m_shardCounts(shardCounts)
+    , m_bookings(bookings)
+    , m_schedules(schedules)
+{
+}
+
+bool ShardBench::run(QList<Result>* results)
+{
+    if (!QFile::exists(m_configPath)) {
+        m_lastError = "Configuration file not found: " + m_configPath;
+        return false;
+    }
+
+    QSettings settings(m_configPath, QSettings::IniFormat);
+    m_host = settings.value("database/host", "localhost").toString();
+    m_port = settings.value("database/port", 5432).toInt();
+    m_dbName = settings.value("database/name", "train_tickets").toString();
+    m_username = settings.value("database/username", "").toString();
+    m_password = settings.value("database/password", "").toString();
+    m_runTag = QString::number(QDateTime::currentMSecsSinceEpoch());
+
+    bool ok = false;
+    {
+        QSqlDatabase db;
+        if (!open("shard_bench", &db, &m_lastError)) {
+            QSqlDatabase::removeDatabase("shard_bench");
+            return false;
+        }
+
+        QSqlQuery user(db);
+        int userId = -1;
+        if (user.exec("SELECT id FROM users ORDER BY id LIMIT 1") && user.next()) {
+            userId = user.value(0).toInt();
+        }
+
+        QList<Booking> bookings;
+        if (userId < 0) {
+            m_lastError = "No user to book for; generate a dataset first";
+        } else if (loadBookings(db, m_bookings * m_shardCounts.size(), &bookings)) {
+            ok = true;
+            for (int i = 0; ok && i < m_shardCounts.size(); ++i) {
+                Result result;
+                ok = runShards(m_shardCounts[i], bookings.mid(i * m_bookings, m_bookings), userId, &result);
+                if (ok) {
+                    results->append(result);
+                }
+            }
+            bool cleaned = cleanUp(db);
+            ok = ok && cleaned;
+        }
+        db.close();
+    }
+    QSqlDatabase::removeDatabase("shard_bench");
+    return ok;
+}
+
+bool ShardBench::open(const QString& connectionName, QSqlDatabase* db, QString* error) const
+{
+    *db = QSqlDatabase::addDatabase("QPSQL", connectionName);
+    db->setHostName(m_host);
+    db->setPort(m_port);
+    db->setDatabaseName(m_dbName);
+    db->setUserName(m_username);
+    db->setPassword(m_password);
+    db->setConnectOptions("connect_timeout=10;sslmode=prefer");
+
+    if (!db->open()) {
+        *error = "Cannot connect to database: " + db->lastError().text();
+        return false;
+    }
+    return true;
+}
+
+// Whole-route bookings on free seats of the next departures, interleaved by
+// schedule so that every run spreads over all of them.
+bool ShardBench::loadBookings(QSqlDatabase& db, int count, QList<Booking>* bookings)
+{
+    QSqlQuery schedules(db);
+    schedules.prepare(R"(
+        SELECT id FROM schedules
+        WHERE departure_date >= CURRENT_DATE AND status = 'active'
+        ORDER BY departure_date, id
+        LIMIT :limit
+    )");
+    schedules.bindValue(":limit", m_schedules);
+    if (!schedules.exec()) {
+        m_lastError = schedules.lastError().text();
+        return false;
+    }
+
+    QList<int> scheduleIds;
+    while (schedules.next()) {
+        scheduleIds.append(schedules.value(0).toInt());
+    }
+    if (scheduleIds.isEmpty()) {
+        m_lastError = "No upcoming schedules; generate a dataset first";
+        return false;
+    }
+
+    QSqlQuery seats(db);
+    seats.prepare(R"(
+        SELECT se.id AS seat_id, first_stop.station_id AS dep_station, last_stop.station_id AS arr_station
+        FROM schedules sch
+        JOIN routes r ON r.id = sch.route_id
+        CROSS JOIN LATERAL (
+            SELECT station_id FROM route_stops WHERE route_id = r.id ORDER BY stop_order LIMIT 1
+        ) first_stop
+        CROSS JOIN LATERAL (
+            SELECT station_id FROM route_stops WHERE route_id = r.id ORDER BY stop_order DESC LIMIT 1
+        ) last_stop
+        JOIN carriages c ON c.train_id = r.train_id
+        JOIN seats se ON se.carriage_id = c.id
+        WHERE sch.id = :schedule_id
+          AND NOT EXISTS (
+              SELECT 1 FROM tickets tk
+              WHERE tk.seat_id = se.id
+                AND tk.schedule_id = sch.id
+                AND tk.departure_date = sch.departure_date
+                AND tk.status IN ('booked', 'paid')
+          )
+        ORDER BY se.id
+        LIMIT :limit
+    )");
+
+    int perSchedule = (count + scheduleIds.size() - 1) / scheduleIds.size();
+    QList<QList<Booking>> bySchedule;
+    for (int scheduleId: scheduleIds) {
+        seats.bindValue(":schedule_id", scheduleId);
+        seats.bindValue(":limit", perSchedule);
+        if (!seats.exec()) {
+            m_lastError = seats.lastError().text();
+            return false;
+        }
+
+        QList<Booking> free;
+        while (seats.next()) {
+            free.append(Booking{scheduleId,
+                                seats.value("seat_id").toInt(),
+                                seats.value("dep_station").toInt(),
+                                seats.value("arr_station").toInt(),
+                                QString()});
+        }
+        bySchedule.append(free);
+    }
+
+    for (int i = 0; i < perSchedule && bookings->size() < count; ++i) {
+        for (const QList<Booking>& free: bySchedule) {
+            if (i < free.size() && bookings->size() < count) {
+                Booking booking = free[i];
+                booking.ticketNumber = QString("BENCH%1-%2").arg(m_runTag).arg(bookings->size());
+                bookings->append(booking);
+            }
+        }
+    }
+
+    if (bookings->size() < count) {
+        m_lastError = QString("Only %1 free seats on %2 schedules, %3 needed; raise --schedules")
+                          .arg(bookings->size()).arg(scheduleIds.size()).arg(count);
+        return false;
+    }
+    return true;
+}
+
+// Connections are opened before the clock starts, as the server opens its
+// shards at startup; the run ends when the slowest shard is done.
+bool ShardBench::runShards(int shards, const QList<Booking>& bookings, int userId, Result* result)
+{
+    QVector<QList<Booking>> queues(shards);
+    for (const Booking& booking: bookings) {
+        queues[int(uint(booking.scheduleId) % uint(shards))].append(booking);
+    }
+
+    QSemaphore ready;
+    QSemaphore start;
+    std::atomic<int> failed(0);
+    QVector<QString> errors(shards);
+    QList<QThread*> threads;
+    for (int i = 0; i < shards; ++i) {
+        QList<Booking> queue = queues[i];
+        QString connectionName = QString("shard_bench_%1").arg(i);
+        QString* error = &errors[i];
+        threads.append(QThread::create([this, connectionName, queue, userId, error, &ready, &start, &failed]() {
+            {
+                QSqlDatabase db;
+                bool opened = open(connectionName, &db, error);
+                ready.release();
+                start.acquire();
+                if (opened) {
+                    for (const Booking& booking: queue) {
+                        if (!book(db, userId, booking)) {
+                            failed++;
+                        }
+                    }
+                    db.close();
+                }
+            }
+            QSqlDatabase::removeDatabase(connectionName);
+        }));
+        threads.last()->start();
+    }
+
+    ready.acquire(shards);
+    QElapsedTimer timer;
+    timer.start();
+    start.release(shards);
+    for (QThread* thread: threads) {
+        thread->wait();
+        delete thread;
+    }
+
+    result->shards = shards;
+    result->bookings = bookings.size();
+    result->failed = failed.load();
+    result->millis = timer.elapsed();
+
+    for (const QString& error: errors) {
+        if (!error.isEmpty()) {
+            m_lastError = error;
+            return false;
+        }
+    }
+    return true;
+}
+
+// InventoryShard::bookTicket: the schedule lock of Database::lockSchedules,
+// then the insert with its audit record, in one transaction.
+bool ShardBench::book(QSqlDatabase& db, int userId, const Booking& booking)
+{
+    if (!db.transaction()) {
+        return false;
+    }
+
+    QSqlQuery lock(db);
+    lock.prepare(R"(
+        SELECT pg_advisory_xact_lock(CAST(:lock_class AS integer), id)
+        FROM (SELECT DISTINCT unnest(CAST(:ids AS integer[])) AS id ORDER BY id) ids
+    )");
+    lock.bindValue(":lock_class", INVENTORY_LOCK_CLASS);
+    lock.bindValue(":ids", QString("{%1}").arg(booking.scheduleId));
+
+    QSqlQuery insert(db);
+    insert.prepare(TicketQueries::insertTicket(true));
+    insert.bindValue(":user_id", userId);
+    insert.bindValue(":schedule_id", booking.scheduleId);
+    insert.bindValue(":seat_id", booking.seatId);
+    insert.bindValue(":dep_station", booking.departureStationId);
+    insert.bindValue(":arr_station", booking.arrivalStationId);
+    insert.bindValue(":ticket_number", booking.ticketNumber);
+    insert.bindValue(":price", 1.0);
+    insert.bindValue(":passenger_name", "Shard Bench");
+    insert.bindValue(":passenger_doc", "0");
+    insert.bindValue(":details", QString("Ticket %1 booked").arg(booking.ticketNumber));
+
+    if (!lock.exec() || !insert.exec() || !insert.next()
+        || insert.value("occupied").toBool() || !insert.value("schedule_found").toBool()) {
+        db.rollback();
+        return false;
+    }
+    return db.commit();
+}
+
+bool ShardBench::cleanUp(QSqlDatabase& db)
+{
+    QString prefix = QString("BENCH%1-").arg(m_runTag);
+
+    QSqlQuery tickets(db);
+    tickets.prepare("DELETE FROM tickets WHERE ticket_number LIKE :pattern");
+    tickets.bindValue(":pattern", prefix + "%");
+
+    QSqlQuery audit(db);
+    audit.prepare("DELETE FROM audit_logs WHERE action = 'ticket_booked' AND details LIKE :pattern");
+    audit.bindValue(":pattern", "Ticket " + prefix + "%");
+
+    if (!tickets.exec() || !audit.exec()) {
+        m_lastError = "Cleanup failed, remove tickets numbered " + prefix + "* by hand";
+        return false;
+    }
+    return true;
+}
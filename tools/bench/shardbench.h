@@ -0,0 +1,61 @@
+#ifndef SHARDBENCH_H
+#define SHARDBENCH_H
+
+#include <QList>
+#include <QSqlDatabase>
+#include <QString>
+
+// Books tickets the way the server's inventory shards do, once for each
+// shard count: one thread and one connection per shard, each running the
+// bookings of the schedules that map to it one after another, with the
+// same advisory lock and the same statement. Every booking takes a seat
+// nobody holds, so none is refused for being taken, and the tickets and
+// audit records the runs create are deleted at the end.
+class ShardBench
+{
+public:
+    struct Result {
+        int shards;
+        int bookings;
+        int failed;
+        qint64 millis;
+    };
+
+    ShardBench(const QString& configPath, const QList<int>& shardCounts, int bookings, int schedules);
+
+    bool run(QList<Result>* results);
+    QString lastError() const { return m_lastError; }
+
+private:
+    struct Booking {
+        int scheduleId;
+        int seatId;
+        int departureStationId;
+        int arrivalStationId;
+        QString ticketNumber;
+    };
+
+    // Database::INVENTORY_LOCK_CLASS, so the runs contend with a live
+    // server's bookings exactly as its own shards do.
+    static const int INVENTORY_LOCK_CLASS = 7305;
+
+    bool open(const QString& connectionName, QSqlDatabase* db, QString* error) const;
+    bool loadBookings(QSqlDatabase& db, int count, QList<Booking>* bookings);
+    bool runShards(int shards, const QList<Booking>& bookings, int userId, Result* result);
+    static bool book(QSqlDatabase& db, int userId, const Booking& booking);
+    bool cleanUp(QSqlDatabase& db);
+
+    QString m_configPath;
+    QString m_host;
+    int m_port;
+    QString m_dbName;
+    QString m_username;
+    QString m_password;
+    QList<int> m_shardCounts;
+    int m_bookings;
+    int m_schedules;
+    QString m_runTag;
+    QString m_lastError;
+};
+
+#endif // SHARDBENCH_H
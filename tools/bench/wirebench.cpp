@@ -0,0 +1,86 @@
+#include "wirebench.h"
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QJsonArray>
+
+WireBench::WireBench(int seats, int iterations)
+    : m_seats(seats)
+    , m_iterations(iterations)
+{
+}
+
+// Same keys and value shapes as ClientHandler::seatsToJson without
+// "compact": 60-seat carriages with a mix of seat types and about a third
+// of the seats taken.
+QJsonObject WireBench::seatMapResponse() const{
+    static const QStringList seatTypes = {"lower", "upper", "side_lower", "side_upper"};
+    static const int SEATS_PER_CARRIAGE = 60;
+
+    QJsonArray seats;
+    for (int i = 0; i < m_seats; i++){
+        int carriage = i / SEATS_PER_CARRIAGE;
+        QJsonObject seat;
+        seat["id"] = 100000 + i;
+        seat["carriageId"] = 5000 + carriage;
+        seat["carriageNumber"] = carriage + 1;
+        seat["carriageType"] = carriage % 3 == 0 ? "coupe" : "platzkart";
+        seat["seatNumber"] = i % SEATS_PER_CARRIAGE + 1;
+        seat["seatType"] = seatTypes[i % seatTypes.size()];
+        seat["isAvailable"] = i % 3 != 0;
+        seats.append(seat);
+    }
+
+    QJsonObject data;
+    data["seats"] = seats;
+    data["count"] = m_seats;
+
+    QJsonObject response;
+    response["command"] = "GET_AVAILABLE_SEATS";
+    response["success"] = true;
+    response["timestamp"] = QDateTime::currentDateTime().toString(Qt::ISODate);
+    response["requestId"] = 42;
+    response["data"] = data;
+    return response;
+}
+
+bool WireBench::run(QList<Result>* results){
+    const QJsonObject response = seatMapResponse();
+
+    for (WireProtocol::Encoding encoding: {WireProtocol::Encoding::Json, WireProtocol::Encoding::Cbor}){
+        QByteArray frame;
+        QElapsedTimer timer;
+        timer.start();
+        for (int i = 0; i < m_iterations; i++){
+            frame = WireProtocol::encode(response, encoding);
+        }
+        qint64 encodeNanos = timer.nsecsElapsed();
+
+        qint64 decodeNanos = 0;
+        for (int i = 0; i < m_iterations; i++){
+            QByteArray buffer = frame;
+            timer.restart();
+
+            QByteArray payload;
+            WireProtocol::Encoding received;
+            QJsonObject message;
+            QString error;
+            if (WireProtocol::takeMessage(buffer, &payload, &received) != WireProtocol::DecodeStatus::Message
+                || !WireProtocol::decode(payload, received, &message, &error)){
+                m_lastError = QString("%1 frame did not decode: %2")
+                                  .arg(WireProtocol::encodingName(encoding), error);
+                return false;
+            }
+            decodeNanos += timer.nsecsElapsed();
+
+            if (message["data"].toObject()["count"].toInt() != m_seats){
+                m_lastError = QString("%1 frame decoded to a different message").arg(WireProtocol::encodingName(encoding));
+                return false;
+            }
+        }
+
+        results->append(Result{encoding, frame.size(),
+                               encodeNanos / 1000.0 / m_iterations,
+                               decodeNanos / 1000.0 / m_iterations});
+    }
+    return true;
+}
@@ -0,0 +1,36 @@
+#ifndef WIREBENCH_H
+#define WIREBENCH_H
+
+#include <QJsonObject>
+#include <QList>
+#include <QString>
+#include "wireprotocol.h"
+
+// Encodes and decodes one GET_AVAILABLE_SEATS response in its per-seat form
+// (the largest message the server sends) with every wire encoding, and
+// reports the frame size and the CPU time per message on each side. Decoding
+// covers what a peer does on receipt: takeMessage followed by decode.
+class WireBench
+{
+public:
+    struct Result {
+        WireProtocol::Encoding encoding;
+        qint64 frameBytes;
+        double encodeMicros;
+        double decodeMicros;
+    };
+
+    WireBench(int seats, int iterations);
+
+    bool run(QList<Result>* results);
+    QString lastError() const { return m_lastError; }
+
+private:
+    QJsonObject seatMapResponse() const;
+
+    int m_seats;
+    int m_iterations;
+    QString m_lastError;
+};
+
+#endif // WIREBENCH_H
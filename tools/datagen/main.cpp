@@ -0,0 +1,173 @@
+#include <QCoreApplication>
+#include <QFile>
+#include <QSettings>
+#include <QTextStream>
+#include <libpq-fe.h>
+#include "networkgenerator.h"
+#include "plancheck.h"
+
+namespace {
+
+QByteArray connectionString(const QSettings& settings){
+    QStringList parts;
+    auto add = [&parts](const char* key, const QString& value){
+        QString escaped = value;
+        escaped.replace("\\", "\\\\").replace("'", "\\'");
+        parts << QString("%1='%2'").arg(key, escaped);
+    };
+    add("host", settings.value("database/host", "localhost").toString());
+    add("port", settings.value("database/port", 5432).toString());
+    add("dbname", settings.value("database/name", "train_tickets").toString());
+    add("user", settings.value("database/username", "").toString());
+    add("password", settings.value("database/password", "").toString());
+    return parts.join(' ').toUtf8();
+}
+
+bool hasExistingData(PGconn* connection){
+    PGresult* result = PQexec(connection, "SELECT EXISTS (SELECT 1 FROM users) OR EXISTS (SELECT 1 FROM stations)");
+    bool existing = PQresultStatus(result) != PGRES_TUPLES_OK || QByteArray(PQgetvalue(result, 0, 0)) == "t";
+    PQclear(result);
+    return existing;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    app.setApplicationName("Railway Network Data Generator");
+    app.setApplicationVersion("1.0.0");
+
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+
+    NetworkGenerator::Options options = NetworkGenerator::defaultOptions();
+    QString configPath = "config/database.conf";
+    bool replace = false;
+    bool checkPlans = false;
+
+    QStringList args = app.arguments();
+    for (int i = 1; i < args.size(); ++i) {
+        if (args[i] == "--config") {
+            if (i + 1 < args.size()) {
+                configPath = args[++i];
+            }
+        } else if (args[i] == "--stations") {
+            if (i + 1 < args.size()) {
+                options.stations = args[++i].toInt();
+            }
+        } else if (args[i] == "--trains") {
+            if (i + 1 < args.size()) {
+                options.trains = args[++i].toInt();
+            }
+        } else if (args[i] == "--days") {
+            if (i + 1 < args.size()) {
+                options.days = args[++i].toInt();
+            }
+        } else if (args[i] == "--fill") {
+            if (i + 1 < args.size()) {
+                options.fillRate = args[++i].toDouble();
+            }
+        } else if (args[i] == "--users") {
+            if (i + 1 < args.size()) {
+                options.users = args[++i].toInt();
+            }
+        } else if (args[i] == "--min-stops") {
+            if (i + 1 < args.size()) {
+                options.minStops = args[++i].toInt();
+            }
+        } else if (args[i] == "--max-stops") {
+            if (i + 1 < args.size()) {
+                options.maxStops = args[++i].toInt();
+            }
+        } else if (args[i] == "--seed") {
+            if (i + 1 < args.size()) {
+                options.seed = args[++i].toUInt();
+            }
+        } else if (args[i] == "--start-date") {
+            if (i + 1 < args.size()) {
+                options.startDate = QDate::fromString(args[++i], Qt::ISODate);
+            }
+        } else if (args[i] == "--no-bulk") {
+            options.bulk = false;
+        } else if (args[i] == "--replace") {
+            replace = true;
+        } else if (args[i] == "--check-plans") {
+            checkPlans = true;
+        } else if (args[i] == "--help") {
+            out << "Usage: " << args[0] << " [OPTIONS]\n";
+            out << "\n";
+            out << "Fills the database with a synthetic railway network for scale testing.\n";
+            out << "All users, stations, trains, schedules and tickets are replaced.\n";
+            out << "\n";
+            out << "Options:\n";
+            out << "  --config FILE      Database settings (default: config/database.conf)\n";
+            out << "  --stations N       Number of stations (default: 5000)\n";
+            out << "  --trains N         Number of trains, one route each (default: 2000)\n";
+            out << "  --days N           Days of daily departures (default: 365)\n";
+            out << "  --fill RATE        Share of seat-days sold, 0..1 (default: 0.4)\n";
+            out << "  --users N          Number of user accounts (default: 10000)\n";
+            out << "  --min-stops N      Shortest route (default: 5)\n";
+            out << "  --max-stops N      Longest route (default: 25)\n";
+            out << "  --seed N           Random seed; equal seeds give equal networks (default: 1)\n";
+            out << "  --start-date DATE  First departure date, YYYY-MM-DD (default: today)\n";
+            out << "  --no-bulk          Keep constraints and indexes in place during the load\n";
+            out << "  --replace          Allow overwriting a database that already has data\n";
+            out << "  --check-plans      Check the query plans of hot ticket queries instead of generating\n";
+            out << "  --help             Show this help message\n";
+            out << "\n";
+            out << "Every generated user (userN@example.com) has the password Generated1!\n";
+            return 0;
+        }
+    }
+
+    if (options.stations < 2 || options.trains < 1 || options.days < 1 || options.users < 1
+        || options.fillRate < 0.0 || options.fillRate > 1.0
+        || options.minStops < 2 || options.maxStops < options.minStops || !options.startDate.isValid()) {
+        err << "Invalid generator parameters, see --help" << Qt::endl;
+        return 1;
+    }
+
+    if (!QFile::exists(configPath)) {
+        err << "Configuration file not found: " << configPath << Qt::endl;
+        return 1;
+    }
+
+    QSettings settings(configPath, QSettings::IniFormat);
+    PGconn* connection = PQconnectdb(connectionString(settings).constData());
+    if (PQstatus(connection) != CONNECTION_OK) {
+        err << "Failed to connect to database: " << QString::fromUtf8(PQerrorMessage(connection)).trimmed() << Qt::endl;
+        PQfinish(connection);
+        return 1;
+    }
+
+    if (checkPlans) {
+        PlanCheck check(connection);
+        bool ok = check.run();
+        if (!ok) {
+            err << "Plan check failed: " << check.lastError() << Qt::endl;
+        }
+        PQfinish(connection);
+        return ok ? 0 : 1;
+    }
+
+    if (!replace && hasExistingData(connection)) {
+        err << "The database already has users or stations; pass --replace to overwrite them" << Qt::endl;
+        PQfinish(connection);
+        return 1;
+    }
+
+    NetworkGenerator generator(connection, options);
+    out << QString("Generating %1 stations, %2 trains, %3 days at %4% fill (about %5 tickets)")
+               .arg(options.stations).arg(options.trains).arg(options.days)
+               .arg(options.fillRate * 100.0, 0, 'f', 0).arg(generator.estimatedTickets())
+        << Qt::endl;
+
+    bool ok = generator.run();
+    if (!ok) {
+        err << "Generation failed: " << generator.lastError() << Qt::endl;
+    }
+
+    PQfinish(connection);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,676 @@
+#include "networkgenerator.h"
+#include "copystream.h"
+#include <QCryptographicHash>
+#include <QTextStream>
+#include <QtMath>
+#include <algorithm>
+
+const char* const NetworkGenerator::SYNTHETIC_PASSWORD = "Generated1!";
+
+namespace {
+
+const QStringList LOADED_TABLES = {
+    "users", "stations", "trains", "routes", "route_stops",
+    "carriages", "seats", "schedules", "tickets"
+};
+
+struct TrainType {
+    const char* name;
+    int weight;
+    double speedKmh;
+};
+
+const TrainType TRAIN_TYPES[] = {
+    {"Скоростной", 15, 140.0},
+    {"Фирменный", 25, 90.0},
+    {"Пассажирский", 50, 70.0},
+    {"Электричка", 10, 60.0}
+};
+
+struct CarType {
+    const char* name;
+    int weight;
+    int seats;
+    double multiplier;
+};
+
+const CarType CAR_TYPES[] = {
+    {"Сидячий", 10, 18, 1.0},
+    {"Купе", 40, 36, 2.5},
+    {"Плацкарт", 40, 54, 1.5},
+    {"СВ", 10, 18, 4.0}
+};
+
+// Rails wind; straight-line distance between stations undercounts the track.
+const double TRACK_FACTOR = 1.2;
+const double PRICE_PER_KM = 2.5;
+const double AVERAGE_SEATS_PER_TRAIN = 14 * 40.0;
+
+QString tableList(){
+    QStringList quoted;
+    for (const QString& table: LOADED_TABLES){
+        quoted << QString("'%1'").arg(table);
+    }
+    return quoted.join(", ");
+}
+
+}
+
+NetworkGenerator::Options NetworkGenerator::defaultOptions(){
+    Options options;
+    options.stations = 5000;
+    options.trains = 2000;
+    options.days = 365;
+    options.fillRate = 0.4;
+    options.users = 10000;
+    options.minStops = 5;
+    options.maxStops = 25;
+    options.seed = 1;
+    options.startDate = QDate::currentDate();
+    options.bulk = true;
+    return options;
+}
+
+NetworkGenerator::NetworkGenerator(PGconn* connection, const Options& options)
+    : m_connection(connection)
+    , m_options(options)
+    , m_random(options.seed)
+{
+}
+
+qint64 NetworkGenerator::estimatedTickets() const{
+    return qint64(double(m_options.trains) * m_options.days * AVERAGE_SEATS_PER_TRAIN * m_options.fillRate);
+}
+
+bool NetworkGenerator::run(){
+    m_timer.start();
+
+    buildStations();
+    buildNeighbours();
+    buildTrains();
+    step("network planned", true);
+
+    if (!exec("BEGIN")){
+        return false;
+    }
+
+    bool ok = exec("SET LOCAL synchronous_commit = off")
+              && prepareTables()
+              && (!m_options.bulk || dropSecondaryStructures())
+              && loadUsers()
+              && loadStations()
+              && loadTrains()
+              && loadSchedules()
+              && loadTickets()
+              && (!m_options.bulk || restoreSecondaryStructures())
+              && resetSequences();
+
+    if (!ok){
+        QString error = m_lastError;
+        exec("ROLLBACK");
+        m_lastError = error;
+        return false;
+    }
+
+    if (!step("commit", exec("COMMIT"))){
+        return false;
+    }
+    // Vacuum rather than a bare ANALYZE: tickets cannot be loaded frozen, and
+    // index-only scans need the visibility map it sets.
+    return step("vacuum analyze", exec("VACUUM (ANALYZE)"));
+}
+
+bool NetworkGenerator::exec(const QString& sql){
+    PGresult* result = PQexec(m_connection, sql.toUtf8().constData());
+    ExecStatusType status = PQresultStatus(result);
+    bool ok = status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK;
+    if (!ok){
+        m_lastError = QString::fromUtf8(PQresultErrorMessage(result)).trimmed();
+    }
+    PQclear(result);
+    return ok;
+}
+
+bool NetworkGenerator::query(const QString& sql, QList<QStringList>* rows){
+    PGresult* result = PQexec(m_connection, sql.toUtf8().constData());
+    if (PQresultStatus(result) != PGRES_TUPLES_OK){
+        m_lastError = QString::fromUtf8(PQresultErrorMessage(result)).trimmed();
+        PQclear(result);
+        return false;
+    }
+
+    rows->clear();
+    for (int row = 0; row < PQntuples(result); row++){
+        QStringList values;
+        for (int column = 0; column < PQnfields(result); column++){
+            values << QString::fromUtf8(PQgetvalue(result, row, column));
+        }
+        rows->append(values);
+    }
+    PQclear(result);
+    return true;
+}
+
+bool NetworkGenerator::step(const QString& what, bool ok, CopyStream* stream){
+    QTextStream out(stdout);
+    if (!ok){
+        if (stream){
+            m_lastError = stream->lastError();
+        }
+        out << what << ": failed" << Qt::endl;
+        return false;
+    }
+
+    out << QString("[%1 s] %2").arg(m_timer.elapsed() / 1000.0, 0, 'f', 1).arg(what);
+    if (stream){
+        out << ": " << stream->rowCount() << " rows";
+    }
+    out << Qt::endl;
+    return true;
+}
+
+// Stations gather around regional centres the way real networks do, so the
+// nearest-neighbour walks below produce plausible routes with shared hubs.
+void NetworkGenerator::buildStations(){
+    int clusterCount = qMax(1, m_options.stations / 25);
+    QVector<QPair<double, double>> centres;
+    centres.reserve(clusterCount);
+    for (int i = 0; i < clusterCount; i++){
+        centres.append({43.0 + m_random.generateDouble() * 25.0, 28.0 + m_random.generateDouble() * 107.0});
+    }
+
+    m_stations.clear();
+    m_stations.reserve(m_options.stations);
+    for (int i = 0; i < m_options.stations; i++){
+        StationInfo station;
+        station.cluster = m_random.bounded(clusterCount);
+        double spreadLat = (m_random.generateDouble() + m_random.generateDouble() - 1.0) * 1.5;
+        double spreadLon = (m_random.generateDouble() + m_random.generateDouble() - 1.0) * 2.5;
+        station.latitude = centres[station.cluster].first + spreadLat;
+        station.longitude = centres[station.cluster].second + spreadLon;
+        m_stations.append(station);
+    }
+}
+
+void NetworkGenerator::buildNeighbours(){
+    int count = m_stations.size();
+    int keep = qMin(NEIGHBOUR_COUNT, count - 1);
+    QVector<QPair<double, int>> distances;
+    distances.reserve(count);
+
+    for (int i = 0; i < count; i++){
+        distances.clear();
+        for (int j = 0; j < count; j++){
+            if (j != i){
+                distances.append({distanceKm(m_stations[i], m_stations[j]), j});
+            }
+        }
+        std::partial_sort(distances.begin(), distances.begin() + keep, distances.end());
+
+        m_stations[i].neighbours.clear();
+        for (int k = 0; k < keep; k++){
+            m_stations[i].neighbours.append(distances[k].second);
+        }
+    }
+}
+
+void NetworkGenerator::buildTrains(){
+    m_trains.clear();
+    m_trains.reserve(m_options.trains);
+
+    qint64 nextCarriageId = 1;
+    qint64 nextSeatId = 1;
+    for (int i = 0; i < m_options.trains; i++){
+        TrainPlan plan = planTrain();
+        plan.firstCarriageId = nextCarriageId;
+        plan.firstSeatId = nextSeatId;
+        nextCarriageId += plan.cars.size();
+        nextSeatId += plan.totalSeats;
+        m_trains.append(plan);
+    }
+}
+
+NetworkGenerator::TrainPlan NetworkGenerator::planTrain(){
+    int typeWeight = 0;
+    for (const TrainType& type: TRAIN_TYPES){
+        typeWeight += type.weight;
+    }
+    int pick = m_random.bounded(typeWeight);
+    const TrainType* type = &TRAIN_TYPES[0];
+    for (const TrainType& candidate: TRAIN_TYPES){
+        if (pick < candidate.weight){
+            type = &candidate;
+            break;
+        }
+        pick -= candidate.weight;
+    }
+
+    // Walk from a random station towards a random target, picking among the
+    // closest-to-target unvisited neighbours so routes bend but keep going.
+    int stopCount = m_random.bounded(m_options.minStops, m_options.maxStops + 1);
+    QVector<int> path;
+    for (int attempt = 0; attempt < 10 && path.size() < 2; attempt++){
+        int start = m_random.bounded(m_stations.size());
+        int target = m_random.bounded(m_stations.size());
+        path = {start};
+
+        while (path.size() < stopCount){
+            QVector<QPair<double, int>> candidates;
+            for (int neighbour: m_stations[path.last()].neighbours){
+                if (!path.contains(neighbour)){
+                    candidates.append({distanceKm(m_stations[neighbour], m_stations[target]), neighbour});
+                }
+            }
+            if (candidates.isEmpty()){
+                break;
+            }
+            std::sort(candidates.begin(), candidates.end());
+            path.append(candidates[m_random.bounded(qMin(3, int(candidates.size())))].second);
+        }
+    }
+
+    // Ten walks from stations without usable neighbours are unlikely but
+    // possible; a train still needs two stops for a ticket to exist, so it
+    // then runs to the nearest other station.
+    if (path.size() < 2){
+        int start = path.first();
+        int nearest = start == 0 ? 1 : 0;
+        for (int i = 0; i < m_stations.size(); i++){
+            if (i != start && distanceKm(m_stations[start], m_stations[i]) < distanceKm(m_stations[start], m_stations[nearest])){
+                nearest = i;
+            }
+        }
+        path.append(nearest);
+    }
+
+    TrainPlan plan;
+    plan.type = type->name;
+    plan.totalSeats = 0;
+    plan.firstCarriageId = 0;
+    plan.firstSeatId = 0;
+
+    int minute = m_random.bounded(300, 1380);
+    double price = 0.0;
+    for (int i = 0; i < path.size(); i++){
+        Stop stop;
+        stop.station = path[i];
+        if (i == 0){
+            stop.arrivalMinute = -1;
+            stop.dwellMinutes = 0;
+        } else {
+            double legKm = distanceKm(m_stations[path[i - 1]], m_stations[path[i]]) * TRACK_FACTOR;
+            minute += qMax(5, qRound(legKm / type->speedKmh * 60.0));
+            price += legKm * PRICE_PER_KM;
+            stop.arrivalMinute = minute;
+            stop.dwellMinutes = i == path.size() - 1 ? 0 : m_random.bounded(2, 21);
+        }
+        minute += stop.dwellMinutes;
+        stop.departureMinute = minute;
+        stop.price = price;
+        plan.stops.append(stop);
+    }
+
+    int carWeight = 0;
+    for (const CarType& car: CAR_TYPES){
+        carWeight += car.weight;
+    }
+    int carCount = m_random.bounded(8, 21);
+    for (int number = 1; number <= carCount; number++){
+        int carPick = m_random.bounded(carWeight);
+        const CarType* carType = &CAR_TYPES[0];
+        for (const CarType& candidate: CAR_TYPES){
+            if (carPick < candidate.weight){
+                carType = &candidate;
+                break;
+            }
+            carPick -= candidate.weight;
+        }
+        plan.cars.append(Car{number, carType->name, carType->seats, carType->multiplier});
+        plan.totalSeats += carType->seats;
+    }
+
+    return plan;
+}
+
+// Everything the generator writes is replaced wholesale. Tables that only
+// reference users are emptied too, since their rows would point at users
+// that no longer exist.
+bool NetworkGenerator::prepareTables(){
+    return step("tables truncated", exec("TRUNCATE users, audit_logs, sessions, verification_codes, stations, trains, "
+                                         "routes, route_stops, carriages, seats, schedules, tickets "
+                                         "RESTART IDENTITY CASCADE"));
+}
+
+// Index maintenance and per-row foreign key checks dominate a large load, so
+// bulk mode drops them up front and rebuilds each once over the final data.
+bool NetworkGenerator::dropSecondaryStructures(){
+    m_constraints.clear();
+    m_indexes.clear();
+
+    QList<QStringList> rows;
+    QString constraintsSql = QString(R"(
+        SELECT conrelid::regclass::text, conname, pg_get_constraintdef(oid)
+        FROM pg_constraint
+        WHERE contype IN ('f', 'u')
+          AND connamespace = (SELECT oid FROM pg_namespace WHERE nspname = current_schema())
+          AND conrelid::regclass::text IN (%1)
+        ORDER BY contype = 'f' DESC
+    )").arg(tableList());
+    if (!query(constraintsSql, &rows)){
+        return false;
+    }
+    for (const QStringList& row: rows){
+        m_constraints.append(SavedDefinition{row[0], row[1], row[2]});
+    }
+
+    QString indexesSql = QString(R"(
+        SELECT tablename, indexname, indexdef
+        FROM pg_indexes i
+        WHERE schemaname = current_schema()
+          AND tablename IN (%1)
+          AND NOT EXISTS (SELECT 1 FROM pg_constraint c WHERE c.conname = i.indexname)
+    )").arg(tableList());
+    if (!query(indexesSql, &rows)){
+        return false;
+    }
+    for (const QStringList& row: rows){
+        m_indexes.append(SavedDefinition{row[0], row[1], row[2]});
+    }
+
+    // Foreign keys are listed first so they go before anything they lean on.
+    for (const SavedDefinition& constraint: m_constraints){
+        if (!exec(QString("ALTER TABLE %1 DROP CONSTRAINT %2").arg(constraint.table, constraint.name))){
+            return false;
+        }
+    }
+    for (const SavedDefinition& index: m_indexes){
+        if (!exec(QString("DROP INDEX %1").arg(index.name))){
+            return false;
+        }
+    }
+
+    return step(QString("dropped %1 constraints and %2 indexes").arg(m_constraints.size()).arg(m_indexes.size()), true);
+}
+
+// Unique constraints and plain indexes are rebuilt before the foreign keys,
+// whose validation scans then find the referenced keys already indexed.
+bool NetworkGenerator::restoreSecondaryStructures(){
+    for (const SavedDefinition& constraint: m_constraints){
+        if (!constraint.definition.startsWith("FOREIGN KEY")
+            && !exec(QString("ALTER TABLE %1 ADD CONSTRAINT %2 %3").arg(constraint.table, constraint.name, constraint.definition))){
+            return false;
+        }
+    }
+    for (const SavedDefinition& index: m_indexes){
+        if (!exec(index.definition)){
+            return false;
+        }
+    }
+    if (!step("unique constraints and indexes restored", true)){
+        return false;
+    }
+
+    for (const SavedDefinition& constraint: m_constraints){
+        if (constraint.definition.startsWith("FOREIGN KEY")
+            && !exec(QString("ALTER TABLE %1 ADD CONSTRAINT %2 %3").arg(constraint.table, constraint.name, constraint.definition))){
+            return false;
+        }
+    }
+    return step("foreign keys restored", true);
+}
+
+bool NetworkGenerator::resetSequences(){
+    for (const QString& table: LOADED_TABLES){
+        QString sql = QString("SELECT setval(pg_get_serial_sequence('%1', 'id'), COALESCE(MAX(id), 0) + 1, false) FROM %1").arg(table);
+        if (!exec(sql)){
+            return false;
+        }
+    }
+    return step("sequences reset", true);
+}
+
+bool NetworkGenerator::loadUsers(){
+    // One known password for every account lets load tests log in as anyone.
+    // The hash follows Database::hashPassword and is computed only once.
+    QByteArray salt = "0123456789abcdef0123456789abcdef";
+    QByteArray hash = (QString::fromLatin1(SYNTHETIC_PASSWORD) + QString::fromLatin1(salt)).toUtf8();
+    for (int i = 0; i < 10000; i++){
+        hash = QCryptographicHash::hash(hash, QCryptographicHash::Sha256);
+    }
+    hash = hash.toHex();
+
+    CopyStream copy(m_connection);
+    if (!copy.begin("users", {"id", "name", "surname", "email", "password_hash", "password_salt", "is_verified"}, m_options.bulk)){
+        return step("users", false, &copy);
+    }
+    for (int id = 1; id <= m_options.users; id++){
+        QByteArray number = QByteArray::number(id);
+        copy.field(id).field("Пользователь").field(number).field("user" + number + "@example.com")
+            .field(hash).field(salt).field(true);
+        if (!copy.endRow()){
+            return step("users", false, &copy);
+        }
+    }
+    return step("users", copy.finish(), &copy);
+}
+
+bool NetworkGenerator::loadStations(){
+    CopyStream copy(m_connection);
+    if (!copy.begin("stations", {"id", "name", "city", "code", "latitude", "longitude"}, m_options.bulk)){
+        return step("stations", false, &copy);
+    }
+    for (int i = 0; i < m_stations.size(); i++){
+        const StationInfo& station = m_stations[i];
+        int id = i + 1;
+        QByteArray city = "Город " + QByteArray::number(station.cluster + 1);
+        copy.field(id).field("Станция " + QByteArray::number(id)).field(city)
+            .field("S" + QByteArray::number(id, 36).toUpper())
+            .field(QByteArray::number(station.latitude, 'f', 6)).field(QByteArray::number(station.longitude, 'f', 6));
+        if (!copy.endRow()){
+            return step("stations", false, &copy);
+        }
+    }
+    return step("stations", copy.finish(), &copy);
+}
+
+// Train and route ids equal the train's position and carriage and seat ids
+// were handed out in buildTrains, so nothing has to be read back.
+bool NetworkGenerator::loadTrains(){
+    QByteArray validFrom = m_options.startDate.toString(Qt::ISODate).toLatin1();
+    QByteArray validTo = m_options.startDate.addDays(m_options.days - 1).toString(Qt::ISODate).toLatin1();
+
+    CopyStream copy(m_connection);
+    if (!copy.begin("trains", {"id", "train_number", "train_type", "total_seats", "is_active"}, m_options.bulk)){
+        return step("trains", false, &copy);
+    }
+    for (int i = 0; i < m_trains.size(); i++){
+        const TrainPlan& train = m_trains[i];
+        copy.field(i + 1).field("G" + QByteArray::number(i + 1).rightJustified(5, '0'))
+            .field(train.type).field(train.totalSeats).field(true);
+        if (!copy.endRow()){
+            return step("trains", false, &copy);
+        }
+    }
+    if (!step("trains", copy.finish(), &copy)){
+        return false;
+    }
+
+    if (!copy.begin("routes", {"id", "train_id", "route_name", "valid_from", "valid_to"}, m_options.bulk)){
+        return step("routes", false, &copy);
+    }
+    for (int i = 0; i < m_trains.size(); i++){
+        const TrainPlan& train = m_trains[i];
+        QByteArray name = "Станция " + QByteArray::number(train.stops.first().station + 1)
+                          + " - Станция " + QByteArray::number(train.stops.last().station + 1);
+        copy.field(i + 1).field(i + 1).field(name).field(validFrom).field(validTo);
+        if (!copy.endRow()){
+            return step("routes", false, &copy);
+        }
+    }
+    if (!step("routes", copy.finish(), &copy)){
+        return false;
+    }
+
+    if (!copy.begin("route_stops", {"id", "route_id", "station_id", "stop_order", "arrival_time", "departure_time",
+                                    "stop_duration_minutes", "price_from_start"}, m_options.bulk)){
+        return step("route_stops", false, &copy);
+    }
+    qint64 stopId = 1;
+    for (int i = 0; i < m_trains.size(); i++){
+        const QVector<Stop>& stops = m_trains[i].stops;
+        for (int order = 0; order < stops.size(); order++){
+            const Stop& stop = stops[order];
+            copy.field(stopId++).field(i + 1).field(stop.station + 1).field(order + 1);
+            if (stop.arrivalMinute < 0){
+                copy.nullField();
+            } else {
+                copy.field(timeOfDay(stop.arrivalMinute));
+            }
+            copy.field(timeOfDay(stop.departureMinute)).field(stop.dwellMinutes).field(stop.price);
+            if (!copy.endRow()){
+                return step("route_stops", false, &copy);
+            }
+        }
+    }
+    if (!step("route_stops", copy.finish(), &copy)){
+        return false;
+    }
+
+    if (!copy.begin("carriages", {"id", "train_id", "carriage_number", "carriage_type", "total_seats", "price_multiplier"}, m_options.bulk)){
+        return step("carriages", false, &copy);
+    }
+    for (int i = 0; i < m_trains.size(); i++){
+        const TrainPlan& train = m_trains[i];
+        for (int c = 0; c < train.cars.size(); c++){
+            const Car& car = train.cars[c];
+            copy.field(train.firstCarriageId + c).field(i + 1).field(car.number).field(car.type)
+                .field(car.seats).field(car.multiplier);
+            if (!copy.endRow()){
+                return step("carriages", false, &copy);
+            }
+        }
+    }
+    if (!step("carriages", copy.finish(), &copy)){
+        return false;
+    }
+
+    if (!copy.begin("seats", {"id", "carriage_id", "seat_number", "seat_type", "is_available"}, m_options.bulk)){
+        return step("seats", false, &copy);
+    }
+    for (const TrainPlan& train: m_trains){
+        qint64 seatId = train.firstSeatId;
+        for (int c = 0; c < train.cars.size(); c++){
+            const Car& car = train.cars[c];
+            for (int seat = 1; seat <= car.seats; seat++){
+                copy.field(seatId++).field(train.firstCarriageId + c).field(seat)
+                    .field(seat % 2 == 1 ? "Нижнее" : "Верхнее").field(true);
+                if (!copy.endRow()){
+                    return step("seats", false, &copy);
+                }
+            }
+        }
+    }
+    return step("seats", copy.finish(), &copy);
+}
+
+bool NetworkGenerator::loadSchedules(){
+    QVector<QByteArray> dates;
+    dates.reserve(m_options.days);
+    for (int day = 0; day < m_options.days; day++){
+        dates.append(m_options.startDate.addDays(day).toString(Qt::ISODate).toLatin1());
+    }
+
+    CopyStream copy(m_connection);
+    if (!copy.begin("schedules", {"id", "route_id", "departure_date", "status"}, m_options.bulk)){
+        return step("schedules", false, &copy);
+    }
+    qint64 scheduleId = 1;
+    for (int i = 0; i < m_trains.size(); i++){
+        for (int day = 0; day < m_options.days; day++){
+            copy.field(scheduleId++).field(i + 1).field(dates[day]).field("active");
+            if (!copy.endRow()){
+                return step("schedules", false, &copy);
+            }
+        }
+    }
+    return step("schedules", copy.finish(), &copy);
+}
+
+// Schedule ids follow the order written by loadSchedules: train by train,
+// day by day. Each occupied seat-day carries one paid ticket on a random
+// segment of the route, which is enough to exercise the overlap checks.
+bool NetworkGenerator::loadTickets(){
+    QVector<QByteArray> departures;
+    QVector<QByteArray> bookedAt;
+    departures.reserve(m_options.days);
+    bookedAt.reserve(m_options.days);
+    for (int day = 0; day < m_options.days; day++){
+        departures.append(m_options.startDate.addDays(day).toString(Qt::ISODate).toLatin1());
+        QDate date = m_options.startDate.addDays(day - 7);
+        bookedAt.append(date.toString(Qt::ISODate).toLatin1() + " 12:00:00");
+    }
+
+    QString partitions = QString("SELECT ensure_ticket_partitions('%1', '%2')")
+                             .arg(m_options.startDate.toString(Qt::ISODate),
+                                  m_options.startDate.addDays(m_options.days - 1).toString(Qt::ISODate));
+    if (!step("ticket partitions ready", exec(partitions))){
+        return false;
+    }
+
+    // COPY FREEZE is not available for partitioned tables.
+    CopyStream copy(m_connection);
+    if (!copy.begin("tickets", {"id", "user_id", "schedule_id", "seat_id", "departure_station_id", "arrival_station_id",
+                                "departure_date", "ticket_number", "price", "status", "booked_at", "paid_at",
+                                "passenger_name", "passenger_document"})){
+        return step("tickets", false, &copy);
+    }
+
+    qint64 ticketId = 1;
+    qint64 scheduleId = 1;
+    for (const TrainPlan& train: m_trains){
+        int stopCount = train.stops.size();
+        for (int day = 0; day < m_options.days; day++, scheduleId++){
+            qint64 seatId = train.firstSeatId;
+            for (const Car& car: train.cars){
+                for (int seat = 0; seat < car.seats; seat++, seatId++){
+                    if (m_random.generateDouble() >= m_options.fillRate){
+                        continue;
+                    }
+
+                    int from = m_random.bounded(stopCount - 1);
+                    int to = m_random.bounded(from + 1, stopCount);
+                    double price = (train.stops[to].price - train.stops[from].price) * car.multiplier;
+                    int userId = m_random.bounded(m_options.users) + 1;
+                    QByteArray document = QByteArray::number(qint64(1000000000) + m_random.bounded(9000000000LL));
+
+                    copy.field(ticketId).field(userId).field(scheduleId).field(seatId)
+                        .field(train.stops[from].station + 1).field(train.stops[to].station + 1).field(departures[day])
+                        .field("GEN" + QByteArray::number(ticketId)).field(price).field("paid")
+                        .field(bookedAt[day]).field(bookedAt[day])
+                        .field("Пассажир " + QByteArray::number(userId)).field(document);
+                    ticketId++;
+                    if (!copy.endRow()){
+                        return step("tickets", false, &copy);
+                    }
+                }
+            }
+        }
+    }
+    return step("tickets", copy.finish(), &copy);
+}
+
+double NetworkGenerator::distanceKm(const StationInfo& a, const StationInfo& b){
+    const double earthRadiusKm = 6371.0;
+    double lat1 = qDegreesToRadians(a.latitude);
+    double lat2 = qDegreesToRadians(b.latitude);
+    double dLat = lat2 - lat1;
+    double dLon = qDegreesToRadians(b.longitude - a.longitude);
+    double h = qSin(dLat / 2) * qSin(dLat / 2) + qCos(lat1) * qCos(lat2) * qSin(dLon / 2) * qSin(dLon / 2);
+    return 2.0 * earthRadiusKm * qAsin(qSqrt(qMin(1.0, h)));
+}
+
+QByteArray NetworkGenerator::timeOfDay(int minute){
+    minute %= 24 * 60;
+    return QByteArray::number(minute / 60).rightJustified(2, '0') + ":"
+           + QByteArray::number(minute % 60).rightJustified(2, '0') + ":00";
+}
@@ -0,0 +1,120 @@
+#ifndef NETWORKGENERATOR_H
+#define NETWORKGENERATOR_H
+
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QDate>
+#include <QElapsedTimer>
+#include <QRandomGenerator>
+#include <libpq-fe.h>
+
+class CopyStream;
+
+// Builds a synthetic railway network and loads it with COPY in a single
+// transaction. Stations are clustered around regional centres, each train
+// runs one route walked along nearest neighbours, and every route departs
+// daily for the requested number of days. Bookings fill the requested share
+// of seat-days with one paid ticket per occupied seat on a random segment.
+class NetworkGenerator
+{
+public:
+    struct Options {
+        int stations;
+        int trains;
+        int days;
+        double fillRate;
+        int users;
+        int minStops;
+        int maxStops;
+        quint32 seed;
+        QDate startDate;
+        bool bulk;
+    };
+
+    static Options defaultOptions();
+
+    NetworkGenerator(PGconn* connection, const Options& options);
+
+    bool run();
+    QString lastError() const { return m_lastError; }
+
+    qint64 estimatedTickets() const;
+
+private:
+    struct StationInfo {
+        double latitude;
+        double longitude;
+        int cluster;
+        QVector<int> neighbours;
+    };
+
+    struct Stop {
+        int station;
+        int arrivalMinute;
+        int departureMinute;
+        int dwellMinutes;
+        double price;
+    };
+
+    struct Car {
+        int number;
+        const char* type;
+        int seats;
+        double multiplier;
+    };
+
+    struct TrainPlan {
+        const char* type;
+        QVector<Stop> stops;
+        QVector<Car> cars;
+        int totalSeats;
+        qint64 firstCarriageId;
+        qint64 firstSeatId;
+    };
+
+    struct SavedDefinition {
+        QString table;
+        QString name;
+        QString definition;
+    };
+
+    static const int NEIGHBOUR_COUNT = 8;
+    static const char* const SYNTHETIC_PASSWORD;
+
+    bool exec(const QString& sql);
+    bool query(const QString& sql, QList<QStringList>* rows);
+    bool step(const QString& what, bool ok, CopyStream* stream = nullptr);
+
+    void buildStations();
+    void buildNeighbours();
+    void buildTrains();
+    TrainPlan planTrain();
+
+    bool prepareTables();
+    bool dropSecondaryStructures();
+    bool restoreSecondaryStructures();
+    bool resetSequences();
+
+    bool loadUsers();
+    bool loadStations();
+    bool loadTrains();
+    bool loadSchedules();
+    bool loadTickets();
+
+    static double distanceKm(const StationInfo& a, const StationInfo& b);
+    static QByteArray timeOfDay(int minute);
+
+    PGconn* m_connection;
+    Options m_options;
+    QRandomGenerator m_random;
+    QElapsedTimer m_timer;
+    QString m_lastError;
+
+    QVector<StationInfo> m_stations;
+    QVector<TrainPlan> m_trains;
+    QList<SavedDefinition> m_constraints;
+    QList<SavedDefinition> m_indexes;
+};
+
+#endif // NETWORKGENERATOR_H
@@ -0,0 +1,250 @@
+#include "plancheck.h"
+#include "ticketqueries.h"
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QRegularExpression>
+#include <QTextStream>
+
+PlanCheck::PlanCheck(PGconn* connection)
+    : m_connection(connection)
+    , m_failed(0)
+{
+}
+
+bool PlanCheck::run(){
+    m_failed = 0;
+
+    PGresult* result = PQexec(m_connection, R"(
+        SELECT schedule_id, seat_id, departure_date, departure_station_id, arrival_station_id
+        FROM tickets
+        WHERE status IN ('booked', 'paid')
+        LIMIT 1
+    )");
+    if (PQresultStatus(result) != PGRES_TUPLES_OK || PQntuples(result) == 0){
+        m_lastError = PQresultStatus(result) == PGRES_TUPLES_OK
+                      ? "No live tickets to check against; generate a dataset first"
+                      : QString::fromUtf8(PQresultErrorMessage(result)).trimmed();
+        PQclear(result);
+        return false;
+    }
+    QString scheduleId = PQgetvalue(result, 0, 0);
+    QString seatId = PQgetvalue(result, 0, 1);
+    QString departureDate = PQgetvalue(result, 0, 2);
+    QString departureStation = PQgetvalue(result, 0, 3);
+    QString arrivalStation = PQgetvalue(result, 0, 4);
+    PQclear(result);
+
+    QSet<QString> liveSeat;
+    QSet<QString> bookedAt;
+    if (!indexFamily("idx_tickets_live_seat", &liveSeat) || !indexFamily("idx_tickets_booked_at", &bookedAt)){
+        return false;
+    }
+
+    auto examine = [&](const QList<Scan>& scans, const QSet<QString>& family, bool indexOnly){
+        QStringList failures;
+        QSet<QString> partitions;
+        bool usedIndex = false;
+        for (const Scan& scan: scans){
+            if (scan.relation.startsWith("tickets")){
+                partitions.insert(scan.relation);
+                if (scan.nodeType == "Seq Scan" && scan.rowsRemoved > MAX_SEQ_SCAN_DISCARDED_ROWS){
+                    failures << QString("sequential scan on %1 discarding %2 rows").arg(scan.relation).arg(scan.rowsRemoved);
+                }
+            }
+            if (family.contains(scan.index)){
+                usedIndex = true;
+                if (indexOnly && scan.nodeType != "Index Only Scan"){
+                    failures << QString("%1 instead of an index-only scan").arg(scan.nodeType);
+                }
+                if (indexOnly && scan.heapFetches > 0){
+                    failures << QString("%1 heap fetches; run VACUUM on tickets").arg(scan.heapFetches);
+                }
+            }
+        }
+        if (!partitions.isEmpty() && !usedIndex){
+            failures << "expected index was not used";
+        }
+        return qMakePair(failures, int(partitions.size()));
+    };
+
+    QHash<QString, QString> values{
+        {"seat_id", seatId},
+        {"schedule_id", scheduleId},
+        {"dep_station", departureStation},
+        {"arr_station", arrivalStation},
+        {"user_id", "0"},
+        {"ticket_number", "PLANCHECK"},
+        {"price", "0"},
+        {"passenger_name", "Plan Check"},
+        {"passenger_doc", "0"}
+    };
+
+    QList<Scan> scans;
+    QStringList params;
+    if (!explain(bindNamed(TicketQueries::seatOverlap(), values, &params), params, &scans)){
+        return false;
+    }
+    auto overlap = examine(scans, liveSeat, true);
+    if (overlap.second > 1){
+        overlap.first << QString("%1 partitions scanned").arg(overlap.second);
+    }
+    report("seat overlap check", overlap.first);
+
+    // The seat is taken, so the insert is skipped, but the occupancy probe
+    // inside the statement runs exactly as it does for a booking.
+    params.clear();
+    if (!explain(bindNamed(TicketQueries::insertTicket(false), values, &params), params, &scans)){
+        return false;
+    }
+    auto booking = examine(scans, liveSeat, true);
+    if (booking.second > 1){
+        booking.first << QString("%1 partitions scanned").arg(booking.second);
+    }
+    report("booking occupancy probe", booking.first);
+
+    if (!explain(TicketQueries::SEARCH_TRAINS, {departureStation, arrivalStation, departureDate}, &scans)){
+        return false;
+    }
+    auto availability = examine(scans, liveSeat, true);
+    if (availability.second > 1){
+        availability.first << QString("%1 partitions scanned").arg(availability.second);
+    }
+    report("search availability count", availability.first);
+
+    if (!explain(TicketQueries::availableSeats(), {scheduleId, departureStation, arrivalStation}, &scans)){
+        return false;
+    }
+    auto seatMap = examine(scans, liveSeat, true);
+    if (seatMap.second > 1){
+        seatMap.first << QString("%1 partitions scanned").arg(seatMap.second);
+    }
+    report("seat map availability", seatMap.first);
+
+    // Expiry reads every partition by design, so only the partition count
+    // goes unchecked.
+    if (!explain(TicketQueries::expireBookings(15), {}, &scans)){
+        return false;
+    }
+    report("expired booking scan", examine(scans, bookedAt, false).first);
+
+    if (m_failed > 0){
+        m_lastError = QString("%1 plan checks failed").arg(m_failed);
+        return false;
+    }
+    return true;
+}
+
+// Runs inside a transaction that is rolled back, since the booking and
+// expiry statements write.
+bool PlanCheck::explain(const QString& sql, const QStringList& params, QList<Scan>* scans){
+    PQclear(PQexec(m_connection, "BEGIN"));
+
+    QByteArray statement = ("EXPLAIN (ANALYZE, COSTS OFF, FORMAT JSON) " + sql).toUtf8();
+    QList<QByteArray> values;
+    QVector<const char*> pointers;
+    for (const QString& param: params){
+        values.append(param.toUtf8());
+    }
+    for (const QByteArray& value: values){
+        pointers.append(value.constData());
+    }
+
+    PGresult* result = PQexecParams(m_connection, statement.constData(), pointers.size(), nullptr,
+                                    pointers.constData(), nullptr, nullptr, 0);
+    bool ok = PQresultStatus(result) == PGRES_TUPLES_OK && PQntuples(result) > 0;
+    QByteArray plan = ok ? QByteArray(PQgetvalue(result, 0, 0)) : QByteArray();
+    if (!ok){
+        m_lastError = QString::fromUtf8(PQresultErrorMessage(result)).trimmed();
+    }
+    PQclear(result);
+    PQclear(PQexec(m_connection, "ROLLBACK"));
+    if (!ok){
+        return false;
+    }
+
+    scans->clear();
+    collectScans(QJsonDocument::fromJson(plan).array().first().toObject().value("Plan").toObject(), scans);
+    return true;
+}
+
+// The server binds :name placeholders through QSqlQuery; libpq takes $n.
+// Repeated names map to the same parameter.
+QString PlanCheck::bindNamed(const QString& sql, const QHash<QString, QString>& values, QStringList* params){
+    static const QRegularExpression placeholder("(?<![:\\w]):(\\w+)");
+    QStringList names;
+    QString bound;
+    qsizetype last = 0;
+
+    QRegularExpressionMatchIterator matches = placeholder.globalMatch(sql);
+    while (matches.hasNext()){
+        QRegularExpressionMatch match = matches.next();
+        QString name = match.captured(1);
+        int index = names.indexOf(name);
+        if (index < 0){
+            names.append(name);
+            params->append(values.value(name));
+            index = names.size() - 1;
+        }
+        bound += sql.mid(last, match.capturedStart() - last);
+        bound += QString("$%1").arg(index + 1);
+        last = match.capturedEnd();
+    }
+    bound += sql.mid(last);
+    return bound;
+}
+
+// Indexes created on the partitioned table are inherited by every partition
+// under generated names, so the plan names a child, never the parent.
+bool PlanCheck::indexFamily(const QString& parentIndex, QSet<QString>* names){
+    QString sql = QString(R"(
+        SELECT c.relname
+        FROM pg_inherits i
+        JOIN pg_class c ON c.oid = i.inhrelid
+        WHERE i.inhparent = to_regclass('%1')
+    )").arg(parentIndex);
+
+    PGresult* result = PQexec(m_connection, sql.toUtf8().constData());
+    if (PQresultStatus(result) != PGRES_TUPLES_OK){
+        m_lastError = QString::fromUtf8(PQresultErrorMessage(result)).trimmed();
+        PQclear(result);
+        return false;
+    }
+
+    names->clear();
+    names->insert(parentIndex);
+    for (int row = 0; row < PQntuples(result); row++){
+        names->insert(QString::fromUtf8(PQgetvalue(result, row, 0)));
+    }
+    PQclear(result);
+    return true;
+}
+
+// Nodes the executor pruned at run time report zero loops and are skipped,
+// as is the insert or update itself, which names the parent table.
+void PlanCheck::collectScans(const QJsonObject& node, QList<Scan>* scans){
+    if ((node.contains("Relation Name") || node.contains("Index Name"))
+        && node.value("Node Type").toString() != "ModifyTable"
+        && node.value("Actual Loops").toInteger() > 0){
+        scans->append(Scan{node.value("Node Type").toString(),
+                           node.value("Relation Name").toString(),
+                           node.value("Index Name").toString(),
+                           node.value("Heap Fetches").toInteger(),
+                           node.value("Rows Removed by Filter").toInteger()});
+    }
+
+    for (const QJsonValue& child: node.value("Plans").toArray()){
+        collectScans(child.toObject(), scans);
+    }
+}
+
+bool PlanCheck::report(const QString& name, const QStringList& failures){
+    QTextStream out(stdout);
+    if (failures.isEmpty()){
+        out << "PASS " << name << Qt::endl;
+        return true;
+    }
+
+    out << "FAIL " << name << ": " << failures.join("; ") << Qt::endl;
+    m_failed++;
+    return false;
+}
@@ -0,0 +1,47 @@
+#ifndef PLANCHECK_H
+#define PLANCHECK_H
+
+#include <QString>
+#include <QStringList>
+#include <QSet>
+#include <QHash>
+#include <QJsonObject>
+#include <libpq-fe.h>
+
+// Runs the server's hot ticket queries, taken from ticketqueries.h, under
+// EXPLAIN ANALYZE against the current database and checks that each one is
+// answered from the intended partial index and, where it has a departure
+// date, touches a single monthly partition. Meant to be run on a generated
+// dataset, where a sequential scan would be obvious in timings but easy to
+// miss in review.
+class PlanCheck
+{
+public:
+    explicit PlanCheck(PGconn* connection);
+
+    bool run();
+    QString lastError() const { return m_lastError; }
+
+private:
+    struct Scan {
+        QString nodeType;
+        QString relation;
+        QString index;
+        qint64 heapFetches;
+        qint64 rowsRemoved;
+    };
+
+    static const qint64 MAX_SEQ_SCAN_DISCARDED_ROWS = 1000;
+
+    bool explain(const QString& sql, const QStringList& params, QList<Scan>* scans);
+    static QString bindNamed(const QString& sql, const QHash<QString, QString>& values, QStringList* params);
+    bool indexFamily(const QString& parentIndex, QSet<QString>* names);
+    static void collectScans(const QJsonObject& node, QList<Scan>* scans);
+    bool report(const QString& name, const QStringList& failures);
+
+    PGconn* m_connection;
+    QString m_lastError;
+    int m_failed;
+};
+
+#endif // PLANCHECK_H